@@ -20,4 +20,10 @@ enum {
 	EIO,
 	ENODEV,
 	ENOTDIR,
+	ENOPROTOOPT,
+	EAGAIN,
+	EMFILE,
+	EISDIR,
+	ETIMEDOUT,
+	ENOMEM,
 };
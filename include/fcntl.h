@@ -0,0 +1,14 @@
+#pragma once
+
+/* flags for open() */
+enum {
+	/* noformat */
+	O_READ = 1,
+	O_WRITE = 2,
+	O_CREAT = 4,
+	O_APPEND = 8,
+
+	O_RDONLY = O_READ,
+	O_WRONLY = O_WRITE,
+	O_RDWR = O_READ | O_WRITE,
+};
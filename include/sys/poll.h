@@ -0,0 +1,19 @@
+#pragma once
+
+/* events and revents bits */
+#define POLLIN   0x001 /* data may be read without blocking */
+#define POLLOUT  0x004 /* data may be written without blocking */
+#define POLLERR  0x008
+#define POLLHUP  0x010
+#define POLLNVAL 0x020 /* fd is not open */
+
+/* The most file descriptors one poll() call accepts */
+#define POLL_MAX_FDS 128
+
+typedef unsigned int nfds_t;
+
+struct pollfd {
+	int fd;
+	short events;
+	short revents;
+};
@@ -17,8 +17,20 @@ enum {
 	SOCK_DGRAM,
 };
 
+/* may be combined with the socket() type */
+#define SOCK_NONBLOCK 0x800
+
 #define IPPROTO_UDP 17
 
+/* setsockopt() levels and options */
+#define SOL_SOCKET 1
+#define SO_RCVBUF   8  /* int: bytes of packets to queue before dropping */
+#define SO_RCVTIMEO 20 /* struct timeval: longest recv() waits, 0 forever */
+
+/* send() and recv() flags */
+#define MSG_DONTWAIT 0x40   /* fail with EAGAIN rather than wait */
+#define MSG_MORE     0x8000 /* more data follows, the kernel may delay it */
+
 struct in_addr {
 	uint32_t s_addr;
 };
@@ -32,3 +44,33 @@ struct sockaddr_in {
 struct sockaddr {
 	sa_family_t s_family;
 };
+
+/*
+ * System calls only take four arguments, so setsockopt() passes the kernel a
+ * pointer to its arguments instead.
+ */
+struct sockopt_args {
+	int level;
+	int optname;
+	const void *optval;
+	socklen_t optlen;
+};
+
+/*
+ * A message for sendmmsg() and recvmmsg(). Unlike POSIX, there is no struct
+ * iovec: each message is a single buffer.
+ */
+struct msghdr {
+	void *msg_name; /* struct sockaddr_in: destination, or sender */
+	socklen_t msg_namelen;
+	void *msg_buf;
+	size_t msg_buflen;
+};
+
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len; /* set to the bytes sent or received */
+};
+
+/* The most messages handled by one sendmmsg() or recvmmsg() call */
+#define MMSG_MAX 1024
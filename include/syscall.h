@@ -5,7 +5,11 @@
 
 #include <stddef.h>
 
+#include "fcntl.h"
+#include "sys/poll.h"
 #include "sys/socket.h"
+#include "time.h"
+#include "unistd.h"
 
 /* macro quoting utilities */
 #define syscall_h_quote(blah)            #blah
@@ -33,18 +37,29 @@
 /*
  * System call numbers
  */
-#define SYS_RELINQUISH 0
-#define SYS_DISPLAY    1
-#define SYS_EXIT       2
-#define SYS_GETCHAR    3
-#define SYS_RUNPROC    4
-#define SYS_GETPID     5
-#define SYS_SOCKET     6
-#define SYS_BIND       7
-#define SYS_CONNECT    8
-#define SYS_SEND       9
-#define SYS_RECV       10
-#define MAX_SYS        10
+#define SYS_RELINQUISH    0
+#define SYS_DISPLAY       1
+#define SYS_EXIT          2
+#define SYS_GETCHAR       3
+#define SYS_RUNPROC       4
+#define SYS_GETPID        5
+#define SYS_SOCKET        6
+#define SYS_BIND          7
+#define SYS_CONNECT       8
+#define SYS_SEND          9
+#define SYS_RECV          10
+#define SYS_SETSOCKOPT    11
+#define SYS_SENDMMSG      12
+#define SYS_RECVMMSG      13
+#define SYS_POLL          14
+#define SYS_CLOSE         15
+#define SYS_OPEN          16
+#define SYS_READ          17
+#define SYS_WRITE         18
+#define SYS_NICE          19
+#define SYS_NANOSLEEP     20
+#define SYS_CLOCK_GETTIME 21
+#define MAX_SYS           21
 
 /*
  * System call syntax sugars
@@ -63,6 +78,21 @@ int bind(int sockfd, const struct sockaddr *address, socklen_t address_len);
 int connect(int sockfd, const struct sockaddr *address, socklen_t address_len);
 int send(int sockfd, const void *buffer, size_t length, int flags);
 int recv(int sockfd, void *buffer, size_t length, int flags);
+int setsockopt(int sockfd, int level, int optname, const void *optval,
+               socklen_t optlen);
+int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+int poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int close(int fd);
+int open(const char *path, int flags);
+int read(int fd, void *buf, size_t count);
+int write(int fd, const void *buf, size_t count);
+int nice(int inc);
+int nanosleep(const struct timespec *req, struct timespec *rem);
+unsigned int sleep(unsigned int seconds);
+int clock_gettime_syscall(clockid_t clk, struct timespec *tp);
+/* Reads the counter through the vDSO page, without a system call (vdso.c) */
+int clock_gettime(clockid_t clk, struct timespec *tp);
 
 /*
  * Declare a puts() which wraps the display() system call, necessary for printf
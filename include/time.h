@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef int32_t time_t;
+typedef int32_t clockid_t;
+
+/* Time since boot, which never jumps. The only clock we have. */
+#define CLOCK_MONOTONIC 1
+
+struct timespec {
+	time_t tv_sec;
+	int32_t tv_nsec; /* 0 to 999999999 */
+};
+
+struct timeval {
+	time_t tv_sec;
+	int32_t tv_usec; /* 0 to 999999 */
+};
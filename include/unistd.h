@@ -0,0 +1,10 @@
+#pragma once
+
+/* file descriptors every user process starts with, all on the console */
+#define STDIN_FILENO  0
+#define STDOUT_FILENO 1
+#define STDERR_FILENO 2
+
+/* range of nice() values: processes with lower values are always run first */
+#define NICE_MIN -20
+#define NICE_MAX 19
@@ -0,0 +1,40 @@
+/*
+ * vdso.h: the data page shared read-only with every process
+ *
+ * The kernel maps one page at VDSO_ADDR into each process. User mode may read
+ * the virtual counter CNTVCT directly, and this page says how to turn that into
+ * the same CLOCK_MONOTONIC time which clock_gettime() returns, so reading the
+ * time needs no system call.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include "time.h"
+#include "util.h"
+
+/* The page just below the process image */
+#define VDSO_ADDR  0x3FFFF000
+#define VDSO_MAGIC 0x4f534456 /* "VDSO" */
+
+struct vdso_data {
+	uint32_t magic;
+	uint32_t cntfrq; /* counter frequency in Hz */
+	/* nanoseconds = (counts * ns_mult) >> ns_shift, for counts < cntfrq */
+	uint32_t ns_mult;
+	uint32_t ns_shift;
+	uint64_t cntvoff; /* CNTPCT - CNTVCT */
+};
+
+/*
+ * Convert a physical count (CNTPCT) to a timespec. The kernel and user space
+ * both use this, so that the two paths agree.
+ */
+static inline void vdso_count_to_ts(const struct vdso_data *vd, uint64_t count,
+                                    struct timespec *ts)
+{
+	uint32_t rem = div64_32(&count, vd->cntfrq);
+
+	ts->tv_sec = count;
+	ts->tv_nsec = ((uint64_t)rem * vd->ns_mult) >> vd->ns_shift;
+}
@@ -55,3 +55,19 @@ def test_readp(blkvm, devname):
 def test_read_out_of_bounds(blkvm, devname):
     res = blkvm.cmd(f'blk read {devname} 2')
     assert 'ERROR' in res
+
+
+def test_poll_read(blkvm, devname):
+    blkvm.cmd(f'blk poll {devname} 200')
+    res = blkvm.cmd(f'blk read {devname} 1')
+    assert f'result: "{BLKS[1]}"' in res
+    res = blkvm.cmd(f'blk status {devname}')
+    assert 'poll budget: 200 us' in res
+
+
+def test_bench(blkvm, devname):
+    res = blkvm.cmd(f'blk bench {devname} 20')
+    assert 'interrupt driven' in res
+    assert 'polling for 100 us' in res
+    assert res.count('p50') == 2
+    assert 'ERROR' not in res
@@ -137,6 +137,41 @@ def test_cat_file_other(mountvm):
     assert 'the second file' in output
 
 
+def test_block_cache(mountvm):
+    mountvm.cmd('fs cat /DIR/FILE2.TXT')
+    before = mountvm.cmd('blk cache')
+    mountvm.cmd('fs cat /DIR/FILE2.TXT')
+    after = mountvm.cmd('blk cache')
+
+    def stat(output, name):
+        match = re.search(name + r'\s*: (\d+)', output)
+        assert match
+        return int(match.group(1))
+
+    # The second read is served entirely from the cache
+    assert stat(after, 'misses') == stat(before, 'misses')
+    assert stat(after, 'hits') > stat(before, 'hits')
+
+
+def test_request_merging(mountvm, devname):
+    before = mountvm.cmd(f'blk status {devname}')
+    # Each write dirties a whole cluster, which is flushed when the file is
+    # closed. The sectors of the cluster should go out as one request.
+    mountvm.cmd('fs addline /EMPTY.TXT ' + 'x' * 100)
+    after = mountvm.cmd(f'blk status {devname}')
+
+    def stat(output, name):
+        match = re.search(name + r'\s*: (\d+)', output)
+        assert match
+        return int(match.group(1))
+
+    submitted = stat(after, 'submitted') - stat(before, 'submitted')
+    dispatched = stat(after, 'dispatched') - stat(before, 'dispatched')
+    assert stat(after, 'merged') > stat(before, 'merged')
+    assert dispatched < submitted
+    assert 'queue depth: 0' in after
+
+
 def test_multi_block_file(raw_vm, f12disk):
     # Need to do this test with a raw vm and manually mount, etc, because we
     # will need to "reboot".
@@ -2,6 +2,7 @@
 """
 Basic tests of functionality for SOS
 """
+import re
 import time
 
 
@@ -36,3 +37,94 @@ def test_demo(vm):
         vm.read_until(r'Process \d+ exited with code 0.')
         count -= 1
     assert count == 0, 'Expect all processes to exit successfully'
+
+
+def test_nice(vm):
+    assert 'nice() = 5' in vm.cmd('nice 5')
+    assert 'nice() = 3' in vm.cmd('nice -2')
+    # clamped to NICE_MAX, and user space can't go below the default of 0
+    assert 'nice() = 19' in vm.cmd('nice 100')
+    assert 'nice() = 0' in vm.cmd('nice -100')
+
+
+def test_demo_while_niced(vm):
+    """
+    Processes at the default priority still run and exit when the shell has
+    lowered its own priority.
+    """
+    vm.cmd('nice 10')
+    test_demo(vm)
+
+
+def timer_interrupts(vm):
+    res = vm.cmd('timer stats')
+    return int(re.search(r'interrupts: (\d+)', res).group(1))
+
+
+def test_tickless_idle(vm):
+    """
+    Sitting at the kernel shell prompt, the timer should barely fire. With
+    the dynamic tick disabled, it fires at HZ (100) times per second.
+    """
+    vm.cmd('exit')
+
+    before = timer_interrupts(vm)
+    time.sleep(1)
+    assert timer_interrupts(vm) - before < 20
+
+    vm.cmd('timer nohz off')
+    before = timer_interrupts(vm)
+    time.sleep(1)
+    assert timer_interrupts(vm) - before >= 80
+
+
+def test_sleep(vm):
+    start = time.time()
+    res = vm.cmd('sleep 500')
+    elapsed = time.time() - start
+    assert 'nanosleep() = 0' in res
+    assert 0.5 <= elapsed < 1.5
+
+
+def test_hrtimer_stats(vm):
+    vm.cmd('sleep 100')
+    vm.cmd('sleep 100')
+    vm.cmd('exit')
+    res = vm.cmd('timer hrtimers')
+    fired = int(re.search(r'fired: (\d+)', res).group(1))
+    assert fired >= 2
+    assert re.search(r'lateness: avg \d+ us, max \d+ us', res)
+
+
+def test_timebench(vm):
+    """
+    The vDSO clock and the clock_gettime() system call agree, and never go
+    backwards.
+    """
+    res = vm.cmd('run timebench')
+    assert re.search(r'syscall: \d+ calls in \d+ us', res)
+    assert re.search(r'vdso: \d+ calls in \d+ us', res)
+    assert 'clocks agree' in res
+    assert 'backwards' not in res
+
+
+def test_spawnbench(vm):
+    res = vm.cmd('spawnbench 20')
+    assert re.search(r'spawned true 20 times in \d+ us, \d+ us each', res)
+
+
+def test_image_pages_on_demand(vm):
+    """
+    Text is mapped from the shared image, and the stack is zeroed on demand.
+    Running the same binary again maps the same shared pages rather than
+    copying anything.
+    """
+    vm.cmd('run true')
+    vm.cmd('run true')
+    vm.cmd('exit')
+    res = vm.cmd('proc pages')
+    m = re.search(r'shared: (\d+), copied: (\d+), zeroed: (\d+)', res)
+    assert m
+    shared, copied, zeroed = map(int, m.groups())
+    assert shared >= 2
+    assert zeroed >= 2
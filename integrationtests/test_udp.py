@@ -18,11 +18,48 @@ PORT_ITER = itertools.cycle(range(5000, 5100))
 def recvfrom_timeout(sk, timeout=2):
     r, _, _ = select.select([sk], [], [], timeout)
     if r:
-        return sk.recvfrom(4096)
+        return sk.recvfrom(65536)
     else:
         raise TimeoutError('Timed out reading from socket')
 
 
+def connect_vm_socket(net_vm, sk):
+    """
+    Open a socket in the VM, connected to sk, and send a message through it so
+    that the NAT will deliver replies. Returns the file descriptor in the VM,
+    and the address which sk sees it at.
+    """
+    res = net_vm.cmd('socket')
+    fildes = int(SOCKET_RE.search(res).group(1))
+    net_vm.cmd(f'connect {fildes} 10.0.2.2 {sk.getsockname()[1]}')
+    net_vm.cmd(f'send {fildes} hello')
+    _, addr = recvfrom_timeout(sk)
+    return fildes, addr
+
+
+def send_paced(sk, addr, payloads):
+    for i, payload in enumerate(payloads):
+        sk.sendto(payload, addr)
+        if i % 32 == 31:
+            time.sleep(0.001)  # don't overrun the NAT's queue
+
+
+def recv_up_to(sk, count, size=None):
+    """
+    Receive datagrams until count have arrived, or one times out. Returns the
+    number received.
+    """
+    received = 0
+    try:
+        while received < count:
+            data, _ = recvfrom_timeout(sk)
+            assert size is None or len(data) == size
+            received += 1
+    except TimeoutError:
+        pass
+    return received
+
+
 @pytest.fixture
 def net_vm(raw_vm):
     raw_vm.start()
@@ -74,3 +111,346 @@ def test_udp_send_recv_wait(net_vm, sk):
     sk.sendto(b'Hello from the test harness!\0', addr)
     res = net_vm.read_until('[uk]sh>')
     assert 'Hello from the test harness!' in res
+
+
+
+def test_udp_connected_demux(net_vm, sk):
+    """
+    A connected socket only receives from its peer, even though other hosts
+    can reach its port.
+    """
+    res = net_vm.cmd('socket')
+    fildes = int(SOCKET_RE.search(res).group(1))
+    net_vm.cmd(f'connect {fildes} 10.0.2.2 {sk.getsockname()[1]}')
+    net_vm.cmd(f'send {fildes} hello')
+    _, addr = recvfrom_timeout(sk)
+
+    other = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    try:
+        other.sendto(b'wrong peer\0', addr)
+        time.sleep(0.1)
+        sk.sendto(b'right peer\0', addr)
+        time.sleep(0.1)
+    finally:
+        other.close()
+    res = net_vm.cmd(f'recv {fildes}')
+    assert 'right peer' in res
+
+    net_vm.cmd('exit')
+    stats = net_vm.cmd('netstats')
+    match = re.search(r'udp:\s*(\d+) received, (\d+) dropped', stats)
+    assert match
+    assert int(match.group(2)) >= 1
+
+
+def test_udp_rcvbuf_limit(net_vm, sk):
+    res = net_vm.cmd('socket')
+    fildes = int(SOCKET_RE.search(res).group(1))
+    net_vm.cmd(f'connect {fildes} 10.0.2.2 {sk.getsockname()[1]}')
+    # the minimum: two packet buffers
+    res = net_vm.cmd(f'rcvbuf {fildes} 1')
+    assert 'setsockopt() = 0' in res
+    net_vm.cmd(f'send {fildes} hello')
+    _, addr = recvfrom_timeout(sk)
+
+    for i in range(10):
+        sk.sendto(f'packet {i}\0'.encode(), addr)
+    time.sleep(0.2)
+    res = net_vm.cmd(f'recv {fildes}')
+    assert 'packet 0' in res
+    res = net_vm.cmd(f'recv {fildes}')
+    assert 'packet 1' in res
+
+    net_vm.cmd('exit')
+    stats = net_vm.cmd('netstats')
+    match = re.search(r'socket:.*, (\d+) overflowed', stats)
+    assert match
+    assert int(match.group(1)) >= 1
+
+
+def test_udp_nonblocking(net_vm, sk):
+    res = net_vm.cmd('socket nonblock')
+    fildes = int(SOCKET_RE.search(res).group(1))
+    net_vm.cmd(f'connect {fildes} 10.0.2.2 {sk.getsockname()[1]}')
+    net_vm.cmd(f'send {fildes} hello')
+    _, addr = recvfrom_timeout(sk)
+
+    res = net_vm.cmd(f'recv {fildes}')
+    assert 'recv() = -20' in res  # EAGAIN
+
+    sk.sendto(b'now there is data\0', addr)
+    time.sleep(0.1)
+    res = net_vm.cmd(f'recv {fildes}')
+    assert 'now there is data' in res
+
+
+def test_socket_close_reuses_fd(net_vm, sk):
+    fds = []
+    for _ in range(3):
+        res = net_vm.cmd('socket')
+        fds.append(int(SOCKET_RE.search(res).group(1)))
+    # 0, 1 and 2 are the console
+    assert fds == [3, 4, 5]
+
+    net_vm.cmd(f'bind {fds[1]} 0.0.0.0 4242')
+    res = net_vm.cmd(f'close {fds[1]}')
+    assert 'close() = 0' in res
+    res = net_vm.cmd(f'close {fds[1]}')
+    assert 'close() = -8' in res  # EBADF
+
+    # the lowest free fd is reused, and the closed socket's port is free
+    res = net_vm.cmd('socket')
+    assert int(SOCKET_RE.search(res).group(1)) == fds[1]
+    res = net_vm.cmd(f'bind {fds[1]} 0.0.0.0 4242')
+    assert 'bind() = 0' in res
+
+
+def test_udp_rcvtimeo(net_vm, sk):
+    res = net_vm.cmd('socket')
+    fildes = int(SOCKET_RE.search(res).group(1))
+    net_vm.cmd(f'connect {fildes} 10.0.2.2 {sk.getsockname()[1]}')
+    net_vm.cmd(f'send {fildes} hello')
+    _, addr = recvfrom_timeout(sk)
+
+    res = net_vm.cmd(f'rcvtimeo {fildes} 300')
+    assert 'setsockopt() = 0' in res
+    start = time.time()
+    res = net_vm.cmd(f'recv {fildes}')
+    elapsed = time.time() - start
+    assert 'recv() = -20' in res  # EAGAIN
+    assert 0.3 <= elapsed < 1.3
+
+    # data arriving within the timeout is still received
+    net_vm.send_cmd(f'recv {fildes}')
+    sk.sendto(b'in time\0', addr)
+    res = net_vm.read_until(net_vm.prompt)
+    assert 'in time' in res
+
+
+def test_udp_poll(net_vm, sk):
+    fds = []
+    for _ in range(2):
+        res = net_vm.cmd('socket')
+        fds.append(int(SOCKET_RE.search(res).group(1)))
+    other = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    other.bind(('0.0.0.0', next(PORT_ITER)))
+    try:
+        addrs = []
+        for fd, host in zip(fds, (sk, other)):
+            net_vm.cmd(f'connect {fd} 10.0.2.2 {host.getsockname()[1]}')
+            net_vm.cmd(f'send {fd} hello')
+            addrs.append(recvfrom_timeout(host)[1])
+
+        # nothing to read: times out
+        res = net_vm.cmd(f'poll 200 {fds[0]} {fds[1]}')
+        assert 'poll() = 0' in res
+
+        # data arrives while we wait, only on the second socket
+        net_vm.send_cmd(f'poll 5000 {fds[0]} {fds[1]}')
+        time.sleep(0.2)
+        other.sendto(b'wake up\0', addrs[1])
+        res = net_vm.read_until('ush>')
+        assert 'poll() = 1' in res
+        assert f'fd {fds[1]}: revents 0x1' in res
+        res = net_vm.cmd(f'recv {fds[1]}')
+        assert 'wake up' in res
+    finally:
+        other.close()
+
+    # the console is fd 0
+    net_vm.send_cmd('poll 5000 0')
+    time.sleep(0.2)
+    net_vm.send_cmd('echo')
+    res = net_vm.read_until('ush>')
+    assert 'poll() = 1' in res
+    assert 'fd 0: revents 0x1' in res
+
+def test_udp_checksums(net_vm, sk):
+    res = net_vm.cmd('socket')
+    fildes = int(SOCKET_RE.search(res).group(1))
+    net_vm.cmd(f'connect {fildes} 10.0.2.2 {sk.getsockname()[1]}')
+
+    # odd lengths exercise the padding byte; the host drops bad checksums
+    for payload in ('a', 'ab', 'abcdefghijklmnopqrstuvwxyz0123456789'):
+        net_vm.cmd(f'send {fildes} {payload}')
+        data, addr = recvfrom_timeout(sk)
+        assert data == payload.encode() + b'\0'
+
+    sk.sendto(b'odd', addr)
+    time.sleep(0.1)
+    res = net_vm.cmd(f'recv {fildes}')
+    assert 'recv() = 3' in res
+
+    net_vm.cmd('exit')
+    stats = net_vm.cmd('netstats')
+    match = re.search(r'csum:\s*(\d+) offloaded, (\d+) trusted, (\d+) bad',
+                      stats)
+    assert match
+    assert int(match.group(3)) == 0
+
+
+def pattern(size):
+    return bytes(ord('a') + i % 26 for i in range(size))
+
+
+
+def test_arp_resolves_gateway(net_vm, sk):
+    res = net_vm.cmd('socket')
+    fildes = int(SOCKET_RE.search(res).group(1))
+    net_vm.cmd(f'connect {fildes} 10.0.2.2 {sk.getsockname()[1]}')
+
+    # the first send waits on ARP, the rest use the cached address
+    for i in range(3):
+        net_vm.cmd(f'send {fildes} arp{i}')
+        data, addr = recvfrom_timeout(sk)
+        assert data == f'arp{i}'.encode() + b'\0'
+
+    net_vm.cmd('exit')
+    table = net_vm.cmd('show-arptable')
+    assert re.search(r'10\.0\.2\.2\s+\S+\s+reachable', table)
+    assert re.search(r'255\.255\.255\.255\s+\S+\s+static', table)
+    match = re.search(r'(\d+) entries, (\d+) hits, (\d+) misses, '
+                      r'(\d+) requests', table)
+    assert match
+    assert int(match.group(2)) >= 2
+    assert int(match.group(4)) >= 1
+
+@pytest.mark.parametrize('size', [1473, 4000, 65507])
+def test_udp_large_datagrams(net_vm, sk, size):
+    """
+    Datagrams bigger than the MTU are fragmented on the way out, and
+    reassembled on the way in.
+    """
+    res = net_vm.cmd('socket')
+    fildes = int(SOCKET_RE.search(res).group(1))
+    net_vm.cmd(f'connect {fildes} 10.0.2.2 {sk.getsockname()[1]}')
+
+    res = net_vm.cmd(f'sendbig {fildes} {size}')
+    assert f'send() = {size}' in res
+    data, addr = recvfrom_timeout(sk)
+    assert data == pattern(size)
+
+    sk.sendto(pattern(size), addr)
+    time.sleep(0.2)
+    res = net_vm.cmd(f'recvbig {fildes}')
+    assert f'recv() = {size}, sum = {sum(pattern(size))}' in res
+
+    net_vm.cmd('exit')
+    stats = net_vm.cmd('netstats')
+    match = re.search(r'frag:\s*(\d+) received, (\d+) reassembled, '
+                      r'(\d+) abandoned, (\d+) sent', stats)
+    assert match
+    assert int(match.group(2)) >= 1
+    assert int(match.group(3)) == 0
+    assert int(match.group(4)) > 1
+
+
+def test_udp_recv_throughput(net_vm, sk):
+    count, size = 2000, 1024
+    fildes, addr = connect_vm_socket(net_vm, sk)
+
+    net_vm.send_cmd(f'recvbench {fildes} {count}')
+    time.sleep(0.1)
+    start = time.monotonic()
+    send_paced(sk, addr, itertools.repeat(b'x' * size, count))
+    res = net_vm.read_until('ush>', timeout=60)
+    elapsed = time.monotonic() - start
+    assert f'recvbench: {count} packets, {count * size} bytes' in res
+    print(f'UDP receive: {count / elapsed:.0f} packets/s, '
+          f'{count * size / elapsed / 1e6:.2f} MB/s')
+
+    net_vm.cmd('exit')
+    stats = net_vm.cmd('netstats')
+    match = re.search(r'pool:\s*(\d+) reused, (\d+) allocated', stats)
+    assert match
+    # after the ring is filled, receive buffers come from the pool
+    assert int(match.group(1)) > int(match.group(2))
+
+
+def test_udp_send_batched(net_vm, sk):
+    count, size = 1000, 512
+    fildes, _ = connect_vm_socket(net_vm, sk)
+
+    # more packets than the tx ring holds, so the sender must block
+    net_vm.send_cmd(f'sendbench {fildes} {count} {size}')
+    start = time.monotonic()
+    received = recv_up_to(sk, count, size)
+    elapsed = time.monotonic() - start
+    res = net_vm.read_until('ush>', timeout=60)
+    assert f'sendbench: {count} packets, {size} bytes each' in res
+    print(f'UDP send: {received / elapsed:.0f} packets/s')
+    # the NAT may drop some, but most must arrive
+    assert received > count // 2
+
+    net_vm.cmd('exit')
+    stats = net_vm.cmd('netstatus')
+    match = re.search(r'packets = (\d+), reaped = (\d+)', stats)
+    assert match
+    assert int(match.group(1)) >= count
+    # one notification per batch, not per packet
+    match = re.search(r'notifications = (\d+) \(skipped (\d+)\)', stats)
+    assert int(match.group(1)) + int(match.group(2)) < count
+
+
+def test_udp_mmsg_throughput(net_vm, sk):
+    """
+    Compare the single-message and batched syscalls, in both directions.
+    """
+    count, size = 2000, 512
+    fildes, addr = connect_vm_socket(net_vm, sk)
+
+    for cmd in ('recvbench', 'recvmbench'):
+        net_vm.send_cmd(f'{cmd} {fildes} {count}')
+        time.sleep(0.1)
+        start = time.monotonic()
+        send_paced(sk, addr, itertools.repeat(b'x' * size, count))
+        res = net_vm.read_until('ush>', timeout=60)
+        elapsed = time.monotonic() - start
+        assert f'{cmd}: {count} packets, {count * size} bytes' in res
+        print(f'{cmd}: {count / elapsed:.0f} packets/s')
+    match = re.search(r'(\d+) calls', res)
+    assert int(match.group(1)) < count
+
+    for cmd in ('sendbench', 'sendmbench'):
+        net_vm.send_cmd(f'{cmd} {fildes} {count} {size}')
+        start = time.monotonic()
+        received = recv_up_to(sk, count, size)
+        elapsed = time.monotonic() - start
+        res = net_vm.read_until('ush>', timeout=60)
+        assert f'{cmd}: {count} packets, {size} bytes each' in res
+        print(f'{cmd}: {received / elapsed:.0f} packets/s')
+        assert received > count // 2
+
+
+def test_udp_stress(net_vm, sk):
+    """
+    Push many times the ring size through both queues, so the ring indices
+    wrap around repeatedly.
+    """
+    count, size = 5000, 256
+    fildes, addr = connect_vm_socket(net_vm, sk)
+
+    for _ in range(2):
+        net_vm.send_cmd(f'recvbench {fildes} {count}')
+        time.sleep(0.1)
+        send_paced(sk, addr, (i.to_bytes(4, 'little') * (size // 4)
+                              for i in range(count)))
+        res = net_vm.read_until('ush>', timeout=60)
+        assert f'recvbench: {count} packets, {count * size} bytes' in res
+
+        net_vm.send_cmd(f'sendbench {fildes} {count} {size}')
+        received = recv_up_to(sk, count)
+        res = net_vm.read_until('ush>', timeout=60)
+        assert f'sendbench: {count} packets, {size} bytes each' in res
+        assert received > count // 2
+
+    net_vm.cmd('exit')
+    stats = net_vm.cmd('netstatus')
+    match = re.search(r'tx queue \((\d+) entries\)', stats)
+    assert match
+    ring = int(match.group(1))
+    # every transmitted buffer was reaped and its descriptors returned
+    match = re.search(r'packets = (\d+), reaped = (\d+), pending = (\d+), '
+                      r'free desc = (\d+)', stats)
+    assert match.group(1) == match.group(2)
+    assert int(match.group(4)) == ring
@@ -67,6 +67,7 @@
 #define SLD_PRO_UNA       (SLD__AP2 | SLD__AP0) /* AP=0b101 */
 #define SLD_PRO_URO       (SLD__AP2 | SLD__AP1) /* AP=0b110 */
 #define SLD_EXECUTE_NEVER 0x01
+#define SLD_AP_MASK       (SLD__AP2 | SLD__AP1 | SLD__AP0)
 
 #define FLD_PRW_UNA       (FLD__AP0) /* AP=0b001 */
 #define FLD_PRW_URO       (FLD__AP1) /* AP=0b010 */
@@ -104,5 +105,5 @@
 // Flags for different types of memory
 #define KMEM_DEFAULT (FLD_NORMAL_SHAREABLE | FLD_PRW_UNA)
 #define UMEM_FLAGS_RW (SLD_NORMAL_SHAREABLE | SLD_PRW_URW | SLD_NG)
-#define UMEM_FLAGS_RO (SLD_NORMAL_SHAREABLE | SLD_PRW_URW | SLD_NG)
+#define UMEM_FLAGS_RO (SLD_NORMAL_SHAREABLE | SLD_PRO_URO | SLD_NG)
 #define PERIPH_DEFAULT (SLD_PRW_UNA | SLD_EXECUTE_NEVER | SLD_DEVICE_NONSHAREABLE)
@@ -8,21 +8,87 @@
 static struct list_head blkdev_list;
 static spinsem_t blkdev_list_lock;
 
+/*
+ * The block cache. Each buffer holds one device block, and is indexed by
+ * (dev, blkidx) in a hash table. Every buffer is also on the LRU list, with the
+ * most recently used at the head, and unused buffers at the tail. Buffers which
+ * are in use by a caller (refcnt > 0) are never evicted.
+ *
+ * Writes only update the buffer and mark it dirty. Dirty buffers go to the
+ * device when they are evicted, when too many are dirty, or when somebody
+ * calls blk_cache_flush().
+ */
+#define BLK_CACHE_BUFS      128
+#define BLK_CACHE_HASH      64
+#define BLK_CACHE_BATCH     32
+#define BLK_CACHE_DIRTY_MAX (BLK_CACHE_BUFS / 2)
+
+struct blkbuf {
+	struct blkdev *dev;    /* NULL if unused */
+	uint64_t blkidx;
+	uint8_t *data;
+	uint32_t size;         /* allocated size of data */
+	uint32_t refcnt;
+	bool valid;            /* data has been read or written */
+	bool dirty;            /* data must be written to the device */
+	struct waitlist ready; /* triggered once the buffer is valid */
+	struct blkbuf *hnext;
+	struct list_head lru;
+};
+
+static struct blkbuf blk_bufs[BLK_CACHE_BUFS];
+static struct blkbuf *blk_hash[BLK_CACHE_HASH];
+static struct list_head blk_lru;
+static spinsem_t blk_cache_lock;
+
+static struct {
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t evictions;
+	uint32_t writebacks;
+	uint32_t dirty;
+	uint32_t uncached;
+} blk_stats;
+
+static uint32_t blk_ticks_per_us;
+
+#define blk_bucket(dev, blkidx)                                                \
+	((((uint32_t)(dev) >> 4) + (uint32_t)(blkidx)) % BLK_CACHE_HASH)
+
 void blkreq_init(struct blkreq *req)
 {
+	req->iov = NULL;
+	req->iovcnt = 0;
 	wait_list_init(&req->wait);
 	INIT_LIST_HEAD(req->reqlist);
+	INIT_LIST_HEAD(req->merged);
 }
 
 void blk_init(void)
 {
+	int i;
 	INIT_SPINSEM(&blkdev_list_lock, 1);
 	INIT_LIST_HEAD(blkdev_list);
+
+	INIT_SPINSEM(&blk_cache_lock, 1);
+	INIT_LIST_HEAD(blk_lru);
+	for (i = 0; i < BLK_CACHE_BUFS; i++)
+		list_insert_end(&blk_lru, &blk_bufs[i].lru);
 }
 
 void blkdev_register(struct blkdev *dev)
 {
 	int flags;
+
+	INIT_SPINSEM(&dev->qlock, 1);
+	INIT_LIST_HEAD(dev->queue);
+	INIT_LIST_HEAD(dev->done);
+	dev->headpos = 0;
+	dev->poll_us = 0;
+	memset(&dev->stats, 0, sizeof(dev->stats));
+	if (!blk_ticks_per_us)
+		blk_ticks_per_us = max(timer_get_freq() / 1000000, 1);
+
 	spin_acquire_irqsave(&blkdev_list_lock, &flags);
 	list_insert_end(&blkdev_list, &dev->blklist);
 	spin_release_irqrestore(&blkdev_list_lock, &flags);
@@ -45,15 +111,15 @@ struct blkdev *blkdev_get_by_name(char *name)
 	return NULL;
 }
 
-enum blkreq_status blkreq_wait_all(struct blkreq *req)
+enum blkreq_status blkreq_wait_all(struct blkdev *dev, struct blkreq *req)
 {
 	struct blkreq *iter;
 	enum blkreq_status status;
-	wait_for(&req->wait);
+	blk_wait(dev, req);
 	status = req->status;
 	list_for_each_entry(iter, &req->reqlist, reqlist)
 	{
-		wait_for(&iter->wait);
+		blk_wait(dev, iter);
 		if (iter->status != BLKREQ_OK)
 			status = iter->status;
 	}
@@ -70,9 +136,684 @@ void blkreq_free_all(struct blkdev *dev, struct blkreq *req)
 	dev->ops->free(dev, req);
 }
 
+void blk_submit(struct blkdev *dev, struct blkreq *req)
+{
+	struct blkreq *iter;
+	int flags;
+
+	req->start = (uint32_t)timer_get_count();
+	spin_acquire_irqsave(&dev->qlock, &flags);
+	/* Keep the queue sorted, and requests for the same block in order */
+	list_for_each_entry_reverse(iter, &dev->queue, queue)
+	{
+		if (iter->blkidx <= req->blkidx)
+			break;
+	}
+	list_insert(&iter->queue, &req->queue);
+	dev->stats.submitted++;
+	dev->stats.depth++;
+	if (dev->stats.depth > dev->stats.maxdepth)
+		dev->stats.maxdepth = dev->stats.depth;
+	spin_release_irqrestore(&dev->qlock, &flags);
+}
+
+/* The number of pages a buffer touches */
+static inline uint32_t blkvec_pages(uint8_t *buf, uint32_t len)
+{
+	return (((uint32_t)buf & (PAGE_SIZE - 1)) + len + PAGE_SIZE - 1) /
+	       PAGE_SIZE;
+}
+
+/*
+ * A device may need a segment for each page of a request's buffers, since
+ * pages need not be physically contiguous. So that is what we count.
+ */
+static uint32_t blkreq_segs(struct blkreq *req)
+{
+	uint32_t i, segs = 0;
+
+	if (!req->iovcnt)
+		return blkvec_pages(req->buf, req->size);
+	for (i = 0; i < req->iovcnt; i++)
+		segs += blkvec_pages(req->iov[i].buf, req->iov[i].len);
+	return segs;
+}
+
+static inline uint32_t blkreq_nvec(struct blkreq *req)
+{
+	return req->iovcnt ? req->iovcnt : 1;
+}
+
+/**
+ * Return true if next may be merged onto the end of req, which is first in a
+ * run transferring size bytes in segs segments (see blkreq_segs()).
+ */
+static bool blk_can_merge(struct blkdev *dev, struct blkreq *req,
+                          struct blkreq *next, uint32_t size, uint32_t segs)
+{
+	return next->type == req->type &&
+	       next->blkidx == req->blkidx + size / dev->blksiz &&
+	       size + next->size <= dev->maxblks * dev->blksiz &&
+	       segs + blkreq_segs(next) <= dev->maxsegs;
+}
+
+/**
+ * Take the run of mergeable requests at the front of the batch, and submit it
+ * to the device as one request.
+ */
+static void blk_dispatch_run(struct blkdev *dev, struct list_head *batch)
+{
+	struct blkreq *first, *next, *req, *merge;
+	uint32_t size, segs, nvec, n = 1, i = 0, k;
+	int flags;
+
+	first = container_of(batch->next, struct blkreq, queue);
+	size = first->size;
+	segs = blkreq_segs(first);
+	nvec = blkreq_nvec(first);
+	next = first;
+	while (next->queue.next != batch) {
+		req = container_of(next->queue.next, struct blkreq, queue);
+		if (!blk_can_merge(dev, first, req, size, segs))
+			break;
+		size += req->size;
+		segs += blkreq_segs(req);
+		nvec += blkreq_nvec(req);
+		next = req;
+		n++;
+	}
+
+	/*
+	 * The merged request carries a scatter-gather list of each request's
+	 * buffers, and the requests themselves. They are completed along with
+	 * it, in blkreq_complete(). Without memory for either, just submit the
+	 * first request alone.
+	 */
+	merge = NULL;
+	if (n > 1)
+		merge = dev->ops->alloc(dev);
+	if (merge) {
+		merge->iov = kmalloc(nvec * sizeof(struct blkvec));
+		if (!merge->iov) {
+			dev->ops->free(dev, merge);
+			merge = NULL;
+		}
+	}
+	if (!merge)
+		n = 1;
+
+	spin_acquire_irqsave(&dev->qlock, &flags);
+	dev->stats.dispatched++;
+	dev->stats.merged += n - 1;
+	spin_release_irqrestore(&dev->qlock, &flags);
+
+	if (n == 1) {
+		list_remove(&first->queue);
+		dev->ops->submit(dev, first);
+		return;
+	}
+
+	merge->type = first->type;
+	merge->blkidx = first->blkidx;
+	merge->size = size;
+	merge->iovcnt = nvec;
+	for (k = 0; k < n; k++) {
+		req = container_of(batch->next, struct blkreq, queue);
+		if (req->iovcnt) {
+			memcpy(&merge->iov[i], req->iov,
+			       req->iovcnt * sizeof(struct blkvec));
+			i += req->iovcnt;
+		} else {
+			merge->iov[i].buf = req->buf;
+			merge->iov[i++].len = req->size;
+		}
+		list_remove(&req->queue);
+		list_insert_end(&merge->merged, &req->queue);
+	}
+	dev->ops->submit(dev, merge);
+}
+
+/**
+ * Free the merge requests which have completed. Their constituent requests
+ * were already detached and completed by blkreq_complete().
+ */
+static void blk_reap_done(struct blkdev *dev)
+{
+	struct list_head done;
+	struct blkreq *req, *next;
+	int flags;
+
+	INIT_LIST_HEAD(done);
+	spin_acquire_irqsave(&dev->qlock, &flags);
+	list_for_each_entry_safe(req, next, &dev->done, queue)
+	{
+		list_remove(&req->queue);
+		list_insert_end(&done, &req->queue);
+	}
+	spin_release_irqrestore(&dev->qlock, &flags);
+
+	list_for_each_entry_safe(req, next, &done, queue)
+	{
+		kfree(req->iov, req->iovcnt * sizeof(struct blkvec));
+		dev->ops->free(dev, req);
+	}
+}
+
+void blk_unplug(struct blkdev *dev)
+{
+	struct list_head batch;
+	struct blkreq *req, *next;
+	int flags;
+
+	INIT_LIST_HEAD(batch);
+
+	/*
+	 * Dispatch in one sweep across the device, from where the last batch
+	 * ended: first the requests at or beyond that block, then the rest.
+	 */
+	spin_acquire_irqsave(&dev->qlock, &flags);
+	list_for_each_entry_safe(req, next, &dev->queue, queue)
+	{
+		if (req->blkidx >= dev->headpos) {
+			list_remove(&req->queue);
+			list_insert_end(&batch, &req->queue);
+		}
+	}
+	list_for_each_entry_safe(req, next, &dev->queue, queue)
+	{
+		list_remove(&req->queue);
+		list_insert_end(&batch, &req->queue);
+	}
+	if (!list_empty(&batch)) {
+		req = container_of(batch.prev, struct blkreq, queue);
+		dev->headpos = req->blkidx + req->size / dev->blksiz;
+		dev->stats.kicks++;
+	}
+	spin_release_irqrestore(&dev->qlock, &flags);
+
+	blk_reap_done(dev);
+	if (list_empty(&batch))
+		return;
+	while (!list_empty(&batch))
+		blk_dispatch_run(dev, &batch);
+	if (dev->ops->kick)
+		dev->ops->kick(dev);
+}
+
+/* Must hold dev->qlock */
+static void blkreq_account(struct blkdev *dev, struct blkreq *req,
+                           uint32_t now)
+{
+	uint32_t us = (now - req->start) / blk_ticks_per_us;
+	uint32_t bucket = us ? 32 - __builtin_clz(us) : 0;
+
+	dev->stats.latency[min(bucket, BLK_LAT_BUCKETS - 1)]++;
+	dev->stats.depth--;
+}
+
+void blkreq_complete(struct blkdev *dev, struct blkreq *req)
+{
+	struct blkreq *iter, *next;
+	uint32_t now = (uint32_t)timer_get_count();
+	int flags;
+
+	spin_acquire_irqsave(&dev->qlock, &flags);
+	if (list_empty(&req->merged)) {
+		blkreq_account(dev, req, now);
+		spin_release_irqrestore(&dev->qlock, &flags);
+		wait_list_awaken(&req->wait);
+		return;
+	}
+
+	/*
+	 * This may run in interrupt context, so the merge request is freed
+	 * later, by blk_reap_done() in process context.
+	 */
+	list_for_each_entry_safe(iter, next, &req->merged, queue)
+	{
+		list_remove(&iter->queue);
+		iter->status = req->status;
+		blkreq_account(dev, iter, now);
+		wait_list_awaken(&iter->wait);
+	}
+	list_insert_end(&dev->done, &req->queue);
+	spin_release_irqrestore(&dev->qlock, &flags);
+}
+
+void blk_wait(struct blkdev *dev, struct blkreq *req)
+{
+	uint64_t start, budget;
+	bool *done = &req->wait.triggered;
+	int flags;
+
+	if (dev->poll_us && dev->ops->poll) {
+		budget = dev->poll_us * blk_ticks_per_us;
+		start = timer_get_count();
+		while (!*(volatile bool *)done &&
+		       timer_get_count() - start < budget)
+			dev->ops->poll(dev);
+	}
+
+	spin_acquire_irqsave(&dev->qlock, &flags);
+	if (*(volatile bool *)done)
+		dev->stats.polled++;
+	else
+		dev->stats.slept++;
+	spin_release_irqrestore(&dev->qlock, &flags);
+	wait_for(&req->wait);
+	blk_reap_done(dev);
+}
+
+/**
+ * Read or write nblk consecutive blocks, bypassing the cache, and wait for the
+ * result. This uses as few requests as the device allows.
+ */
+static int blk_sync_io(struct blkdev *dev, uint64_t blkidx, uint8_t *buf,
+                       enum blkreq_type op, uint32_t nblk)
+{
+	uint32_t i, n;
+	struct blkreq *first = NULL, *req;
+	enum blkreq_status status;
+
+	for (i = 0; i < nblk; i += n) {
+		n = min(nblk - i, dev->maxblks);
+		req = dev->ops->alloc(dev);
+		req->blkidx = blkidx + i;
+		req->type = op;
+		req->buf = buf + i * dev->blksiz;
+		req->size = n * dev->blksiz;
+		if (first)
+			list_insert_end(&first->reqlist, &req->reqlist);
+		else
+			first = req;
+		blk_submit(dev, req);
+	}
+	blk_unplug(dev);
+
+	status = blkreq_wait_all(dev, first);
+	blkreq_free_all(dev, first);
+	return status == BLKREQ_OK ? 0 : -EIO;
+}
+
+/* Must hold blk_cache_lock */
+static void blkbuf_unhash(struct blkbuf *buf)
+{
+	struct blkbuf **link = &blk_hash[blk_bucket(buf->dev, buf->blkidx)];
+	while (*link != buf)
+		link = &(*link)->hnext;
+	*link = buf->hnext;
+	buf->dev = NULL;
+	buf->valid = false;
+}
+
+/**
+ * Find the buffer for a block, or claim one for it, and take a reference. If
+ * *fill is set on return, the buffer is new and the caller must read it (or
+ * overwrite it), then call blkbuf_ready(). Otherwise, the buffer may still be
+ * being filled by another thread: wait on buf->ready before using it.
+ *
+ * Returns NULL if every buffer is in use, or there is no memory for one. The
+ * caller should do uncached I/O.
+ */
+static struct blkbuf *blkbuf_get(struct blkdev *dev, uint64_t blkidx,
+                                 bool *fill)
+{
+	struct blkbuf *buf;
+	int flags;
+
+again:
+	spin_acquire_irqsave(&blk_cache_lock, &flags);
+	for (buf = blk_hash[blk_bucket(dev, blkidx)]; buf; buf = buf->hnext) {
+		if (buf->dev == dev && buf->blkidx == blkidx) {
+			buf->refcnt++;
+			list_remove(&buf->lru);
+			list_insert(&blk_lru, &buf->lru);
+			blk_stats.hits++;
+			spin_release_irqrestore(&blk_cache_lock, &flags);
+			*fill = false;
+			return buf;
+		}
+	}
+
+	/* Find the least recently used buffer which nobody is using */
+	list_for_each_entry_reverse(buf, &blk_lru, lru)
+	{
+		if (buf->refcnt == 0)
+			break;
+	}
+	if (&buf->lru == &blk_lru) {
+		blk_stats.uncached++;
+		spin_release_irqrestore(&blk_cache_lock, &flags);
+		return NULL;
+	}
+
+	if (buf->dirty) {
+		/*
+		 * Write it back without the lock, and then start over, since
+		 * the block we want could have been cached meanwhile.
+		 */
+		buf->refcnt++;
+		buf->dirty = false;
+		blk_stats.dirty--;
+		blk_stats.writebacks++;
+		spin_release_irqrestore(&blk_cache_lock, &flags);
+		if (blk_sync_io(buf->dev, buf->blkidx, buf->data, BLKREQ_WRITE,
+		                1) < 0)
+			printf("blk: error writing back block %u of \"%s\"\n",
+			       (uint32_t)buf->blkidx, buf->dev->name);
+		spin_acquire_irqsave(&blk_cache_lock, &flags);
+		buf->refcnt--;
+		spin_release_irqrestore(&blk_cache_lock, &flags);
+		goto again;
+	}
+
+	if (buf->dev) {
+		blkbuf_unhash(buf);
+		blk_stats.evictions++;
+	}
+	blk_stats.misses++;
+	buf->dev = dev;
+	buf->blkidx = blkidx;
+	buf->refcnt = 1;
+	buf->valid = false;
+	wait_list_init(&buf->ready);
+	buf->hnext = blk_hash[blk_bucket(dev, blkidx)];
+	blk_hash[blk_bucket(dev, blkidx)] = buf;
+	list_remove(&buf->lru);
+	list_insert(&blk_lru, &buf->lru);
+	spin_release_irqrestore(&blk_cache_lock, &flags);
+
+	if (buf->size < dev->blksiz) {
+		if (buf->data)
+			kfree(buf->data, buf->size);
+		buf->size = 0;
+		buf->data = kmalloc(dev->blksiz);
+		if (!buf->data) {
+			/* Give the buffer up, as if reading it had failed */
+			spin_acquire_irqsave(&blk_cache_lock, &flags);
+			blkbuf_unhash(buf);
+			buf->refcnt--;
+			blk_stats.uncached++;
+			spin_release_irqrestore(&blk_cache_lock, &flags);
+			wait_list_awaken(&buf->ready);
+			return NULL;
+		}
+		buf->size = dev->blksiz;
+	}
+	*fill = true;
+	return buf;
+}
+
+/**
+ * Finish filling a buffer returned by blkbuf_get(). If the read failed, the
+ * buffer is dropped from the cache.
+ */
+static void blkbuf_ready(struct blkbuf *buf, bool ok)
+{
+	int flags;
+	spin_acquire_irqsave(&blk_cache_lock, &flags);
+	if (ok)
+		buf->valid = true;
+	else
+		blkbuf_unhash(buf);
+	spin_release_irqrestore(&blk_cache_lock, &flags);
+	wait_list_awaken(&buf->ready);
+}
+
+static void blkbuf_put(struct blkbuf *buf)
+{
+	int flags;
+	spin_acquire_irqsave(&blk_cache_lock, &flags);
+	buf->refcnt--;
+	spin_release_irqrestore(&blk_cache_lock, &flags);
+}
+
+static int blk_cache_read_batch(struct blkdev *dev, uint64_t blkidx,
+                                uint8_t *dst, uint32_t nblk)
+{
+	struct blkbuf *bufs[BLK_CACHE_BATCH];
+	bool fill[BLK_CACHE_BATCH];
+	struct blkreq *reqs[BLK_CACHE_BATCH];
+	uint32_t i, j, k;
+	bool ok;
+	int rv = 0;
+
+	for (i = 0; i < nblk; i++)
+		bufs[i] = blkbuf_get(dev, blkidx + i, &fill[i]);
+
+	/*
+	 * Each run of blocks which we must read (new buffers, or blocks we
+	 * couldn't cache) becomes a single request, straight into dst.
+	 */
+	for (i = 0; i < nblk; i = j) {
+		reqs[i] = NULL;
+		j = i + 1;
+		if (bufs[i] && !fill[i])
+			continue;
+		while (j < nblk && j - i < dev->maxblks && (!bufs[j] || fill[j]))
+			j++;
+		reqs[i] = dev->ops->alloc(dev);
+		reqs[i]->blkidx = blkidx + i;
+		reqs[i]->type = BLKREQ_READ;
+		reqs[i]->buf = dst + i * dev->blksiz;
+		reqs[i]->size = (j - i) * dev->blksiz;
+		blk_submit(dev, reqs[i]);
+	}
+	blk_unplug(dev);
+
+	for (i = 0; i < nblk; i = j) {
+		j = i + 1;
+		if (!reqs[i]) {
+			/* cached, though maybe still being read by another */
+			wait_for(&bufs[i]->ready);
+			if (bufs[i]->valid)
+				memcpy(dst + i * dev->blksiz, bufs[i]->data,
+				       dev->blksiz);
+			else
+				rv = -EIO;
+			blkbuf_put(bufs[i]);
+			continue;
+		}
+
+		j = i + reqs[i]->size / dev->blksiz;
+		blk_wait(dev, reqs[i]);
+		ok = reqs[i]->status == BLKREQ_OK;
+		if (!ok)
+			rv = -EIO;
+		for (k = i; k < j; k++) {
+			if (!bufs[k])
+				continue;
+			if (ok)
+				memcpy(bufs[k]->data, dst + k * dev->blksiz,
+				       dev->blksiz);
+			blkbuf_ready(bufs[k], ok);
+			blkbuf_put(bufs[k]);
+		}
+		dev->ops->free(dev, reqs[i]);
+	}
+	return rv;
+}
+
+static int blk_cache_write_batch(struct blkdev *dev, uint64_t blkidx,
+                                 const uint8_t *src, uint32_t nblk)
+{
+	struct blkbuf *buf;
+	uint32_t i;
+	bool fill;
+	int flags, rv = 0;
+
+	for (i = 0; i < nblk; i++) {
+		buf = blkbuf_get(dev, blkidx + i, &fill);
+		if (!buf) {
+			if (blk_sync_io(dev, blkidx + i,
+			                (uint8_t *)src + i * dev->blksiz,
+			                BLKREQ_WRITE, 1) < 0)
+				rv = -EIO;
+			continue;
+		}
+		if (!fill)
+			wait_for(&buf->ready);
+
+		spin_acquire_irqsave(&blk_cache_lock, &flags);
+		if (!fill && !buf->valid) {
+			/* Another thread failed to read it, and dropped it
+			 * from the cache. Write it directly instead. */
+			spin_release_irqrestore(&blk_cache_lock, &flags);
+			blkbuf_put(buf);
+			if (blk_sync_io(dev, blkidx + i,
+			                (uint8_t *)src + i * dev->blksiz,
+			                BLKREQ_WRITE, 1) < 0)
+				rv = -EIO;
+			continue;
+		}
+		memcpy(buf->data, src + i * dev->blksiz, dev->blksiz);
+		if (!buf->dirty)
+			blk_stats.dirty++;
+		buf->dirty = true;
+		spin_release_irqrestore(&blk_cache_lock, &flags);
+		if (fill)
+			blkbuf_ready(buf, true);
+		blkbuf_put(buf);
+	}
+	return rv;
+}
+
+int blk_cache_read(struct blkdev *dev, uint64_t blkidx, void *dst,
+                   uint32_t nblk)
+{
+	uint32_t n;
+	int rv = 0;
+
+	for (; nblk; nblk -= n, blkidx += n, dst += n * dev->blksiz) {
+		n = min(nblk, BLK_CACHE_BATCH);
+		if (blk_cache_read_batch(dev, blkidx, dst, n) < 0)
+			rv = -EIO;
+	}
+	return rv;
+}
+
+int blk_cache_write(struct blkdev *dev, uint64_t blkidx, const void *src,
+                    uint32_t nblk)
+{
+	uint32_t n;
+	int rv = 0;
+
+	for (; nblk; nblk -= n, blkidx += n, src += n * dev->blksiz) {
+		n = min(nblk, BLK_CACHE_BATCH);
+		if (blk_cache_write_batch(dev, blkidx, src, n) < 0)
+			rv = -EIO;
+	}
+	if (blk_stats.dirty > BLK_CACHE_DIRTY_MAX)
+		blk_cache_flush(NULL);
+	return rv;
+}
+
+int blk_cache_flush(struct blkdev *dev)
+{
+	struct blkbuf *flushing[BLK_CACHE_BUFS], *tmp;
+	struct blkreq *reqs[BLK_CACHE_BUFS];
+	struct blkdev *bdev;
+	uint32_t i, j, n = 0;
+	int flags, rv = 0;
+
+	/* Pin each dirty buffer and mark it clean before writing it out, so
+	 * that a concurrent write will dirty it again. */
+	spin_acquire_irqsave(&blk_cache_lock, &flags);
+	for (i = 0; i < BLK_CACHE_BUFS; i++) {
+		if (!blk_bufs[i].dirty || !blk_bufs[i].valid ||
+		    (dev && blk_bufs[i].dev != dev))
+			continue;
+		blk_bufs[i].dirty = false;
+		blk_bufs[i].refcnt++;
+		blk_stats.dirty--;
+		blk_stats.writebacks++;
+		flushing[n++] = &blk_bufs[i];
+	}
+	spin_release_irqrestore(&blk_cache_lock, &flags);
+
+	/*
+	 * Sort by device and block, so that each device is unplugged once, and
+	 * requests are queued in order.
+	 */
+	for (i = 1; i < n; i++) {
+		tmp = flushing[i];
+		for (j = i; j > 0 && (flushing[j - 1]->dev > tmp->dev ||
+		                      (flushing[j - 1]->dev == tmp->dev &&
+		                       flushing[j - 1]->blkidx > tmp->blkidx));
+		     j--)
+			flushing[j] = flushing[j - 1];
+		flushing[j] = tmp;
+	}
+
+	/*
+	 * Submit a write for each buffer. The scheduler merges runs of
+	 * consecutive blocks into one request, using the buffers in place.
+	 */
+	for (i = 0; i < n; i++) {
+		bdev = flushing[i]->dev;
+		reqs[i] = bdev->ops->alloc(bdev);
+		reqs[i]->blkidx = flushing[i]->blkidx;
+		reqs[i]->type = BLKREQ_WRITE;
+		reqs[i]->buf = flushing[i]->data;
+		reqs[i]->size = bdev->blksiz;
+		blk_submit(bdev, reqs[i]);
+		if (i + 1 == n || flushing[i + 1]->dev != bdev)
+			blk_unplug(bdev);
+	}
+
+	for (i = 0; i < n; i++) {
+		bdev = flushing[i]->dev;
+		blk_wait(bdev, reqs[i]);
+		if (reqs[i]->status != BLKREQ_OK) {
+			printf("blk: error writing back block %u of \"%s\"\n",
+			       (uint32_t)flushing[i]->blkidx, bdev->name);
+			rv = -EIO;
+		}
+		bdev->ops->free(bdev, reqs[i]);
+		blkbuf_put(flushing[i]);
+	}
+	return rv;
+}
+
+int blk_cmd_cache(int argc, char **argv)
+{
+	uint32_t i, used = 0;
+
+	for (i = 0; i < BLK_CACHE_BUFS; i++)
+		if (blk_bufs[i].dev)
+			used++;
+	printf("Block cache: %u of %u buffers in use\n", used,
+	       BLK_CACHE_BUFS);
+	printf("    hits      : %u\n", blk_stats.hits);
+	printf("    misses    : %u\n", blk_stats.misses);
+	printf("    evictions : %u\n", blk_stats.evictions);
+	printf("    dirty     : %u\n", blk_stats.dirty);
+	printf("    writebacks: %u\n", blk_stats.writebacks);
+	printf("    uncached  : %u\n", blk_stats.uncached);
+	return 0;
+}
+
+int blk_cmd_flush(int argc, char **argv)
+{
+	struct blkdev *dev = NULL;
+	if (argc > 1) {
+		puts("usage: blk flush [BLKNAME]\n");
+		return 1;
+	}
+	if (argc == 1) {
+		dev = blkdev_get_by_name(argv[0]);
+		if (!dev) {
+			printf("no such blockdev \"%s\"\n", argv[0]);
+			return 1;
+		}
+	}
+	return blk_cache_flush(dev) < 0 ? 1 : 0;
+}
+
 int blk_cmd_status(int argc, char **argv)
 {
 	struct blkdev *dev;
+	uint32_t i;
 	if (argc != 1) {
 		puts("usage: blk status BLKNAME\n");
 		return 1;
@@ -85,16 +826,172 @@ int blk_cmd_status(int argc, char **argv)
 	printf("Block device \"%s\"\n", argv[0]);
 	printf("    block size : %d\n", dev->blksiz);
 	printf("    block count: %d\n", (uint32_t)dev->blkcnt);
+	printf("    max request: %d blocks\n", dev->maxblks);
+	printf("    queue depth: %u (max %u)\n", dev->stats.depth,
+	       dev->stats.maxdepth);
+	printf("    submitted  : %u\n", dev->stats.submitted);
+	printf("    merged     : %u\n", dev->stats.merged);
+	printf("    dispatched : %u in %u batches\n", dev->stats.dispatched,
+	       dev->stats.kicks);
+	printf("    poll budget: %u us\n", dev->poll_us);
+	printf("    waits      : %u without sleeping, %u slept\n",
+	       dev->stats.polled, dev->stats.slept);
+	puts("    latency (us):\n");
+	for (i = 0; i < BLK_LAT_BUCKETS; i++) {
+		if (!dev->stats.latency[i])
+			continue;
+		if (i == 0)
+			printf("        < 1\t%u\n", dev->stats.latency[i]);
+		else if (i == BLK_LAT_BUCKETS - 1)
+			printf("        >= %u\t%u\n", 1 << (i - 1),
+			       dev->stats.latency[i]);
+		else
+			printf("        %u-%u\t%u\n", 1 << (i - 1),
+			       (1 << i) - 1, dev->stats.latency[i]);
+	}
 	puts("Device info below:\n");
 	dev->ops->status(dev);
 	return 0;
 }
 
-int blk_cmd_read(int argc, char **argv)
+int blk_cmd_poll(int argc, char **argv)
 {
 	struct blkdev *dev;
-	uint32_t rv = 0;
+	if (argc != 2) {
+		puts("usage: blk poll BLKNAME MICROSECONDS\n");
+		return 1;
+	}
+	dev = blkdev_get_by_name(argv[0]);
+	if (!dev) {
+		printf("no such blockdev \"%s\"\n", argv[0]);
+		return 1;
+	}
+	if (!dev->ops->poll) {
+		printf("blockdev \"%s\" does not support polling\n", argv[0]);
+		return 1;
+	}
+	dev->poll_us = atoi(argv[1]);
+	return 0;
+}
+
+static void blk_sort_u32(uint32_t *arr, uint32_t n)
+{
+	uint32_t i, j, tmp;
+	for (i = 1; i < n; i++) {
+		tmp = arr[i];
+		for (j = i; j > 0 && arr[j - 1] > tmp; j--)
+			arr[j] = arr[j - 1];
+		arr[j] = tmp;
+	}
+}
+
+/* Most reads "blk bench" will time: the latencies are kept for sorting */
+#define BLK_BENCH_MAX 10000
+
+/**
+ * Time n uncached single-block reads into buf, and report the median and 99th
+ * percentile latency in microseconds.
+ */
+static int blk_bench_reads(struct blkdev *dev, uint32_t n, uint32_t *lat,
+                           uint8_t *buf)
+{
 	struct blkreq *req;
+	uint64_t start;
+	uint32_t i, nblk = min(dev->blkcnt, n);
+	int rv = 0;
+
+	req = dev->ops->alloc(dev);
+	req->type = BLKREQ_READ;
+	req->size = dev->blksiz;
+	req->buf = buf;
+	for (i = 0; i < n; i++) {
+		wait_list_init(&req->wait);
+		req->blkidx = i % nblk;
+		start = timer_get_count();
+		blk_submit(dev, req);
+		blk_unplug(dev);
+		blk_wait(dev, req);
+		lat[i] = (uint32_t)(timer_get_count() - start) /
+		         blk_ticks_per_us;
+		if (req->status != BLKREQ_OK)
+			rv = -EIO;
+	}
+	dev->ops->free(dev, req);
+
+	blk_sort_u32(lat, n);
+	printf("    p50 %u us, p99 %u us, max %u us\n", lat[n / 2],
+	       lat[n * 99 / 100], lat[n - 1]);
+	return rv;
+}
+
+int blk_cmd_bench(int argc, char **argv)
+{
+	struct blkdev *dev;
+	uint32_t n = 1000, budget = 100, saved, *lat;
+	uint8_t *buf;
+	int rv = 0;
+
+	if (argc < 1 || argc > 3) {
+		puts("usage: blk bench BLKNAME [COUNT [POLL_US]]\n");
+		return 1;
+	}
+	dev = blkdev_get_by_name(argv[0]);
+	if (!dev) {
+		printf("no such blockdev \"%s\"\n", argv[0]);
+		return 1;
+	}
+	if (argc >= 2)
+		n = atoi(argv[1]);
+	if (argc >= 3)
+		budget = atoi(argv[2]);
+	if (n == 0 || n > BLK_BENCH_MAX) {
+		printf("blk bench: COUNT must be 1 to %u\n", BLK_BENCH_MAX);
+		return 1;
+	}
+
+	lat = kmalloc(n * sizeof(uint32_t));
+	buf = kmalloc(dev->blksiz);
+	if (!lat || !buf) {
+		puts("blk bench: out of memory\n");
+		if (lat)
+			kfree(lat, n * sizeof(uint32_t));
+		if (buf)
+			kfree(buf, dev->blksiz);
+		return 1;
+	}
+	saved = dev->poll_us;
+
+	printf("%u single block reads, interrupt driven:\n", n);
+	dev->poll_us = 0;
+	if (blk_bench_reads(dev, n, lat, buf) < 0)
+		rv = 1;
+
+	if (dev->ops->poll) {
+		printf("%u single block reads, polling for %u us:\n", n,
+		       budget);
+		dev->poll_us = budget;
+		if (blk_bench_reads(dev, n, lat, buf) < 0)
+			rv = 1;
+	}
+
+	dev->poll_us = saved;
+	kfree(lat, n * sizeof(uint32_t));
+	kfree(buf, dev->blksiz);
+	if (rv)
+		puts("ERROR: some reads failed\n");
+	return rv;
+}
+
+/*
+ * The read and write commands go through the cache, so that they agree with
+ * the filesystem about what is on the disk. A write is flushed before
+ * returning, so "written!" means that the device has it.
+ */
+int blk_cmd_read(int argc, char **argv)
+{
+	struct blkdev *dev;
+	uint32_t blkidx, rv = 0;
+	uint8_t *buf;
 
 	if (argc != 2) {
 		puts("usage: blk read BLKNAME SECTOR\n");
@@ -106,29 +1003,34 @@ int blk_cmd_read(int argc, char **argv)
 		return 1;
 	}
 
-	req = dev->ops->alloc(dev);
-	req->size = 512;
-	req->buf = kmalloc(req->size);
-	req->blkidx = atoi(argv[1]);
-	dev->ops->submit(dev, req);
-	wait_for(&req->wait);
-	if (req->status != BLKREQ_OK) {
+	blkidx = atoi(argv[1]);
+	if (blkidx >= dev->blkcnt) {
+		puts("ERROR: sector out of range\n");
+		return 1;
+	}
+
+	buf = kmalloc(dev->blksiz);
+	if (!buf) {
+		puts("ERROR: out of memory\n");
+		return 1;
+	}
+	if (blk_cache_read(dev, blkidx, buf, 1) < 0) {
 		puts("ERROR\n");
 		rv = 1;
 		goto cleanup;
 	}
-	printf("result: \"%s\"\n", req->buf);
+	buf[dev->blksiz - 1] = '\0';
+	printf("result: \"%s\"\n", buf);
 cleanup:
-	kfree(req->buf, req->size);
-	dev->ops->free(dev, req);
+	kfree(buf, dev->blksiz);
 	return rv;
 }
 
 int blk_cmd_write(int argc, char **argv)
 {
 	struct blkdev *dev;
-	struct blkreq *req;
-	uint32_t len, rv = 0;
+	uint8_t *buf;
+	uint32_t blkidx, len, rv = 0;
 
 	if (argc != 3) {
 		puts("usage: blk write BLKNAME SECTOR STRING\n");
@@ -140,15 +1042,23 @@ int blk_cmd_write(int argc, char **argv)
 		return 1;
 	}
 
-	req = dev->ops->alloc(dev);
-	req->size = 512;
-	req->buf = kmalloc(req->size);
-	req->blkidx = atoi(argv[1]);
-	len = strlen(argv[2]);
-	memcpy(req->buf, argv[2], len + 1);
-	dev->ops->submit(dev, req);
-	wait_for(&req->wait);
-	if (req->status != BLKREQ_OK) {
+	/* the cache would hold on to a block the device can't store */
+	blkidx = atoi(argv[1]);
+	if (blkidx >= dev->blkcnt) {
+		puts("ERROR: sector out of range\n");
+		return 1;
+	}
+
+	buf = kmalloc(dev->blksiz);
+	if (!buf) {
+		puts("ERROR: out of memory\n");
+		return 1;
+	}
+	len = min(strlen(argv[2]), dev->blksiz - 1);
+	memset(buf, 0, dev->blksiz);
+	memcpy(buf, argv[2], len);
+	if (blk_cache_write(dev, blkidx, buf, 1) < 0 ||
+	    blk_cache_flush(dev) < 0) {
 		puts("ERROR\n");
 		rv = 1;
 		goto cleanup;
@@ -156,8 +1066,7 @@ int blk_cmd_write(int argc, char **argv)
 	puts("written!\n");
 
 cleanup:
-	kfree(req->buf, req->size);
-	dev->ops->free(dev, req);
+	kfree(buf, dev->blksiz);
 	return rv;
 }
 
@@ -165,5 +1074,9 @@ struct ksh_cmd blk_ksh_cmds[] = {
 	KSH_CMD("read", blk_cmd_read, "read block device sector"),
 	KSH_CMD("write", blk_cmd_write, "write block device sector"),
 	KSH_CMD("status", blk_cmd_status, "read block device status"),
+	KSH_CMD("cache", blk_cmd_cache, "show block cache statistics"),
+	KSH_CMD("flush", blk_cmd_flush, "write back dirty cached blocks"),
+	KSH_CMD("poll", blk_cmd_poll, "set busy-poll budget for a device"),
+	KSH_CMD("bench", blk_cmd_bench, "compare polling and interrupt latency"),
 	{ 0 },
 };
@@ -4,6 +4,15 @@
 #include "list.h"
 #include "wait.h"
 
+/**
+ * One piece of a scatter-gather list. It should not cross a page boundary,
+ * since each page of it may take a segment of its own.
+ */
+struct blkvec {
+	uint8_t *buf;
+	uint32_t len;
+};
+
 /**
  * A request to read or write a block from a block device.
  *
@@ -21,7 +30,20 @@ struct blkreq {
 	} type;
 	uint64_t blkidx;
 	uint8_t *buf;
+	/*
+	 * Number of bytes to transfer. This must be a multiple of the device
+	 * block size, and a request may cover up to dev->maxblks consecutive
+	 * blocks starting at blkidx.
+	 */
 	uint32_t size;
+	/*
+	 * Alternatively, a scatter-gather list of up to dev->maxsegs buffers.
+	 * If iovcnt is non-zero, buf is ignored, and the data is transferred
+	 * to or from each buffer in turn. The lengths must add up to size.
+	 * blkreq_init() sets iovcnt to zero.
+	 */
+	struct blkvec *iov;
+	uint32_t iovcnt;
 	/* PARAMETERS RETURNED AS OUTPUT */
 	enum blkreq_status {
 		BLKREQ_OK,
@@ -30,6 +52,10 @@ struct blkreq {
 	/* FIELDS INITIALIZED BY alloc() */
 	struct waitlist wait;
 	struct list_head reqlist;
+	/* FIELDS USED BY THE BLOCK LAYER */
+	struct list_head queue;  /* link in the device queue or a merge */
+	struct list_head merged; /* requests merged into this one */
+	uint32_t start;          /* timer count when submitted */
 };
 
 struct blkdev;
@@ -50,30 +76,60 @@ struct blkdev_ops {
 	 */
 	void (*free)(struct blkdev *dev, struct blkreq *req);
 	/**
-	 * Submit a block request to the device.
-	 *
-	 * When this function returns, the request is submitted, but not
-	 * finished. The `wait` field of the req is an event which can be used
-	 * to block until the request is satisfied. However, a caller may want
-	 * to submit additional requests first, and then wait for all of them.
+	 * Submit a block request to the device. This is called by the block
+	 * layer when it dispatches its queue: users should call blk_submit().
 	 *
-	 * Submitting the request to the device hands over ownership until the
-	 * `wait` event is triggered. Callers MAY NOT modify the request after
-	 * this function returns, until the wait event is triggered.
+	 * The device need not start the request until kick() is called. When
+	 * the request finishes, the driver must call blkreq_complete().
 	 */
 	void (*submit)(struct blkdev *dev, struct blkreq *req);
+	/**
+	 * Tell the device about every request submitted since the last kick.
+	 * This is optional, for devices which start requests in submit().
+	 */
+	void (*kick)(struct blkdev *dev);
+	/**
+	 * Complete any requests which the device has finished, without
+	 * waiting for its interrupt. Return true if there were any. This is
+	 * optional, and used by blk_wait() when the device has a poll budget.
+	 */
+	bool (*poll)(struct blkdev *dev);
 	/**
 	 * Print out status information.
 	 */
 	void (*status)(struct blkdev *dev);
 };
 
+/* Completion latency histogram buckets, by power of two microseconds */
+#define BLK_LAT_BUCKETS 16
+
+struct blkdev_stats {
+	uint32_t depth;      /* requests submitted but not complete */
+	uint32_t maxdepth;
+	uint32_t submitted;  /* requests passed to blk_submit() */
+	uint32_t merged;     /* requests merged into another one */
+	uint32_t dispatched; /* requests passed to the driver */
+	uint32_t kicks;
+	uint32_t polled;     /* waits which ended without sleeping */
+	uint32_t slept;      /* waits which went to sleep */
+	uint32_t latency[BLK_LAT_BUCKETS];
+};
+
 struct blkdev {
 	struct list_head blklist;
 	struct blkdev_ops *ops;
 	uint64_t blkcnt;
 	uint32_t blksiz;
+	uint32_t maxblks; /* most blocks a single request may transfer */
+	uint32_t maxsegs; /* most pages a request's buffers may touch */
 	char name[16];
+	/* I/O scheduler, initialized by blkdev_register() */
+	spinsem_t qlock;
+	struct list_head queue; /* pending requests, sorted by blkidx */
+	struct list_head done;  /* finished merge requests, to be reaped */
+	uint64_t headpos;       /* block after the last dispatched request */
+	uint32_t poll_us;       /* busy-poll budget for blk_wait(), 0 = off */
+	struct blkdev_stats stats;
 };
 
 /**
@@ -94,12 +150,59 @@ void blkdev_register(struct blkdev *blk);
  */
 struct blkdev *blkdev_get_by_name(char *name);
 
+/**
+ * Queue a request for the device. Queued requests are sorted by block, and
+ * adjacent requests of the same type are merged when they are dispatched by
+ * blk_unplug(). The request's `wait` field is an event which is triggered when
+ * it completes.
+ *
+ * Submitting the request hands over ownership until the `wait` event is
+ * triggered. Callers MAY NOT modify the request until then.
+ */
+void blk_submit(struct blkdev *dev, struct blkreq *req);
+/**
+ * Dispatch every queued request to the device, and notify it once. Callers
+ * must unplug after submitting, before waiting on their requests.
+ */
+void blk_unplug(struct blkdev *dev);
+/**
+ * Called by device drivers when a request submitted with ops->submit() has
+ * finished, and its status is set.
+ */
+void blkreq_complete(struct blkdev *dev, struct blkreq *req);
+/**
+ * Wait for a submitted request to complete. If the device has a poll budget,
+ * first spin polling the device for up to that many microseconds, and only
+ * then sleep until the interrupt.
+ */
+void blk_wait(struct blkdev *dev, struct blkreq *req);
+
 /**
  * Wait for every item in the request list to complete. If all requests have
  * status BLKREQ_QK, return BLKREQ_OK, otherwise return BLKREQ_ERR.
  */
-enum blkreq_status blkreq_wait_all(struct blkreq *req);
+enum blkreq_status blkreq_wait_all(struct blkdev *dev, struct blkreq *req);
 /**
  * Free every request in the request list.
  */
 void blkreq_free_all(struct blkdev *dev, struct blkreq *req);
+
+/**
+ * Read nblk consecutive blocks through the block cache.
+ * Return: 0 on success, -EIO if any block could not be read
+ */
+int blk_cache_read(struct blkdev *dev, uint64_t blkidx, void *dst,
+                   uint32_t nblk);
+/**
+ * Write nblk consecutive blocks through the block cache. The data may not reach
+ * the device until the blocks are evicted or flushed.
+ * Return: 0 on success, -EIO if any block could not be written
+ */
+int blk_cache_write(struct blkdev *dev, uint64_t blkidx, const void *src,
+                    uint32_t nblk);
+/**
+ * Write every dirty cached block of a device (or of all devices, if dev is
+ * NULL) and wait for the writes to complete.
+ * Return: 0 on success, -EIO if any block could not be written
+ */
+int blk_cache_flush(struct blkdev *dev);
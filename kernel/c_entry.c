@@ -48,11 +48,54 @@ void print_fault(uint32_t fsr, uint32_t far, struct ctx *ctx)
 	puts("END OF FAULT REPORT\n");
 }
 
+#define DFSR_WNR (1 << 11) /* the abort was caused by a write */
+
+static void fault_oom_exit(void)
+{
+	printf("[kernel] Process %u killed: out of memory.\n", current->id);
+	destroy_current_process();
+	/* never returns */
+}
+
+/*
+ * Translation faults, and permission faults, on user memory may just mean that
+ * a page of the current process's image needs to be mapped. This applies to
+ * faults in the kernel too, while accessing user memory in a system call.
+ *
+ * If there is no memory for the page, a user process is killed: rather than
+ * retrying the instruction, the abort returns into fault_oom_exit() on the
+ * process's kernel stack, just as a kernel thread starts.
+ */
+static bool handle_image_fault(uint32_t fsr, uint32_t far, bool write,
+                               struct ctx *ctx)
+{
+	int rv;
+
+	switch (fsr & 0x40F) {
+	case 0x5: /* translation (section) */
+	case 0x7: /* translation (page) */
+	case 0xF: /* permission (page) */
+		rv = image_fault(current, far, write);
+		break;
+	default:
+		return false;
+	}
+	if (rv == -ENOMEM && (ctx->spsr & ARM_MODE_MASK) == ARM_MODE_USER) {
+		ctx->spsr = ARM_MODE_SYS;
+		ctx->sp = (uint32_t)current->kstack;
+		ctx->ret = (uint32_t)fault_oom_exit;
+		return true;
+	}
+	return rv == 0;
+}
+
 void data_abort(struct ctx *ctx)
 {
 	uint32_t dfsr, dfar;
 	get_cpreg(dfsr, c5, 0, c0, 0);
 	get_cpreg(dfar, c6, 0, c0, 0);
+	if (handle_image_fault(dfsr, dfar, dfsr & DFSR_WNR, ctx))
+		return;
 	printf("ERR: Data Abort! DFSR=%x DFAR=%x\n", dfsr, dfar);
 	print_fault(dfsr, dfar, ctx);
 	cpu_infinite_loop();
@@ -63,6 +106,8 @@ void prefetch_abort(struct ctx *ctx)
 	uint32_t fsr, far;
 	get_cpreg(fsr, c5, 0, c0, 1);
 	get_cpreg(far, c6, 0, c0, 2);
+	if (handle_image_fault(fsr, far, false, ctx))
+		return;
 	printf("ERR: Prefetch Abort! FSR=%x IFAR=%x\n", fsr, far);
 	print_fault(fsr, far, ctx);
 	cpu_infinite_loop();
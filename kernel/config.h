@@ -47,3 +47,16 @@
  * for vmalloc?
  */
 #define CONFIG_VMALLOC_MBS 8
+
+/*
+ * CONFIG_VIRTIO_NET_RING
+ * OPTIONAL: how many entries to request for each virtio-net queue. This must
+ * be a power of two. If the device's QueueNumMax is smaller, we use that.
+ */
+#if !defined(CONFIG_VIRTIO_NET_RING)
+#define CONFIG_VIRTIO_NET_RING 256
+#endif
+#if CONFIG_VIRTIO_NET_RING < 2 || CONFIG_VIRTIO_NET_RING > 32768 ||            \
+        (CONFIG_VIRTIO_NET_RING & (CONFIG_VIRTIO_NET_RING - 1))
+#error "CONFIG_VIRTIO_NET_RING must be a power of two, from 2 to 32768"
+#endif
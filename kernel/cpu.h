@@ -130,6 +130,12 @@ static inline void tlbiall(void)
 	set_cpreg(reg, c8, 0, c7, 0);
 }
 
+/* Invalidate the TLB entry for one page (address | ASID) */
+static inline void tlbimva(uint32_t mva_asid)
+{
+	set_cpreg(mva_asid, c8, 0, c7, 1);
+}
+
 static inline uint32_t get_sctlr()
 {
 	uint32_t reg;
@@ -144,6 +150,12 @@ static inline uint32_t get_cpsr()
 	return val;
 }
 
+/* True while handling an interrupt (including timers), where we can't sleep */
+static inline bool in_irq(void)
+{
+	return (get_cpsr() & ARM_MODE_MASK) == ARM_MODE_IRQ;
+}
+
 /**
  * Data Cache Clean and Invalidate by Virtual Address
  * -> write back and invalidate cache for src
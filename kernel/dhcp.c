@@ -8,8 +8,8 @@
  *
  * This relies a bit on how network initialization works in SOS. Currently, the
  * "network interface" structure (struct netif) initializes the IP, gateway,
- * subnet, and dns fields to 0, and in the IP layer, we record static mappings
- * for the IP broadcast address 255.255.255.255 to map it to the MAC
+ * subnet, and dns fields to 0, and in the IP layer, the neighbor table has a
+ * static entry mapping the IP broadcast address 255.255.255.255 to the MAC
  * ff:ff:ff:ff:ff:ff. This means that when we send a DHCP packet via IP it gets
  * properly handled down the chain.
  */
@@ -31,6 +31,11 @@ static void dhcp_discover(struct netif *netif)
 	struct dhcp_option *dtype;
 	int space = udp_reserve();
 	struct packet *pkt = packet_alloc();
+
+	if (!pkt) {
+		netstats.tx_nomem++;
+		return;
+	}
 	pkt->al = (void *)pkt->data + space;
 
 	dhcp = (struct dhcp *)pkt->al;
@@ -138,6 +143,10 @@ struct packet *dhcp_handle_offer(struct netif *netif, struct packet *pkt)
 		return NULL;
 
 	pktr = packet_alloc();
+	if (!pktr) {
+		netstats.tx_nomem++;
+		return NULL;
+	}
 	pktr->al = pktr->data + udp_reserve();
 	dhcpr = (struct dhcp *)pktr->al;
 	dhcpr->op = BOOTREQUEST;
@@ -214,23 +223,44 @@ int dhcp_handle_ack(struct netif *netif, struct packet *pkt)
 	return 0;
 }
 
+/*
+ * Each message is retransmitted if no reply comes, waiting twice as long each
+ * time: 2, 4, 8 and then 16 seconds.
+ */
+#define DHCP_TRIES      4
+#define DHCP_TIMEOUT_MS 2000
+
 void dhcp(void)
 {
-	struct packet *offer, *reply, *ack;
+	struct packet *offer = NULL, *reply, *ack = NULL;
+	int try;
 
-	interrupt_disable();
-	dhcp_discover(&nif);
-	offer = udp_wait(UDPPORT_DHCP_CLIENT); /* interrupts re-enabled */
+	for (try = 0; try < DHCP_TRIES && !offer; try++) {
+		interrupt_disable();
+		dhcp_discover(&nif);
+		/* interrupts re-enabled */
+		offer = udp_wait(UDPPORT_DHCP_CLIENT, DHCP_TIMEOUT_MS << try);
+	}
+	if (!offer) {
+		puts("dhcp: no offer received, giving up\n");
+		return;
+	}
 
-	reply = dhcp_handle_offer(&nif, offer);
+	for (try = 0; try < DHCP_TRIES && !ack; try++) {
+		reply = dhcp_handle_offer(&nif, offer);
+		if (!reply)
+			break;
+		interrupt_disable();
+		udp_send(&nif, reply, 0, 0xFFFFFFFF, htons(UDPPORT_DHCP_CLIENT),
+		         htons(UDPPORT_DHCP_SERVER));
+		/* interrupts re-enabled */
+		ack = udp_wait(UDPPORT_DHCP_CLIENT, DHCP_TIMEOUT_MS << try);
+	}
 	packet_free(offer);
-	if (!reply)
+	if (!ack) {
+		puts("dhcp: no ack received, giving up\n");
 		return;
-
-	interrupt_disable();
-	udp_send(&nif, reply, 0, 0xFFFFFFFF, htons(UDPPORT_DHCP_CLIENT),
-	         htons(UDPPORT_DHCP_SERVER));
-	ack = udp_wait(UDPPORT_DHCP_CLIENT); /* interrupts re-enabled */
+	}
 
 	dhcp_handle_ack(&nif, ack);
 	packet_free(ack);
@@ -245,7 +275,7 @@ static void dhcp_kthread(void *arg)
 void dhcp_kthread_start(void)
 {
 	struct process *proc = create_kthread(dhcp_kthread, NULL);
-	list_insert(&process_list, &proc->list);
+	kthread_start(proc);
 }
 
 int dhcp_cmd_discover(int argc, char **argv)
@@ -59,7 +59,7 @@ swi_impl:
 	bic v1, v1, #0xFF000000
 
 	adr lr, _swi_ret           /* set our return address */
-	cmp v1, #10                /* compare to max syscall number */
+	cmp v1, #21                /* compare to max syscall number */
 	movhi a1, v1               /* if higher, go to generic swi() with */
 	bhi sys_unknown            /* syscall number as arg */
 	add pc, pc, v1, lsl #2     /* branch to pc + interrupt number * 4 */
@@ -77,6 +77,17 @@ swi_impl:
 	/*  8 */ b sys_connect
 	/*  9 */ b sys_send
 	/* 10 */ b sys_recv
+	/* 11 */ b sys_setsockopt
+	/* 12 */ b sys_sendmmsg
+	/* 13 */ b sys_recvmmsg
+	/* 14 */ b sys_poll
+	/* 15 */ b sys_close
+	/* 16 */ b sys_open
+	/* 17 */ b sys_read
+	/* 18 */ b sys_write
+	/* 19 */ b sys_nice
+	/* 20 */ b sys_nanosleep
+	/* 21 */ b sys_clock_gettime
 	/* END. Please update max syscall number above. */
 _swi_ret:
 	pop {v1, v2}
@@ -240,20 +251,82 @@ fiq_impl:
 	nop
 	sub pc, pc, #8
 
+/*
+ * Data aborts may be handled (see image_fault()), in which case we return and
+ * retry the instruction, just like a prefetch abort.
+ */
 .global data_abort_impl
 data_abort_impl:
+	/* Load abrt-mode stack */
+	ldr sp, =abrt_stack
+	ldr sp, [sp]
+
+	/*
+	 * The lr points two instructions past the aborted one. To retry it,
+	 * reset it back by two instructions.
+	 * NOTE: assumes that we don't have Thumb instructions
+	 */
+	add lr, lr, #-8
+
+        /* Dump LR and SPSR to ABRT stack */
 	srsfd sp!, #MODE_ABRT
+
+	/* Save registers in standard order */
 	push {v1-v8}
 	push {a2-a4,r12}
 	push {a1}
-	/* Push dummy values for SP and LR of interrupted mode. */
-	mov a1, #0
-	mov a2, #0
-	push {a1, a2}
+
+	/*
+	 * Save SP and LR of interrupted mode. (could be any of them)
+	 */
+	mrs v1, spsr
+	and v1, v1, #MODE_MASK
+	cmp v1, #MODE_SVC
+	bne 1f
+		cps #MODE_SVC
+		b 2f
+	1:
+	cmp v1, #MODE_IRQ
+	bne 1f
+		cps #MODE_IRQ
+		b 2f
+	1:
+	cmp v1, #MODE_UNDF
+	bne 1f
+		cps #MODE_UNDF
+		b 2f
+	1:
+		cps #MODE_SYS
+	2:
+	mov v1, sp
+	mov v2, lr
+	/* Now return to ABRT mode and push those registers to the stack */
+	cps #MODE_ABRT
+	push {v1, v2}
+
+	/* Call the C data abort handler. */
 	mov a1, sp
 	bl data_abort
-	nop
-	sub pc, pc, #8
+
+	/* Now restore SP and LR of interrupted mode. */
+	ldr v1, [sp, #64]  /* grab saved spsr */
+	pop {v2, v3}     /* pop saved sp / lr */
+	and v1, v1, #MODE_MASK
+	cmp v1, #MODE_SVC /* SVC */
+	bne 1f
+		cps #MODE_SVC
+		b 2f
+	1:
+		cps #MODE_SYS /* retrieve from SYS or USR modes */
+	2:
+	mov sp, v2
+	mov lr, v3
+	cps #MODE_ABRT
+
+	pop {a1}
+	pop {a2-a4,r12}
+	pop {v1-v8}
+	rfefd sp!
 
 /**
  * Handle IRQ.
@@ -17,14 +17,19 @@ void eth_recv(struct netif *netif, struct packet *pkt)
 		case ETHERTYPE_IP:
 			ip_recv(netif, pkt);
 			break;
+		case ETHERTYPE_ARP:
+			arp_recv(netif, pkt);
+			break;
 		default:
 			printf("received ethernet packet of unknown ethertype "
 			       "0x%x\n",
 			       ntohs(pkt->eth->ethertype));
+			netstats.eth_drops++;
 			packet_free(pkt);
 		}
 	} else {
 		puts("received ethernet packet not destined for us\n");
+		netstats.eth_drops++;
 		packet_free(pkt);
 	}
 }
@@ -44,3 +49,65 @@ int eth_send(struct netif *netif, struct packet *pkt, uint16_t ethertype,
 	virtio_net_send(netif->dev, pkt);
 	return 0;
 }
+
+static void arp_send(struct netif *netif, uint16_t oper, uint8_t *dst_mac,
+                     uint8_t *tha, uint32_t tpa)
+{
+	struct packet *pkt = packet_alloc();
+
+	if (!pkt) {
+		netstats.tx_nomem++;
+		return;
+	}
+	pkt->nl = (void *)pkt->data + sizeof(struct etherframe);
+	pkt->end = pkt->nl + sizeof(struct arphdr);
+	pkt->arp->htype = htons(ARP_HTYPE_ETHERNET);
+	pkt->arp->ptype = htons(ETHERTYPE_IP);
+	pkt->arp->hlen = MAC_SIZE;
+	pkt->arp->plen = sizeof(uint32_t);
+	pkt->arp->oper = htons(oper);
+	memcpy(pkt->arp->sha, netif->mac, MAC_SIZE);
+	pkt->arp->spa = netif->ip;
+	memcpy(pkt->arp->tha, tha, MAC_SIZE);
+	pkt->arp->tpa = tpa;
+	eth_send(netif, pkt, ETHERTYPE_ARP, dst_mac);
+}
+
+/**
+ * Broadcast a request for the MAC address of ip.
+ */
+void arp_request(struct netif *netif, uint32_t ip)
+{
+	uint8_t unknown[MAC_SIZE] = { 0 };
+
+	arp_send(netif, ARP_REQUEST, broadcast_mac, unknown, ip);
+}
+
+void arp_recv(struct netif *netif, struct packet *pkt)
+{
+	struct arphdr *arp = pkt->arp;
+	bool for_us;
+
+	if (pkt->end - pkt->nl < sizeof(struct arphdr) ||
+	    ntohs(arp->htype) != ARP_HTYPE_ETHERNET ||
+	    ntohs(arp->ptype) != ETHERTYPE_IP || arp->hlen != MAC_SIZE ||
+	    arp->plen != sizeof(uint32_t)) {
+		puts("received unsupported ARP packet, dropping\n");
+		netstats.eth_drops++;
+		goto out;
+	}
+
+	/*
+	 * Per RFC 826, learn the sender if we already know of it, or if the
+	 * packet is meant for us (in which case they will likely talk to us).
+	 * Until DHCP assigns us an address, nothing is for us.
+	 */
+	for_us = netif->ip && arp->tpa == netif->ip;
+	if (arp->spa)
+		neigh_update(netif, arp->spa, arp->sha, for_us);
+
+	if (for_us && ntohs(arp->oper) == ARP_REQUEST)
+		arp_send(netif, ARP_REPLY, arp->sha, arp->sha, arp->spa);
+out:
+	packet_free(pkt);
+}
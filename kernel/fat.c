@@ -128,32 +128,10 @@ int fat_extract_shortname(char *input, char *dest)
 
 int fat_clusop(struct blkdev *dev, uint64_t block, void *dst, int op, int nblk)
 {
-	int i, rv = 0;
-	struct blkreq *first, *req;
-	enum blkreq_status status;
-
-	first = dev->ops->alloc(dev);
-	first->blkidx = block;
-	first->type = op;
-	first->buf = dst;
-	first->size = dev->blksiz;
-	dev->ops->submit(dev, first);
-
-	for (i = 1; i < nblk; i++) {
-		req = dev->ops->alloc(dev);
-		req->blkidx = block + i;
-		req->type = op;
-		req->buf = dst + i * dev->blksiz;
-		req->size = dev->blksiz;
-		list_insert_end(&first->reqlist, &req->reqlist);
-		dev->ops->submit(dev, req);
-	}
-
-	status = blkreq_wait_all(first);
-	if (status != BLKREQ_OK)
-		rv = -EIO;
-	blkreq_free_all(dev, first);
-	return rv;
+	if (op == BLKREQ_READ)
+		return blk_cache_read(dev, block, dst, nblk);
+	else
+		return blk_cache_write(dev, block, dst, nblk);
 }
 
 static inline int fat_read_cluster(struct fat_fs *fs, uint64_t cluster,
@@ -564,8 +542,9 @@ out:
 
 int fat_close(struct file *f)
 {
+	struct fat_fs *fs = (struct fat_fs *)f->node->fs;
 	fs_free_file(f);
-	return 0;
+	return blk_cache_flush(fs->dev);
 }
 
 int fat_write(struct file *f, const uint8_t *src, size_t count)
@@ -733,8 +712,9 @@ void fat_init(struct blkdev *dev)
 	req->buf = kmalloc(dev->blksiz);
 	req->blkidx = 0;
 	req->size = dev->blksiz;
-	dev->ops->submit(dev, req);
-	wait_for(&req->wait);
+	blk_submit(dev, req);
+	blk_unplug(dev);
+	blk_wait(dev, req);
 	if (req->status != BLKREQ_OK)
 		goto out;
 
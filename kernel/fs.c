@@ -6,6 +6,7 @@
 #include "list.h"
 #include "string.h"
 #include "mm.h"
+#include "unistd.h"
 
 struct slab *fs_node_slab;
 struct slab *file_slab;
@@ -100,7 +101,10 @@ out:
 
 struct file *fs_alloc_file(void)
 {
-	return slab_alloc(file_slab);
+	struct file *f = slab_alloc(file_slab);
+	memset(f, 0, sizeof(struct file));
+	f->refcount = 1;
+	return f;
 }
 
 void fs_free_file(struct file *f)
@@ -108,6 +112,115 @@ void fs_free_file(struct file *f)
 	slab_free(file_slab, f);
 }
 
+void file_get(struct file *f)
+{
+	f->refcount++;
+}
+
+/*
+ * Drop a reference to a file. Dropping the last one closes it, and the close
+ * operation is responsible for freeing the file.
+ */
+int file_put(struct file *f)
+{
+	if (--f->refcount)
+		return 0;
+	return f->ops->close(f);
+}
+
+/*
+ * Set up a user process's fd table, with the console as its standard input,
+ * output and error. The kernel holds its own reference to the console, so it
+ * is never closed.
+ */
+void fd_table_init(struct process *p)
+{
+	int fd;
+
+	p->files = kmalloc(FD_INITIAL * sizeof(struct file *));
+	memset(p->files, 0, FD_INITIAL * sizeof(struct file *));
+	p->nfiles = FD_INITIAL;
+	p->fd_next = 0;
+	if (!uart_file)
+		return;
+	for (fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++) {
+		file_get(uart_file);
+		p->files[fd] = uart_file;
+	}
+	p->fd_next = STDERR_FILENO + 1;
+}
+
+void fd_table_destroy(struct process *p)
+{
+	unsigned int fd;
+
+	for (fd = 0; fd < p->nfiles; fd++)
+		if (p->files[fd])
+			file_put(p->files[fd]);
+	if (p->files)
+		kfree(p->files, p->nfiles * sizeof(struct file *));
+	p->files = NULL;
+	p->nfiles = 0;
+}
+
+static int fd_table_grow(struct process *p)
+{
+	struct file **files;
+	unsigned int nfiles = p->nfiles * 2;
+
+	if (nfiles > FD_MAX)
+		return -EMFILE;
+	files = kmalloc(nfiles * sizeof(struct file *));
+	memcpy(files, p->files, p->nfiles * sizeof(struct file *));
+	memset(&files[p->nfiles], 0,
+	       (nfiles - p->nfiles) * sizeof(struct file *));
+	kfree(p->files, p->nfiles * sizeof(struct file *));
+	p->files = files;
+	p->nfiles = nfiles;
+	return 0;
+}
+
+/*
+ * Give the file the lowest free fd in the process, taking over the caller's
+ * reference to it. fd_next is a lower bound on the free slots, so that opening
+ * many files in a row doesn't rescan the table each time.
+ */
+int fd_install(struct process *p, struct file *f)
+{
+	unsigned int fd;
+	int rv;
+
+	for (fd = p->fd_next; fd < p->nfiles; fd++)
+		if (!p->files[fd])
+			break;
+	if (fd == p->nfiles) {
+		rv = fd_table_grow(p);
+		if (rv < 0)
+			return rv;
+	}
+	p->files[fd] = f;
+	p->fd_next = fd + 1;
+	return fd;
+}
+
+struct file *fd_get(struct process *p, int fd)
+{
+	if (fd < 0 || (unsigned int)fd >= p->nfiles)
+		return NULL;
+	return p->files[fd];
+}
+
+int fd_close(struct process *p, int fd)
+{
+	struct file *f = fd_get(p, fd);
+
+	if (!f)
+		return -EBADF;
+	p->files[fd] = NULL;
+	p->fd_next = min(p->fd_next, (unsigned int)fd);
+	return file_put(f);
+}
+
 static int cmd_ls(int argc, char **argv)
 {
 	struct fs_node *node;
@@ -205,9 +318,10 @@ struct ksh_cmd fs_ksh_cmds[] = {
 
 void fs_init(void)
 {
-	fs_node_slab =
-	        slab_new("fs_node", sizeof(struct fs_node), kmem_get_page);
-	file_slab = slab_new("file", sizeof(struct file), kmem_get_page);
+	fs_node_slab = slab_new("fs_node", sizeof(struct fs_node),
+	                        kmem_get_page, kmem_free_page);
+	file_slab = slab_new("file", sizeof(struct file), kmem_get_page,
+	                     kmem_free_page);
 	fs_root = slab_alloc(fs_node_slab);
 	strlcpy(fs_root->name, "/", sizeof(fs_root->name));
 	fs_root->type = FSN_LAZY_DIR;
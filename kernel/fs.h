@@ -1,31 +1,23 @@
 #pragma once
 #include <stdint.h>
 
+#include "fcntl.h"
 #include "list.h"
 #include "slab.h"
 
-enum {
-	/* noformat */
-	O_READ = 1,
-	O_WRITE = 2,
-	O_CREAT = 4,
-	O_APPEND = 8,
-
-	O_RDONLY = O_READ,
-	O_WRONLY = O_WRITE,
-	O_RDWR = O_READ | O_WRITE,
-};
-
 struct fs_node;
 struct file;
 struct file_ops;
 struct fs;
 struct fs_ops;
+struct poll_table;
+struct process;
 
 struct file_ops {
 	int (*read)(struct file *f, void *dst, size_t amt);
 	int (*write)(struct file *f, void *src, size_t amt);
 	int (*close)(struct file *f);
+	int (*poll)(struct file *f, struct poll_table *pt);
 };
 
 #define FILE_PRIVATE_SIZE 64
@@ -34,6 +26,7 @@ struct file {
 	struct fs_node *node;
 	uint64_t pos;
 	unsigned int flags;
+	unsigned int refcount; /* the last file_put() calls ops->close */
 	uint8_t priv[FILE_PRIVATE_SIZE];
 };
 
@@ -50,6 +43,7 @@ struct fs {
 };
 
 #define FILENAME_MAX 128
+#define PATH_MAX     1024
 struct fs_node {
 	struct fs_node *parent;
 	struct list_head list; /* for containing in the parent's list */
@@ -73,5 +67,19 @@ void fs_reset_dir(struct fs_node *node);
 int fs_resolve(const char *path, struct fs_node **out);
 struct file *fs_alloc_file(void);
 void fs_free_file(struct file *f);
+void file_get(struct file *f);
+int file_put(struct file *f);
+
+/*
+ * Per-process file descriptor tables. The table starts with FD_INITIAL slots
+ * and doubles whenever it fills, up to FD_MAX.
+ */
+#define FD_INITIAL 8
+#define FD_MAX     1024
+void fd_table_init(struct process *p);
+void fd_table_destroy(struct process *p);
+int fd_install(struct process *p, struct file *f);
+struct file *fd_get(struct process *p, int fd);
+int fd_close(struct process *p, int fd);
 
 extern struct file *uart_file;
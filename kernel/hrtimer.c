@@ -0,0 +1,301 @@
+/*
+ * hrtimer.c: high resolution timers
+ *
+ * Pending timers are kept in a binary min-heap ordered by expiry, which is an
+ * array of pointers that doubles when it fills. Starting and cancelling a
+ * timer is O(log n), and the soonest expiry is always heap[0]. The timer
+ * interrupt runs every expired timer, and the generic timer is then programmed
+ * for the new heap[0] (see tick_program() in timer.c).
+ *
+ * Timer functions are called from the timer interrupt, without hrtimer_lock
+ * held, so they may start or cancel timers themselves.
+ *
+ * The heap is grown before hrtimer_lock is taken. If there is no memory for
+ * it, hrtimer_start() fails, and a timeout acts as though it expired at once.
+ */
+#include "kernel.h"
+#include "ksh.h"
+#include "string.h"
+#include "wait.h"
+
+#define HRTIMER_HEAP_INITIAL 32
+
+static struct hrtimer **heap;
+static unsigned int heap_len, heap_cap;
+static DECLARE_SPINSEM(hrtimer_lock, 1);
+
+static struct {
+	uint32_t started;
+	uint32_t cancelled;
+	uint32_t fired;
+	uint32_t max_depth;
+	uint32_t late_us_total; /* lateness of each fired timer, summed */
+	uint32_t late_us_max;
+} hrtimer_stats;
+
+static inline void heap_set(unsigned int i, struct hrtimer *t)
+{
+	heap[i] = t;
+	t->index = i;
+}
+
+static void sift_up(unsigned int i)
+{
+	struct hrtimer *t = heap[i];
+	unsigned int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (heap[parent]->expires <= t->expires)
+			break;
+		heap_set(i, heap[parent]);
+		i = parent;
+	}
+	heap_set(i, t);
+}
+
+static void sift_down(unsigned int i)
+{
+	struct hrtimer *t = heap[i];
+	unsigned int child;
+
+	while ((child = 2 * i + 1) < heap_len) {
+		if (child + 1 < heap_len &&
+		    heap[child + 1]->expires < heap[child]->expires)
+			child++;
+		if (t->expires <= heap[child]->expires)
+			break;
+		heap_set(i, heap[child]);
+		i = child;
+	}
+	heap_set(i, t);
+}
+
+/*
+ * Grow the heap to cap entries. hrtimer_lock must not be held: the allocation
+ * is made without it, and swapped in under it, unless somebody else grew the
+ * heap meanwhile.
+ */
+static int heap_grow(unsigned int cap)
+{
+	struct hrtimer **new, **old;
+	unsigned int oldcap;
+	int flags;
+
+	new = kmalloc(cap * sizeof(struct hrtimer *));
+	if (!new)
+		return -ENOMEM;
+
+	spin_acquire_irqsave(&hrtimer_lock, &flags);
+	if (heap_cap >= cap) {
+		spin_release_irqrestore(&hrtimer_lock, &flags);
+		kfree(new, cap * sizeof(struct hrtimer *));
+		return 0;
+	}
+	if (heap_len)
+		memcpy(new, heap, heap_len * sizeof(struct hrtimer *));
+	old = heap;
+	oldcap = heap_cap;
+	heap = new;
+	heap_cap = cap;
+	spin_release_irqrestore(&hrtimer_lock, &flags);
+
+	if (old)
+		kfree(old, oldcap * sizeof(struct hrtimer *));
+	return 0;
+}
+
+/* hrtimer_lock must be held */
+static void heap_remove(struct hrtimer *t)
+{
+	unsigned int i = t->index;
+
+	t->pending = false;
+	heap_len--;
+	if (i == heap_len)
+		return;
+	heap_set(i, heap[heap_len]);
+	if (i > 0 && heap[i]->expires < heap[(i - 1) / 2]->expires)
+		sift_up(i);
+	else
+		sift_down(i);
+}
+
+void hrtimer_init(struct hrtimer *t, void (*fn)(struct hrtimer *t))
+{
+	t->fn = fn;
+	t->pending = false;
+}
+
+/*
+ * Start (or restart) a timer to call its function once the timer count
+ * reaches expires. Returns -ENOMEM, leaving the timer stopped, if the heap
+ * is full and can't grow.
+ */
+int hrtimer_start(struct hrtimer *t, uint64_t expires)
+{
+	unsigned int cap;
+	int flags;
+
+again:
+	spin_acquire_irqsave(&hrtimer_lock, &flags);
+	if (t->pending)
+		heap_remove(t);
+	if (heap_len == heap_cap) {
+		cap = heap_cap ? heap_cap * 2 : HRTIMER_HEAP_INITIAL;
+		spin_release_irqrestore(&hrtimer_lock, &flags);
+		if (heap_grow(cap) < 0)
+			return -ENOMEM;
+		goto again;
+	}
+	t->expires = expires;
+	t->pending = true;
+	heap_set(heap_len++, t);
+	sift_up(heap_len - 1);
+	hrtimer_stats.started++;
+	hrtimer_stats.max_depth = max(hrtimer_stats.max_depth, heap_len);
+	timer_set_event(expires);
+	spin_release_irqrestore(&hrtimer_lock, &flags);
+	return 0;
+}
+
+/*
+ * Stop a timer. Returns true if it was pending, or false if it already fired
+ * (or was never started).
+ */
+bool hrtimer_cancel(struct hrtimer *t)
+{
+	bool pending;
+	int flags;
+
+	spin_acquire_irqsave(&hrtimer_lock, &flags);
+	pending = t->pending;
+	if (pending) {
+		heap_remove(t);
+		hrtimer_stats.cancelled++;
+	}
+	spin_release_irqrestore(&hrtimer_lock, &flags);
+	return pending;
+}
+
+/*
+ * Return the soonest expiry in *expires, or false if no timer is pending.
+ */
+bool hrtimer_next(uint64_t *expires)
+{
+	bool rv = false;
+	int flags;
+
+	spin_acquire_irqsave(&hrtimer_lock, &flags);
+	if (heap_len) {
+		*expires = heap[0]->expires;
+		rv = true;
+	}
+	spin_release_irqrestore(&hrtimer_lock, &flags);
+	return rv;
+}
+
+/*
+ * Run each timer which has expired by now. Called from the timer interrupt.
+ */
+void hrtimer_run(uint64_t now)
+{
+	struct hrtimer *t;
+	uint32_t late;
+
+	/* lateness is in microseconds, and clamped to 32 bits of counts */
+	for (;;) {
+		_spin_acquire(&hrtimer_lock);
+		if (!heap_len || heap[0]->expires > now) {
+			_spin_release(&hrtimer_lock);
+			break;
+		}
+		t = heap[0];
+		heap_remove(t);
+		late = min(now - t->expires, 0xFFFFFFFFULL);
+		late = timer_count_to_us(late);
+		hrtimer_stats.fired++;
+		hrtimer_stats.late_us_total += late;
+		if (late > hrtimer_stats.late_us_max)
+			hrtimer_stats.late_us_max = late;
+		_spin_release(&hrtimer_lock);
+
+		t->fn(t);
+	}
+}
+
+static void timeout_fn(struct hrtimer *timer)
+{
+	struct timeout *t = container_of(timer, struct timeout, timer);
+
+	t->expired = true;
+	proc_wake(t->proc);
+}
+
+/*
+ * A timeout wakes the current process when it expires, and sets expired. If
+ * the timer can't be started, it expires immediately, so that nobody sleeps
+ * forever waiting for it.
+ */
+void timeout_start(struct timeout *t, uint64_t expires)
+{
+	t->proc = current;
+	t->expired = false;
+	hrtimer_init(&t->timer, timeout_fn);
+	if (hrtimer_start(&t->timer, expires) < 0)
+		timeout_fn(&t->timer);
+}
+
+void timeout_cancel(struct timeout *t)
+{
+	hrtimer_cancel(&t->timer);
+}
+
+/*
+ * Sleep until the timer count reaches expires.
+ */
+void timer_sleep_until(uint64_t expires)
+{
+	struct timeout t;
+
+	timeout_start(&t, expires);
+	for (;;) {
+		proc_block(current);
+		if (t.expired)
+			break;
+		schedule();
+	}
+	proc_wake(current);
+
+	/* without a timer, we can only yield until the time has come */
+	while (timer_get_count() < expires)
+		schedule();
+}
+
+int hrtimer_cmd_show(int argc, char **argv)
+{
+	uint64_t next, now;
+	unsigned int len, cap;
+	int flags;
+
+	spin_acquire_irqsave(&hrtimer_lock, &flags);
+	len = heap_len;
+	cap = heap_cap;
+	spin_release_irqrestore(&hrtimer_lock, &flags);
+
+	printf("queued: %u (max %u, capacity %u)\n", len,
+	       hrtimer_stats.max_depth, cap);
+	printf("started: %u, fired: %u, cancelled: %u\n",
+	       hrtimer_stats.started, hrtimer_stats.fired,
+	       hrtimer_stats.cancelled);
+	printf("lateness: avg %u us, max %u us\n",
+	       hrtimer_stats.late_us_total / max(hrtimer_stats.fired, 1),
+	       hrtimer_stats.late_us_max);
+	if (hrtimer_next(&next)) {
+		now = timer_get_count();
+		next = next > now ? next - now : 0;
+		printf("next expiry in %u us\n",
+		       timer_count_to_us(min(next, 0xFFFFFFFFULL)));
+	}
+	return 0;
+}
@@ -1,57 +1,477 @@
 #include "kernel.h"
+#include "mm.h"
 #include "net.h"
+#include "slab.h"
 #include "string.h"
 
 static uint32_t ipid = 0;
 
-struct ip_mac_mapping {
+/*
+ * The neighbor table maps on-link IP addresses to MAC addresses. Entries are
+ * created when we need to send to an address, and filled in by ARP replies.
+ * Packets sent while an entry is incomplete wait on its pending queue.
+ *
+ * There is no timer, so entries age as they are used: a reachable entry older
+ * than NEIGH_REACHABLE_SECS becomes stale, which means it is still used but
+ * we ask again. An incomplete entry is re-requested at most once a second, and
+ * gives up (dropping its packets) after NEIGH_MAX_PROBES requests.
+ */
+enum {
+	NEIGH_INCOMPLETE,
+	NEIGH_REACHABLE,
+	NEIGH_STALE,
+	NEIGH_STATIC,
+};
+static const char *neigh_states[] = { "incomplete", "reachable", "stale",
+	                              "static" };
+
+struct neigh {
+	struct list_head list; /* in the hash bucket */
 	uint32_t ip;
 	uint8_t mac[6];
+	uint8_t state;
+	uint8_t probes;    /* requests sent since the last reply */
+	uint64_t updated;  /* timer count of the last reply */
+	uint64_t probed;   /* timer count of the last request */
+	uint32_t hits;     /* packets sent to this neighbor */
+	uint32_t npending; /* packets on the pending list */
+	struct list_head pending;
 };
 
-#define MAX_MAPPINGS 16
-static struct ip_mac_mapping mappings[MAX_MAPPINGS] = {
-	{ 0xFFFFFFFF, { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF } },
-};
-int nmap = 1;
+#define NEIGH_HASH           32
+#define NEIGH_MAX            128
+#define NEIGH_MAX_PENDING    64
+#define NEIGH_MAX_PROBES     3
+#define NEIGH_REACHABLE_SECS 60
+
+static struct list_head neigh_hash[NEIGH_HASH];
+static struct slab *neigh_slab;
+static spinsem_t neigh_lock;
+static uint32_t neigh_count;
+
+static struct {
+	uint32_t hits;      /* lookups which found a usable address */
+	uint32_t misses;    /* lookups which had to wait for ARP */
+	uint32_t requests;  /* ARP requests sent */
+	uint32_t updates;   /* ARP replies (or requests) which set an entry */
+	uint32_t queued;    /* packets put on a pending list */
+	uint32_t drops;     /* pending packets dropped */
+	uint32_t evictions; /* entries removed to make room */
+} neigh_stats;
+
+#define neigh_bucket(ip)                                                       \
+	(&neigh_hash[(ntohl(ip) ^ (ntohl(ip) >> 8)) % NEIGH_HASH])
+
+static uint64_t neigh_secs(uint32_t secs)
+{
+	return (uint64_t)secs * timer_get_freq();
+}
 
-static uint8_t *get_mapping(uint32_t ip)
+/* Must hold neigh_lock */
+static struct neigh *neigh_lookup(uint32_t ip)
 {
-	int i;
-	for (i = 0; i < nmap; i++)
-		if (mappings[i].ip == ip)
-			return mappings[i].mac;
+	struct neigh *n;
+
+	list_for_each_entry(n, neigh_bucket(ip), list)
+	{
+		if (n->ip == ip)
+			return n;
+	}
 	return NULL;
 }
 
-static void upsert_mapping(uint32_t ip, uint8_t *mac)
+/*
+ * Must hold neigh_lock. Pending packets are moved to drop, to be freed once
+ * the lock is released.
+ */
+static void neigh_remove(struct neigh *n, struct list_head *drop)
 {
-	int i;
-	for (i = 0; i < nmap; i++)
-		if (mappings[i].ip == ip)
-			break;
-	if (i == nmap) {
-		if (i >= MAX_MAPPINGS) {
-			puts("oh no! ran out of ip-mac mapping space\n");
+	struct packet *pkt, *next;
+
+	list_for_each_entry_safe(pkt, next, &n->pending, list)
+	{
+		list_remove(&pkt->list);
+		list_insert_end(drop, &pkt->list);
+		neigh_stats.drops++;
+	}
+	list_remove(&n->list);
+	slab_free(neigh_slab, n);
+	neigh_count--;
+}
+
+static void neigh_free_dropped(struct list_head *drop)
+{
+	struct packet *pkt, *next;
+
+	list_for_each_entry_safe(pkt, next, drop, list)
+	{
+		list_remove(&pkt->list);
+		packet_free(pkt);
+	}
+}
+
+/*
+ * Make room for an entry by removing the least recently confirmed dynamic
+ * entry. Must hold neigh_lock.
+ */
+static void neigh_evict(struct list_head *drop)
+{
+	struct neigh *n, *victim = NULL;
+	uint32_t i;
+
+	for (i = 0; i < NEIGH_HASH; i++)
+		list_for_each_entry(n, &neigh_hash[i], list)
+		{
+			if (n->state != NEIGH_STATIC &&
+			    (!victim || n->updated < victim->updated))
+				victim = n;
+		}
+	if (victim) {
+		neigh_stats.evictions++;
+		neigh_remove(victim, drop);
+	}
+}
+
+/* Must hold neigh_lock. May return NULL. */
+static struct neigh *neigh_create(uint32_t ip, struct list_head *drop)
+{
+	struct neigh *n;
+
+	if (neigh_count >= NEIGH_MAX)
+		neigh_evict(drop);
+	n = slab_alloc(neigh_slab);
+	if (!n)
+		return NULL;
+	n->ip = ip;
+	memset(n->mac, 0, sizeof(n->mac));
+	n->state = NEIGH_INCOMPLETE;
+	n->probes = 0;
+	n->updated = 0;
+	n->probed = 0;
+	n->hits = 0;
+	n->npending = 0;
+	INIT_LIST_HEAD(n->pending);
+	list_insert(neigh_bucket(ip), &n->list);
+	neigh_count++;
+	return n;
+}
+
+/**
+ * Record that ip is at mac, from an ARP packet. Entries are only created when
+ * create is set (we were the target of the ARP packet). Any packets waiting
+ * for the address are sent.
+ */
+void neigh_update(struct netif *netif, uint32_t ip, uint8_t *mac, bool create)
+{
+	struct neigh *n;
+	struct packet *pkt, *next;
+	struct list_head pending, drop;
+	int flags;
+
+	INIT_LIST_HEAD(pending);
+	INIT_LIST_HEAD(drop);
+	spin_acquire_irqsave(&neigh_lock, &flags);
+	n = neigh_lookup(ip);
+	if (!n && create)
+		n = neigh_create(ip, &drop);
+	if (n && n->state != NEIGH_STATIC) {
+		memcpy(n->mac, mac, sizeof(n->mac));
+		n->state = NEIGH_REACHABLE;
+		n->updated = timer_get_count();
+		n->probes = 0;
+		neigh_stats.updates++;
+		list_for_each_entry_safe(pkt, next, &n->pending, list)
+		{
+			list_remove(&pkt->list);
+			list_insert_end(&pending, &pkt->list);
+		}
+		n->npending = 0;
+	}
+	spin_release_irqrestore(&neigh_lock, &flags);
+
+	/* send outside the lock, since sending may sleep */
+	list_for_each_entry_safe(pkt, next, &pending, list)
+	{
+		list_remove(&pkt->list);
+		eth_send(netif, pkt, ETHERTYPE_IP, mac);
+	}
+	neigh_free_dropped(&drop);
+}
+
+/**
+ * Send an IP packet to the on-link address nexthop, resolving its MAC address
+ * first if necessary.
+ */
+static void neigh_output(struct netif *netif, struct packet *pkt,
+                         uint32_t nexthop)
+{
+	struct neigh *n;
+	struct list_head drop;
+	uint8_t mac[6];
+	uint64_t now = timer_get_count();
+	bool request = false, send = false;
+	int flags;
+
+	INIT_LIST_HEAD(drop);
+	spin_acquire_irqsave(&neigh_lock, &flags);
+	n = neigh_lookup(nexthop);
+	if (!n)
+		n = neigh_create(nexthop, &drop);
+	if (!n) {
+		spin_release_irqrestore(&neigh_lock, &flags);
+		neigh_free_dropped(&drop);
+		packet_free(pkt);
+		return;
+	}
+
+	if (n->state == NEIGH_REACHABLE &&
+	    now - n->updated > neigh_secs(NEIGH_REACHABLE_SECS))
+		n->state = NEIGH_STALE;
+	/* a stale neighbor which stopped answering must be resolved again */
+	if (n->state == NEIGH_STALE && n->probes >= NEIGH_MAX_PROBES &&
+	    now - n->probed > neigh_secs(1))
+		n->state = NEIGH_INCOMPLETE;
+
+	if (n->state == NEIGH_INCOMPLETE) {
+		neigh_stats.misses++;
+		if (n->npending >= NEIGH_MAX_PENDING) {
+			/* drop the oldest */
+			struct packet *old = container_of(n->pending.next,
+			                                  struct packet, list);
+			list_remove(&old->list);
+			list_insert_end(&drop, &old->list);
+			n->npending--;
+			neigh_stats.drops++;
 		}
-		nmap++;
+		list_insert_end(&n->pending, &pkt->list);
+		n->npending++;
+		neigh_stats.queued++;
+		if (!n->probes || now - n->probed > neigh_secs(1)) {
+			if (n->probes >= NEIGH_MAX_PROBES) {
+				/* nobody answered, give up on these packets */
+				neigh_remove(n, &drop);
+			} else {
+				request = true;
+			}
+		}
+	} else {
+		neigh_stats.hits++;
+		n->hits++;
+		memcpy(mac, n->mac, sizeof(mac));
+		send = true;
+		/* a stale entry is used while we check it is still valid */
+		request = n->state == NEIGH_STALE &&
+		          now - n->probed > neigh_secs(1);
+	}
+	if (request) {
+		n->probes++;
+		n->probed = now;
+		neigh_stats.requests++;
 	}
-	mappings[i].ip = ip;
-	memcpy(mappings[i].mac, mac, 6);
+	spin_release_irqrestore(&neigh_lock, &flags);
+
+	if (request)
+		arp_request(netif, nexthop);
+	if (send)
+		eth_send(netif, pkt, ETHERTYPE_IP, mac);
+	neigh_free_dropped(&drop);
+}
+
+static void neigh_add_static(uint32_t ip, uint8_t *mac)
+{
+	struct neigh *n;
+	DECLARE_LIST_HEAD(drop);
+
+	n = neigh_create(ip, &drop);
+	memcpy(n->mac, mac, sizeof(n->mac));
+	n->state = NEIGH_STATIC;
+}
+
+void neigh_init(void)
+{
+	uint8_t broadcast[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+	uint32_t i;
+
+	for (i = 0; i < NEIGH_HASH; i++)
+		INIT_LIST_HEAD(neigh_hash[i]);
+	INIT_SPINSEM(&neigh_lock, 1);
+	neigh_slab = slab_new("neigh", sizeof(struct neigh), kmem_get_page,
+	                      kmem_free_page);
+	neigh_add_static(0xFFFFFFFF, broadcast);
+}
+
+/* Convert a timer count difference to seconds, without 64-bit division */
+static uint32_t neigh_age(uint64_t now, uint64_t then)
+{
+	return (uint32_t)((now - then) >> 16) / (timer_get_freq() >> 16);
+}
+
+/*
+ * Datagrams being reassembled from fragments. Fragments are kept sorted by
+ * offset on a packet chain. There is no timer to expire incomplete datagrams,
+ * so once IP_REASM_MAX are in progress, the oldest is abandoned.
+ */
+struct ip_reasm {
+	struct list_head list;
+	uint32_t src;
+	uint32_t dst;
+	uint16_t id;
+	uint8_t proto;
+	uint32_t total; /* payload length, known once the last fragment comes */
+	uint32_t have;  /* payload bytes received so far */
+	struct packet *frags;
+};
+
+#define IP_REASM_MAX 8
+static DECLARE_LIST_HEAD(ip_reasm_list);
+static uint32_t ip_reasm_count;
+
+static void ip_reasm_free(struct ip_reasm *r)
+{
+	list_remove(&r->list);
+	ip_reasm_count--;
+	packet_free(r->frags);
+	kfree(r, sizeof(struct ip_reasm));
+}
+
+static struct ip_reasm *ip_reasm_get(struct iphdr *ip)
+{
+	struct ip_reasm *r;
+
+	list_for_each_entry(r, &ip_reasm_list, list)
+	{
+		if (r->src == ip->src && r->dst == ip->dst && r->id == ip->id &&
+		    r->proto == ip->proto)
+			return r;
+	}
+
+	if (ip_reasm_count >= IP_REASM_MAX) {
+		r = container_of(ip_reasm_list.next, struct ip_reasm, list);
+		netstats.ip_reasm_fails++;
+		ip_reasm_free(r);
+	}
+	r = kmalloc(sizeof(struct ip_reasm));
+	if (!r)
+		return NULL;
+	r->src = ip->src;
+	r->dst = ip->dst;
+	r->id = ip->id;
+	r->proto = ip->proto;
+	r->total = 0;
+	r->have = 0;
+	r->frags = NULL;
+	list_insert_end(&ip_reasm_list, &r->list);
+	ip_reasm_count++;
+	return r;
+}
+
+#define frag_offset(pkt) ((ntohs((pkt)->ip->flags_foffset) & IP_OFFMASK) * 8)
+
+/**
+ * Add a fragment to its datagram. When the datagram is complete, return it as
+ * a packet chain: the first fragment, with the payload of the others chained
+ * behind it. Otherwise, return NULL. Takes ownership of pkt.
+ */
+static struct packet *ip_reassemble(struct packet *pkt)
+{
+	struct ip_reasm *r = NULL;
+	struct packet **link, *head;
+	uint32_t offset = frag_offset(pkt);
+	uint32_t len = pkt->end - pkt->tl;
+	bool more = ntohs(pkt->ip->flags_foffset) & IP_MF;
+
+	netstats.ip_frags++;
+	/* A fragment fits in one receive buffer, so it is never a chain */
+	if (pkt->frag || (more && (len & 7)) || !len ||
+	    offset + len > IP_MAX_PAYLOAD) {
+		puts("received bad IP fragment, dropping\n");
+		goto drop;
+	}
+	r = ip_reasm_get(pkt->ip);
+	if (!r)
+		goto drop;
+
+	/* Find our place in the list, dropping anything overlapping */
+	for (link = &r->frags; *link; link = &(*link)->frag)
+		if (frag_offset(*link) >= offset)
+			break;
+	if (*link && frag_offset(*link) < offset + len)
+		goto drop;
+	if (link != &r->frags) {
+		head = container_of(link, struct packet, frag);
+		if (frag_offset(head) + (head->end - head->tl) > offset)
+			goto drop;
+	}
+	/* Nothing may lie beyond the end, which the last fragment sets */
+	if (more && r->total && offset + len > r->total)
+		goto drop;
+	if (!more) {
+		if (r->total || *link)
+			goto drop;
+		r->total = offset + len;
+	}
+	pkt->al = pkt->tl; /* the payload, once it follows the first fragment */
+	pkt->frag = *link;
+	*link = pkt;
+	r->have += len;
+
+	if (!r->total || r->have != r->total || frag_offset(r->frags) != 0)
+		return NULL;
+
+	/*
+	 * Everything is here: the fragments lie within [0, total) without
+	 * overlapping, and add up to total, so they are contiguous.
+	 */
+	head = r->frags;
+	head->ip->flags_foffset = 0;
+	head->ip->len = htons(ip_get_length(head->ip) + r->total);
+	r->frags = NULL;
+	ip_reasm_free(r);
+	netstats.ip_reassembled++;
+	return head;
+drop:
+	if (r && !r->frags)
+		ip_reasm_free(r);
+	netstats.ip_drops++;
+	packet_free(pkt);
+	return NULL;
 }
 
 int ip_cmd_show_arptable(int argc, char **argv)
 {
-	int i;
-	puts("IP <--> MAC\n");
-	for (i = 0; i < nmap; i++)
-		printf("%I: %M\n", mappings[i].ip, mappings[i].mac);
+	struct neigh *n;
+	uint64_t now = timer_get_count();
+	uint32_t i;
+	int flags;
+
+	spin_acquire_irqsave(&neigh_lock, &flags);
+	puts("IP\tMAC\tstate\tage\thits\tpending\n");
+	for (i = 0; i < NEIGH_HASH; i++)
+		list_for_each_entry(n, &neigh_hash[i], list)
+		{
+			printf("%I\t%M\t%s\t", n->ip, n->mac,
+			       neigh_states[n->state]);
+			if (n->state == NEIGH_STATIC || !n->updated)
+				puts("-");
+			else
+				printf("%u", neigh_age(now, n->updated));
+			printf("\t%u\t%u\n", n->hits, n->npending);
+		}
+	printf("%u entries, %u hits, %u misses, %u requests, %u updates\n",
+	       neigh_count, neigh_stats.hits, neigh_stats.misses,
+	       neigh_stats.requests, neigh_stats.updates);
+	printf("%u packets queued, %u dropped, %u evictions\n",
+	       neigh_stats.queued, neigh_stats.drops, neigh_stats.evictions);
+	spin_release_irqrestore(&neigh_lock, &flags);
 	return 0;
 }
 
 void ip_recv(struct netif *netif, struct packet *pkt)
 {
+	uint32_t csum, len;
+
 	/*printf("ip_recv src=%I dst=%I\n", pkt->ip->src, pkt->ip->dst);*/
+	netstats.ip_rx++;
 	if (pkt->ip->dst != netif->ip && pkt->ip->dst != 0xFFFFFFFF) {
 		puts("received IP packet not destined for us, dropping\n");
 		goto cleanup;
@@ -61,7 +481,27 @@ void ip_recv(struct netif *netif, struct packet *pkt)
 		puts("received IP packet with bad IHL field, dropping\n");
 		goto cleanup;
 	}
-	upsert_mapping(pkt->ip->src, pkt->eth->src_mac);
+	csum_init(&csum);
+	csum_add(&csum, pkt->nl, ip_get_length(pkt->ip) / 2);
+	if (csum_finalize(&csum) != 0) {
+		puts("received IP packet with bad header checksum, dropping\n");
+		netstats.csum_errors++;
+		goto cleanup;
+	}
+	len = ntohs(pkt->ip->len);
+	if (len < ip_get_length(pkt->ip) ||
+	    len > packet_chain_len(pkt, pkt->nl)) {
+		puts("received IP packet with bad length, dropping\n");
+		goto cleanup;
+	}
+	/* short frames are padded, so don't trust the end of the frame */
+	if (!pkt->frag)
+		pkt->end = pkt->nl + len;
+	if (ntohs(pkt->ip->flags_foffset) & (IP_MF | IP_OFFMASK)) {
+		pkt = ip_reassemble(pkt);
+		if (!pkt)
+			return;
+	}
 	switch (pkt->ip->proto) {
 	case IPPROTO_UDP:
 		udp_recv(netif, pkt);
@@ -72,6 +512,7 @@ void ip_recv(struct netif *netif, struct packet *pkt)
 		goto cleanup;
 	}
 cleanup:
+	netstats.ip_drops++;
 	packet_free(pkt);
 }
 
@@ -83,33 +524,68 @@ uint32_t ip_route(struct netif *netif, uint32_t dst_ip)
 	return netif->gateway_ip;
 }
 
-uint8_t *ip_get_mac(struct netif *netif, uint32_t nexthop)
-{
-	return get_mapping(nexthop);
-}
-
-int ip_send(struct netif *netif, struct packet *pkt, uint8_t proto,
-            uint32_t src_ip, uint32_t dst_ip)
+/**
+ * Fill in the IP header for one packet, whose payload begins at start.
+ */
+static void ip_fill_header(struct netif *netif, struct packet *pkt,
+                           void *start, uint8_t proto, uint32_t dst_ip,
+                           uint16_t id, uint16_t foffset)
 {
 	uint32_t csum;
-	uint32_t nexthop = ip_route(netif, dst_ip);
-	uint8_t *mac = ip_get_mac(netif, nexthop);
 
-	pkt->nl = pkt->tl - sizeof(struct iphdr);
+	pkt->nl = start - sizeof(struct iphdr);
 
 	/* Set IHL to 5, Version to 4 */
 	pkt->ip->verihl = 5 | (4 << 4);
+	pkt->ip->tos = 0;
 	pkt->ip->len = htons(pkt->end - pkt->nl);
-	pkt->ip->id = htons(ipid++);
+	pkt->ip->id = id;
+	pkt->ip->flags_foffset = htons(foffset);
 	pkt->ip->ttl = 32; /* somewhat low so we don't break the internet */
 	pkt->ip->proto = proto;
 	pkt->ip->src = netif->ip;
 	pkt->ip->dst = dst_ip;
+	pkt->ip->csum = 0;
 	csum_init(&csum);
-	csum_add(&csum, pkt->nl, 10);
+	csum_add(&csum, pkt->nl, sizeof(struct iphdr) / 2);
 	pkt->ip->csum = csum_finalize(&csum);
+}
 
-	eth_send(netif, pkt, ETHERTYPE_IP, mac);
+/**
+ * Send an IP datagram. A packet chain is sent as one fragment per packet, so
+ * each packet must leave ip_reserve() bytes of headroom before its payload,
+ * and every packet but the last must carry IP_FRAG_PAYLOAD bytes.
+ */
+int ip_send(struct netif *netif, struct packet *pkt, uint8_t proto,
+            uint32_t src_ip, uint32_t dst_ip)
+{
+	uint32_t nexthop = ip_route(netif, dst_ip);
+	uint16_t id = htons(ipid++);
+	uint32_t more = pkt->flags & PKT_F_MORE;
+	uint32_t offset = 0;
+	struct packet *next;
+	void *start = pkt->tl;
+
+	if (!pkt->frag) {
+		ip_fill_header(netif, pkt, start, proto, dst_ip, id, 0);
+		neigh_output(netif, pkt, nexthop);
+		return 0;
+	}
+
+	for (; pkt; pkt = next) {
+		next = pkt->frag;
+		pkt->frag = NULL;
+		ip_fill_header(netif, pkt, start, proto, dst_ip, id,
+		               (next ? IP_MF : 0) | (offset / 8));
+		offset += pkt->end - start;
+		/* one notification for the whole datagram */
+		pkt->flags &= ~PKT_F_MORE;
+		pkt->flags |= next ? PKT_F_MORE : more;
+		netstats.ip_frags_sent++;
+		neigh_output(netif, pkt, nexthop);
+		if (next)
+			start = next->al;
+	}
 	return 0;
 }
 
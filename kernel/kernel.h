@@ -85,11 +85,13 @@ uint32_t snprintf(char *buf, uint32_t size, const char *format, ...);
 uint32_t printf(const char *format, ...);
 
 /*
- * KMalloc
+ * KMalloc: allocations larger than 2048 bytes come straight from the page
+ * allocator, and kfree() ignores the size argument for them.
  */
 void *kmalloc(uint32_t size);
 void kfree(void *ptr, uint32_t size);
 void kmalloc_init(void);
+void kmalloc_report(void);
 
 /*
  * System info debugging command (see sysinfo.c for details)
@@ -121,19 +123,25 @@ struct process {
 	/** Global process list entry. */
 	struct list_head list;
 
-	/** List of sockets */
-	struct list_head sockets;
+	/** Run queue entry, linked while pr_ready is set (see proc_wake()) */
+	struct list_head runq;
 
-	uint32_t max_fildes;
+	/** Scheduling priority, NICE_MIN (runs first) to NICE_MAX */
+	int nice;
+
+	/** Open files, indexed by fd (see fd_install()) */
+	struct file **files;
+	unsigned int nfiles;
+	unsigned int fd_next;
 
 	/** Basically a pid */
 	uint32_t id;
 
-	/** Size of the process image file. */
-	uint32_t size;
+	/** Index of the process image in binaries[]. */
+	uint32_t binary;
 
-	/** Physical address of process image. */
-	void *image;
+	/** Size of the process image, including its bss and stack. */
+	uint32_t size;
 
 	/** Allocator for the process address space. */
 	void *vmem_allocator;
@@ -148,11 +156,16 @@ struct process {
 };
 
 /* Create a process */
+#define USER_IMAGE_START 0x40000000
 struct process *create_process(uint32_t binary);
+int image_fault(struct process *p, uint32_t addr, bool write);
 struct process *create_kthread(void (*func)(void *), void *arg);
+void kthread_start(struct process *p);
 #define BIN_SALUTATIONS 0
 #define BIN_HELLO       1
 #define BIN_USH         2
+#define BIN_TIMEBENCH   3
+#define BIN_TRUE        4
 int32_t process_image_lookup(char *name);
 
 /* Destroy the current process and reschedule. Does not return. */
@@ -163,6 +176,13 @@ void schedule(void);
 void context_switch(struct process *new_process);
 bool timer_can_reschedule(struct ctx *ctx);
 void irq_schedule(struct ctx *ctx);
+
+/* Move a process on or off its run queue, setting pr_ready to match */
+void proc_wake(struct process *p);
+void proc_block(struct process *p);
+int proc_set_nice(struct process *p, int nice);
+unsigned int sched_nr_ready(void);
+
 extern bool preempt_enabled;
 static inline void preempt_disable(void)
 {
@@ -189,6 +209,10 @@ extern uint32_t process_hello_start[];
 extern uint32_t process_hello_end[];
 extern uint32_t process_ush_start[];
 extern uint32_t process_ush_end[];
+extern uint32_t process_timebench_start[];
+extern uint32_t process_timebench_end[];
+extern uint32_t process_true_start[];
+extern uint32_t process_true_end[];
 
 /* "uncomment" this if you want to debug page allocations */
 #ifdef DEBUG_PAGE_ALLOCATOR_CALLS
@@ -206,9 +230,12 @@ void dtb_init(uint32_t phys);
 
 /* ksh commands */
 int virtio_net_cmd_status(int argc, char **argv);
+int virtio_net_cmd_poll(int argc, char **argv);
 int virtio_net_cmd_dhcpdiscover(int argc, char **argv);
 int dhcp_cmd_discover(int argc, char **argv);
 int ip_cmd_show_arptable(int argc, char **argv);
+int udp_cmd_show_sockets(int argc, char **argv);
+int net_cmd_stats(int argc, char **argv);
 
 /* GIC Driver */
 typedef void (*isr_t)(uint32_t, struct ctx *);
@@ -224,6 +251,49 @@ char *gic_get_name(uint32_t intid);
 /* timer */
 void timer_init(void);
 void timer_isr(uint32_t intid, struct ctx *ctx);
+uint64_t timer_get_count(void);
+uint32_t timer_get_freq(void);
+void timer_restart_tick(void);
+void timer_set_event(uint64_t when);
+uint64_t timer_ms_to_count(uint32_t ms);
+uint64_t timer_ts_to_count(uint32_t sec, uint32_t nsec);
+uint32_t timer_count_to_us(uint32_t count);
+
+/*
+ * An hrtimer calls fn from the timer interrupt once the timer count reaches
+ * expires (see hrtimer.c).
+ */
+struct hrtimer {
+	uint64_t expires;
+	void (*fn)(struct hrtimer *t);
+	unsigned int index; /* position in the timer heap */
+	bool pending;
+};
+void hrtimer_init(struct hrtimer *t, void (*fn)(struct hrtimer *t));
+int hrtimer_start(struct hrtimer *t, uint64_t expires);
+bool hrtimer_cancel(struct hrtimer *t);
+bool hrtimer_next(uint64_t *expires);
+void hrtimer_run(uint64_t now);
+int hrtimer_cmd_show(int argc, char **argv);
+
+/*
+ * A timeout makes a process ready at a timer count, so that it can stop
+ * waiting.
+ */
+struct timeout {
+	struct hrtimer timer;
+	struct process *proc;
+	bool expired;
+};
+void timeout_start(struct timeout *t, uint64_t expires);
+void timeout_cancel(struct timeout *t);
+void timer_sleep_until(uint64_t expires);
+
+/* The read-only page of timekeeping data shared with user space (vdso.c) */
+struct timespec;
+void vdso_init(void);
+void vdso_map(struct process *p);
+void timer_get_monotonic(struct timespec *ts);
 
 /* special exectuion functions, see entry.s */
 int __nopreempt setctx(struct ctx *ctx);
@@ -235,14 +305,18 @@ void virtio_init(void);
 struct virtio_net;
 struct packet;
 void virtio_net_send(struct virtio_net *dev, struct packet *pkt);
+void virtio_net_send_flush(struct virtio_net *dev);
+bool virtio_net_busy_poll(struct virtio_net *dev, uint64_t start);
 struct netif;
 extern struct netif nif;
 
 void packet_init(void);
-struct packet *udp_wait(uint16_t port);
+void neigh_init(void);
+struct packet *udp_wait(uint16_t port, uint32_t timeout_ms);
 
 int copy_from_user(void *kerndst, const void *usersrc, size_t n);
 int copy_to_user(void *userdst, const void *kernsrc, size_t n);
+int copy_string_from_user(char *kerndst, const char *usersrc, size_t n);
 
 void dhcp_kthread_start(void);
 
@@ -1,25 +1,33 @@
 /*
  * kmalloc.c: A kernel memory allocator based on the slab allocator
  *
- * This allocator can allocate up to 2048 bytes of memory. Larger allocations
- * must be made with a page allocator or some other type of memory management
- * strategy.
+ * Allocations up to KMALLOC_MAX bytes come from a slab for their power-of-two
+ * size class. Larger allocations are made directly from the page allocator,
+ * and their size is recorded in a small hash table, so that kfree() can find
+ * it again.
  */
 
 #include <stdint.h>
 
 #include "kernel.h"
-#include "slab.h"
 #include "mm.h"
+#include "slab.h"
+#include "util.h"
+
+#define KMALLOC_MIN_SHIFT 3
+#define KMALLOC_MAX       2048
+#define KMALLOC_HASH      32
 
 struct kmalloc_size {
 	int size;
 	char *slabname;
 	struct slab *slab;
+	uint32_t allocs;
+	uint32_t frees;
 };
 
 struct kmalloc_size kmalloc_sizes[] = {
-	/* Cannot have a slab for size 4 because it's smaller than llnode */
+	/* Cannot have a slab for size 4 because it's smaller than a pointer */
 	{ 8, "kmalloc(8)", NULL },       { 16, "kmalloc(16)", NULL },
 	{ 32, "kmalloc(32)", NULL },     { 64, "kmalloc(64)", NULL },
 	{ 128, "kmalloc(128)", NULL },   { 256, "kmalloc(256)", NULL },
@@ -27,44 +35,121 @@ struct kmalloc_size kmalloc_sizes[] = {
 	{ 2048, "kmalloc(2048)", NULL },
 };
 
-static struct slab *find_slab(uint32_t size)
-{
-	int32_t i;
+/*
+ * A record of a large allocation, kept in the hash table by address.
+ */
+struct kmalloc_large {
+	void *ptr;
+	uint32_t size;
+	struct kmalloc_large *next;
+};
 
-	for (i = 0; i < nelem(kmalloc_sizes); i++)
-		if (kmalloc_sizes[i].size >= size)
-			return kmalloc_sizes[i].slab;
+static struct slab *large_slab;
+static struct kmalloc_large *large_hash[KMALLOC_HASH];
+static uint32_t large_allocs, large_frees, large_pages;
+
+#define large_bucket(ptr) (((uint32_t)(ptr) / PAGE_SIZE) % KMALLOC_HASH)
 
-	return NULL;
+/**
+ * Return the index of the smallest size class which fits size.
+ */
+static inline uint32_t size_class(uint32_t size)
+{
+	if (size <= (1 << KMALLOC_MIN_SHIFT))
+		return 0;
+	return log2_ceil(size) - KMALLOC_MIN_SHIFT;
 }
 
-void *kmalloc(uint32_t size)
+static void *kmalloc_large(uint32_t size)
 {
-	struct slab *slab;
+	struct kmalloc_large *rec;
+	uint32_t bytes = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 
-	slab = find_slab(size);
-	if (!slab) {
-		printf("kmalloc: Got allocation for size %u greater than "
-		       "2048. Somebody didn't read the docs! Get ready for "
-		       "a very interesting crash.\n",
-		       size);
+	rec = slab_alloc(large_slab);
+	if (!rec)
+		return NULL;
+	rec->ptr = kmem_get_pages(bytes, 0);
+	if (!rec->ptr) {
+		slab_free(large_slab, rec);
 		return NULL;
 	}
-	return slab_alloc(slab);
+	rec->size = bytes;
+	rec->next = large_hash[large_bucket(rec->ptr)];
+	large_hash[large_bucket(rec->ptr)] = rec;
+	large_allocs++;
+	large_pages += bytes / PAGE_SIZE;
+	return rec->ptr;
+}
+
+/**
+ * Free ptr if it was a large allocation, returning true. Large allocations are
+ * always page aligned, so most slab objects don't need the hash lookup.
+ */
+static bool kfree_large(void *ptr)
+{
+	struct kmalloc_large **link, *rec;
+
+	if ((uint32_t)ptr & (PAGE_SIZE - 1))
+		return false;
+
+	link = &large_hash[large_bucket(ptr)];
+	for (; *link; link = &(*link)->next) {
+		rec = *link;
+		if (rec->ptr == ptr) {
+			*link = rec->next;
+			kmem_free_pages(ptr, rec->size);
+			large_frees++;
+			large_pages -= rec->size / PAGE_SIZE;
+			slab_free(large_slab, rec);
+			return true;
+		}
+	}
+	return false;
+}
+
+void *kmalloc(uint32_t size)
+{
+	struct kmalloc_size *cls;
+	void *ptr;
+
+	if (size > KMALLOC_MAX)
+		return kmalloc_large(size);
+
+	cls = &kmalloc_sizes[size_class(size)];
+	ptr = slab_alloc(cls->slab);
+	if (ptr)
+		cls->allocs++;
+	return ptr;
 }
 
 void kfree(void *ptr, uint32_t size)
 {
-	struct slab *slab;
+	struct kmalloc_size *cls;
+
+	if (kfree_large(ptr))
+		return;
 
-	slab = find_slab(size);
-	if (!slab) {
-		printf("kfree: Got free request for size %u greater than "
-		       "2048. Very weird.\n",
-		       size);
+	if (size > KMALLOC_MAX) {
+		printf("kfree: 0x%x is not a large allocation (size %u)\n",
+		       ptr, size);
 		return;
 	}
-	return slab_free(slab, ptr);
+
+	cls = &kmalloc_sizes[size_class(size)];
+	cls->frees++;
+	slab_free(cls->slab, ptr);
+}
+
+void kmalloc_report(void)
+{
+	uint32_t i;
+	puts("class\tallocs\tfrees\tin use\n");
+	for (i = 0; i < nelem(kmalloc_sizes); i++)
+		printf("%u\t%u\t%u\t%u\n", kmalloc_sizes[i].size,
+		       kmalloc_sizes[i].allocs, kmalloc_sizes[i].frees,
+		       kmalloc_sizes[i].allocs - kmalloc_sizes[i].frees);
+	printf("large\t%u\t%u\t%u (%u pages)\n", large_allocs, large_frees,
+	       large_allocs - large_frees, large_pages);
 }
 
 void kmalloc_init(void)
@@ -73,6 +158,9 @@ void kmalloc_init(void)
 	for (i = 0; i < nelem(kmalloc_sizes); i++) {
 		kmalloc_sizes[i].slab =
 		        slab_new(kmalloc_sizes[i].slabname,
-		                 kmalloc_sizes[i].size, kmem_get_page);
+		                 kmalloc_sizes[i].size, kmem_get_page,
+		                 kmem_free_page);
 	}
+	large_slab = slab_new("kmalloc_large", sizeof(struct kmalloc_large),
+	                      kmem_get_page, kmem_free_page);
 }
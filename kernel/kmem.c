@@ -15,6 +15,12 @@
 #define top_n_bits(n) (0xFFFFFFFF << (32 - n))
 #define bot_n_bits(n) (0xFFFFFFFF >> (32 - n))
 
+/*
+ * The kernel page allocator needs a descriptor for each free block, so give it
+ * more room than the default single page. This follows the first-level table.
+ */
+#define KERNALLOC_SIZE (8 * PAGE_SIZE)
+
 uint32_t *first_level_table;
 
 /*
@@ -58,7 +64,8 @@ static uint32_t *get_second(uint32_t fld)
 }
 
 /**
- * Create a second-level table, given that it doesn't exist.
+ * Create a second-level table, given that it doesn't exist. Returns NULL if
+ * there is no memory for it.
  */
 static uint32_t *create_second(uint32_t *base, uint32_t first_idx)
 {
@@ -67,6 +74,8 @@ static uint32_t *create_second(uint32_t *base, uint32_t first_idx)
 	* TODO we're wasting memory) of physical memory, map it into
 	* kernel space, and we use that as a second-level table. */
 	second = kmem_get_page();
+	if (!second)
+		return NULL;
 	second_phys = kvtop(second);
 	base[first_idx] = second_phys | FLD_COARSE;
 
@@ -82,15 +91,23 @@ static uint32_t *create_second(uint32_t *base, uint32_t first_idx)
 }
 
 /**
- * Clean up all second-level tables in a user page table
+ * Clean up all second-level tables in a user page table, and the pages which
+ * belong to the process: those it may write. Read-only pages are shared (image
+ * text, data not yet copied, and the vDSO), so they are left alone.
  */
 void umem_cleanup(struct process *p)
 {
-	uint32_t i, fld, *second;
+	uint32_t i, j, fld, sld, *second;
 	for (i = 0; i < CONFIG_KERNEL_START >> 20; i++) {
 		fld = p->first[i];
 		if ((fld & FLD_MASK) == FLD_COARSE) {
 			second = get_second(fld);
+			for (j = 0; j < 256; j++) {
+				sld = second[j];
+				if ((sld & SLD_MASK) == SLD_SMALL &&
+				    (sld & SLD_AP_MASK) == SLD_PRW_URW)
+					kmem_free_page(kptov(SLD_ADDR(sld)));
+			}
 			kmem_free_page(second);
 		}
 	}
@@ -105,8 +122,8 @@ void umem_cleanup(struct process *p)
  * @param phys physical address (should be page aligned)
  * @param attrs second-level small page descriptor bits to include
  */
-static void map_page(uint32_t *base, uint32_t virt, uint32_t phys,
-                     uint32_t attrs)
+static int map_page(uint32_t *base, uint32_t virt, uint32_t phys,
+                    uint32_t attrs)
 {
 	uint32_t *second;
 	uint32_t fld = base[fld_idx(virt)];
@@ -115,9 +132,11 @@ static void map_page(uint32_t *base, uint32_t virt, uint32_t phys,
 		second = get_second(fld);
 	} else if ((fld & FLD_MASK) == 0) {
 		second = create_second(base, virt >> 20);
+		if (!second)
+			return -ENOMEM;
 	} else {
 		puts("map_page: First level table entry doesn't point to table");
-		return;
+		return -EINVAL;
 	}
 
 	second[sld_idx(virt)] = (phys & 0xFFFFF000) | attrs | SLD_SMALL;
@@ -128,32 +147,45 @@ static void map_page(uint32_t *base, uint32_t virt, uint32_t phys,
 	 * crash if I don't clean the cache to PoC (PoU won't work even).
 	 */
 	DCCMVAC(&second[sld_idx(virt)]);
+	return 0;
 }
 
 /* Map multiple pages in a row. This is mainly to automate map_page() */
-static void map_pages(uint32_t *base, uint32_t virt, uint32_t phys,
-                      uint32_t len, uint32_t attrs)
+static int map_pages(uint32_t *base, uint32_t virt, uint32_t phys,
+                     uint32_t len, uint32_t attrs)
 {
 	uint32_t i;
-	for (i = 0; i < len; i += 4096)
-		map_page(base, virt + i, phys + i, attrs);
+	int rv;
+	for (i = 0; i < len; i += 4096) {
+		rv = map_page(base, virt + i, phys + i, attrs);
+		if (rv < 0)
+			return rv;
+	}
+	return 0;
 }
 
 /**
  * Public API function, see mm.h
  */
-void umem_map_pages(struct process *p, uint32_t virt, uint32_t phys,
-                    uint32_t len, enum umem_perm perm)
+int umem_map_pages(struct process *p, uint32_t virt, uint32_t phys,
+                   uint32_t len, enum umem_perm perm)
 {
-	uint32_t attrs;
+	uint32_t attrs, i;
+	int rv;
 	if (perm == UMEM_RO) {
 		attrs = UMEM_FLAGS_RO;
 	} else {
 		attrs = UMEM_FLAGS_RW;
 	}
-	map_pages(p->first, virt, phys, len, attrs);
+	rv = map_pages(p->first, virt, phys, len, attrs);
+	mb();
+	/* The pages may have been mapped before, e.g. read-only until a
+	 * copy-on-write fault, so drop any stale TLB entries. */
+	for (i = 0; i < len; i += PAGE_SIZE)
+		tlbimva((virt + i) | (p->id & 0xFF));
 	mb();
 	isb();
+	return rv;
 }
 
 /**
@@ -184,6 +216,20 @@ uint32_t umem_lookup_phys(struct process *p, void *virt_ptr)
 	return lookup_phys(p->first, virt_ptr);
 }
 
+bool umem_writable(struct process *p, void *virt_ptr)
+{
+	uint32_t virt = (uint32_t)virt_ptr;
+	uint32_t fld = p->first[fld_idx(virt)];
+	uint32_t sld;
+
+	/* user memory is only ever mapped with small pages */
+	if ((fld & FLD_MASK) != FLD_COARSE)
+		return false;
+	sld = get_second(fld)[sld_idx(virt)];
+	return (sld & SLD_MASK) == SLD_SMALL &&
+	       (sld & SLD_AP_MASK) == SLD_PRW_URW;
+}
+
 uint32_t kmem_lookup_phys(void *virt_ptr)
 {
 	return lookup_phys(first_level_table, virt_ptr);
@@ -361,7 +407,9 @@ int kmem_init2_postmmu(void)
 	 * Create the memory allocator which allocates kernel direct memory.
 	 */
 	kernalloc = (void*)first_level_table + 0x4000;
-	init_page_allocator(kernalloc, CONFIG_KERNEL_START + (phy_dynamic_start + 0x5000 - phy_start), VMALLOC_START);
+	init_page_allocator_sized(kernalloc, KERNALLOC_SIZE,
+	        CONFIG_KERNEL_START + (phy_dynamic_start + 0x4000 + KERNALLOC_SIZE - phy_start),
+	        VMALLOC_START);
 
 	/* Cretae the memory allocator for vmalloc addresses. */
 	kern_virt_allocator = (void *)alloc_pages(kernalloc, 0x1000, 0);
@@ -43,6 +43,12 @@ static int cmd_slab_report(int argc, char **argv)
 	return 0;
 }
 
+static int cmd_kmalloc_report(int argc, char **argv)
+{
+	kmalloc_report();
+	return 0;
+}
+
 static int cmd_cxtk_report(int argc, char **argv)
 {
 	cxtk_report();
@@ -93,10 +99,14 @@ static int help(int argc, char **argv);
 struct ksh_cmd cmds[] = {
 	KSH_CMD("echo", echo, "print each arg, useful for debugging"),
 	KSH_CMD("netstatus", virtio_net_cmd_status, "read net device status"),
+	KSH_CMD("netpoll", virtio_net_cmd_poll, "set net busy-poll budget (us)"),
+	KSH_CMD("netstats", net_cmd_stats, "show receive path counters"),
 	KSH_CMD("dhcpdiscover", dhcp_cmd_discover, "send DHCPDISCOVER"),
 	KSH_CMD("help", help, "show this help message"),
 	KSH_CMD("show-arptable", ip_cmd_show_arptable, "show the arp table"),
+	KSH_CMD("show-udp", udp_cmd_show_sockets, "show bound UDP sockets"),
 	KSH_CMD("slab-report", cmd_slab_report, "print all slab stats"),
+	KSH_CMD("kmalloc-report", cmd_kmalloc_report, "print kmalloc stats"),
 	KSH_CMD("cxtk", cmd_cxtk_report, "print context switch report"),
 	KSH_CMD("resctx", cmd_resctx, "demo for setctx/resctx"),
 	KSH_CMD("udiv", cmd_udiv, "unsigned division"),
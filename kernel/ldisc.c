@@ -7,6 +7,7 @@
 #include "list.h"
 #include "string.h"
 #include "sync.h"
+#include "sys/poll.h"
 #include "wait.h"
 
 #define LLE_INIT_BUF 1024
@@ -111,10 +112,19 @@ static int flip_close(struct file *f)
 	return 0;
 }
 
+static int flip_poll(struct file *f, struct poll_table *pt)
+{
+	struct flip_file *ff = get_flip_file(f);
+
+	poll_wait(pt, &ff->wait);
+	return POLLOUT | (flip_maybe_get_buffer(ff) ? POLLIN : 0);
+}
+
 struct file_ops flip_file_ops = {
 	.read = flip_read,
 	.write = flip_write,
 	.close = flip_close,
+	.poll = flip_poll,
 };
 
 struct file *flip_file_new(void)
@@ -126,6 +136,7 @@ struct file *flip_file_new(void)
 	wait_list_init(&ff->wait);
 	INIT_SPINSEM(&ff->lock, 1);
 	f->ops = &flip_file_ops;
+	f->flags = O_RDWR;
 	return f;
 }
 
@@ -65,10 +65,12 @@ void main(uint32_t phys)
 #endif
 	gic_init();
 	timer_init();
+	vdso_init();
 	fs_init(); /* Initialize file slab before uart file is created */
 	uart_init_irq();
 #if CONFIG_BOARD == BOARD_QEMU
 	packet_init();
+	neigh_init();
 	blk_init();
 	virtio_init();
 #endif
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "config.h"
@@ -104,7 +105,7 @@ struct process;
 
 enum umem_perm {
 	UMEM_RW = 0,
-	UMEM_RO = 1,
+	UMEM_RO = 1, /* read-only to the kernel too, so writes always fault */
 };
 
 /*
@@ -123,8 +124,9 @@ enum umem_perm {
  * @param phys Physical address to map (page aligned)
  * @param size Number of bytes to map (increments of PAGE_SIZE)
  * @param perm Permissions of this mapping (RW or RO)
+ * @return 0, or -ENOMEM if a second-level table couldn't be allocated
  */
-void umem_map_pages(struct process *p, uint32_t virt, uint32_t phys, uint32_t size, enum umem_perm perm);
+int umem_map_pages(struct process *p, uint32_t virt, uint32_t phys, uint32_t size, enum umem_perm perm);
 
 /**
  * Lookup the mapping for a user virtual address.
@@ -134,10 +136,17 @@ void umem_map_pages(struct process *p, uint32_t virt, uint32_t phys, uint32_t si
 uint32_t umem_lookup_phys(struct process *p, void *virt_ptr);
 
 /**
- * Destroy all memory mappings within the process address space. Note that this
- * simply frees the memory associated with the page tables (e.g. second level
- * pages). It doesn't do anything to free the the mapped memory. The caller
- * should handle that.
+ * Return true if a user virtual address is mapped, and user mode may write it.
+ * @param p Process page tables to use
+ * @param virt_ptr Virtual address to lookup
+ */
+bool umem_writable(struct process *p, void *virt_ptr);
+
+/**
+ * Destroy all memory mappings within the process address space. This frees the
+ * memory associated with the page tables (e.g. second level pages), and every
+ * page mapped UMEM_RW, which the process is assumed to own. Pages mapped
+ * UMEM_RO are shared, and the caller should handle them.
  */
 void umem_cleanup(struct process *p);
 
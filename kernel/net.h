@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
+
+#include "csum.h"
 #include "inet.h"
 #include "packets.h"
 
@@ -7,6 +10,7 @@ struct netif {
 	uint32_t ip;
 	uint8_t mac[6];
 	struct virtio_net *dev;
+	bool tx_csum; /* the device can fill in transport checksums */
 
 	uint32_t gateway_ip;
 	uint32_t subnet_mask;
@@ -17,6 +21,11 @@ void eth_recv(struct netif *netif, struct packet *pkt);
 int eth_send(struct netif *netif, struct packet *pkt, uint16_t ethertype,
              uint8_t dst_mac[6]);
 
+void arp_recv(struct netif *netif, struct packet *pkt);
+void arp_request(struct netif *netif, uint32_t ip);
+
+void neigh_update(struct netif *netif, uint32_t ip, uint8_t *mac, bool create);
+
 void ip_recv(struct netif *netif, struct packet *pkt);
 /* TODO: maybe netif shouldn't be in ip_send() */
 int ip_send(struct netif *netif, struct packet *pkt, uint8_t proto,
@@ -29,7 +38,62 @@ void udp_send(struct netif *netif, struct packet *pkt, uint32_t src_ip,
 int udp_reserve(void);
 void udp_init(void);
 
-void csum_init(uint32_t *csum);
-void csum_add(uint32_t *csum, uint16_t *data, uint32_t n);
-void csum_add_value(uint32_t *csum, uint16_t data);
-uint16_t csum_finalize(uint32_t *csum);
+/*
+ * Counters for each stage of the receive path. A packet is counted once by
+ * each stage it reaches, so drops show up as the difference between stages.
+ */
+struct netstats {
+	uint32_t rx_frames;   /* frames received from the device */
+	uint32_t rx_bytes;
+	uint32_t pool_hits;   /* receive buffers reused from the packet pool */
+	uint32_t pool_misses; /* receive buffers allocated from the slab */
+	uint32_t tx_nomem;    /* packets not sent for lack of memory */
+	uint32_t eth_drops;   /* not for us, or unknown ethertype */
+	uint32_t ip_rx;
+	uint32_t ip_drops;
+	uint32_t ip_frags;       /* fragments received */
+	uint32_t ip_reassembled; /* datagrams put back together */
+	uint32_t ip_reasm_fails; /* partial datagrams given up on */
+	uint32_t ip_frags_sent;
+	uint32_t udp_rx;
+	uint32_t udp_drops;   /* nobody listening on the port */
+	uint32_t sock_queued; /* packets queued on a socket */
+	uint32_t sock_recvd;  /* packets copied out to user space */
+	uint32_t sock_bytes;
+	uint32_t sock_drops;  /* socket receive queue was full */
+	uint32_t csum_offloaded; /* sent with the checksum left to the device */
+	uint32_t csum_trusted;   /* received, already validated by the device */
+	uint32_t csum_errors;    /* received with a bad checksum, dropped */
+};
+extern struct netstats netstats;
+
+/**
+ * Allocate a packet for the device to receive into. Unlike packet_alloc(), the
+ * packet is not zeroed: it is usually recycled from the packet pool. Returns
+ * NULL if there is no memory.
+ */
+struct packet *packet_alloc_rx(void);
+
+/**
+ * Clear a packet's pointers and flags, so that a receive buffer can be given
+ * back to the device without freeing it.
+ */
+void packet_reset_rx(struct packet *pkt);
+
+/**
+ * Return the bytes in a packet chain, from start in the head packet to the end
+ * of the last one.
+ */
+uint32_t packet_chain_len(struct packet *pkt, void *start);
+
+/**
+ * Return the buffer space used by a packet chain, for receive queue limits.
+ */
+uint32_t packet_chain_size(struct packet *pkt);
+
+/**
+ * Add the bytes in a packet chain, from start in the head packet, to a
+ * checksum.
+ */
+void packet_csum_add(uint32_t *csum, struct packet *pkt, void *start);
+
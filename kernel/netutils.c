@@ -10,49 +10,153 @@
 struct slab *pktslab = NULL;
 #define PACKET_SIZE 2048
 
-void csum_init(uint32_t *csum)
+/*
+ * Freed packets go into a pool, up to PACKET_POOL_MAX, rather than back to the
+ * slab. Receive buffers are taken from the pool without zeroing them: the
+ * device overwrites the frame, and each layer sets the pointers it uses.
+ */
+#define PACKET_POOL_MAX 256
+
+/* Beyond the pool, keep enough empty slab pages to absorb a receive burst */
+#define PACKET_SLAB_WATERMARK 16
+static struct list_head packet_pool;
+static uint32_t packet_pool_count;
+static spinsem_t packet_pool_lock;
+
+struct netstats netstats;
+
+void packet_init(void)
 {
-	*csum = 0;
+	pktslab = slab_new("packet", PACKET_SIZE, kmem_get_page, kmem_free_page);
+	slab_set_watermark(pktslab, PACKET_SLAB_WATERMARK);
+	INIT_LIST_HEAD(packet_pool);
+	INIT_SPINSEM(&packet_pool_lock, 1);
+	packet_pool_count = 0;
 }
 
-void csum_add(uint32_t *csum, uint16_t *data, uint32_t n)
+static struct packet *packet_pool_get(void)
 {
-	uint32_t i;
-	for (i = 0; i < n; i++) {
-		*csum += data[i];
+	struct packet *pkt = NULL;
+	int flags;
+
+	spin_acquire_irqsave(&packet_pool_lock, &flags);
+	if (!list_empty(&packet_pool)) {
+		pkt = container_of(packet_pool.next, struct packet, list);
+		list_remove(&pkt->list);
+		packet_pool_count--;
 	}
+	spin_release_irqrestore(&packet_pool_lock, &flags);
+	return pkt;
 }
 
-void csum_add_value(uint32_t *csum, uint16_t data)
+struct packet *packet_alloc(void)
 {
-	csum_add(csum, &data, 1);
+	struct packet *pkt = packet_pool_get();
+	if (!pkt)
+		pkt = (struct packet *)slab_alloc(pktslab);
+	if (!pkt)
+		return NULL;
+	memset(pkt, 0, PACKET_SIZE);
+	pkt->capacity = PACKET_CAPACITY;
+	return pkt;
 }
 
-uint16_t csum_finalize(uint32_t *csum)
+void packet_reset_rx(struct packet *pkt)
 {
-	uint32_t add;
-	while (*csum & 0xFFFF0000) {
-		add = (*csum & 0xFFFF0000) >> 16;
-		*csum &= 0x0000FFFF;
-		*csum += add;
-	}
-	return ~((uint16_t)*csum);
+	pkt->ll = pkt->nl = pkt->tl = pkt->al = pkt->end = NULL;
+	pkt->frag = NULL;
+	pkt->capacity = PACKET_CAPACITY;
+	pkt->flags = 0;
 }
 
-void packet_init(void)
+struct packet *packet_alloc_rx(void)
 {
-	pktslab = slab_new("packet", PACKET_SIZE, kmem_get_page);
+	struct packet *pkt = packet_pool_get();
+	if (pkt) {
+		netstats.pool_hits++;
+	} else {
+		netstats.pool_misses++;
+		pkt = (struct packet *)slab_alloc(pktslab);
+		if (!pkt)
+			return NULL;
+	}
+	packet_reset_rx(pkt);
+	return pkt;
 }
 
-struct packet *packet_alloc(void)
+static void packet_free_one(struct packet *pkt)
 {
-	struct packet *pkt = (struct packet *)slab_alloc(pktslab);
-	memset(pkt, 0, PACKET_SIZE);
-	pkt->capacity = PACKET_CAPACITY;
-	return pkt;
+	int flags;
+
+	spin_acquire_irqsave(&packet_pool_lock, &flags);
+	if (packet_pool_count < PACKET_POOL_MAX) {
+		list_insert(&packet_pool, &pkt->list);
+		packet_pool_count++;
+		pkt = NULL;
+	}
+	spin_release_irqrestore(&packet_pool_lock, &flags);
+	if (pkt)
+		slab_free(pktslab, (void *)pkt);
 }
 
+/**
+ * Free a packet, along with the rest of its chain.
+ */
 void packet_free(struct packet *pkt)
 {
-	slab_free(pktslab, (void *)pkt);
+	struct packet *next;
+
+	for (; pkt; pkt = next) {
+		next = pkt->frag;
+		packet_free_one(pkt);
+	}
+}
+
+uint32_t packet_chain_len(struct packet *pkt, void *start)
+{
+	uint32_t len = pkt->end - start;
+
+	for (pkt = pkt->frag; pkt; pkt = pkt->frag)
+		len += pkt->end - pkt->al;
+	return len;
+}
+
+uint32_t packet_chain_size(struct packet *pkt)
+{
+	uint32_t size = 0;
+
+	for (; pkt; pkt = pkt->frag)
+		size += PACKET_SIZE;
+	return size;
+}
+
+void packet_csum_add(uint32_t *csum, struct packet *pkt, void *start)
+{
+	csum_add_bytes(csum, start, pkt->end - start);
+	for (pkt = pkt->frag; pkt; pkt = pkt->frag)
+		csum_add_bytes(csum, pkt->al, pkt->end - pkt->al);
+}
+
+int net_cmd_stats(int argc, char **argv)
+{
+	printf("device:\t%u frames, %u bytes\n", netstats.rx_frames,
+	       netstats.rx_bytes);
+	printf("pool:\t%u reused, %u allocated, %u free, %u out of memory\n",
+	       netstats.pool_hits, netstats.pool_misses, packet_pool_count,
+	       netstats.tx_nomem);
+	printf("eth:\t%u dropped\n", netstats.eth_drops);
+	printf("ip:\t%u received, %u dropped\n", netstats.ip_rx,
+	       netstats.ip_drops);
+	printf("frag:\t%u received, %u reassembled, %u abandoned, %u sent\n",
+	       netstats.ip_frags, netstats.ip_reassembled,
+	       netstats.ip_reasm_fails, netstats.ip_frags_sent);
+	printf("udp:\t%u received, %u dropped\n", netstats.udp_rx,
+	       netstats.udp_drops);
+	printf("socket:\t%u queued, %u received, %u bytes, %u overflowed\n",
+	       netstats.sock_queued, netstats.sock_recvd, netstats.sock_bytes,
+	       netstats.sock_drops);
+	printf("csum:\t%u offloaded, %u trusted, %u bad\n",
+	       netstats.csum_offloaded, netstats.csum_trusted,
+	       netstats.csum_errors);
+	return 0;
 }
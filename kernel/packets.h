@@ -15,7 +15,28 @@ struct etherframe {
 	uint16_t ethertype;
 } __attribute__((packed));
 
-#define ETHERTYPE_IP 0x0800
+#define ETHERTYPE_IP  0x0800
+#define ETHERTYPE_ARP 0x0806
+
+/*
+ * ARP Packet, for IPv4 over Ethernet
+ * https://tools.ietf.org/html/rfc826
+ */
+struct arphdr {
+	uint16_t htype;
+	uint16_t ptype;
+	uint8_t hlen;
+	uint8_t plen;
+	uint16_t oper;
+	uint8_t sha[6];
+	uint32_t spa;
+	uint8_t tha[6];
+	uint32_t tpa;
+} __attribute__((packed));
+
+#define ARP_HTYPE_ETHERNET 1
+#define ARP_REQUEST        1
+#define ARP_REPLY          2
 
 /*
  * IP Header
@@ -35,6 +56,11 @@ struct iphdr {
 	uint8_t options[0];
 } __attribute__((packed));
 
+/* flags_foffset bits, in host order */
+#define IP_DF      0x4000 /* don't fragment */
+#define IP_MF      0x2000 /* more fragments */
+#define IP_OFFMASK 0x1FFF /* fragment offset, in units of 8 bytes */
+
 #define ip_get_version(ip) (((ip)->verihl & 0xF0) >> 4)
 #define ip_get_length(ip)  (((ip)->verihl & 0x0F) * 4)
 
@@ -139,6 +165,7 @@ struct packet {
 	union {
 		void *nl;
 		struct iphdr *ip;
+		struct arphdr *arp;
 	};
 
 	/* Transport-layer header pointer */
@@ -157,13 +184,39 @@ struct packet {
 
 	/* Packets need to be queued in various places, we use this list */
 	struct list_head list;
+
+	/*
+	 * A datagram too big for one buffer is a chain of packets linked by
+	 * frag. The head holds the headers, and each packet after it holds
+	 * more payload, between al and end. Every piece but the last has an
+	 * even length, so that checksums can be summed piece by piece.
+	 */
+	struct packet *frag;
 	uint32_t capacity;
+	uint32_t flags;
+	uint16_t csum_offset; /* PKT_F_CSUM_PARTIAL: checksum field within tl */
 	uint8_t data[0];
 };
 
+/* The sender has more packets coming, so the driver may delay notifying */
+#define PKT_F_MORE 0x1
+/* The transport checksum holds only the pseudo-header sum, the device must
+ * finish it */
+#define PKT_F_CSUM_PARTIAL 0x2
+/* The device validated the transport checksum of this received packet */
+#define PKT_F_CSUM_VALID 0x4
+
+/* A zeroed packet to send, or NULL if there is no memory */
 struct packet *packet_alloc(void);
 void packet_free(struct packet *pkt);
 #define PACKET_SIZE     2048
 #define PACKET_CAPACITY (PACKET_SIZE - sizeof(struct packet))
 
 #define MAX_ETH_PKT_SIZE 1514
+#define ETH_MTU          1500
+
+/* IP payload in each fragment we send: what fits in the MTU, rounded down to
+ * a multiple of 8 */
+#define IP_FRAG_PAYLOAD ((ETH_MTU - sizeof(struct iphdr)) & ~7)
+#define IP_MAX_PAYLOAD  (65535 - sizeof(struct iphdr))
+#define UDP_MAX_PAYLOAD (IP_MAX_PAYLOAD - sizeof(struct udphdr))
@@ -0,0 +1,138 @@
+/*
+ * poll.c: wait for events on several files at once
+ *
+ * Each pollable file has a poll operation which reports its POLL* events,
+ * and registers a waiter on the waitlist which is awoken when they change.
+ * sys_poll() scans every fd this way, then sleeps unless one of those waiters
+ * has already fired. Being awoken by any waitlist, or by the timeout, makes
+ * the process ready again, and it scans once more.
+ */
+#include "cxtk.h"
+#include "fs.h"
+#include "kernel.h"
+#include "sys/poll.h"
+
+static short poll_one(struct pollfd *pfd, struct poll_table *pt)
+{
+	struct file *f;
+	int mask;
+
+	f = fd_get(current, pfd->fd);
+	if (!f || !f->ops->poll)
+		return POLLNVAL;
+	mask = f->ops->poll(f, pt);
+	/* errors are reported whether asked for or not */
+	return mask & (pfd->events | POLLERR | POLLHUP);
+}
+
+/*
+ * Fill in revents for each fd, and return how many have any. The process stays
+ * ready while scanning, since the scan may be preempted.
+ */
+static int poll_scan(struct pollfd *fds, nfds_t nfds, struct poll_table *pt)
+{
+	nfds_t i;
+	int nready = 0;
+
+	pt->count = 0;
+	for (i = 0; i < nfds; i++) {
+		fds[i].revents = poll_one(&fds[i], pt);
+		if (fds[i].revents)
+			nready++;
+	}
+	return nready;
+}
+
+/*
+ * Sleep until a waiter registered by poll_scan() fires, or the timeout expires.
+ * An event which arrived after its fd was checked has already dequeued its
+ * waiter, so with interrupts off, we only block if none has.
+ */
+static void poll_sleep(struct poll_table *pt, struct timeout *tmo)
+{
+	unsigned int i;
+	int flags;
+
+	irqsave(&flags);
+	if (tmo && tmo->expired) {
+		irqrestore(&flags);
+		return;
+	}
+	for (i = 0; i < pt->count; i++) {
+		if (!pt->entries[i].waiter.queued) {
+			irqrestore(&flags);
+			return;
+		}
+	}
+	proc_block(current);
+	irqrestore(&flags);
+	schedule();
+}
+
+static void poll_release(struct poll_table *pt)
+{
+	unsigned int i;
+
+	for (i = 0; i < pt->count; i++)
+		wait_list_remove(pt->entries[i].wl, &pt->entries[i].waiter);
+	pt->count = 0;
+}
+
+/*
+ * Wait until an fd has one of its requested events, or for timeout
+ * milliseconds. A negative timeout waits forever, and zero doesn't wait at all.
+ * Returns the number of fds with events.
+ */
+int sys_poll(struct pollfd *ufds, nfds_t nfds, int timeout)
+{
+	struct pollfd *fds = NULL;
+	struct poll_table pt = { 0 };
+	struct timeout tmo;
+	int rv, err;
+	cxtk_track_syscall();
+
+	if (nfds > POLL_MAX_FDS) {
+		rv = -EINVAL;
+		goto out;
+	}
+	if (nfds) {
+		fds = kmalloc(nfds * sizeof(struct pollfd));
+		pt.entries = kmalloc(nfds * sizeof(struct poll_entry));
+		pt.max = nfds;
+		if (!fds || !pt.entries) {
+			rv = -ENOMEM;
+			goto out_free;
+		}
+		rv = copy_from_user(fds, ufds, nfds * sizeof(struct pollfd));
+		if (rv < 0)
+			goto out_free;
+	}
+
+	if (timeout > 0)
+		timeout_start(&tmo,
+		              timer_get_count() + timer_ms_to_count(timeout));
+	for (;;) {
+		rv = poll_scan(fds, nfds, &pt);
+		if (rv || !timeout || (timeout > 0 && tmo.expired))
+			break;
+		poll_sleep(&pt, timeout > 0 ? &tmo : NULL);
+		poll_release(&pt);
+	}
+	poll_release(&pt);
+	if (timeout > 0)
+		timeout_cancel(&tmo);
+
+	if (nfds) {
+		err = copy_to_user(ufds, fds, nfds * sizeof(struct pollfd));
+		if (err < 0)
+			rv = err;
+	}
+out_free:
+	if (fds)
+		kfree(fds, nfds * sizeof(struct pollfd));
+	if (pt.entries)
+		kfree(pt.entries, nfds * sizeof(struct poll_entry));
+out:
+	cxtk_track_syscall_return();
+	return rv;
+}
@@ -2,11 +2,12 @@
  * Routines for dealing with processes.
  */
 #include "cxtk.h"
+#include "fs.h"
 #include "kernel.h"
 #include "ksh.h"
 #include "slab.h"
-#include "socket.h"
 #include "string.h"
+#include "unistd.h"
 #include "wait.h"
 #include "mm.h"
 #include "config.h"
@@ -17,6 +18,19 @@ struct slab *proc_slab;
 static uint32_t pid = 1;
 struct process *idle_process = NULL;
 
+/*
+ * Run queues: a list of ready processes for each priority, and a bitmap of the
+ * non-empty lists, so choosing the next process takes the same time no matter
+ * how many processes are blocked. A process is queued exactly while pr_ready
+ * is set. The idle process is never queued.
+ */
+#define NR_PRIO    (NICE_MAX - NICE_MIN + 1)
+#define RUNQ_WORDS ((NR_PRIO + 31) / 32)
+static struct list_head runq[NR_PRIO];
+static uint32_t runq_bitmap[RUNQ_WORDS];
+static unsigned int nr_ready;
+static DECLARE_SPINSEM(runq_lock, 1);
+
 bool preempt_enabled = true;
 const char nopreempt_begin;
 const char nopreempt_end;
@@ -29,6 +43,22 @@ struct static_binary {
 	char *name;
 };
 
+/*
+ * The start of each image, which user/startup.s branches over. Addresses are
+ * in the user address space.
+ */
+struct image_header {
+	uint32_t branch;
+	uint32_t code_end;  /* text and rodata end here, page aligned */
+	uint32_t image_end; /* after the data, bss and stack, page aligned */
+};
+
+static struct {
+	uint32_t shared; /* pages mapped from the kernel's copy of the image */
+	uint32_t copied; /* data pages copied on write */
+	uint32_t zeroed; /* bss and stack pages */
+} image_stats;
+
 struct static_binary binaries[] = {
 	{ .start = process_salutations_start,
 	  .end = process_salutations_end,
@@ -37,6 +67,12 @@ struct static_binary binaries[] = {
 	  .end = process_hello_end,
 	  .name = "hello" },
 	{ .start = process_ush_start, .end = process_ush_end, .name = "ush" },
+	{ .start = process_timebench_start,
+	  .end = process_timebench_end,
+	  .name = "timebench" },
+	{ .start = process_true_start,
+	  .end = process_true_end,
+	  .name = "true" },
 };
 
 bool timer_can_reschedule(struct ctx *ctx)
@@ -63,29 +99,23 @@ bool timer_can_reschedule(struct ctx *ctx)
  * 4096 bytes (minus the space reserved for the process struct itself). You can
  * take this process and either start it using start_process(), or context
  * switch it in later.
+ *
+ * Nothing of the image is mapped or copied yet: pages are mapped as the process
+ * uses them, by image_fault().
  */
 struct process *create_process(uint32_t binary)
 {
-	uint32_t size, i, *dst, *src;
+	struct image_header *hdr = binaries[binary].start;
 	struct process *p = slab_alloc(proc_slab);
 
+	/* The id is the ASID, which mapping pages needs */
+	p->id = pid++;
+
 	/*
 	 * Allocate a kernel stack.
 	 */
 	p->kstack = kmem_get_pages(PAGE_SIZE, 0) + PAGE_SIZE;
 
-	/*
-	 * Determine the size of the "process image" rounded to a whole page
-	 */
-	size = (
-	        /* subtract start from end */
-	        (uint32_t)binaries[binary].end -
-	        (uint32_t)binaries[binary].start
-	        /* object file doesn't include stack space, so we assume 8 bytes
-	         * of alignment and a page of stack */
-	        + PAGE_SIZE + 8);
-	size = ((size >> PAGE_BITS) + 1) << PAGE_BITS;
-
 	/*
 	 * Create an allocator for the user virtual memory space
 	 */
@@ -99,48 +129,95 @@ struct process *create_process(uint32_t binary)
 	 */
 	p->first = kmem_get_pages(0x4000, 14);
 	p->ttbr0 = kvtop(p->first);
-	for (i = 0; i < 0x2000; i++) /* one day I'll implement memset() */
-		p->first[i] = 0;
+	memset(p->first, 0, 0x4000);
 
 	/*
-	 * Allocate physical memory for the process image, and map it
-	 * temporarily into kernel memory.
+	 * Reserve the address space for the image, including the bss and stack
+	 * which aren't part of the image file.
 	 */
-	p->image = kmem_get_pages(size, 0);
-
-	/*
-	 * Copy the "process image" over.
-	 */
-	dst = (uint32_t *)p->image;
-	src = (uint32_t *)binaries[binary].start;
-	for (i = 0; i < (size / 4); i++) {
-		dst[i] = src[i];
-		DCCMVAU(&dst[i]);
-	}
-
-	mark_alloc(p->vmem_allocator, 0x40000000, size);
-	umem_map_pages(p, 0x40000000, kvtop(p->image), size, UMEM_RW);
+	p->binary = binary;
+	p->size = hdr->image_end - USER_IMAGE_START;
+	mark_alloc(p->vmem_allocator, USER_IMAGE_START, p->size);
+	vdso_map(p);
 
 	/*
 	 * Set up some process variables
 	 */
 	memset(&p->context, 0, sizeof(struct ctx));
 	p->context.spsr = ARM_MODE_USER;
-	p->context.ret = 0x40000000; /* jump to process img */
-	p->id = pid++;
-	p->size = size;
-	list_insert(&process_list, &p->list);
-	p->flags.pr_ready = 1;
+	p->context.ret = USER_IMAGE_START; /* jump to process img */
+	p->flags.pr_ready = 0;
 	p->flags.pr_kernel = 0;
+	p->nice = 0;
 
-	INIT_LIST_HEAD(p->sockets);
-	p->max_fildes = 0;
+	fd_table_init(p);
 
 	wait_list_init(&p->endlist);
 
+	list_insert(&process_list, &p->list);
+	proc_wake(p);
 	return p;
 }
 
+/**
+ * Map in the page of a process's image at addr, after a fault. Pages are mapped
+ * as they are first used:
+ *
+ * - Text (and rodata) pages are mapped read-only, straight from the kernel's
+ *   copy of the image, so every process running the image shares them.
+ * - Data pages are shared the same way until they are written, and then the
+ *   process gets its own copy (copy-on-write).
+ * - Pages past the end of the image file (the bss and stack) are zeroed.
+ *
+ * Returns 0 if the access may be retried, -EACCES if it's a real fault, or
+ * -ENOMEM if there was no memory to map the page.
+ */
+int image_fault(struct process *p, uint32_t addr, bool write)
+{
+	struct static_binary *bin;
+	struct image_header *hdr;
+	uint32_t off, page;
+	void *kpage;
+
+	if (!p || p->flags.pr_kernel || addr < USER_IMAGE_START)
+		return -EACCES;
+	page = addr & ~(PAGE_SIZE - 1);
+	off = page - USER_IMAGE_START;
+	if (off >= p->size)
+		return -EACCES;
+	/* Only a missing page, or a write to a shared one, is our business */
+	if (umem_writable(p, (void *)addr) ||
+	    (!write && umem_lookup_phys(p, (void *)addr)))
+		return -EACCES;
+
+	bin = &binaries[p->binary];
+	hdr = bin->start;
+	if (page < hdr->code_end && write)
+		return -EACCES;
+
+	if (page < hdr->code_end || (off < bin->end - bin->start && !write)) {
+		image_stats.shared++;
+		return umem_map_pages(p, page, kvtop(bin->start + off),
+		                      PAGE_SIZE, UMEM_RO);
+	}
+
+	kpage = kmem_get_page();
+	if (!kpage)
+		return -ENOMEM;
+	if (off < bin->end - bin->start) {
+		image_stats.copied++;
+		memcpy(kpage, bin->start + off, PAGE_SIZE);
+	} else {
+		image_stats.zeroed++;
+		memset(kpage, 0, PAGE_SIZE);
+	}
+	if (umem_map_pages(p, page, kvtop(kpage), PAGE_SIZE, UMEM_RW) < 0) {
+		kmem_free_page(kpage);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
 /**
  * Create a kernel thread! This thread cannot be started with start_process(),
  * but may be context-switched in.
@@ -150,8 +227,9 @@ struct process *create_kthread(void (*func)(void *), void *arg)
 	struct process *p = slab_alloc(proc_slab);
 	p->id = pid++;
 	p->size = 0;
-	p->flags.pr_ready = 1;
+	p->flags.pr_ready = 0; /* until kthread_start() */
 	p->flags.pr_kernel = 1;
+	p->nice = 0;
 	p->kstack = (void *)kmem_get_pages(4096, 0) + 4096;
 
 	/* kthread is in kernel memory space, no user memory region */
@@ -160,8 +238,10 @@ struct process *create_kthread(void (*func)(void *), void *arg)
 	p->first = NULL;
 	p->shadow = NULL;
 
-	INIT_LIST_HEAD(p->sockets);
-	p->max_fildes = 0;
+	/* kthreads have no file descriptors */
+	p->files = NULL;
+	p->nfiles = 0;
+	p->fd_next = 0;
 
 	memset(&p->context, 0, sizeof(struct ctx));
 	p->context.spsr = (uint32_t)ARM_MODE_SYS;
@@ -173,31 +253,43 @@ struct process *create_kthread(void (*func)(void *), void *arg)
 	return p;
 }
 
+/**
+ * Add a kernel thread to the process list and let it run.
+ */
+void kthread_start(struct process *p)
+{
+	list_insert(&process_list, &p->list);
+	proc_wake(p);
+}
+
 void destroy_current_process()
 {
-	struct socket *sock;
 	// printf("[kernel]\t\tdestroy process %u (p=0x%x)\n", proc->id, proc);
+
+	/*
+	 * Close files first: closing may sleep (e.g. flushing the block cache),
+	 * which needs the process still runnable, its address space intact,
+	 * and nothing below underway.
+	 */
+	fd_table_destroy(current);
+
 	preempt_disable();
 
 	/*
 	 * Remove from the global process list
 	 */
 	list_remove(&current->list);
+	proc_block(current);
 
 	if (!current->flags.pr_kernel) {
-		/*
-		 * Free the process image's physical memory (it's not mapped
-		 * anywhere except for the process's virtual address space)
-		 */
-		kmem_free_pages(current->image, current->size);
-
 		/*
 		 * Free the process's virtual memory allocator.
 		 */
 		kmem_free_pages(current->vmem_allocator, 0x1000);
 
 		/*
-		 * Find any second-level page tables, and free them too!
+		 * Find any second-level page tables, and free them too! This
+		 * also frees the image pages the process copied or zeroed.
 		 */
 		umem_cleanup(current);
 
@@ -208,11 +300,6 @@ void destroy_current_process()
 	} else {
 	}
 
-	list_for_each_entry(sock, &current->sockets, sockets)
-	{
-		socket_destroy(sock);
-	}
-
 	wait_list_awaken(&current->endlist);
 	wait_list_destroy(&current->endlist);
 
@@ -279,56 +366,135 @@ void __nopreempt context_switch(struct process *new_process)
 	resctx(0, &current->context);
 }
 
-struct process *choose_new_process(void)
+static inline unsigned int proc_prio(struct process *p)
 {
-	struct process *iter, *chosen = NULL;
-	int count_seen = 0, count_ready = 0;
+	return p->nice - NICE_MIN;
+}
 
-	list_for_each_entry(iter, &process_list, list)
-	{
-		count_seen++;
-		if (iter->flags.pr_ready) {
-			count_ready++;
-			if (iter != current) {
-				chosen = iter;
-				break;
-			}
-		}
+/* runq_lock must be held for the runq_*() helpers */
+static void runq_add(struct process *p)
+{
+	unsigned int prio = proc_prio(p);
+
+	list_insert_end(&runq[prio], &p->runq);
+	runq_bitmap[prio / 32] |= 1u << (prio % 32);
+	nr_ready++;
+}
+
+static void runq_del(struct process *p)
+{
+	unsigned int prio = proc_prio(p);
+
+	list_remove(&p->runq);
+	if (list_empty(&runq[prio]))
+		runq_bitmap[prio / 32] &= ~(1u << (prio % 32));
+	nr_ready--;
+}
+
+static struct process *runq_first(void)
+{
+	unsigned int i, prio;
+
+	for (i = 0; i < RUNQ_WORDS; i++) {
+		if (!runq_bitmap[i])
+			continue;
+		prio = i * 32 + __builtin_ctz(runq_bitmap[i]);
+		return container_of(runq[prio].next, struct process, runq);
 	}
+	return NULL;
+}
 
-	if (chosen) {
-		/*
-		 * A new process is chosen, move it to the end to give other
-		 * processes a chance (round robin scheduler).
-		 */
-		list_remove(&chosen->list);
-		list_insert_end(&process_list, &chosen->list);
+/* The number of ready processes, including the current one if it is ready */
+unsigned int sched_nr_ready(void)
+{
+	return nr_ready;
+}
 
-		return chosen;
-	} else if (current && current->flags.pr_ready) {
-		/*
-		 * There are no other options, but the current process still
-		 * exists and is still runnable. Just keep running it.
-		 */
-		return current;
+void proc_wake(struct process *p)
+{
+	int flags;
+	bool woke = false;
+
+	spin_acquire_irqsave(&runq_lock, &flags);
+	if (!p->flags.pr_ready) {
+		p->flags.pr_ready = 1;
+		runq_add(p);
+		woke = true;
+	}
+	spin_release_irqrestore(&runq_lock, &flags);
+	if (woke)
+		timer_restart_tick();
+}
+
+void proc_block(struct process *p)
+{
+	int flags;
+
+	spin_acquire_irqsave(&runq_lock, &flags);
+	if (p->flags.pr_ready) {
+		p->flags.pr_ready = 0;
+		runq_del(p);
+	}
+	spin_release_irqrestore(&runq_lock, &flags);
+}
+
+/*
+ * Set a process's nice value, clamped to NICE_MIN..NICE_MAX, and return it.
+ */
+int proc_set_nice(struct process *p, int nice)
+{
+	int flags;
+
+	nice = max(NICE_MIN, min(nice, NICE_MAX));
+	spin_acquire_irqsave(&runq_lock, &flags);
+	if (p->flags.pr_ready) {
+		runq_del(p);
+		p->nice = nice;
+		runq_add(p);
 	} else {
-		/*
-		 * At this point, either there is no process available at all,
-		 * or no process is ready. We'll use the IDLE process, which is
-		 * always marked as not ready, but in reality we can always
-		 * idle a bit.
-		 */
-		static bool warned = false;
-		if (count_seen == 0 && !warned) {
-			puts("[kernel] WARNING: no more processes remain, "
-			     "dropping into kernel shell\n");
-			warned = true;
-			chosen = create_kthread(ksh, KSH_BLOCK);
-			list_insert(&process_list, &chosen->list);
-			return chosen;
-		}
-		return idle_process;
+		p->nice = nice;
 	}
+	spin_release_irqrestore(&runq_lock, &flags);
+	return nice;
+}
+
+/*
+ * Return the first process of the highest priority run queue. The current
+ * process goes to the back of its queue first, so processes of equal priority
+ * take turns (round robin). Lower priorities only run while every higher one
+ * is blocked.
+ */
+struct process *choose_new_process(void)
+{
+	static bool warned = false;
+	struct process *chosen;
+	int flags;
+
+	spin_acquire_irqsave(&runq_lock, &flags);
+	if (current && current->flags.pr_ready) {
+		runq_del(current);
+		runq_add(current);
+	}
+	chosen = runq_first();
+	spin_release_irqrestore(&runq_lock, &flags);
+
+	if (chosen)
+		return chosen;
+
+	/*
+	 * At this point, either there is no process available at all, or no
+	 * process is ready. We'll use the IDLE process, which is never ready,
+	 * but in reality we can always idle a bit.
+	 */
+	if (list_empty(&process_list) && !warned) {
+		puts("[kernel] WARNING: no more processes remain, "
+		     "dropping into kernel shell\n");
+		warned = true;
+		chosen = create_kthread(ksh, KSH_BLOCK);
+		kthread_start(chosen);
+		return chosen;
+	}
+	return idle_process;
 }
 
 void irq_schedule(struct ctx *ctx)
@@ -398,9 +564,11 @@ static int cmd_mkproc(int argc, char **argv)
 static int cmd_lsproc(int argc, char **argv)
 {
 	struct process *p;
+	puts("pid\tnice\tready\n");
 	list_for_each_entry(p, &process_list, list)
 	{
-		printf("%u\n", p->id);
+		printf("%u\t%d\t%s\n", p->id, p->nice,
+		       p->flags.pr_ready ? "yes" : "no");
 	}
 	return 0;
 }
@@ -433,13 +601,27 @@ static int cmd_execproc(int argc, char **argv)
 	return 0;
 }
 
+static int cmd_pages(int argc, char **argv)
+{
+	printf("shared: %u, copied: %u, zeroed: %u\n", image_stats.shared,
+	       image_stats.copied, image_stats.zeroed);
+	return 0;
+}
+
 struct ksh_cmd proc_ksh_cmds[] = {
 	KSH_CMD("create", cmd_mkproc, "create new process given binary image"),
 	KSH_CMD("ls", cmd_lsproc, "list process IDs"),
 	KSH_CMD("exec", cmd_execproc, "run process"),
+	KSH_CMD("pages", cmd_pages, "count image pages mapped on fault"),
 	{ 0 },
 };
 
+/*
+ * The tick may be stopped while idle, so rather than waiting for it, switch
+ * to a process as soon as an interrupt makes one ready. Interrupts are masked
+ * between checking and waiting, so a wakeup can't slip in between: a pending
+ * interrupt still ends the wfi.
+ */
 static void idle(void *arg)
 {
 	while (1) {
@@ -449,7 +631,12 @@ static void idle(void *arg)
 		cpsr = get_cpsr();
 		if ((cpsr & ARM_MODE_MASK) != ARM_MODE_SYS)
 			printf("ERROR: idling in non-sys mode. CPSR=0x%x\n", cpsr);
-		asm("wfi");
+		interrupt_disable();
+		if (!sched_nr_ready())
+			asm("wfi");
+		interrupt_enable();
+		if (sched_nr_ready())
+			schedule();
 	}
 }
 
@@ -458,8 +645,13 @@ static void idle(void *arg)
  */
 void process_init(void)
 {
+	int i;
+
 	INIT_LIST_HEAD(process_list);
-	proc_slab = slab_new("process", sizeof(struct process), kmem_get_page);
+	for (i = 0; i < NR_PRIO; i++)
+		INIT_LIST_HEAD(runq[i]);
+	proc_slab = slab_new("process", sizeof(struct process), kmem_get_page,
+	                     kmem_free_page);
+	/* the idle process is never started, so it is never ready */
 	idle_process = create_kthread(idle, NULL);
-	idle_process->flags.pr_ready = 0; /* idle process is never ready */
 }
@@ -1,37 +1,61 @@
 .section .data
 
+/*
+ * Each image starts on a page, and is padded to a whole page with zeroes, so
+ * that processes can map the pages directly (see image_fault()).
+ */
+
 .global process_salutations_start
 .type process_salutations_start,object
 .global process_salutations_end
 .type process_salutations_end,object
 
-	.align 4
+	.balign 4096
 process_salutations_start:
 	.incbin "user/salutations.bin"
-	.align 4
+	.balign 4096
 process_salutations_end:
-	nop
 
 .global process_hello_start
 .type process_hello_start,object
 .global process_hello_end
 .type process_hello_end,object
 
-	.align 4
+	.balign 4096
 process_hello_start:
 	.incbin "user/hello.bin"
-	.align 4
+	.balign 4096
 process_hello_end:
-	nop
 
 .global process_ush_start
 .type process_ush_start,object
 .global process_ush_end
 .type process_ush_end,object
 
-	.align 4
+	.balign 4096
 process_ush_start:
 	.incbin "user/ush.bin"
-	.align 4
+	.balign 4096
 process_ush_end:
-	nop
+
+.global process_timebench_start
+.type process_timebench_start,object
+.global process_timebench_end
+.type process_timebench_end,object
+
+	.balign 4096
+process_timebench_start:
+	.incbin "user/timebench.bin"
+	.balign 4096
+process_timebench_end:
+
+.global process_true_start
+.type process_true_start,object
+.global process_true_end
+.type process_true_end,object
+
+	.balign 4096
+process_true_start:
+	.incbin "user/true.bin"
+	.balign 4096
+process_true_end:
@@ -1,8 +1,11 @@
 #include "socket.h"
+#include "fs.h"
 #include "kernel.h"
 #include "slab.h"
 #include "string.h"
 #include "mm.h"
+#include "sys/poll.h"
+#include "time.h"
 
 struct slab *socket_slab;
 
@@ -19,11 +22,39 @@ static struct sockops *lookup_proto(int protocol)
 	return NULL;
 }
 
+/* sockets are kept behind a struct file, so they share the fd table */
+#define file_sock(f) (*(struct socket **)(f)->priv)
+
+static int socket_file_close(struct file *f)
+{
+	socket_destroy(file_sock(f));
+	fs_free_file(f);
+	return 0;
+}
+
+static int socket_file_poll(struct file *f, struct poll_table *pt)
+{
+	struct socket *sock = file_sock(f);
+
+	if (!sock->ops->poll)
+		return POLLNVAL;
+	return sock->ops->poll(sock, pt);
+}
+
+static struct file_ops socket_file_ops = {
+	.close = socket_file_close,
+	.poll = socket_file_poll,
+};
+
 int socket_socket(int domain, int type, int protocol)
 {
 	struct socket *sock;
 	struct sockops *ops;
+	struct file *f;
+	bool nonblock = type & SOCK_NONBLOCK;
+	int fd;
 
+	type &= ~SOCK_NONBLOCK;
 	if (domain != AF_INET)
 		return -EAFNOSUPPORT;
 
@@ -39,14 +70,24 @@ int socket_socket(int domain, int type, int protocol)
 
 	sock = slab_alloc(socket_slab);
 	memset(sock, 0, sizeof(struct socket));
-	current->max_fildes++;
-	sock->fildes = current->max_fildes;
 	sock->proc = current;
 	sock->ops = ops;
-	list_insert_end(&current->sockets, &sock->sockets);
+	sock->flags.sk_nonblock = nonblock;
 	INIT_LIST_HEAD(sock->recvq);
 	wait_list_init(&sock->recvwait);
-	return sock->fildes;
+	sock->rcvbuf = SOCK_RCVBUF_DEFAULT;
+
+	f = fs_alloc_file();
+	f->ops = &socket_file_ops;
+	f->flags = O_RDWR;
+	file_sock(f) = sock;
+	fd = fd_install(current, f);
+	if (fd < 0) {
+		socket_file_close(f);
+		return fd;
+	}
+	sock->fildes = fd;
+	return fd;
 }
 
 void socket_register_proto(struct sockops *ops)
@@ -56,27 +97,77 @@ void socket_register_proto(struct sockops *ops)
 
 void socket_destroy(struct socket *sock)
 {
-	struct packet *pkt;
+	struct packet *pkt, *next;
+	if (sock->ops->close)
+		sock->ops->close(sock);
 	wait_list_destroy(&sock->recvwait);
-	list_for_each_entry(pkt, &sock->recvq, list)
+	list_for_each_entry_safe(pkt, next, &sock->recvq, list)
 	{
 		packet_free(pkt);
 	}
 	slab_free(socket_slab, sock);
 }
 
+/* Return the socket behind a file, or NULL if it is some other file. */
+struct socket *socket_from_file(struct file *f)
+{
+	if (!f || f->ops != &socket_file_ops)
+		return NULL;
+	return file_sock(f);
+}
+
 struct socket *socket_get_by_fd(struct process *proc, int fd)
 {
-	struct socket *sk;
-	list_for_each_entry(sk, &proc->sockets, sockets)
-	{
-		if (sk->fildes == fd)
-			return sk;
+	return socket_from_file(fd_get(proc, fd));
+}
+
+static int socket_setsockopt_int(const void *optval, socklen_t optlen,
+                                 int *val)
+{
+	if (optlen != sizeof(int))
+		return -EINVAL;
+	return copy_from_user(val, optval, sizeof(int));
+}
+
+int socket_setsockopt(struct socket *sock, const struct sockopt_args *args)
+{
+	struct timeval tv;
+	int rv, val;
+
+	if (args->level != SOL_SOCKET) {
+		if (!sock->ops->setsockopt)
+			return -ENOPROTOOPT;
+		return sock->ops->setsockopt(sock, args->level, args->optname,
+		                             args->optval, args->optlen);
+	}
+
+	switch (args->optname) {
+	case SO_RCVBUF:
+		rv = socket_setsockopt_int(args->optval, args->optlen, &val);
+		if (rv < 0)
+			return rv;
+		if (val < 0)
+			return -EINVAL;
+		sock->rcvbuf = max(SOCK_RCVBUF_MIN, min(val, SOCK_RCVBUF_MAX));
+		return 0;
+	case SO_RCVTIMEO:
+		if (args->optlen != sizeof(struct timeval))
+			return -EINVAL;
+		rv = copy_from_user(&tv, args->optval, sizeof(tv));
+		if (rv < 0)
+			return rv;
+		if (tv.tv_sec < 0 || tv.tv_usec < 0 || tv.tv_usec >= 1000000)
+			return -EINVAL;
+		sock->rcvtimeo =
+		        timer_ts_to_count(tv.tv_sec, tv.tv_usec * 1000);
+		return 0;
+	default:
+		return -ENOPROTOOPT;
 	}
-	return NULL;
 }
 
 void socket_init(void)
 {
-	socket_slab = slab_new("socket", sizeof(struct socket), kmem_get_page);
+	socket_slab = slab_new("socket", sizeof(struct socket), kmem_get_page,
+	                       kmem_free_page);
 }
@@ -9,6 +9,7 @@
 #include "sys/socket.h"
 #include "wait.h"
 
+struct file;
 struct socket;
 
 struct sockops {
@@ -20,7 +21,14 @@ struct sockops {
 	            int flags);
 	int (*recv)(struct socket *socket, void *buffer, size_t length,
 	            int flags);
+	int (*sendmmsg)(struct socket *socket, struct mmsghdr *msgvec,
+	                unsigned int vlen, int flags);
+	int (*recvmmsg)(struct socket *socket, struct mmsghdr *msgvec,
+	                unsigned int vlen, int flags);
 	int (*close)(struct socket *socket);
+	int (*poll)(struct socket *socket, struct poll_table *pt);
+	int (*setsockopt)(struct socket *socket, int level, int optname,
+	                  const void *optval, socklen_t optlen);
 
 	struct list_head list;
 	uint32_t proto;
@@ -29,21 +37,35 @@ struct sockops {
 struct socket {
 	int fildes;
 	struct process *proc;
-	struct list_head sockets;
 	struct sockops *ops;
 	struct {
 		int sk_bound : 1;
 		int sk_connected : 1;
 		int sk_open : 1;
+		int sk_nonblock : 1; /* SOCK_NONBLOCK: never wait to receive */
 	} flags;
 	struct sockaddr_in src;
 	struct sockaddr_in dst;
 	struct list_head recvq;
 	struct waitlist recvwait;
+	uint32_t rcvbuf;     /* SO_RCVBUF: limit for rcvq_bytes */
+	uint32_t rcvq_bytes; /* buffer space used by packets in recvq */
+	uint32_t rcv_drops;  /* packets dropped because recvq was full */
+	uint64_t rcvtimeo;   /* SO_RCVTIMEO in timer counts, or 0 for none */
 };
 
+/*
+ * Receive queues are charged the whole buffer size of each packet, not just
+ * the payload. The default holds about as many packets as the receive ring.
+ */
+#define SOCK_RCVBUF_DEFAULT (256 * PACKET_SIZE)
+#define SOCK_RCVBUF_MIN     (2 * PACKET_SIZE)
+#define SOCK_RCVBUF_MAX     (4096 * PACKET_SIZE)
+
 int socket_socket(int domain, int type, int protocol);
 void socket_register_proto(struct sockops *ops);
 void socket_destroy(struct socket *sock);
+struct socket *socket_from_file(struct file *f);
 struct socket *socket_get_by_fd(struct process *proc, int fd);
+int socket_setsockopt(struct socket *sock, const struct sockopt_args *args);
 void socket_init(void);
@@ -5,8 +5,11 @@
  * entry.s. They shouldn't be called by external code anyway.
  */
 #include "cxtk.h"
+#include "fs.h"
 #include "kernel.h"
 #include "socket.h"
+#include "time.h"
+#include "unistd.h"
 
 void sys_relinquish(void)
 {
@@ -170,6 +173,253 @@ out:
 	return rv;
 }
 
+int sys_sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+                 int flags)
+{
+	int rv;
+	struct socket *sk;
+	cxtk_track_syscall();
+
+	sk = socket_get_by_fd(current, sockfd);
+	if (!sk) {
+		rv = -EBADF;
+		goto out;
+	}
+
+	if (!sk->ops->sendmmsg) {
+		rv = -EOPNOTSUPP;
+		goto out;
+	}
+
+	rv = sk->ops->sendmmsg(sk, msgvec, min(vlen, MMSG_MAX), flags);
+out:
+	cxtk_track_syscall_return();
+	return rv;
+}
+
+int sys_recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+                 int flags)
+{
+	int rv;
+	struct socket *sk;
+	cxtk_track_syscall();
+
+	sk = socket_get_by_fd(current, sockfd);
+	if (!sk) {
+		rv = -EBADF;
+		goto out;
+	}
+
+	if (!sk->ops->recvmmsg) {
+		rv = -EOPNOTSUPP;
+		goto out;
+	}
+
+	rv = sk->ops->recvmmsg(sk, msgvec, min(vlen, MMSG_MAX), flags);
+out:
+	cxtk_track_syscall_return();
+	return rv;
+}
+
+int sys_setsockopt(int sockfd, const struct sockopt_args *uargs)
+{
+	int rv;
+	struct socket *sk;
+	struct sockopt_args args;
+	cxtk_track_syscall();
+
+	sk = socket_get_by_fd(current, sockfd);
+	if (!sk) {
+		rv = -EBADF;
+		goto out;
+	}
+
+	rv = copy_from_user(&args, uargs, sizeof(args));
+	if (rv < 0)
+		goto out;
+
+	rv = socket_setsockopt(sk, &args);
+out:
+	cxtk_track_syscall_return();
+	return rv;
+}
+
+int sys_close(int fd)
+{
+	int rv;
+	cxtk_track_syscall();
+	rv = fd_close(current, fd);
+	cxtk_track_syscall_return();
+	return rv;
+}
+
+int sys_open(const char *upath, int flags)
+{
+	int rv;
+	char *path;
+	struct fs_node *node;
+	struct file *f;
+	cxtk_track_syscall();
+
+	path = kmalloc(PATH_MAX);
+	rv = copy_string_from_user(path, upath, PATH_MAX);
+	if (rv < 0)
+		goto out;
+
+	rv = fs_resolve(path, &node);
+	if (rv < 0)
+		goto out;
+
+	if (node->type != FSN_FILE) {
+		rv = -EISDIR;
+		goto out;
+	}
+
+	f = node->fs->fs_ops->fs_open(node, flags);
+	rv = fd_install(current, f);
+	if (rv < 0)
+		file_put(f);
+out:
+	kfree(path, PATH_MAX);
+	cxtk_track_syscall_return();
+	return rv;
+}
+
+/*
+ * File operations take kernel buffers, so read() and write() go through a
+ * bounce buffer, and may transfer less than was asked for. Sockets already
+ * copy to and from user space themselves.
+ */
+#define SYS_IO_MAX 4096
+
+int sys_read(int fd, void *buffer, size_t length)
+{
+	int rv;
+	struct file *f;
+	struct socket *sk;
+	void *kbuf;
+	cxtk_track_syscall();
+
+	f = fd_get(current, fd);
+	if (!f || !(f->flags & O_READ)) {
+		rv = -EBADF;
+		goto out;
+	}
+
+	sk = socket_from_file(f);
+	if (sk) {
+		rv = sk->ops->recv ? sk->ops->recv(sk, buffer, length, 0)
+		                   : -EOPNOTSUPP;
+		goto out;
+	}
+
+	length = min(length, SYS_IO_MAX);
+	kbuf = kmalloc(length);
+	rv = f->ops->read(f, kbuf, length);
+	if (rv > 0) {
+		int err = copy_to_user(buffer, kbuf, rv);
+		if (err < 0)
+			rv = err;
+	}
+	kfree(kbuf, length);
+out:
+	cxtk_track_syscall_return();
+	return rv;
+}
+
+int sys_write(int fd, const void *buffer, size_t length)
+{
+	int rv;
+	struct file *f;
+	struct socket *sk;
+	void *kbuf;
+	cxtk_track_syscall();
+
+	f = fd_get(current, fd);
+	if (!f || !(f->flags & O_WRITE)) {
+		rv = -EBADF;
+		goto out;
+	}
+
+	sk = socket_from_file(f);
+	if (sk) {
+		rv = sk->ops->send ? sk->ops->send(sk, buffer, length, 0)
+		                   : -EOPNOTSUPP;
+		goto out;
+	}
+
+	length = min(length, SYS_IO_MAX);
+	kbuf = kmalloc(length);
+	rv = copy_from_user(kbuf, buffer, length);
+	if (rv == 0)
+		rv = f->ops->write(f, kbuf, length);
+	kfree(kbuf, length);
+out:
+	cxtk_track_syscall_return();
+	return rv;
+}
+
+/*
+ * Add inc to the nice value of the current process, and return the new value.
+ * Scheduling is strict priority, so a user process below the default of 0
+ * would starve the shell and kernel threads: user space may lower its own
+ * priority, but never raise it past the default. inc is clamped first so the
+ * sum cannot overflow.
+ */
+int sys_nice(int inc)
+{
+	int rv;
+	cxtk_track_syscall();
+	inc = max(NICE_MIN - NICE_MAX, min(inc, NICE_MAX - NICE_MIN));
+	rv = proc_set_nice(current, max(current->nice + inc, 0));
+	cxtk_track_syscall_return();
+	return rv;
+}
+
+/*
+ * There are no signals to interrupt a sleep, so rem is never written.
+ */
+int sys_nanosleep(const struct timespec *ureq, struct timespec *rem)
+{
+	struct timespec req;
+	uint64_t start = timer_get_count();
+	int rv;
+	cxtk_track_syscall();
+
+	rv = copy_from_user(&req, ureq, sizeof(req));
+	if (rv < 0)
+		goto out;
+	if (req.tv_sec < 0 || req.tv_nsec < 0 || req.tv_nsec >= 1000000000) {
+		rv = -EINVAL;
+		goto out;
+	}
+	timer_sleep_until(start + timer_ts_to_count(req.tv_sec, req.tv_nsec));
+out:
+	cxtk_track_syscall_return();
+	return rv;
+}
+
+/*
+ * Only CLOCK_MONOTONIC exists. User space normally reads it through the vDSO
+ * page instead, which gives the same result without a system call.
+ */
+int sys_clock_gettime(clockid_t clk, struct timespec *uts)
+{
+	struct timespec ts;
+	int rv;
+	cxtk_track_syscall();
+
+	if (clk != CLOCK_MONOTONIC) {
+		rv = -EINVAL;
+		goto out;
+	}
+	timer_get_monotonic(&ts);
+	rv = copy_to_user(uts, &ts, sizeof(ts));
+out:
+	cxtk_track_syscall_return();
+	return rv;
+}
+
 void sys_unknown(uint32_t svc_num)
 {
 	cxtk_track_syscall();
@@ -4,6 +4,7 @@
 #include "gic.h"
 #include "kernel.h"
 #include "ksh.h"
+#include "string.h"
 
 #include "arm-mailbox.h"
 #include "config.h"
@@ -26,6 +27,9 @@
 
 #define HZ 100
 
+/* Longest the tick may be stopped when nothing needs it: 10 seconds */
+#define NOHZ_MAX_TICKS (10 * HZ)
+
 static int cmd_timer_get_freq(int argc, char **argv)
 {
 	uint32_t dst;
@@ -50,24 +54,198 @@ static int cmd_timer_get_ctl(int argc, char **argv)
 	return 0;
 }
 
+uint64_t timer_get_count(void)
+{
+	uint32_t lo, hi;
+	GET_CNTPCT(lo, hi);
+	return ((uint64_t)hi << 32) | lo;
+}
+
+uint32_t timer_get_freq(void)
+{
+	uint32_t freq;
+	GET_CNTFRQ(freq);
+	return freq;
+}
+
+/*
+ * Conversions between time and timer counts. These avoid 64-bit division,
+ * at the cost of ignoring any fraction of a count per millisecond.
+ */
+uint64_t timer_ms_to_count(uint32_t ms)
+{
+	return (uint64_t)ms * (timer_get_freq() / 1000);
+}
+
+uint64_t timer_ts_to_count(uint32_t sec, uint32_t nsec)
+{
+	uint32_t freq = timer_get_freq();
+	uint32_t usec = nsec / 1000;
+
+	return (uint64_t)sec * freq + timer_ms_to_count(usec / 1000) +
+	       (usec % 1000) * (freq / 1000) / 1000;
+}
+
+uint32_t timer_count_to_us(uint32_t count)
+{
+	uint32_t per_ms = timer_get_freq() / 1000;
+
+	return count / per_ms * 1000 + count % per_ms * 1000 / per_ms;
+}
+
+static uint32_t timer_count = 0;
+
+/*
+ * Dynamic ticks: the timer is programmed one-shot (with the absolute compare
+ * value, CVAL) for the next deadline. While more than one process is ready,
+ * that is the end of the current time slice. Otherwise, nobody needs to be
+ * preempted, so the periodic tick is stopped and the timer only fires for the
+ * next hrtimer, or after NOHZ_MAX_TICKS. Ticks which were skipped are still
+ * counted in timer_count, by the next interrupt.
+ *
+ * tick_lock protects the tick state. It may be taken with hrtimer_lock held,
+ * but not the other way around.
+ */
+static uint32_t tick_cycles; /* timer counts per tick */
+static uint64_t last_tick;   /* timer count when timer_count last ticked */
+static uint64_t next_event;  /* what the timer is programmed for */
+static bool tick_stopped;
+static bool nohz_enabled = true;
+static DECLARE_SPINSEM(tick_lock, 1);
+
+static struct {
+	uint32_t interrupts; /* timer interrupts taken */
+	uint32_t stopped;    /* times the periodic tick was stopped */
+	uint32_t restarted;  /* times a wakeup restarted the tick */
+} tick_stats;
+
+static void tick_write(uint64_t when)
+{
+	uint32_t lo = when, hi = when >> 32;
+
+	next_event = when;
+	SET_CNTP_CVAL(lo, hi);
+}
+
+/*
+ * Make sure the timer fires no later than when. A time in the past fires
+ * immediately.
+ */
+void timer_set_event(uint64_t when)
+{
+	int flags;
+
+	spin_acquire_irqsave(&tick_lock, &flags);
+	if (tick_cycles && when < next_event)
+		tick_write(when);
+	spin_release_irqrestore(&tick_lock, &flags);
+}
+
+/*
+ * Called when a process becomes ready. If that makes more than one ready
+ * process, they need a time slice, so restart the tick if it is stopped.
+ */
+void timer_restart_tick(void)
+{
+	int flags;
+
+	spin_acquire_irqsave(&tick_lock, &flags);
+	if (tick_stopped && sched_nr_ready() > 1) {
+		tick_stopped = false;
+		tick_stats.restarted++;
+		/* possibly in the past, which catches up immediately */
+		if (last_tick + tick_cycles < next_event)
+			tick_write(last_tick + tick_cycles);
+	}
+	spin_release_irqrestore(&tick_lock, &flags);
+}
+
+/*
+ * Count the ticks which have passed since last_tick, and program the next
+ * event. Only called from the timer interrupt or before it is enabled.
+ */
+static void tick_program(uint64_t now)
+{
+	uint64_t next, delta, expires;
+	uint32_t ticks;
+
+	_spin_acquire(&tick_lock);
+	while (now - last_tick >= tick_cycles) {
+		/* avoid 64-bit division: we are rarely more than 10s behind */
+		delta = min(now - last_tick, 0xFFFFFFFFULL);
+		ticks = (uint32_t)delta / tick_cycles;
+		timer_count += ticks;
+		last_tick += (uint64_t)ticks * tick_cycles;
+	}
+
+	if (nohz_enabled && sched_nr_ready() <= 1) {
+		if (!tick_stopped)
+			tick_stats.stopped++;
+		tick_stopped = true;
+		next = last_tick + (uint64_t)NOHZ_MAX_TICKS * tick_cycles;
+	} else {
+		tick_stopped = false;
+		next = last_tick + tick_cycles;
+	}
+	_spin_release(&tick_lock);
+
+	/* hrtimers fire on time, rather than at the following tick */
+	if (hrtimer_next(&expires))
+		next = min(next, expires);
+	_spin_acquire(&tick_lock);
+	tick_write(next);
+	_spin_release(&tick_lock);
+}
+
+static int cmd_timer_stats(int argc, char **argv)
+{
+	uint32_t secs = timer_count / HZ;
+
+	printf("ticks: %u (%u seconds)\n", timer_count, secs);
+	printf("interrupts: %u, %u per second\n", tick_stats.interrupts,
+	       tick_stats.interrupts / (secs ? secs : 1));
+	printf("nohz: %s, tick stopped %u times, restarted %u times\n",
+	       nohz_enabled ? "on" : "off", tick_stats.stopped,
+	       tick_stats.restarted);
+	return 0;
+}
+
+static int cmd_timer_nohz(int argc, char **argv)
+{
+	if (argc != 1 ||
+	    (strcmp(argv[0], "on") != 0 && strcmp(argv[0], "off") != 0)) {
+		puts("usage: timer nohz on|off\n");
+		return 1;
+	}
+	/* takes effect at the next timer interrupt */
+	nohz_enabled = strcmp(argv[0], "on") == 0;
+	return 0;
+}
+
 struct ksh_cmd timer_ksh_cmds[] = {
 	KSH_CMD("get-freq", cmd_timer_get_freq, "get timer frequency"),
 	KSH_CMD("get-count", cmd_timer_get_count, "get current timer value"),
 	KSH_CMD("get-ctl", cmd_timer_get_ctl, "get timer ctl register"),
+	KSH_CMD("stats", cmd_timer_stats, "show tick and interrupt counts"),
+	KSH_CMD("nohz", cmd_timer_nohz, "stop the tick when idle (on|off)"),
+	KSH_CMD("hrtimers", hrtimer_cmd_show,
+	        "show the timer queue and expiry lateness"),
 	{ 0 },
 };
 
+static void timer_tick_fallback(uint32_t arg)
+{
+}
+
 void timer_init(void)
 {
 	uint32_t dst;
 
-	/* get timer frequency */
+	/* get timer frequency, and divide it by HZ to get the tick length */
 	GET_CNTFRQ(dst);
-
-	/* Set timer tval to tick at appx HZ per second, by dividing the
-	 * frequency by HZ */
-	dst /= HZ;
-	SET_CNTP_TVAL(dst);
+	tick_cycles = dst / HZ;
+	last_tick = timer_get_count();
+	tick_program(last_tick);
 
 	/* Enable the timer */
 	dst = 1;
@@ -77,28 +255,10 @@ void timer_init(void)
 	gic_enable_interrupt(TIMER_INTID);
 }
 
-static uint32_t timer_count = 0;
-
-
-static void timer_tick_fallback(uint32_t arg)
-{
-}
-
 void timer_isr(uint32_t intid, struct ctx *ctx)
 {
-	uint32_t reg;
-
-	/* Reset timer to go off in another 1/HZ second */
-	GET_CNTFRQ(reg);
-	reg /= HZ;
-	SET_CNTP_TVAL(reg);
-
-	/* Ensure the timer is still on */
-	reg = 1;
-	SET_CNTP_CTL(reg);
-
-	timer_count++;
-	timer_tick(timer_count);
+	tick_stats.interrupts++;
+	hrtimer_run(timer_get_count());
 
 	if (timer_can_reschedule(ctx)) {
 		/* We interrupted sys/user mode. This means we can go ahead and
@@ -106,6 +266,10 @@ void timer_isr(uint32_t intid, struct ctx *ctx)
 		irq_schedule(ctx);
 	}
 
+	/* Count the ticks which passed, and set up the next interrupt */
+	tick_program(timer_get_count());
+	timer_tick(timer_count);
+
 	/* Interrupt should now be safe to clear */
 	gic_end_interrupt(intid);
 }
@@ -1,28 +1,50 @@
 #include "kernel.h"
 #include "net.h"
 #include "socket.h"
+#include "sys/poll.h"
 
+/*
+ * Each bound socket (or kernel thread in udp_wait()) has an entry in the
+ * udp_ports table, keyed by local port. A connected socket also goes in the
+ * udp_conns table, keyed by local port and remote address, and only accepts
+ * packets from its peer. Received packets are matched against udp_conns first,
+ * and then the unconnected entries in udp_ports.
+ */
 struct udp_wait_entry {
-	struct hlist_head list;
+	struct hlist_head list;      /* in udp_ports */
+	struct hlist_head conn_list; /* in udp_conns, if connected */
 	struct socket *sock;
 	struct process *proc;
 	struct packet *rcv;
-	uint16_t port;
+	uint16_t port; /* host byte order */
+	bool connected;
+	uint32_t conn_hash;
 };
 
 #define UDP_HLIST_SIZE 128
-struct hlist_head udp_hlist[UDP_HLIST_SIZE];
+struct hlist_head udp_ports[UDP_HLIST_SIZE];
+struct hlist_head udp_conns[UDP_HLIST_SIZE];
+spinsem_t udp_lock;
 
 static inline uint32_t udp_hash(uint16_t port)
 {
 	return port % UDP_HLIST_SIZE;
 }
 
+/* ports are host order, the remote IP network order */
+static inline uint32_t udp_conn_hash(uint16_t port, uint32_t rip,
+                                     uint16_t rport)
+{
+	uint32_t h = rip ^ (rip >> 16) ^ ((uint32_t)port << 5) ^ rport;
+	return (h ^ (h >> 7)) % UDP_HLIST_SIZE;
+}
+
+/* Must hold udp_lock */
 static struct udp_wait_entry *lookup_entry(uint16_t port)
 {
 	struct udp_wait_entry *entry;
 	uint32_t hash = udp_hash(port);
-	list_for_each_entry(entry, &udp_hlist[hash], list)
+	list_for_each_entry(entry, &udp_ports[hash], list)
 	{
 		if (entry->port == port)
 			return entry;
@@ -31,7 +53,60 @@ static struct udp_wait_entry *lookup_entry(uint16_t port)
 }
 
 /*
- * Wait for a packet to come in on "port".
+ * Find who should receive a packet: the socket connected to its source, or
+ * failing that, an unconnected socket on its port. Must hold udp_lock.
+ */
+static struct udp_wait_entry *udp_demux(struct packet *pkt)
+{
+	struct udp_wait_entry *entry;
+	uint16_t port = ntohs(pkt->udp->dst_port);
+	uint16_t rport = ntohs(pkt->udp->src_port);
+	uint32_t rip = pkt->ip->src;
+	struct socket *sock;
+
+	list_for_each_entry(entry,
+	                    &udp_conns[udp_conn_hash(port, rip, rport)],
+	                    conn_list)
+	{
+		sock = entry->sock;
+		if (entry->port == port && sock->dst.sin_addr.s_addr == rip &&
+		    ntohs(sock->dst.sin_port) == rport &&
+		    (!sock->src.sin_addr.s_addr ||
+		     sock->src.sin_addr.s_addr == pkt->ip->dst))
+			return entry;
+	}
+	list_for_each_entry(entry, &udp_ports[udp_hash(port)], list)
+	{
+		if (entry->port == port && !entry->connected)
+			return entry;
+	}
+	return NULL;
+}
+
+/* Must hold udp_lock */
+static void udp_unhash_conn(struct udp_wait_entry *entry)
+{
+	if (entry->connected) {
+		hlist_remove(&udp_conns[entry->conn_hash], &entry->conn_list);
+		entry->connected = false;
+	}
+}
+
+/* Must hold udp_lock */
+static void udp_hash_conn(struct udp_wait_entry *entry)
+{
+	struct socket *sock = entry->sock;
+
+	udp_unhash_conn(entry);
+	entry->conn_hash = udp_conn_hash(entry->port, sock->dst.sin_addr.s_addr,
+	                                 ntohs(sock->dst.sin_port));
+	hlist_insert(&udp_conns[entry->conn_hash], &entry->conn_list);
+	entry->connected = true;
+}
+
+/*
+ * Wait for a packet to come in on "port", for at most timeout_ms milliseconds
+ * (or forever, if it is zero). Returns NULL on timeout.
  *
  * YOU MUST HAVE ALREADY DISABLED INTERRUPTS BEFORE CALLING THIS FUNCTION.
  *
@@ -40,73 +115,159 @@ static struct udp_wait_entry *lookup_entry(uint16_t port)
  * will trigger this receipt. If interrupts are enabled, the packet could be
  * received and handled BEFORE we have entered our sleep.
  */
-struct packet *udp_wait(uint16_t port)
+struct packet *udp_wait(uint16_t port, uint32_t timeout_ms)
 {
 	struct udp_wait_entry entry;
 	uint32_t hash = udp_hash(port);
+	struct timeout t;
+	int flags;
 
 	entry.sock = NULL;
 	entry.proc = current;
 	entry.port = port;
 	entry.rcv = NULL;
-	hlist_insert(&udp_hlist[hash], &entry.list);
+	entry.connected = false;
+	hlist_insert(&udp_ports[hash], &entry.list);
 
-	current->flags.pr_ready = 0;
+	proc_block(current);
+	if (timeout_ms)
+		timeout_start(&t, timer_get_count() +
+		                          timer_ms_to_count(timeout_ms));
 
 	interrupt_enable();
 	schedule();
+	if (timeout_ms)
+		timeout_cancel(&t);
 
-	hlist_remove(&udp_hlist[hash], &entry.list);
+	spin_acquire_irqsave(&udp_lock, &flags);
+	hlist_remove(&udp_ports[hash], &entry.list);
+	spin_release_irqrestore(&udp_lock, &flags);
 	return entry.rcv;
 }
 
+/**
+ * Start the UDP checksum with the IPv4 pseudo-header.
+ */
+static void udp_csum_pseudo(uint32_t *csum, uint32_t src_ip, uint32_t dst_ip,
+                            uint16_t len)
+{
+	csum_init(csum);
+	csum_add(csum, &src_ip, 2);
+	csum_add(csum, &dst_ip, 2);
+	csum_add_value(csum, htons((uint16_t)IPPROTO_UDP));
+	csum_add(csum, &len, 1);
+}
+
+/**
+ * Return true if the UDP length and checksum are good, or the device already
+ * checked them.
+ */
+static bool udp_csum_ok(struct packet *pkt)
+{
+	uint32_t csum;
+	uint32_t len = ntohs(pkt->udp->len);
+	uint32_t have = packet_chain_len(pkt, pkt->tl);
+
+	/* a chain has no padding, so it must be exactly the UDP length */
+	if (len < sizeof(struct udphdr) || len > have ||
+	    (pkt->frag && len != have))
+		return false;
+	if (pkt->flags & PKT_F_CSUM_VALID) {
+		netstats.csum_trusted++;
+		return true;
+	}
+	if (!pkt->udp->csum)
+		return true; /* the sender did not compute one */
+	udp_csum_pseudo(&csum, pkt->ip->src, pkt->ip->dst, pkt->udp->len);
+	if (pkt->frag)
+		packet_csum_add(&csum, pkt, pkt->tl);
+	else
+		csum_add_bytes(&csum, pkt->udp, len);
+	return csum_finalize(&csum) == 0;
+}
+
 void udp_recv(struct netif *netif, struct packet *pkt)
 {
 	struct udp_wait_entry *entry;
-	uint32_t hash = udp_hash(ntohs(pkt->udp->dst_port));
+	struct socket *sock;
+	uint32_t size;
+	int flags;
+
 	/*printf("udp_recv src=%u dst=%u\n", ntohs(pkt->udp->src_port),
 	       ntohs(pkt->udp->dst_port));*/
 	pkt->al = pkt->tl + sizeof(struct udphdr);
-	list_for_each_entry(entry, &udp_hlist[hash], list)
-	{
-		if (entry->sock) {
-			/* TODO: socket may not be connected to this endpoint,
-			 * need to better check here */
-			list_insert_end(&entry->sock->recvq, &pkt->list);
-			wait_list_awaken(&entry->sock->recvwait);
-			return;
-		} else {
-			if (entry->port == ntohs(pkt->udp->dst_port)) {
-				entry->rcv = pkt;
-				entry->proc->flags.pr_ready = true;
-				return;
-			}
-		}
+	netstats.udp_rx++;
+	if (!udp_csum_ok(pkt)) {
+		puts("received bad UDP length or checksum, dropping\n");
+		netstats.csum_errors++;
+		netstats.udp_drops++;
+		packet_free(pkt);
+		return;
 	}
-	puts("nobody was waiting for this packet, freeing\n");
-	packet_free(pkt);
+	/* short frames are padded, so don't trust the end of the frame */
+	if (!pkt->frag)
+		pkt->end = pkt->tl + ntohs(pkt->udp->len);
+
+	spin_acquire_irqsave(&udp_lock, &flags);
+	entry = udp_demux(pkt);
+	if (!entry) {
+		spin_release_irqrestore(&udp_lock, &flags);
+		puts("nobody was waiting for this packet, freeing\n");
+		netstats.udp_drops++;
+		packet_free(pkt);
+		return;
+	}
+	if (!entry->sock) {
+		entry->rcv = pkt;
+		proc_wake(entry->proc);
+		spin_release_irqrestore(&udp_lock, &flags);
+		return;
+	}
+
+	/* An empty queue takes any datagram, even one bigger than rcvbuf */
+	sock = entry->sock;
+	size = packet_chain_size(pkt);
+	if (sock->rcvq_bytes && sock->rcvq_bytes + size > sock->rcvbuf) {
+		sock->rcv_drops++;
+		netstats.sock_drops++;
+		spin_release_irqrestore(&udp_lock, &flags);
+		packet_free(pkt);
+		return;
+	}
+	list_insert_end(&sock->recvq, &pkt->list);
+	sock->rcvq_bytes += size;
+	netstats.sock_queued++;
+	spin_release_irqrestore(&udp_lock, &flags);
+	wait_list_awaken(&sock->recvwait);
 }
 
 void udp_send(struct netif *netif, struct packet *pkt, uint32_t src_ip,
               uint32_t dst_ip, uint16_t src_port, uint16_t dst_port)
 {
 	uint32_t csum;
-	uint32_t len_rounded;
+	uint32_t len;
 	pkt->tl = pkt->al - sizeof(struct udphdr);
 
+	len = packet_chain_len(pkt, pkt->tl);
 	pkt->udp->src_port = src_port;
 	pkt->udp->dst_port = dst_port;
-	pkt->udp->len = htons(pkt->end - pkt->tl);
-	len_rounded = pkt->end - pkt->tl;
-	len_rounded = (len_rounded / 2) + (len_rounded % 2);
+	pkt->udp->len = htons(len);
 	pkt->udp->csum = 0;
-	csum_init(&csum);
-	csum_add(&csum, &src_ip, 2);
-	csum_add(&csum, &dst_ip, 2);
-	csum_add_value(&csum, ntohs((uint16_t)IPPROTO_UDP));
-	csum_add(&csum, &pkt->udp->len, 1);
-	csum_add(&csum, (uint16_t *)pkt->udp, len_rounded);
-	pkt->udp->csum = csum_finalize(&csum);
+	udp_csum_pseudo(&csum, src_ip, dst_ip, pkt->udp->len);
+	if (netif->tx_csum && !pkt->frag) {
+		/* the device sums the rest and stores it at csum_offset. It
+		 * can't do this across IP fragments. */
+		pkt->udp->csum = csum_fold(&csum);
+		pkt->csum_offset = offsetof(struct udphdr, csum);
+		pkt->flags |= PKT_F_CSUM_PARTIAL;
+		netstats.csum_offloaded++;
+	} else {
+		packet_csum_add(&csum, pkt, pkt->tl);
+		pkt->udp->csum = csum_finalize(&csum);
+		/* zero means "no checksum", so send its other representation */
+		if (!pkt->udp->csum)
+			pkt->udp->csum = 0xFFFF;
+	}
 	ip_send(netif, pkt, IPPROTO_UDP, src_ip, dst_ip);
 }
 
@@ -115,26 +276,27 @@ int udp_reserve(void)
 	return ip_reserve() + sizeof(struct udphdr);
 }
 
-void udp_do_bind(struct socket *sock, const struct sockaddr_in *addr)
+/* Must hold udp_lock */
+static void udp_do_bind(struct socket *sock, const struct sockaddr_in *addr)
 {
 	struct udp_wait_entry *entry;
 	int hash;
 	hash = udp_hash(ntohs(addr->sin_port));
 
-	/* NOTE: there's totally a race condition we ignore here where we first
-	 * look to see if there is a socket listening on a port, and if not, we
-	 * create it. This is fine for now since we're not preemptive, and
-	 * interrupt handlers don't go around creating sockets. But if we become
-	 * preemptive, a different process could come around and claim the port
-	 * in between, and then we'd encounter a fun time. */
 	entry = kmalloc(sizeof(struct udp_wait_entry));
 	entry->sock = sock;
+	entry->proc = NULL;
+	entry->rcv = NULL;
 	entry->port = ntohs(addr->sin_port);
-	hlist_insert(&udp_hlist[hash], &entry->list);
+	entry->connected = false;
+	hlist_insert(&udp_ports[hash], &entry->list);
 	sock->src = *addr;
 	sock->flags.sk_bound = 1;
+	if (sock->flags.sk_connected)
+		udp_hash_conn(entry);
 }
 
+/* Must hold udp_lock */
 static bool udp_bind_to_ephemeral(struct socket *sock)
 {
 #define EPH_BEGIN 20000
@@ -153,7 +315,7 @@ static bool udp_bind_to_ephemeral(struct socket *sock)
 		else
 			i = i + 1;
 
-		if (!lookup_entry(htons(prev))) {
+		if (!lookup_entry(prev)) {
 			addr.sin_addr.s_addr = 0;
 			addr.sin_port = htons(prev);
 			udp_do_bind(sock, &addr);
@@ -166,7 +328,7 @@ static bool udp_bind_to_ephemeral(struct socket *sock)
 int udp_bind(struct socket *sock, const struct sockaddr *address,
              socklen_t address_len)
 {
-	int rv;
+	int rv, flags;
 	struct sockaddr_in addr;
 
 	if (sock->flags.sk_bound)
@@ -182,18 +344,22 @@ int udp_bind(struct socket *sock, const struct sockaddr *address,
 	if (addr.sin_addr.s_addr != 0 && addr.sin_addr.s_addr != nif.ip)
 		return -EADDRNOTAVAIL;
 
-	if (lookup_entry(addr.sin_port))
+	spin_acquire_irqsave(&udp_lock, &flags);
+	if (lookup_entry(ntohs(addr.sin_port))) {
+		spin_release_irqrestore(&udp_lock, &flags);
 		return -EADDRINUSE;
-
+	}
 	udp_do_bind(sock, &addr);
+	spin_release_irqrestore(&udp_lock, &flags);
 	return 0;
 }
 
 int udp_connect(struct socket *sock, const struct sockaddr *address,
                 socklen_t address_len)
 {
-	int rv;
+	int rv, flags;
 	struct sockaddr_in addr;
+	struct udp_wait_entry *entry;
 
 	/* UDP is connectionless. Calling connect() many times is just fine with
 	 * us. */
@@ -205,55 +371,183 @@ int udp_connect(struct socket *sock, const struct sockaddr *address,
 	if (rv < 0)
 		return rv;
 
+	spin_acquire_irqsave(&udp_lock, &flags);
 	sock->dst = addr;
 	sock->flags.sk_connected = 1;
+	if (sock->flags.sk_bound) {
+		entry = lookup_entry(ntohs(sock->src.sin_port));
+		udp_hash_conn(entry);
+	}
+	spin_release_irqrestore(&udp_lock, &flags);
 	return 0;
 }
 
-int udp_sys_send(struct socket *sock, void *data, size_t len, int flags)
+/**
+ * Copy a datagram from user space into a packet chain laid out for ip_send():
+ * the first packet has room for all the headers, and the rest have room for
+ * the Ethernet and IP headers of their fragment.
+ */
+static struct packet *udp_copy_from_user(const void *data, size_t len,
+                                         int *err)
 {
-	int rv, space;
+	struct packet *pkt, *tail, *frag;
+	uint32_t chunk, done;
+
+	pkt = packet_alloc();
+	if (!pkt) {
+		*err = -ENOMEM;
+		return NULL;
+	}
+	pkt->app = (void *)&pkt->data + udp_reserve();
+	chunk = min(len, IP_FRAG_PAYLOAD - sizeof(struct udphdr));
+	pkt->end = pkt->app + chunk;
+	*err = copy_from_user(pkt->app, data, chunk);
+
+	for (done = chunk, tail = pkt; !*err && done < len; done += chunk) {
+		frag = packet_alloc();
+		if (!frag) {
+			*err = -ENOMEM;
+			break;
+		}
+		frag->al = (void *)&frag->data + ip_reserve();
+		chunk = min(len - done, IP_FRAG_PAYLOAD);
+		frag->end = frag->al + chunk;
+		tail->frag = frag;
+		tail = frag;
+		*err = copy_from_user(frag->al, data + done, chunk);
+	}
+	if (*err) {
+		packet_free(pkt);
+		return NULL;
+	}
+	return pkt;
+}
+
+/**
+ * Send a datagram from user space to dst, which is the connected peer or an
+ * address given to sendmmsg().
+ */
+static int udp_sendto(struct socket *sock, const void *data, size_t len,
+                      const struct sockaddr_in *dst, int flags)
+{
+	int rv, irqflags;
 	struct packet *pkt;
 	uint32_t src;
 
-	space = udp_reserve();
-	if (space + len > MAX_ETH_PKT_SIZE)
+	if (len > UDP_MAX_PAYLOAD)
 		return -EMSGSIZE;
 
-	if (!sock->flags.sk_connected) {
-		/* Although UDP sockets do support sending via sockets without
-		 * connecting, it is through the sendto() or sendmsg() syscalls.
-		 * We require that the socket be connected first. */
-		return -EDESTADDRREQ;
-	}
-
 	if (!sock->flags.sk_bound) {
 		/* Unbound sockets can be sent from -- we just select an unused
 		 * ephemeral port and bind to that. */
-		if (!udp_bind_to_ephemeral(sock)) {
+		spin_acquire_irqsave(&udp_lock, &irqflags);
+		rv = udp_bind_to_ephemeral(sock);
+		spin_release_irqrestore(&udp_lock, &irqflags);
+		if (!rv)
 			return -EADDRINUSE;
-		}
 	}
 
-	pkt = packet_alloc();
-	pkt->app = (void *)&pkt->data + space;
-	rv = copy_from_user(pkt->app, data, len);
-	if (rv < 0)
-		goto error;
-
-	pkt->end = pkt->app + len;
+	pkt = udp_copy_from_user(data, len, &rv);
+	if (!pkt)
+		return rv;
+	if (flags & MSG_MORE)
+		pkt->flags |= PKT_F_MORE;
 
 	if (sock->src.sin_addr.s_addr)
 		src = sock->src.sin_addr.s_addr;
 	else
 		src = nif.ip;
 
-	udp_send(&nif, pkt, src, sock->dst.sin_addr.s_addr, sock->src.sin_port,
-	         sock->dst.sin_port);
+	udp_send(&nif, pkt, src, dst->sin_addr.s_addr, sock->src.sin_port,
+	         dst->sin_port);
 	return len;
-error:
-	packet_free(pkt);
-	return rv;
+}
+
+int udp_sys_send(struct socket *sock, const void *data, size_t len,
+                 int flags)
+{
+	if (!sock->flags.sk_connected) {
+		/* Although UDP sockets do support sending via sockets without
+		 * connecting, it is through the sendto() or sendmsg() syscalls.
+		 * We require that the socket be connected first. */
+		return -EDESTADDRREQ;
+	}
+	return udp_sendto(sock, data, len, &sock->dst, flags);
+}
+
+static int udp_sendmsg(struct socket *sock, const struct msghdr *msg,
+                       int flags)
+{
+	struct sockaddr_in addr;
+	int rv;
+
+	if (!msg->msg_name) {
+		if (!sock->flags.sk_connected)
+			return -EDESTADDRREQ;
+		return udp_sendto(sock, msg->msg_buf, msg->msg_buflen,
+		                  &sock->dst, flags);
+	}
+	if (msg->msg_namelen != sizeof(struct sockaddr_in))
+		return -EINVAL;
+	rv = copy_from_user(&addr, msg->msg_name, sizeof(addr));
+	if (rv < 0)
+		return rv;
+	return udp_sendto(sock, msg->msg_buf, msg->msg_buflen, &addr, flags);
+}
+
+/**
+ * Send each message in msgvec, stopping at the first error. The device is
+ * notified once for the whole batch. Returns the number of messages sent, or
+ * an error if none were.
+ */
+int udp_sendmmsg(struct socket *sock, struct mmsghdr *msgvec,
+                 unsigned int vlen, int flags)
+{
+	struct mmsghdr mmsg;
+	unsigned int i;
+	int rv = 0;
+
+	for (i = 0; i < vlen; i++) {
+		rv = copy_from_user(&mmsg, &msgvec[i], sizeof(mmsg));
+		if (rv < 0)
+			break;
+		rv = udp_sendmsg(sock, &mmsg.msg_hdr,
+		                 flags | (i + 1 < vlen ? MSG_MORE : 0));
+		if (rv < 0)
+			break;
+		mmsg.msg_len = rv;
+		rv = copy_to_user(&msgvec[i].msg_len, &mmsg.msg_len,
+		                  sizeof(mmsg.msg_len));
+		if (rv < 0) {
+			i++; /* it was sent, all the same */
+			break;
+		}
+	}
+	/* an error may have left earlier messages held back */
+	if (i < vlen && !(flags & MSG_MORE))
+		virtio_net_send_flush(nif.dev);
+	return i ? i : rv;
+}
+
+/**
+ * Copy the payload of a datagram, which may be a packet chain, to user space.
+ */
+static int udp_copy_to_user(void *data, struct packet *pkt)
+{
+	void *start = pkt->al;
+	uint32_t done = 0;
+	int rv;
+
+	while (pkt) {
+		rv = copy_to_user(data + done, start, pkt->end - start);
+		if (rv < 0)
+			return rv;
+		done += pkt->end - start;
+		pkt = pkt->frag;
+		if (pkt)
+			start = pkt->al;
+	}
+	return 0;
 }
 
 struct packet *socket_recvq_get(struct socket *socket)
@@ -266,11 +560,17 @@ struct packet *socket_recvq_get(struct socket *socket)
 	return NULL;
 }
 
-int udp_sys_recv(struct socket *sock, void *data, size_t len, int flags)
+/**
+ * Receive one datagram into a user buffer, and if src is given, store its
+ * sender there.
+ */
+static int udp_recvfrom(struct socket *sock, void *data, size_t len,
+                        struct sockaddr_in *src, int flags)
 {
 	struct packet *pkt;
 	size_t pktlen;
-	int rv;
+	uint64_t start, deadline;
+	int rv, irqflags;
 
 	if (!sock->flags.sk_bound) {
 		/* If the socket is not bound, then recv() is somewhat
@@ -279,40 +579,179 @@ int udp_sys_recv(struct socket *sock, void *data, size_t len, int flags)
 		return -EINVAL;
 	}
 
-	/* Get packet or wait for one to come */
+	/* Get packet, or poll for a while, or wait for one to come */
 	pkt = socket_recvq_get(sock);
+	if (!pkt && ((flags & MSG_DONTWAIT) || sock->flags.sk_nonblock))
+		return -EAGAIN;
+	start = timer_get_count();
+	while (!pkt && virtio_net_busy_poll(nif.dev, start))
+		pkt = socket_recvq_get(sock);
+	deadline = start + sock->rcvtimeo;
 	while (!pkt) {
-		wait_for(&sock->recvwait);
+		wait_list_rearm(&sock->recvwait);
 		pkt = socket_recvq_get(sock);
+		if (pkt)
+			break;
+		if (!sock->rcvtimeo) {
+			wait_for(&sock->recvwait);
+		} else if (wait_for_timeout(&sock->recvwait, deadline) < 0) {
+			pkt = socket_recvq_get(sock);
+			if (!pkt)
+				return -EAGAIN;
+		}
 	}
 
 	/* This may not be standard, but we only allow recv()ing entire packets,
 	 * no less. */
-	pktlen = (uint32_t)(pkt->end - pkt->al);
+	pktlen = packet_chain_len(pkt, pkt->al);
 	if (pktlen > len)
 		return -EMSGSIZE;
 
-	if ((rv = copy_to_user(data, pkt->al, pktlen)) < 0)
+	if ((rv = udp_copy_to_user(data, pkt)) < 0)
 		return rv;
 
+	if (src) {
+		src->sin_family = AF_INET;
+		src->sin_addr.s_addr = pkt->ip->src;
+		src->sin_port = pkt->udp->src_port;
+	}
+
+	spin_acquire_irqsave(&udp_lock, &irqflags);
 	list_remove(&pkt->list);
+	sock->rcvq_bytes -= packet_chain_size(pkt);
+	spin_release_irqrestore(&udp_lock, &irqflags);
 	packet_free(pkt);
+	netstats.sock_recvd++;
+	netstats.sock_bytes += pktlen;
 	return pktlen;
 }
 
+int udp_sys_recv(struct socket *sock, void *data, size_t len, int flags)
+{
+	return udp_recvfrom(sock, data, len, NULL, flags);
+}
+
+/**
+ * Receive up to vlen messages. Only the first may wait: after that, we take
+ * what is already queued. Returns the number of messages received, or an
+ * error if none were.
+ */
+int udp_recvmmsg(struct socket *sock, struct mmsghdr *msgvec,
+                 unsigned int vlen, int flags)
+{
+	struct mmsghdr mmsg;
+	struct sockaddr_in src;
+	unsigned int i;
+	int rv = 0;
+
+	for (i = 0; i < vlen; i++) {
+		rv = copy_from_user(&mmsg, &msgvec[i], sizeof(mmsg));
+		if (rv < 0)
+			break;
+		if (mmsg.msg_hdr.msg_name &&
+		    mmsg.msg_hdr.msg_namelen < sizeof(struct sockaddr_in)) {
+			rv = -EINVAL;
+			break;
+		}
+		rv = udp_recvfrom(sock, mmsg.msg_hdr.msg_buf,
+		                  mmsg.msg_hdr.msg_buflen, &src,
+		                  i ? flags | MSG_DONTWAIT : flags);
+		if (rv < 0)
+			break;
+		mmsg.msg_len = rv;
+		rv = copy_to_user(&msgvec[i].msg_len, &mmsg.msg_len,
+		                  sizeof(mmsg.msg_len));
+		if (rv >= 0 && mmsg.msg_hdr.msg_name)
+			rv = copy_to_user(mmsg.msg_hdr.msg_name, &src,
+			                  sizeof(src));
+		if (rv < 0) {
+			i++; /* it was dequeued, all the same */
+			break;
+		}
+	}
+	return i ? i : rv;
+}
+
+/*
+ * Sending only waits for the device ring briefly, so sockets are always
+ * writable.
+ */
+int udp_poll(struct socket *sock, struct poll_table *pt)
+{
+	poll_wait(pt, &sock->recvwait);
+	if (socket_recvq_get(sock))
+		return POLLIN | POLLOUT;
+	return POLLOUT;
+}
+
+int udp_close(struct socket *sock)
+{
+	struct udp_wait_entry *entry;
+	int flags;
+
+	if (!sock->flags.sk_bound)
+		return 0;
+
+	spin_acquire_irqsave(&udp_lock, &flags);
+	entry = lookup_entry(ntohs(sock->src.sin_port));
+	udp_unhash_conn(entry);
+	hlist_remove(&udp_ports[udp_hash(entry->port)], &entry->list);
+	spin_release_irqrestore(&udp_lock, &flags);
+	kfree(entry, sizeof(struct udp_wait_entry));
+	return 0;
+}
+
 struct sockops udp_ops = {
 	.proto = IPPROTO_UDP,
 	.bind = udp_bind,
 	.connect = udp_connect,
 	.send = udp_sys_send,
 	.recv = udp_sys_recv,
+	.sendmmsg = udp_sendmmsg,
+	.recvmmsg = udp_recvmmsg,
+	.close = udp_close,
+	.poll = udp_poll,
 };
 
+int udp_cmd_show_sockets(int argc, char **argv)
+{
+	struct udp_wait_entry *entry;
+	struct socket *sock;
+	uint32_t i;
+	int flags;
+
+	spin_acquire_irqsave(&udp_lock, &flags);
+	puts("port\tpid\tfd\tpeer\tqueued\trcvbuf\tdrops\n");
+	for (i = 0; i < UDP_HLIST_SIZE; i++)
+		list_for_each_entry(entry, &udp_ports[i], list)
+		{
+			sock = entry->sock;
+			if (!sock) {
+				printf("%u\t(kernel)\n", entry->port);
+				continue;
+			}
+			printf("%u\t%u\t%d\t", entry->port, sock->proc->id,
+			       sock->fildes);
+			if (entry->connected)
+				printf("%I:%u", sock->dst.sin_addr.s_addr,
+				       ntohs(sock->dst.sin_port));
+			else
+				puts("*");
+			printf("\t%u\t%u\t%u\n", sock->rcvq_bytes, sock->rcvbuf,
+			       sock->rcv_drops);
+		}
+	spin_release_irqrestore(&udp_lock, &flags);
+	return 0;
+}
+
 void udp_init(void)
 {
 	int i;
 	socket_register_proto(&udp_ops);
 
-	for (i = 0; i < UDP_HLIST_SIZE; i++)
-		INIT_HLIST_HEAD(udp_hlist[i]);
+	INIT_SPINSEM(&udp_lock, 1);
+	for (i = 0; i < UDP_HLIST_SIZE; i++) {
+		INIT_HLIST_HEAD(udp_ports[i]);
+		INIT_HLIST_HEAD(udp_conns[i]);
+	}
 }
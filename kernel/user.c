@@ -4,26 +4,43 @@
 #include <stddef.h>
 
 #include "kernel.h"
+#include "mm.h"
 #include "string.h"
 #include "sys/socket.h"
 
-static int check_bounds(const void *user, size_t n)
+/*
+ * Pages of the process image may not be mapped until they are used, or may be
+ * shared until they're written, so fault them in here.
+ */
+static int check_page(const void *user, bool write)
+{
+	if (write ? umem_writable(current, (void *)user)
+	          : umem_lookup_phys(current, (void *)user) != 0)
+		return 0;
+	return image_fault(current, (uint32_t)user, write);
+}
+
+/*
+ * Check that each page of a user buffer is mapped, and writable by the user if
+ * we will write to it.
+ */
+static int check_bounds(const void *user, size_t n, bool write)
 {
 	void *page;
 	void *first = (void *)user;
 	void *last = (void *)user + n - 1;
 
-	if (umem_lookup_phys(current, first) == 0)
+	if (check_page(first, write) < 0)
 		return -EACCES;
 
 	page = (void *)(((uint32_t)first & (~0xFFF)) + 0x1000);
 	while (page < last) {
-		if (umem_lookup_phys(current, page) == 0)
+		if (check_page(page, write) < 0)
 			return -EACCES;
 		page = (void *)((uint32_t)page + 0x1000);
 	}
 
-	if (umem_lookup_phys(current, last) == 0)
+	if (check_page(last, write) < 0)
 		return -EACCES;
 
 	return 0;
@@ -31,7 +48,7 @@ static int check_bounds(const void *user, size_t n)
 
 int copy_from_user(void *kerndst, const void *usersrc, size_t n)
 {
-	int rv = check_bounds(usersrc, n);
+	int rv = check_bounds(usersrc, n, false);
 	if (rv < 0)
 		return rv;
 	memcpy(kerndst, usersrc, n);
@@ -40,9 +57,28 @@ int copy_from_user(void *kerndst, const void *usersrc, size_t n)
 
 int copy_to_user(void *userdst, const void *kernsrc, size_t n)
 {
-	int rv = check_bounds(userdst, n);
+	int rv = check_bounds(userdst, n, true);
 	if (rv < 0)
 		return rv;
 	memcpy(userdst, kernsrc, n);
 	return 0;
 }
+
+/*
+ * Copy a NUL-terminated string of at most n bytes (including the NUL) from
+ * user space, checking each page as we reach it. Returns the string length.
+ */
+int copy_string_from_user(char *kerndst, const char *usersrc, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if ((i == 0 || ((uint32_t)&usersrc[i] & 0xFFF) == 0) &&
+		    check_page(&usersrc[i], false) < 0)
+			return -EACCES;
+		kerndst[i] = usersrc[i];
+		if (kerndst[i] == '\0')
+			return i;
+	}
+	return -ENAMETOOLONG;
+}
@@ -0,0 +1,80 @@
+/*
+ * vdso.c: the read-only data page mapped into every process
+ *
+ * There is only one page, filled in at boot: it holds nothing which changes
+ * while the system runs. See include/vdso.h for the layout.
+ */
+#include "kernel.h"
+#include "mm.h"
+#include "string.h"
+#include "vdso.h"
+
+#define GET_CNTVCT(dst_lo, dst_hi) get_cpreg64(dst_lo, dst_hi, c14, 1)
+
+#define GET_CNTKCTL(dst) get_cpreg(dst, c14, 0, c1, 0)
+#define SET_CNTKCTL(dst) set_cpreg(dst, c14, 0, c1, 0)
+#define CNTKCTL_PL0VCTEN (1 << 1)
+
+#define NSEC_PER_SEC 1000000000
+
+static struct vdso_data *vdso;
+
+static uint64_t get_cntvct(void)
+{
+	uint32_t lo, hi;
+	GET_CNTVCT(lo, hi);
+	return ((uint64_t)hi << 32) | lo;
+}
+
+void vdso_init(void)
+{
+	uint32_t shift, ctl;
+	uint64_t mult, before, virt, after;
+
+	vdso = kmem_get_page();
+	memset(vdso, 0, PAGE_SIZE);
+	vdso->cntfrq = timer_get_freq();
+
+	/* The largest shift whose multiplier still fits in 32 bits */
+	for (shift = 31; shift > 0; shift--) {
+		mult = (uint64_t)NSEC_PER_SEC << shift;
+		div64_32(&mult, vdso->cntfrq);
+		if (mult <= 0xFFFFFFFF)
+			break;
+	}
+	vdso->ns_mult = mult;
+	vdso->ns_shift = shift;
+
+	/*
+	 * CNTVOFF can only be read from hyp mode, so estimate it by reading the
+	 * virtual count between two physical ones.
+	 */
+	before = timer_get_count();
+	virt = get_cntvct();
+	after = timer_get_count();
+	vdso->cntvoff = before + ((after - before) >> 1) - virt;
+
+	/* Allow user mode to read CNTVCT */
+	GET_CNTKCTL(ctl);
+	ctl |= CNTKCTL_PL0VCTEN;
+	SET_CNTKCTL(ctl);
+
+	vdso->magic = VDSO_MAGIC;
+}
+
+/*
+ * Map the vDSO page read-only into a new process.
+ */
+void vdso_map(struct process *p)
+{
+	mark_alloc(p->vmem_allocator, VDSO_ADDR, PAGE_SIZE);
+	umem_map_pages(p, VDSO_ADDR, kvtop(vdso), PAGE_SIZE, UMEM_RO);
+}
+
+/*
+ * Return the CLOCK_MONOTONIC time, computed exactly as user space does.
+ */
+void timer_get_monotonic(struct timespec *ts)
+{
+	vdso_count_to_ts(vdso, timer_get_count(), ts);
+}
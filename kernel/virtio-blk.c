@@ -12,9 +12,9 @@
 #include "mm.h"
 
 struct virtio_cap blk_caps[] = {
-	{ "VIRTIO_BLK_F_SIZE_MAX", 1, false,
+	{ "VIRTIO_BLK_F_SIZE_MAX", 1, true,
 	  "Maximum size of any single segment is in size_max." },
-	{ "VIRTIO_BLK_F_SEG_MAX", 2, false,
+	{ "VIRTIO_BLK_F_SEG_MAX", 2, true,
 	  "Maximum number of segments in a request is in seg_max." },
 	{ "VIRTIO_BLK_F_GEOMETRY", 4, false,
 	  "Disk-style geometry specified in geometry." },
@@ -27,7 +27,7 @@ struct virtio_cap blk_caps[] = {
 	{ "VIRTIO_BLK_F_CONFIG_WCE", 11, false,
 	  "Device can toggle its cache between writeback and "
 	  "writethrough modes." },
-	VIRTIO_INDP_CAPS
+	VIRTIO_INDP_CAPS(true)
 };
 
 #define get_vblkreq(req) container_of(req, struct virtio_blk_req, blkreq)
@@ -36,42 +36,71 @@ struct slab *blkreq_slab = NULL;
 struct list_head vdevs;
 spinsem_t vdev_list_lock;
 
+/*
+ * Largest request we will make. The segment limit comes from the size of the
+ * indirect table in struct virtio_blk_req.
+ */
+#define VIRTIO_BLK_MAX_REQ_BYTES (64 * 1024)
+
+/* Requests come and go with each batch of I/O: keep a few pages around */
+#define BLKREQ_SLAB_WATERMARK 4
+
 struct virtio_blk {
 	virtio_regs *regs;
 	struct virtio_blk_config *config;
 	struct virtqueue *virtq;
 	uint32_t intid;
+	uint32_t size_max; /* largest data segment */
+	uint32_t seg_max;  /* most data segments in a request */
+	bool indirect;     /* each request uses one ring slot */
+	spinsem_t lock;    /* protects virtq and waiters */
+	struct list_head waiters;
+	uint32_t full_waits;
+	uint32_t interrupts;
+	uint32_t polled; /* requests completed by polling */
 	struct list_head list;
 	struct blkdev blkdev;
 };
+
+/*
+ * A thread waiting for free descriptors. It is on the waiters list until the
+ * interrupt handler frees some descriptors and wakes it up.
+ */
+struct virtio_blk_waiter {
+	struct list_head list;
+	struct waitlist wait;
+};
 #define get_vblkdev(dev) container_of(dev, struct virtio_blk, blkdev)
 
 #define HI32(u64) ((uint32_t)((0xFFFFFFFF00000000ULL & (u64)) >> 32))
 #define LO32(u64) ((uint32_t)(0x00000000FFFFFFFFULL & (u64)))
 
+/* Must hold dev->lock */
 static void virtio_blk_handle_used(struct virtio_blk *dev, uint32_t usedidx)
 {
 	struct virtqueue *virtq = dev->virtq;
-	uint32_t desc1, desc2, desc3;
+	uint32_t desc, next;
 	struct virtio_blk_req *req;
 
-	desc1 = virtq->used->ring[usedidx].id;
-	if (!(virtq->desc[desc1].flags & VIRTQ_DESC_F_NEXT))
-		goto bad_desc;
-	desc2 = virtq->desc[desc1].next;
-	if (!(virtq->desc[desc2].flags & VIRTQ_DESC_F_NEXT))
-		goto bad_desc;
-	desc3 = virtq->desc[desc2].next;
-	if (virtq->desc[desc1].len != VIRTIO_BLK_REQ_HEADER_SIZE ||
-	    virtq->desc[desc2].len != VIRTIO_BLK_SECTOR_SIZE ||
-	    virtq->desc[desc3].len != VIRTIO_BLK_REQ_FOOTER_SIZE)
-		goto bad_desc;
-
-	req = virtq->desc_virt[desc1];
+	desc = virtq->used->ring[usedidx].id;
+	req = virtq->desc_virt[desc];
 
-	virtq_free_desc(virtq, desc1);
-	virtq_free_desc(virtq, desc2);
-	virtq_free_desc(virtq, desc3);
+	if (virtq->desc[desc].flags & VIRTQ_DESC_F_INDIRECT) {
+		virtq_free_desc(virtq, desc);
+	} else {
+		/* header, one or more data segments, then the footer */
+		if (virtq->desc[desc].len != VIRTIO_BLK_REQ_HEADER_SIZE ||
+		    !(virtq->desc[desc].flags & VIRTQ_DESC_F_NEXT))
+			goto bad_desc;
+		while (virtq->desc[desc].flags & VIRTQ_DESC_F_NEXT) {
+			next = virtq->desc[desc].next;
+			virtq_free_desc(virtq, desc);
+			desc = next;
+		}
+		if (virtq->desc[desc].len != VIRTIO_BLK_REQ_FOOTER_SIZE)
+			goto bad_desc;
+		virtq_free_desc(virtq, desc);
+	}
 
 	switch (req->status) {
 	case VIRTIO_BLK_S_OK:
@@ -85,7 +114,7 @@ static void virtio_blk_handle_used(struct virtio_blk *dev, uint32_t usedidx)
 		panic(NULL);
 	}
 
-	wait_list_awaken(&req->blkreq.wait);
+	blkreq_complete(&dev->blkdev, &req->blkreq);
 	return;
 bad_desc:
 	puts("virtio-blk received malformed descriptors\n");
@@ -108,9 +137,41 @@ static struct virtio_blk *virtio_blk_get_dev_by_intid(uint32_t intid)
 	return NULL;
 }
 
+/**
+ * Complete every request the device has used, and wake up anybody waiting for
+ * free descriptors. Returns the number of requests completed. Must hold
+ * dev->lock.
+ */
+static uint32_t virtio_blk_reap(struct virtio_blk *dev)
+{
+	uint32_t len = dev->virtq->len, count = 0;
+	uint16_t seen, used;
+	struct virtio_blk_waiter *waiter, *next;
+
+	seen = dev->virtq->seen_used;
+	do {
+		used = dev->virtq->used->idx;
+		mb();
+		for (; seen != used; seen++, count++)
+			virtio_blk_handle_used(dev, seen % len);
+	} while (virtq_rearm(dev->virtq, seen));
+	dev->virtq->seen_used = seen;
+
+	if (!count)
+		return 0;
+
+	/* Descriptors were freed, so let any blocked submitters retry */
+	list_for_each_entry_safe(waiter, next, &dev->waiters, list)
+	{
+		list_remove(&waiter->list);
+		wait_list_awaken(&waiter->wait);
+	}
+	return count;
+}
+
 static void virtio_blk_isr(uint32_t intid, struct ctx *ctx)
 {
-	int i, len;
+	int flags;
 	struct virtio_blk *dev = virtio_blk_get_dev_by_intid(intid);
 
 	if (!dev) {
@@ -119,19 +180,37 @@ static void virtio_blk_isr(uint32_t intid, struct ctx *ctx)
 		return; /* just to make it obvious we won't continue */
 	}
 
-	len = dev->virtq->len;
-
 	WRITE32(dev->regs->InterruptACK, READ32(dev->regs->InterruptStatus));
 
-	for (i = dev->virtq->seen_used; i != (dev->virtq->used->idx % len);
-	     i = wrap(i + 1, len)) {
-		virtio_blk_handle_used(dev, i);
-	}
-	dev->virtq->seen_used = dev->virtq->used->idx % len;
+	spin_acquire_irqsave(&dev->lock, &flags);
+	dev->interrupts++;
+	virtio_blk_reap(dev);
+	spin_release_irqrestore(&dev->lock, &flags);
 
 	gic_end_interrupt(intid);
 }
 
+static bool virtio_blk_poll(struct blkdev *bdev)
+{
+	struct virtio_blk *dev = get_vblkdev(bdev);
+	uint32_t count;
+	int flags;
+
+	/* cheap check before taking the lock */
+	if (dev->virtq->used->idx == (uint16_t)dev->virtq->seen_used)
+		return false;
+
+	spin_acquire_irqsave(&dev->lock, &flags);
+	count = virtio_blk_reap(dev);
+	dev->polled += count;
+	spin_release_irqrestore(&dev->lock, &flags);
+	return count > 0;
+}
+
+/*
+ * Make a request available to the device. It won't look until it is notified,
+ * which happens in virtio_blk_kick().
+ */
 static void virtio_blk_send(struct virtio_blk *blk, struct virtio_blk_req *hdr)
 {
 	blk->virtq->avail->ring[blk->virtq->avail->idx % blk->virtq->len] =
@@ -139,7 +218,12 @@ static void virtio_blk_send(struct virtio_blk *blk, struct virtio_blk_req *hdr)
 	mb();
 	blk->virtq->avail->idx += 1;
 	mb();
-	WRITE32(blk->regs->QueueNotify, 0);
+}
+
+static void virtio_blk_kick(struct blkdev *dev)
+{
+	struct virtio_blk *blk = get_vblkdev(dev);
+	virtq_kick(blk->regs, blk->virtq, 0);
 }
 
 static int virtio_blk_status(struct blkdev *dev)
@@ -153,6 +237,15 @@ static int virtio_blk_status(struct blkdev *dev)
 	printf("    InterruptStatus=0x%x\n",
 	       READ32(blkdev->regs->InterruptStatus));
 	printf("    MagicValue=0x%x\n", READ32(blkdev->regs->MagicValue));
+	printf("    size_max=%u seg_max=%u indirect=%u\n", blkdev->size_max,
+	       blkdev->seg_max, blkdev->indirect);
+	printf("    free descriptors=%u, waits for a full ring=%u\n",
+	       blkdev->virtq->num_free, blkdev->full_waits);
+	printf("    event_idx=%u notifications=%u (skipped %u) "
+	       "interrupts=%u\n",
+	       blkdev->virtq->event_idx, blkdev->virtq->kicks,
+	       blkdev->virtq->kicks_skipped, blkdev->interrupts);
+	printf("    requests completed by polling=%u\n", blkdev->polled);
 	printf("  Queue 0:\n");
 	printf("    avail.idx = %u\n", blkdev->virtq->avail->idx);
 	printf("    used.idx = %u\n", blkdev->virtq->used->idx);
@@ -176,11 +269,115 @@ static void virtio_blk_free(struct blkdev *dev, struct blkreq *req)
 	slab_free(blkreq_slab, vblkreq);
 }
 
+/**
+ * Return the length of the data segment starting at buf: the physically
+ * contiguous run of memory, limited by the device's size_max.
+ */
+static uint32_t virtio_blk_segment(struct virtio_blk *blk, uint8_t *buf,
+                                   uint32_t remaining)
+{
+	uint32_t phys = kmem_lookup_phys(buf);
+	uint32_t len = PAGE_SIZE - ((uint32_t)buf & (PAGE_SIZE - 1));
+
+	while (len < remaining && len < blk->size_max &&
+	       kmem_lookup_phys(buf + len) == phys + len)
+		len += PAGE_SIZE;
+	return min(len, min(remaining, blk->size_max));
+}
+
+/**
+ * Fill the request's descriptor table with the header, a descriptor for each
+ * data segment, and the footer. Returns the number of descriptors, or 0 if the
+ * request has too many segments or its iov doesn't add up to its size.
+ */
+static uint32_t virtio_blk_build_table(struct virtio_blk *blk,
+                                       struct virtio_blk_req *hdr,
+                                       uint32_t datamode)
+{
+	struct blkreq *req = &hdr->blkreq;
+	struct blkvec single = { req->buf, req->size };
+	struct blkvec *iov = req->iovcnt ? req->iov : &single;
+	uint32_t iovcnt = req->iovcnt ? req->iovcnt : 1;
+	uint32_t i, off, len, n = 1, total = 0;
+
+	hdr->table[0].addr = kmem_lookup_phys(hdr);
+	hdr->table[0].len = VIRTIO_BLK_REQ_HEADER_SIZE;
+	hdr->table[0].flags = VIRTQ_DESC_F_NEXT;
+	hdr->table[0].next = 1;
+
+	for (i = 0; i < iovcnt; i++) {
+		for (off = 0; off < iov[i].len; off += len) {
+			if (n > blk->seg_max)
+				return 0;
+			len = virtio_blk_segment(blk, iov[i].buf + off,
+			                         iov[i].len - off);
+			hdr->table[n].addr = kmem_lookup_phys(iov[i].buf + off);
+			hdr->table[n].len = len;
+			hdr->table[n].flags = datamode | VIRTQ_DESC_F_NEXT;
+			hdr->table[n].next = n + 1;
+			n++;
+		}
+		total += iov[i].len;
+	}
+	if (total != req->size)
+		return 0;
+
+	hdr->table[n].addr = kmem_lookup_phys(&hdr->status);
+	hdr->table[n].len = VIRTIO_BLK_REQ_FOOTER_SIZE;
+	hdr->table[n].flags = VIRTQ_DESC_F_WRITE;
+	hdr->table[n].next = 0;
+	return n + 1;
+}
+
+/**
+ * Put the request's descriptors on the ring. With indirect descriptors, this
+ * is a single descriptor pointing at the table. Otherwise, the table is copied
+ * into a chain of ring descriptors.
+ *
+ * Must hold blk->lock, and have checked that enough descriptors are free.
+ */
+static void virtio_blk_post(struct virtio_blk *blk, struct virtio_blk_req *hdr,
+                            uint32_t count)
+{
+	struct virtqueue *virtq = blk->virtq;
+	uint32_t i, d, prev = 0;
+
+	if (blk->indirect) {
+		d = virtq_alloc_desc(virtq, hdr->table);
+		virtq->desc[d].len = count * sizeof(struct virtqueue_desc);
+		virtq->desc[d].flags = VIRTQ_DESC_F_INDIRECT;
+		virtq->desc_virt[d] = hdr;
+		hdr->descriptor = d;
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		d = virtq_alloc_desc(virtq, hdr);
+		virtq->desc[d].addr = hdr->table[i].addr;
+		virtq->desc[d].len = hdr->table[i].len;
+		virtq->desc[d].flags = hdr->table[i].flags;
+		if (i == 0)
+			hdr->descriptor = d;
+		else
+			virtq->desc[prev].next = d;
+		prev = d;
+	}
+}
+
 static void virtio_blk_submit(struct blkdev *dev, struct blkreq *req)
 {
 	struct virtio_blk *blk = get_vblkdev(dev);
 	struct virtio_blk_req *hdr = get_vblkreq(req);
-	uint32_t d1, d2, d3, datamode = 0;
+	struct virtio_blk_waiter waiter;
+	uint32_t count, needed, datamode = 0;
+	int flags;
+
+	if (req->size == 0 || req->size % dev->blksiz ||
+	    req->size > dev->maxblks * dev->blksiz ||
+	    req->iovcnt > dev->maxsegs) {
+		printf("virtio-blk: bad request size %u\n", req->size);
+		goto err;
+	}
 
 	if (req->type == BLKREQ_READ) {
 		hdr->type = VIRTIO_BLK_T_IN;
@@ -190,24 +387,74 @@ static void virtio_blk_submit(struct blkdev *dev, struct blkreq *req)
 	}
 	hdr->sector = req->blkidx;
 
-	d1 = virtq_alloc_desc(blk->virtq, hdr);
-	hdr->descriptor = d1;
-	blk->virtq->desc[d1].len = VIRTIO_BLK_REQ_HEADER_SIZE;
-	blk->virtq->desc[d1].flags = VIRTQ_DESC_F_NEXT;
-
-	d2 = virtq_alloc_desc(blk->virtq, req->buf);
-	blk->virtq->desc[d2].len = VIRTIO_BLK_SECTOR_SIZE;
-	blk->virtq->desc[d2].flags = datamode | VIRTQ_DESC_F_NEXT;
-
-	d3 = virtq_alloc_desc(blk->virtq,
-	                      (void *)hdr + VIRTIO_BLK_REQ_HEADER_SIZE);
-	blk->virtq->desc[d3].len = VIRTIO_BLK_REQ_FOOTER_SIZE;
-	blk->virtq->desc[d3].flags = VIRTQ_DESC_F_WRITE;
-
-	blk->virtq->desc[d1].next = d2;
-	blk->virtq->desc[d2].next = d3;
-
+	count = virtio_blk_build_table(blk, hdr, datamode);
+	if (!count) {
+		puts("virtio-blk: bad request segments\n");
+		goto err;
+	}
+	needed = blk->indirect ? 1 : count;
+
+	/*
+	 * If the ring is full, wait for the device to complete something. It
+	 * may not have been told about the requests we already sent, so kick.
+	 */
+	spin_acquire_irqsave(&blk->lock, &flags);
+	while (blk->virtq->num_free < needed) {
+		virtio_blk_kick(dev);
+		blk->full_waits++;
+		wait_list_init(&waiter.wait);
+		list_insert_end(&blk->waiters, &waiter.list);
+		spin_release_irqrestore(&blk->lock, &flags);
+		wait_for(&waiter.wait);
+		spin_acquire_irqsave(&blk->lock, &flags);
+	}
+	virtio_blk_post(blk, hdr, count);
 	virtio_blk_send(blk, hdr);
+	spin_release_irqrestore(&blk->lock, &flags);
+	return;
+err:
+	req->status = BLKREQ_ERR;
+	blkreq_complete(dev, req);
+}
+
+/**
+ * Read the segment limits, and from them compute the largest request we can
+ * always fit. In the worst case, every page of a buffer is a separate segment.
+ *
+ * Sector buffers come from callers and may cross a page boundary, so even a
+ * single sector can need two segments. We require seg_max >= 2 and a size_max
+ * of at least one sector, which guarantees that one always fits. Returns -1 if
+ * the device can't meet that.
+ */
+static int virtio_blk_read_limits(struct virtio_blk *vdev, uint32_t features)
+{
+	uint32_t segbytes, maxbytes;
+
+	vdev->size_max = VIRTIO_BLK_MAX_REQ_BYTES;
+	vdev->seg_max = VIRTIO_BLK_MAX_SEGS;
+	if (features & (1 << VIRTIO_BLK_F_SIZE_MAX) &&
+	    READ32(vdev->config->size_max))
+		vdev->size_max = READ32(vdev->config->size_max);
+	if (features & (1 << VIRTIO_BLK_F_SEG_MAX) &&
+	    READ32(vdev->config->seg_max))
+		vdev->seg_max = min(READ32(vdev->config->seg_max),
+		                    VIRTIO_BLK_MAX_SEGS);
+	if (vdev->seg_max < 2 || vdev->size_max < VIRTIO_BLK_SECTOR_SIZE) {
+		printf("error: virtio-blk seg_max %u, size_max %u too small\n",
+		       vdev->seg_max, vdev->size_max);
+		return -1;
+	}
+	vdev->indirect = features & (1 << VIRTIO_F_RING_INDIRECT_DESC);
+	vdev->virtq->event_idx = features & (1 << VIRTIO_F_RING_EVENT_IDX);
+
+	segbytes = min(vdev->size_max, PAGE_SIZE);
+	maxbytes = min((vdev->seg_max - 1) * segbytes,
+	               VIRTIO_BLK_MAX_REQ_BYTES);
+	vdev->blkdev.maxblks = maxbytes / VIRTIO_BLK_SECTOR_SIZE;
+	/* the block layer counts pages: each may need several segments */
+	vdev->blkdev.maxsegs =
+	        max(vdev->seg_max / ((PAGE_SIZE + segbytes - 1) / segbytes), 1);
+	return 0;
 }
 
 static void maybe_virtio_mod_init(void)
@@ -215,7 +462,9 @@ static void maybe_virtio_mod_init(void)
 	if (!blkreq_slab) {
 		blkreq_slab =
 		        slab_new("virtio_blk_req",
-		                 sizeof(struct virtio_blk_req), kmem_get_page);
+		                 sizeof(struct virtio_blk_req), kmem_get_page,
+		                 kmem_free_page);
+		slab_set_watermark(blkreq_slab, BLKREQ_SLAB_WATERMARK);
 		INIT_LIST_HEAD(vdevs);
 		INIT_SPINSEM(&vdev_list_lock, 1);
 	}
@@ -225,6 +474,8 @@ struct blkdev_ops virtio_blk_ops = {
 	.alloc = virtio_blk_alloc,
 	.free = virtio_blk_free,
 	.submit = virtio_blk_submit,
+	.kick = virtio_blk_kick,
+	.poll = virtio_blk_poll,
 	.status = virtio_blk_status,
 };
 
@@ -233,13 +484,13 @@ int virtio_blk_init(virtio_regs *regs, uint32_t intid)
 	struct virtio_blk *vdev;
 	struct virtqueue *virtq;
 	int flags;
-	uint32_t genbefore, genafter;
+	uint32_t genbefore, genafter, features;
 
 	maybe_virtio_mod_init();
 	vdev = kmalloc(sizeof(struct virtio_blk));
 
-	virtio_check_capabilities(regs, blk_caps, nelem(blk_caps),
-	                          "virtio-blk");
+	features = virtio_check_capabilities(regs, blk_caps, nelem(blk_caps),
+	                                     "virtio-blk");
 
 	WRITE32(regs->Status, READ32(regs->Status) | VIRTIO_STATUS_FEATURES_OK);
 	mb();
@@ -254,9 +505,19 @@ int virtio_blk_init(virtio_regs *regs, uint32_t intid)
 	vdev->regs = regs;
 	vdev->virtq = virtq;
 	vdev->intid = intid;
+	vdev->full_waits = 0;
+	vdev->interrupts = 0;
+	vdev->polled = 0;
+	INIT_SPINSEM(&vdev->lock, 1);
+	INIT_LIST_HEAD(vdev->waiters);
 	vdev->config = (struct virtio_blk_config *)&regs->Config;
 	vdev->blkdev.ops = &virtio_blk_ops;
 	vdev->blkdev.blksiz = VIRTIO_BLK_SECTOR_SIZE;
+	if (virtio_blk_read_limits(vdev, features) < 0) {
+		WRITE32(regs->Status,
+		        READ32(regs->Status) | VIRTIO_STATUS_FAILED);
+		return -1;
+	}
 	/* capacity is 64 bit, configuration reg read is not atomic */
 	do {
 		genbefore = READ32(vdev->regs->ConfigGeneration);
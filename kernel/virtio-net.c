@@ -10,13 +10,12 @@
 
 struct netif nif;
 struct virtio_net netdev;
-struct slab *nethdr_slab = NULL;
 
 struct virtio_cap net_caps[] = {
 	{ "VIRTIO_NET_F_CSUM", 0, true,
 	  "Device handles packets with partial checksum. This “checksum "
 	  "offload” is a common feature on modern network cards." },
-	{ "VIRTIO_NET_F_GUEST_CSUM", 1, false,
+	{ "VIRTIO_NET_F_GUEST_CSUM", 1, true,
 	  "Driver handles packets with partial checksum." },
 	{ "VIRTIO_NET_F_CTRL_GUEST_OFFLOADS", 2, false,
 	  "Control channel offloads reconfiguration support." },
@@ -31,7 +30,7 @@ struct virtio_cap net_caps[] = {
 	{ "VIRTIO_NET_F_HOST_ECN", 13, false,
 	  "Device can receive TSO with ECN." },
 	{ "VIRTIO_NET_F_HOST_UFO", 14, false, "Device can receive UFO." },
-	{ "VIRTIO_NET_F_MRG_RXBUF", 15, false,
+	{ "VIRTIO_NET_F_MRG_RXBUF", 15, true,
 	  "Driver can merge receive buffers." },
 	{ "VIRTIO_NET_F_STATUS", 16, true,
 	  "Configuration status field is available." },
@@ -46,71 +45,162 @@ struct virtio_cap net_caps[] = {
 	  "Device supports multiqueue with automatic receive steering." },
 	{ "VIRTIO_NET_F_CTRL_MAC_ADDR", 23, false,
 	  "Set MAC address through control channel" },
-	VIRTIO_INDP_CAPS
+	VIRTIO_INDP_CAPS(false)
 };
 
-static void maybe_init_nethdr_slab(void)
+/**
+ * Post a receive buffer. Each buffer is a single descriptor covering the packet
+ * data: the device writes the virtio_net_hdr at the start, then the frame.
+ */
+static void virtio_net_post_rx(struct virtio_net *dev, struct packet *pkt)
 {
-	if (!nethdr_slab)
-		nethdr_slab =
-		        slab_new("virtio_net_hdr",
-		                 sizeof(struct virtio_net_hdr), kmem_get_page);
+	struct virtqueue *rx = dev->rx;
+	uint32_t d = virtq_alloc_desc(rx, pkt->data);
+
+	rx->desc[d].len = PACKET_CAPACITY;
+	rx->desc[d].flags = VIRTQ_DESC_F_WRITE;
+	rx->avail->ring[rx->avail->idx % rx->len] = d;
+	mb();
+	rx->avail->idx += 1;
 }
 
-void add_packets_to_virtqueue(int n, struct virtqueue *virtq)
+/*
+ * A thread waiting for the device to finish with some tx descriptors. It is on
+ * tx_waiters until virtio_net_reap_tx() wakes it up.
+ */
+struct virtio_net_waiter {
+	struct list_head list;
+	struct waitlist wait;
+};
+
+/**
+ * Free the header and packet of every transmitted buffer in the used ring,
+ * and wake any senders waiting for descriptors. Must hold dev->tx_lock.
+ */
+static void virtio_net_reap_tx(struct virtio_net *dev)
 {
-	int i;
+	struct virtqueue *tx = dev->tx;
+	struct virtio_net_waiter *waiter, *next;
+	uint16_t seen = tx->seen_used;
 	uint32_t d1, d2;
-	struct virtio_net_hdr *hdr;
-	struct packet *pkt;
-	for (i = 0; i < n; i++) {
-		hdr = slab_alloc(nethdr_slab);
-		pkt = packet_alloc();
-		hdr->packet = pkt;
-		d1 = virtq_alloc_desc(virtq, hdr);
-		d2 = virtq_alloc_desc(virtq, pkt->data);
-		virtq->desc[d1].len = VIRTIO_NET_HDRLEN;
-		virtq->desc[d1].flags = VIRTQ_DESC_F_WRITE | VIRTQ_DESC_F_NEXT;
-		virtq->desc[d1].next = d2;
-		virtq->desc[d2].len = PACKET_CAPACITY;
-		virtq->desc[d2].flags = VIRTQ_DESC_F_WRITE;
-		pkt->capacity = PACKET_CAPACITY;
-		virtq->avail->ring[virtq->avail->idx + i] = d1;
+
+	do {
+		for (; seen != tx->used->idx; seen++) {
+			d1 = tx->used->ring[seen % tx->len].id;
+			d2 = tx->desc[d1].next;
+			packet_free(dev->tx_hdrs[d1].packet);
+			virtq_free_desc(tx, d2);
+			virtq_free_desc(tx, d1);
+			dev->tx_reaped++;
+		}
+		tx->seen_used = seen;
+	} while (virtq_rearm(tx, seen));
+
+	list_for_each_entry_safe(waiter, next, &dev->tx_waiters, list)
+	{
+		list_remove(&waiter->list);
+		wait_list_awaken(&waiter->wait);
 	}
-	mb();
-	virtq->avail->idx += n;
 }
 
+/**
+ * Notify the device of any packets which were held back. Must hold
+ * dev->tx_lock.
+ */
+static void virtio_net_flush(struct virtio_net *dev)
+{
+	if (dev->tx_pending) {
+		virtq_kick(dev->regs, dev->tx, VIRTIO_NET_Q_TX);
+		dev->tx_pending = 0;
+	}
+}
+
+/**
+ * Put pkt on the tx queue. The device is notified once per batch: when the
+ * packet is not marked PKT_F_MORE, or every VIRTIO_NET_TX_BATCH packets.
+ * If the ring is full, the sender sleeps until the device frees some
+ * descriptors, unless we are receiving (a reply from within the receive path)
+ * or in an interrupt handler, in which case the packet is dropped.
+ */
 void virtio_net_send(struct virtio_net *dev, struct packet *pkt)
 {
+	struct virtqueue *tx = dev->tx;
+	struct virtio_net_waiter waiter;
+	struct virtio_net_hdr *hdr;
 	uint32_t d1, d2;
-	struct virtio_net_hdr *hdr =
-	        (struct virtio_net_hdr *)slab_alloc(nethdr_slab);
+	int flags;
+
+	spin_acquire_irqsave(&dev->tx_lock, &flags);
+	if (tx->used->idx != (uint16_t)tx->seen_used)
+		virtio_net_reap_tx(dev);
+	while (tx->num_free < 2) {
+		virtio_net_flush(dev);
+		if (dev->rx_busy || in_irq()) {
+			dev->tx_drops++;
+			spin_release_irqrestore(&dev->tx_lock, &flags);
+			packet_free(pkt);
+			return;
+		}
+		dev->tx_full_waits++;
+		wait_list_init(&waiter.wait);
+		list_insert_end(&dev->tx_waiters, &waiter.list);
+		spin_release_irqrestore(&dev->tx_lock, &flags);
+		wait_for(&waiter.wait);
+		spin_acquire_irqsave(&dev->tx_lock, &flags);
+		virtio_net_reap_tx(dev);
+	}
 
-	hdr->flags = 0;
+	/* The header array is indexed by the head of the chain */
+	hdr = &dev->tx_hdrs[tx->free_desc];
 	hdr->gso_type = VIRTIO_NET_HDR_GSO_NONE;
 	hdr->hdr_len = 0;  /* not used unless we have segmentation offload */
 	hdr->gso_size = 0; /* same */
-	hdr->csum_start = 0;
-	hdr->csum_offset = 0;
-	hdr->num_buffers = 0xDEAD;
+	if (pkt->flags & PKT_F_CSUM_PARTIAL) {
+		/* the device sums from csum_start to the end, and stores the
+		 * result at csum_start + csum_offset */
+		hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+		hdr->csum_start = pkt->tl - pkt->ll;
+		hdr->csum_offset = pkt->csum_offset;
+	} else {
+		hdr->flags = 0;
+		hdr->csum_start = 0;
+		hdr->csum_offset = 0;
+	}
+	hdr->num_buffers = 0;
 	hdr->packet = pkt;
 
-	d1 = virtq_alloc_desc(dev->tx, (void *)hdr);
-	dev->tx->desc[d1].len = VIRTIO_NET_HDRLEN;
-	dev->tx->desc[d1].flags = VIRTQ_DESC_F_NEXT;
+	d1 = virtq_alloc_desc(tx, (void *)hdr);
+	tx->desc[d1].len = dev->hdrlen;
+	tx->desc[d1].flags = VIRTQ_DESC_F_NEXT;
 
-	d2 = virtq_alloc_desc(dev->tx, pkt->ll);
-	dev->tx->desc[d2].len = (pkt->end - pkt->ll);
-	dev->tx->desc[d2].flags = 0;
+	d2 = virtq_alloc_desc(tx, pkt->ll);
+	tx->desc[d2].len = (pkt->end - pkt->ll);
+	tx->desc[d2].flags = 0;
 
-	dev->tx->desc[d1].next = d2;
+	tx->desc[d1].next = d2;
 
-	dev->tx->avail->ring[dev->tx->avail->idx] = d1;
-	mb();
-	dev->tx->avail->idx += 1;
+	tx->avail->ring[tx->avail->idx % tx->len] = d1;
 	mb();
-	WRITE32(dev->regs->QueueNotify, VIRTIO_NET_Q_TX);
+	tx->avail->idx += 1;
+	dev->tx_packets++;
+	dev->tx_pending++;
+
+	if (!(pkt->flags & PKT_F_MORE) ||
+	    dev->tx_pending >= VIRTIO_NET_TX_BATCH)
+		virtio_net_flush(dev);
+	spin_release_irqrestore(&dev->tx_lock, &flags);
+}
+
+/**
+ * Notify the device of any packets held back by PKT_F_MORE.
+ */
+void virtio_net_send_flush(struct virtio_net *dev)
+{
+	int flags;
+
+	spin_acquire_irqsave(&dev->tx_lock, &flags);
+	virtio_net_flush(dev);
+	spin_release_irqrestore(&dev->tx_lock, &flags);
 }
 
 int virtio_net_cmd_status(int argc, char **argv)
@@ -123,87 +213,192 @@ int virtio_net_cmd_status(int argc, char **argv)
 	printf("    InterruptStatus=0x%x\n",
 	       READ32(netdev.regs->InterruptStatus));
 	printf("    MagicValue=0x%x\n", READ32(netdev.regs->MagicValue));
-	printf("  tx queue:\n");
+	printf("    event_idx=%u interrupts=%u\n", netdev.tx->event_idx,
+	       netdev.interrupts);
+	printf("    poll budget=%u us, packets received by polling=%u\n",
+	       netdev.poll_us, netdev.polled);
+	printf("  tx queue (%u entries):\n", netdev.tx->len);
 	printf("    avail.idx = %u\n", netdev.tx->avail->idx);
 	printf("    used.idx = %u\n", netdev.tx->used->idx);
+	printf("    notifications = %u (skipped %u)\n", netdev.tx->kicks,
+	       netdev.tx->kicks_skipped);
+	printf("    packets = %u, reaped = %u, pending = %u, free desc = %u\n",
+	       netdev.tx_packets, netdev.tx_reaped, netdev.tx_pending,
+	       netdev.tx->num_free);
+	printf("    waits for space = %u, drops = %u\n", netdev.tx_full_waits,
+	       netdev.tx_drops);
 	WRITE32(netdev.regs->QueueSel, VIRTIO_NET_Q_TX);
 	mb();
 	printf("    ready = 0x%x\n", READ32(netdev.regs->QueueReady));
-	printf("  rx queue:\n");
+	printf("  rx queue (%u entries):\n", netdev.rx->len);
 	printf("    avail.idx = %u\n", netdev.rx->avail->idx);
 	printf("    used.idx = %u\n", netdev.rx->used->idx);
+	printf("    notifications = %u (skipped %u)\n", netdev.rx->kicks,
+	       netdev.rx->kicks_skipped);
+	printf("    mergeable buffers = %s, merged frames = %u\n",
+	       netdev.mrg_rxbuf ? "yes" : "no", netdev.rx_merged);
+	printf("    dropped for lack of memory = %u\n", netdev.rx_nomem);
 	WRITE32(netdev.regs->QueueSel, VIRTIO_NET_Q_RX);
 	mb();
 	printf("    ready = 0x%x\n", READ32(netdev.regs->QueueReady));
 	return 0;
 }
 
-void virtio_handle_rxused(struct virtio_net *dev, uint32_t idx)
+void virtio_handle_rxused(struct virtio_net *dev, uint16_t idx)
 {
-	uint32_t d1 = dev->rx->used->ring[idx].id;
-	uint32_t d2 = dev->rx->desc[d1].next;
-	uint32_t len = dev->rx->used->ring[idx].len;
-	struct virtio_net_hdr *hdr =
-	        (struct virtio_net_hdr *)dev->rx->desc_virt[d1];
-	/* We can get this from d2, but hdr->packet is more foolproof, since we
-	 * don't necessarily know the offset into the packet structure which d2
-	 * will point at. */
-	struct packet *pkt = hdr->packet;
-	pkt->ll = dev->rx->desc_virt[d2];
-	pkt->end = pkt->ll + (len - VIRTIO_NET_HDRLEN);
-	eth_recv(&nif, pkt);
+	struct virtqueue *rx = dev->rx;
+	uint32_t d = rx->used->ring[idx % rx->len].id;
+	uint32_t len = rx->used->ring[idx % rx->len].len;
+	struct packet *pkt =
+	        container_of(rx->desc_virt[d], struct packet, data);
+	struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)pkt->data;
+	struct packet *fresh = NULL;
 
-	/* eth_recv takes ownership of pkt, we will put a new packet in there
-	 * and stick the descriptor back into the avail queue */
-	pkt = packet_alloc();
-	hdr->packet = pkt;
-	dev->rx->desc[d2].addr = kmem_lookup_phys(&pkt->data);
-	dev->rx->desc_virt[d2] = &pkt->data;
+	/*
+	 * We own pkt now, so give the device a new buffer in its place. With
+	 * no memory for one, drop the frame and give pkt itself back, along
+	 * with any more buffers the frame takes up.
+	 */
+	virtq_free_desc(rx, d);
+	if (!dev->rx_skip)
+		fresh = packet_alloc_rx();
+	if (!fresh) {
+		if (dev->rx_skip) {
+			dev->rx_skip--;
+		} else if (dev->rx_head) {
+			dev->rx_skip = dev->rx_remaining - 1;
+			packet_free(dev->rx_head);
+			dev->rx_head = NULL;
+			dev->rx_nomem++;
+		} else {
+			if (dev->mrg_rxbuf && hdr->num_buffers > 1)
+				dev->rx_skip = hdr->num_buffers - 1;
+			dev->rx_nomem++;
+		}
+		packet_reset_rx(pkt);
+		virtio_net_post_rx(dev, pkt);
+		return;
+	}
+	virtio_net_post_rx(dev, fresh);
 
-	dev->rx->avail->ring[dev->rx->avail->idx] = d1;
-	dev->rx->avail->ring[wrap(dev->rx->avail->idx + 1, dev->rx->len)] = d2;
-	mb();
-	dev->rx->avail->idx = wrap(dev->rx->avail->idx + 2, dev->rx->len);
+	if (dev->rx_head) {
+		/* With MRG_RXBUF, the rest of a frame continues in the next
+		 * buffers, without a header. Chain them to the first. */
+		pkt->al = pkt->data;
+		pkt->end = pkt->al + len;
+		dev->rx_tail->frag = pkt;
+		dev->rx_tail = pkt;
+		if (--dev->rx_remaining)
+			return;
+		pkt = dev->rx_head;
+		dev->rx_head = NULL;
+	} else {
+		pkt->ll = (void *)pkt->data + dev->hdrlen;
+		pkt->end = (void *)pkt->data + len;
+		/* With GUEST_CSUM, the device may tell us the checksum was
+		 * checked, or that it was never computed because the packet
+		 * never left the host. Either way, there is nothing to
+		 * verify. */
+		if (hdr->flags &
+		    (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM))
+			pkt->flags |= PKT_F_CSUM_VALID;
+		if (dev->mrg_rxbuf && hdr->num_buffers > 1) {
+			dev->rx_head = dev->rx_tail = pkt;
+			dev->rx_remaining = hdr->num_buffers - 1;
+			dev->rx_merged++;
+			return;
+		}
+	}
+	netstats.rx_frames++;
+	netstats.rx_bytes += packet_chain_len(pkt, pkt->ll);
+	/* eth_recv takes ownership of pkt */
+	eth_recv(&nif, pkt);
 }
 
-void virtio_handle_txused(struct virtio_net *dev, uint32_t idx)
+/**
+ * Process every used buffer in the receive queue. Returns the number of
+ * packets received. Must hold dev->lock.
+ */
+static uint32_t virtio_net_process(struct virtio_net *dev)
 {
-	uint32_t d1 = dev->tx->used->ring[idx].id;
-
-	struct virtio_net_hdr *hdr =
-	        (struct virtio_net_hdr *)dev->tx->desc_virt[d1];
-	struct packet *pkt = hdr->packet;
+	struct virtqueue *rx = dev->rx;
+	uint16_t seen = rx->seen_used;
+	uint32_t count = 0;
 
-	slab_free(nethdr_slab, hdr);
-	packet_free(pkt);
+	dev->rx_busy = true;
+	do {
+		for (; seen != rx->used->idx; seen++) {
+			virtio_handle_rxused(dev, seen);
+			count++;
+		}
+		rx->seen_used = seen;
+	} while (virtq_rearm(rx, seen));
+	/* we refilled the receive ring, tell the device if it is waiting */
+	virtq_kick(dev->regs, dev->rx, VIRTIO_NET_Q_RX);
+	dev->rx_busy = false;
+	return count;
 }
 
 void virtio_net_isr(uint32_t intid, struct ctx *ctx)
 {
-	uint32_t i;
 	struct virtio_net *dev = &netdev;
 	uint32_t stat = READ32(dev->regs->InterruptStatus);
+	int flags;
+
 	WRITE32(dev->regs->InterruptACK, stat);
+	spin_acquire_irqsave(&dev->lock, &flags);
+	dev->interrupts++;
+	virtio_net_process(dev);
+	spin_release_irqrestore(&dev->lock, &flags);
+
+	spin_acquire_irqsave(&dev->tx_lock, &flags);
+	virtio_net_reap_tx(dev);
+	virtio_net_flush(dev);
+	spin_release_irqrestore(&dev->tx_lock, &flags);
+	gic_end_interrupt(intid);
+}
+
+/**
+ * Poll the device once, unless the busy-poll budget which began at timer count
+ * start is used up (or polling is off). Receivers call this in a loop while
+ * they wait for a packet, and go to sleep once it returns false.
+ */
+bool virtio_net_busy_poll(struct virtio_net *dev, uint64_t start)
+{
+	int flags;
 
-	for (i = dev->rx->seen_used; i != dev->rx->used->idx;
-	     i = wrap(i + 1, 32)) {
-		virtio_handle_rxused(dev, i);
+	if (!dev || !dev->poll_us ||
+	    timer_get_count() - start >= dev->poll_ticks)
+		return false;
+
+	if (dev->rx->used->idx != (uint16_t)dev->rx->seen_used) {
+		spin_acquire_irqsave(&dev->lock, &flags);
+		dev->polled += virtio_net_process(dev);
+		spin_release_irqrestore(&dev->lock, &flags);
 	}
-	dev->rx->seen_used = dev->rx->used->idx;
-	for (i = dev->tx->seen_used; i != dev->tx->used->idx;
-	     i = wrap(i + 1, 32)) {
-		virtio_handle_txused(dev, i);
+	return true;
+}
+
+int virtio_net_cmd_poll(int argc, char **argv)
+{
+	if (argc != 1) {
+		puts("usage: netpoll MICROSECONDS\n");
+		return 1;
 	}
-	dev->tx->seen_used = dev->tx->used->idx;
-	gic_end_interrupt(intid);
+	netdev.poll_us = atoi(argv[0]);
+	netdev.poll_ticks = netdev.poll_us * (timer_get_freq() / 1000000);
+	return 0;
 }
 
 int virtio_net_init(virtio_regs *regs, uint32_t intid)
 {
 	volatile struct virtio_net_config *cfg =
 	        (struct virtio_net_config *)regs->Config;
-	virtio_check_capabilities(regs, net_caps, nelem(net_caps),
-	                          "virtio-net");
+	uint32_t features, txlen, rxlen;
+	struct packet *pkt;
+
+	features = virtio_check_capabilities(regs, net_caps, nelem(net_caps),
+	                                     "virtio-net");
 
 	WRITE32(regs->Status, READ32(regs->Status) | VIRTIO_STATUS_FEATURES_OK);
 	mb();
@@ -214,17 +409,54 @@ int virtio_net_init(virtio_regs *regs, uint32_t intid)
 
 	netdev.regs = regs;
 	netdev.cfg = cfg;
-	netdev.tx = virtq_create(128);
-	netdev.rx = virtq_create(128);
+	txlen = virtq_choose_len(regs, VIRTIO_NET_Q_TX, CONFIG_VIRTIO_NET_RING);
+	rxlen = virtq_choose_len(regs, VIRTIO_NET_Q_RX, CONFIG_VIRTIO_NET_RING);
+	if (txlen < 2 || rxlen < 2) {
+		puts("error: virtio-net queues are not available\n");
+		return -1;
+	}
+	netdev.tx = virtq_create(txlen);
+	netdev.rx = virtq_create(rxlen);
+	if (!netdev.tx || !netdev.rx)
+		return -1;
+	netdev.interrupts = 0;
+	netdev.poll_us = 0;
+	netdev.poll_ticks = 0;
+	netdev.polled = 0;
+	INIT_SPINSEM(&netdev.lock, 1);
+	INIT_SPINSEM(&netdev.tx_lock, 1);
+	INIT_LIST_HEAD(netdev.tx_waiters);
+	netdev.tx_hdrs =
+	        kmalloc(netdev.tx->len * sizeof(struct virtio_net_hdr));
+	netdev.tx_pending = 0;
+	netdev.mrg_rxbuf = !!(features & (1 << VIRTIO_NET_F_MRG_RXBUF));
+	netdev.hdrlen =
+	        netdev.mrg_rxbuf ? VIRTIO_NET_HDRLEN_MRG : VIRTIO_NET_HDRLEN;
+	netdev.rx_head = netdev.rx_tail = NULL;
+	netdev.rx_remaining = 0;
+	netdev.rx_skip = 0;
+	netdev.rx_merged = 0;
+	netdev.rx_nomem = 0;
+	netdev.rx_busy = false;
+	netdev.tx_packets = 0;
+	netdev.tx_reaped = 0;
+	netdev.tx_full_waits = 0;
+	netdev.tx_drops = 0;
+	if (features & (1 << VIRTIO_F_RING_EVENT_IDX)) {
+		netdev.tx->event_idx = true;
+		netdev.rx->event_idx = true;
+	}
 
 	nif.ip = 0;
 	memcpy(&nif.mac, (void *)&cfg->mac, 6);
 	nif.gateway_ip = 0;
 	nif.subnet_mask = 0;
 	nif.dev = &netdev;
+	nif.tx_csum = !!(features & (1 << VIRTIO_NET_F_CSUM));
 
-	maybe_init_nethdr_slab();
-	add_packets_to_virtqueue(64, netdev.rx);
+	/* fill the receive ring, as far as memory allows */
+	while (netdev.rx->num_free && (pkt = packet_alloc_rx()))
+		virtio_net_post_rx(&netdev, pkt);
 
 	virtq_add_to_device(regs, netdev.rx, VIRTIO_NET_Q_RX);
 	virtq_add_to_device(regs, netdev.tx, VIRTIO_NET_Q_TX);
@@ -234,7 +466,8 @@ int virtio_net_init(virtio_regs *regs, uint32_t intid)
 	WRITE32(regs->Status, READ32(regs->Status) | VIRTIO_STATUS_DRIVER_OK);
 	mb();
 
-	printf("virtio-net 0x%x (intid %u, MAC %M): ready!\n",
-	       kmem_lookup_phys((void *)regs), intid, &cfg->mac);
+	printf("virtio-net 0x%x (intid %u, MAC %M, %u/%u ring entries): "
+	       "ready!\n",
+	       kmem_lookup_phys((void *)regs), intid, &cfg->mac, txlen, rxlen);
 	return 0;
 }
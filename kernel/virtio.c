@@ -31,11 +31,15 @@ struct virtqueue *virtq_create(uint32_t len)
 	        ALIGN(off_avail_event + sizeof(uint16_t), sizeof(void *));
 	uint32_t memsize = off_desc_virt + len * sizeof(void *);
 
-	if (memsize > PAGE_SIZE) {
-		printf("virtq_create: error, too big for a page\n");
+	if (!len || (len & (len - 1)) || len > VIRTQ_MAX_LEN) {
+		printf("virtq_create: error, bad queue size %u\n", len);
+		return NULL;
+	}
+	page_virt = (uint32_t)kmem_get_pages(ALIGN(memsize, PAGE_SIZE), 0);
+	if (!page_virt) {
+		printf("virtq_create: error, no memory for %u entries\n", len);
 		return NULL;
 	}
-	page_virt = (uint32_t)kmem_get_page();
 
 	virtq = (struct virtqueue *)page_virt;
 	virtq->phys = kvtop((void *)page_virt);
@@ -49,9 +53,16 @@ struct virtqueue *virtq_create(uint32_t len)
 	virtq->desc_virt = (void **)(page_virt + off_desc_virt);
 
 	virtq->avail->idx = 0;
+	virtq->avail->flags = 0;
 	virtq->used->idx = 0;
+	*virtq->used_event = 0;
 	virtq->seen_used = virtq->used->idx;
 	virtq->free_desc = 0;
+	virtq->num_free = len;
+	virtq->event_idx = false;
+	virtq->kicked_idx = 0;
+	virtq->kicks = 0;
+	virtq->kicks_skipped = 0;
 
 	for (i = 0; i < len; i++) {
 		virtq->desc[i].next = i + 1;
@@ -60,6 +71,24 @@ struct virtqueue *virtq_create(uint32_t len)
 	return virtq;
 }
 
+/**
+ * Return the largest queue size no bigger than want which the device supports
+ * for queue queue_sel, or 0 if the queue is not available.
+ */
+uint32_t virtq_choose_len(volatile virtio_regs *regs, uint32_t queue_sel,
+                          uint32_t want)
+{
+	uint32_t max;
+
+	WRITE32(regs->QueueSel, queue_sel);
+	mb();
+	max = min(READ32(regs->QueueNumMax), min(want, VIRTQ_MAX_LEN));
+	if (!max)
+		return 0;
+	/* queue sizes must be a power of two */
+	return 1 << (31 - __builtin_clz(max));
+}
+
 uint32_t virtq_alloc_desc(struct virtqueue *virtq, void *addr)
 {
 	uint32_t desc = virtq->free_desc;
@@ -67,6 +96,7 @@ uint32_t virtq_alloc_desc(struct virtqueue *virtq, void *addr)
 	if (desc == virtq->len)
 		puts("ERROR: ran out of virtqueue descriptors\n");
 	virtq->free_desc = next;
+	virtq->num_free--;
 
 	virtq->desc[desc].addr = kmem_lookup_phys(addr);
 	virtq->desc_virt[desc] = addr;
@@ -77,6 +107,7 @@ void virtq_free_desc(struct virtqueue *virtq, uint32_t desc)
 {
 	virtq->desc[desc].next = virtq->free_desc;
 	virtq->free_desc = desc;
+	virtq->num_free++;
 	virtq->desc_virt[desc] = NULL;
 }
 
@@ -113,13 +144,65 @@ void virtq_show(struct virtqueue *virtq)
 	}
 }
 
-void virtio_check_capabilities(virtio_regs *regs, struct virtio_cap *caps,
-                               uint32_t n, char *whom)
+/*
+ * True if the other side asked to hear about index event, which lies in the
+ * range of indices we moved past, (old, new].
+ */
+#define need_event(event, new, old)                                            \
+	((uint16_t)((new) - (event)-1) < (uint16_t)((new) - (old)))
+
+/**
+ * Notify the device about buffers added to the avail ring since the last call,
+ * unless the device said it does not need to know. Call this once after adding
+ * a batch of buffers.
+ */
+void virtq_kick(volatile virtio_regs *regs, struct virtqueue *virtq,
+                uint32_t queue_sel)
+{
+	uint16_t old = virtq->kicked_idx;
+	uint16_t new = virtq->avail->idx;
+	bool notify;
+
+	/* the device must see the new avail->idx before we read its event */
+	mb();
+	if (virtq->event_idx)
+		notify = need_event(*virtq->avail_event, new, old);
+	else
+		notify = !(virtq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+	virtq->kicked_idx = new;
+
+	if (notify) {
+		WRITE32(regs->QueueNotify, queue_sel);
+		virtq->kicks++;
+	} else {
+		virtq->kicks_skipped++;
+	}
+}
+
+/**
+ * Ask for an interrupt on the next used buffer after index seen, which is the
+ * (free running) used index the driver has processed. The device won't
+ * interrupt again for buffers it uses before then. Returns true if more used
+ * buffers arrived meanwhile, in which case the caller should process them
+ * rather than wait for an interrupt.
+ */
+bool virtq_rearm(struct virtqueue *virtq, uint16_t seen)
+{
+	if (!virtq->event_idx)
+		return false;
+	*virtq->used_event = seen;
+	mb();
+	return virtq->used->idx != seen;
+}
+
+uint32_t virtio_check_capabilities(virtio_regs *regs, struct virtio_cap *caps,
+                                   uint32_t n, char *whom)
 {
 	uint32_t i;
 	uint32_t bank = 0;
 	uint32_t driver = 0;
 	uint32_t device;
+	uint32_t bank0 = 0;
 
 	WRITE32(regs->DeviceFeaturesSel, bank);
 	mb();
@@ -131,6 +214,9 @@ void virtio_check_capabilities(virtio_regs *regs, struct virtio_cap *caps,
 			WRITE32(regs->DriverFeaturesSel, bank);
 			mb();
 			WRITE32(regs->DriverFeatures, driver);
+			if (bank == 0)
+				bank0 = driver;
+			driver = 0;
 			if (device) {
 				/*printf("%s: device supports unknown bits"
 				       " 0x%x in bank %u\n", whom, device,
@@ -142,9 +228,9 @@ void virtio_check_capabilities(virtio_regs *regs, struct virtio_cap *caps,
 			mb();
 			device = READ32(regs->DeviceFeatures);
 		}
-		if (device & (1 << caps[i].bit)) {
+		if (device & (1 << (caps[i].bit % 32))) {
 			if (caps[i].support) {
-				driver |= (1 << caps[i].bit);
+				driver |= (1 << (caps[i].bit % 32));
 			} else {
 				/*printf("virtio supports unsupported option %s
 				   "
@@ -152,17 +238,20 @@ void virtio_check_capabilities(virtio_regs *regs, struct virtio_cap *caps,
 				       caps[i].name, caps[i].help);*/
 			}
 			/* clear this from device now */
-			device &= ~(1 << caps[i].bit);
+			device &= ~(1 << (caps[i].bit % 32));
 		}
 	}
 	/* Time to write our selected bits for this bank */
 	WRITE32(regs->DriverFeaturesSel, bank);
 	mb();
 	WRITE32(regs->DriverFeatures, driver);
+	if (bank == 0)
+		bank0 = driver;
 	if (device) {
 		/*printf("%s: device supports unknown bits"
 		       " 0x%x in bank %u\n", whom, device, bank);*/
 	}
+	return bank0;
 }
 
 static int virtio_dev_init(uint32_t virt, uint32_t intid)
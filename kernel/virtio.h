@@ -12,7 +12,6 @@
 #define VIRTIO_VERSION 0x2
 #define VIRTIO_DEV_NET 0x1
 #define VIRTIO_DEV_BLK 0x2
-#define wrap(x, len)   ((x) & ~(len))
 
 /*
  * See Section 4.2.2 of VIRTIO 1.0 Spec:
@@ -62,6 +61,10 @@ typedef volatile struct __attribute__((packed)) {
 #define VIRTIO_STATUS_DRIVER_OK          (4)
 #define VIRTIO_STATUS_DEVICE_NEEDS_RESET (64)
 
+/* Feature bits shared by all devices, see VIRTIO_INDP_CAPS() */
+#define VIRTIO_F_RING_INDIRECT_DESC 28
+#define VIRTIO_F_RING_EVENT_IDX     29
+
 struct virtio_cap {
 	char *name;
 	uint32_t bit;
@@ -104,15 +107,29 @@ struct virtqueue_used {
 } __attribute__((packed));
 
 /*
- * For simplicity, we lay out the virtqueue in contiguous memory on a single
- * page. See virtq_create for the layout and alignment requirements.
+ * For simplicity, we lay out the virtqueue in contiguous memory, a single page
+ * for the usual sizes. See virtq_create for the layout and alignment
+ * requirements. Ring indices (avail->idx, used->idx, seen_used) run freely
+ * through 16 bits, and are taken modulo len to find a ring entry.
  */
+#define VIRTQ_MAX_LEN 32768
 struct virtqueue {
 	/* Physical base address of the full data structure. */
 	uint32_t phys;
 	uint32_t len;
 	uint32_t seen_used;
 	uint32_t free_desc;
+	uint32_t num_free; /* count of descriptors on the free list */
+
+	/*
+	 * With VIRTIO_F_RING_EVENT_IDX, the device tells us (in avail_event)
+	 * which avail index it wants to be notified about, and we tell it (in
+	 * used_event) which used index we want an interrupt for.
+	 */
+	bool event_idx;
+	uint16_t kicked_idx; /* avail->idx when we last decided to notify */
+	uint32_t kicks;      /* notifications written to QueueNotify */
+	uint32_t kicks_skipped;
 
 	volatile struct virtqueue_desc *desc;
 	volatile struct virtqueue_avail *avail;
@@ -141,6 +158,13 @@ struct virtio_blk_config {
 	uint8_t writeback;
 } __attribute__((packed));
 
+#define VIRTIO_BLK_F_SIZE_MAX 1
+#define VIRTIO_BLK_F_SEG_MAX  2
+
+#define VIRTIO_NET_F_CSUM       0
+#define VIRTIO_NET_F_GUEST_CSUM 1
+#define VIRTIO_NET_F_MRG_RXBUF  15
+
 struct virtio_net_config {
 	uint8_t mac[6];
 #define VIRTIO_NET_S_LINK_UP  1
@@ -149,6 +173,7 @@ struct virtio_net_config {
 	uint16_t max_virtqueue_pairs;
 } __attribute__((packed));
 
+#define VIRTIO_BLK_MAX_SEGS        32
 #define VIRTIO_BLK_REQ_HEADER_SIZE 16
 #define VIRTIO_BLK_REQ_FOOTER_SIZE 1
 struct virtio_blk_req {
@@ -164,6 +189,11 @@ struct virtio_blk_req {
 	uint8_t _pad[3];
 	uint32_t descriptor;
 	struct blkreq blkreq;
+	/*
+	 * Indirect descriptor table: the header, up to VIRTIO_BLK_MAX_SEGS data
+	 * segments, and the status footer.
+	 */
+	struct virtqueue_desc table[VIRTIO_BLK_MAX_SEGS + 2];
 } __attribute__((packed));
 
 #define VIRTIO_BLK_SECTOR_SIZE 512
@@ -175,6 +205,7 @@ struct virtio_blk_req {
 struct packet;
 struct virtio_net_hdr {
 #define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+#define VIRTIO_NET_HDR_F_DATA_VALID 2
 	uint8_t flags;
 #define VIRTIO_NET_HDR_GSO_NONE  0
 #define VIRTIO_NET_HDR_GSO_TCPV4 1
@@ -190,40 +221,85 @@ struct virtio_net_hdr {
 	struct packet *packet;
 } __attribute__((packed));
 
-#define VIRTIO_NET_HDRLEN 10
+#define VIRTIO_NET_HDRLEN     10
+#define VIRTIO_NET_HDRLEN_MRG 12 /* with num_buffers */
 
 #define VIRTIO_NET_Q_RX 0
 #define VIRTIO_NET_Q_TX 1
 
+/* Notify the device at least this often, even if senders say more is coming */
+#define VIRTIO_NET_TX_BATCH 16
+
 struct virtio_net {
 	virtio_regs *regs;
 	volatile struct virtio_net_config *cfg;
 	struct virtqueue *rx;
 	struct virtqueue *tx;
+	uint32_t hdrlen; /* bytes of virtio_net_hdr the device uses */
+	bool mrg_rxbuf;  /* a frame may span several receive buffers */
+
+	spinsem_t lock;       /* serializes receive processing and polling */
+	bool rx_busy;         /* processing received packets, don't sleep */
+	struct packet *rx_head; /* a frame still waiting for more buffers */
+	struct packet *rx_tail;
+	uint16_t rx_remaining; /* buffers rx_head is waiting for */
+	uint16_t rx_skip;      /* buffers left of a frame we dropped */
+	uint32_t rx_merged;    /* frames which spanned buffers */
+	uint32_t rx_nomem;     /* frames dropped for want of a new buffer */
+
+	spinsem_t tx_lock; /* protects the tx queue and tx_waiters */
+	struct virtio_net_hdr *tx_hdrs; /* one per tx descriptor chain head */
+	struct list_head tx_waiters;
+	uint16_t tx_pending; /* packets posted since the last notify */
+	uint32_t tx_packets;
+	uint32_t tx_reaped;
+	uint32_t tx_full_waits;
+	uint32_t tx_drops;
+
+	uint32_t interrupts;
+	uint32_t poll_us;    /* busy-poll budget when receiving, 0 = off */
+	uint32_t poll_ticks; /* the same, in timer counts */
+	uint32_t polled;     /* packets received by polling */
 };
 
 /*
  * virtqueue routines
  */
 struct virtqueue *virtq_create(uint32_t len);
+uint32_t virtq_choose_len(volatile virtio_regs *regs, uint32_t queue_sel,
+                          uint32_t want);
 uint32_t virtq_alloc_desc(struct virtqueue *virtq, void *addr);
 void virtq_free_desc(struct virtqueue *virtq, uint32_t desc);
 void virtq_add_to_device(volatile virtio_regs *regs, struct virtqueue *virtq,
                          uint32_t queue_sel);
 void virtq_show(struct virtqueue *virtq);
+void virtq_kick(volatile virtio_regs *regs, struct virtqueue *virtq,
+                uint32_t queue_sel);
+bool virtq_rearm(struct virtqueue *virtq, uint16_t seen);
 
 /*
  * General purpose routines for virtio drivers
  */
-void virtio_check_capabilities(virtio_regs *device, struct virtio_cap *caps,
-                               uint32_t n, char *whom);
 
-#define VIRTIO_INDP_CAPS                                                       \
-	{ "VIRTIO_F_RING_INDIRECT_DESC", 28, false,                            \
+/**
+ * Negotiate features with the device: each capability which the device offers
+ * and has support set is accepted. Returns the accepted features in bank 0
+ * (bits 0-31).
+ */
+uint32_t virtio_check_capabilities(virtio_regs *device, struct virtio_cap *caps,
+                                   uint32_t n, char *whom);
+
+/*
+ * Capabilities common to all device types, for the end of a driver's list.
+ * indirect says whether the driver supports indirect descriptors.
+ */
+#define VIRTIO_INDP_CAPS(indirect)                                             \
+	{ "VIRTIO_F_RING_INDIRECT_DESC", VIRTIO_F_RING_INDIRECT_DESC,          \
+	  indirect,                                                            \
 	  "Negotiating this feature indicates that the driver can use"         \
 	  " descriptors with the VIRTQ_DESC_F_INDIRECT flag set, as"           \
 	  " described in 2.4.5.3 Indirect Descriptors." },                     \
-	        { "VIRTIO_F_RING_EVENT_IDX", 29, false,                        \
+	        { "VIRTIO_F_RING_EVENT_IDX", VIRTIO_F_RING_EVENT_IDX, true,    \
 		  "This feature enables the used_event and the avail_event "   \
 		  "fields"                                                     \
 		  " as described in 2.4.7 and 2.4.8." },                       \
@@ -31,13 +31,51 @@ void wait_for(struct waitlist *wl)
 		return;
 	}
 	waiter.proc = current;
+	waiter.queued = true;
 	wl->waitcount++;
 	hlist_insert(&wl->waiting, &waiter.list);
-	current->flags.pr_ready = 0;
+	proc_block(current);
 	spin_release_irqrestore(&wl->waitlock, &flags);
 	schedule();
 }
 
+int wait_for_timeout(struct waitlist *wl, uint64_t expires)
+{
+	int flags, rv = 0;
+	struct waiter waiter;
+	struct timeout t;
+	spin_acquire_irqsave(&wl->waitlock, &flags);
+	if (wl->triggered) {
+		spin_release_irqrestore(&wl->waitlock, &flags);
+		return 0;
+	}
+	waiter.proc = current;
+	waiter.queued = true;
+	wl->waitcount++;
+	hlist_insert(&wl->waiting, &waiter.list);
+	proc_block(current);
+	spin_release_irqrestore(&wl->waitlock, &flags);
+
+	timeout_start(&t, expires);
+	schedule();
+	timeout_cancel(&t);
+
+	/* if the waitlist woke us too, that counts */
+	if (waiter.queued) {
+		wait_list_remove(wl, &waiter);
+		rv = -ETIMEDOUT;
+	}
+	return rv;
+}
+
+void wait_list_rearm(struct waitlist *wl)
+{
+	int flags;
+	spin_acquire_irqsave(&wl->waitlock, &flags);
+	wl->triggered = false;
+	spin_release_irqrestore(&wl->waitlock, &flags);
+}
+
 void wait_list_awaken(struct waitlist *wl)
 {
 	struct waiter *waiter;
@@ -46,7 +84,54 @@ void wait_list_awaken(struct waitlist *wl)
 	wl->triggered = true;
 	list_for_each_entry(waiter, &wl->waiting, list)
 	{
-		waiter->proc->flags.pr_ready = 1;
+		proc_wake(waiter->proc);
+		waiter->queued = false;
+	}
+	/* Waiters may be on the stack of the processes we woke: forget them */
+	INIT_HLIST_HEAD(wl->waiting);
+	wl->waitcount = 0;
+	spin_release_irqrestore(&wl->waitlock, &flags);
+}
+
+void wait_list_add(struct waitlist *wl, struct waiter *waiter)
+{
+	int flags;
+	spin_acquire_irqsave(&wl->waitlock, &flags);
+	waiter->proc = current;
+	waiter->queued = true;
+	wl->waitcount++;
+	hlist_insert(&wl->waiting, &waiter->list);
+	spin_release_irqrestore(&wl->waitlock, &flags);
+}
+
+void wait_list_remove(struct waitlist *wl, struct waiter *waiter)
+{
+	struct hlist_head *prev;
+	int flags;
+	spin_acquire_irqsave(&wl->waitlock, &flags);
+	if (!waiter->queued)
+		goto out;
+	/* The list may have been reinitialized, so don't assume we are on it */
+	for (prev = &wl->waiting; prev->next != &wl->waiting;
+	     prev = prev->next) {
+		if (prev->next == &waiter->list) {
+			prev->next = waiter->list.next;
+			wl->waitcount--;
+			break;
+		}
 	}
+	waiter->queued = false;
+out:
 	spin_release_irqrestore(&wl->waitlock, &flags);
 }
+
+void poll_wait(struct poll_table *pt, struct waitlist *wl)
+{
+	struct poll_entry *entry;
+
+	if (!pt || pt->count >= pt->max)
+		return;
+	entry = &pt->entries[pt->count++];
+	entry->wl = wl;
+	wait_list_add(wl, &entry->waiter);
+}
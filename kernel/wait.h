@@ -17,6 +17,7 @@
 #include "list.h"
 #include "sync.h"
 #include <stdbool.h>
+#include <stdint.h>
 
 struct waitlist {
 	struct hlist_head waiting;
@@ -28,6 +29,7 @@ struct waitlist {
 struct waiter {
 	struct hlist_head list;
 	struct process *proc;
+	bool queued; /* still on the waitlist: not yet awoken */
 };
 
 /**
@@ -52,8 +54,68 @@ void wait_list_destroy(struct waitlist *wl);
  */
 void wait_for(struct waitlist *wl);
 
+/**
+ * @brief Wait for a waitlist, but give up when the timer count reaches expires
+ * @param wl waitlist to wait for
+ * @param expires timer count (see timer_get_count()) to stop waiting at
+ * @return 0 if the waitlist was triggered, -ETIMEDOUT otherwise
+ */
+int wait_for_timeout(struct waitlist *wl, uint64_t expires);
+
+/**
+ * @brief Clear a waitlist's triggered state, so it may be waited for again
+ *
+ * Check for the awaited condition after this, and before waiting: a trigger in
+ * between makes the wait return immediately rather than being lost.
+ *
+ * @param wl waitlist to rearm
+ */
+void wait_list_rearm(struct waitlist *wl);
+
 /**
  * @brief Awaken all process in the waitlist
  * @param wl waitlist to awaken
  */
 void wait_list_awaken(struct waitlist *wl);
+
+/**
+ * @brief Add the current process to a waitlist, without sleeping
+ *
+ * This allows waiting on several waitlists at once: add a waiter to each, then
+ * schedule() with the process marked not ready. Being awoken by any of them
+ * makes the process ready again. The waiters must then be removed.
+ *
+ * @param wl waitlist to wait for
+ * @param waiter caller-owned waiter, which must outlive its time on the list
+ */
+void wait_list_add(struct waitlist *wl, struct waiter *waiter);
+
+/**
+ * @brief Remove a waiter added by wait_list_add(), if it is still queued
+ * @param wl waitlist the waiter was added to
+ * @param waiter waiter to remove
+ */
+void wait_list_remove(struct waitlist *wl, struct waiter *waiter);
+
+/*
+ * poll() support. Each pollable object implements a poll operation, which
+ * returns its POLL* events, and calls poll_wait() with the waitlist which is
+ * awoken when those events may change.
+ */
+struct poll_entry {
+	struct waiter waiter;
+	struct waitlist *wl;
+};
+
+struct poll_table {
+	struct poll_entry *entries;
+	unsigned int count;
+	unsigned int max;
+};
+
+/**
+ * @brief Wait on wl as part of a poll() call
+ * @param pt poll table, or NULL if the caller is only checking events
+ * @param wl waitlist which will be awoken on a change of events
+ */
+void poll_wait(struct poll_table *pt, struct waitlist *wl);
@@ -1,166 +1,247 @@
 /**
  * alloc.c: allocates pages of memory, physical or virtual
+ *
+ * This is a buddy allocator, see alloc_private.h for the data structures.
  */
 #include "alloc.h"
 #include "alloc_private.h"
 
-#define MAX_DESCRIPTORS 1023
-
 /**
  * Declare this so we don't depend on any particular library providing printf,
  * whether it's the standard library or my own printf implementation...
  */
 extern int printf(const char *fmt, ...);
 
-void init_page_allocator(void *allocator, uint32_t start, uint32_t end)
+/**
+ * Return the index of the free block starting at pfn, or BUDDY_NIL.
+ */
+static uint16_t buddy_lookup(struct buddy *b, uint32_t pfn)
 {
-	/*
-	 * We assume there are 3GB of available memory, starting at 0x40000000.
-	 * Everything beginning at dynamic_start and ending at 0xFFFFFFFF is
-	 * assumed to be available for us to allocate.
-	 */
-	struct zonehdr *zonehdr = (struct zonehdr *)allocator;
-	zonehdr->next = 0;
-	zonehdr->count = 2;
-	zonehdr->zones[0].addr = start >> PAGE_BITS;
-	zonehdr->zones[0].free = 1;
-	zonehdr->zones[1].addr = end >> PAGE_BITS;
-	zonehdr->zones[1].free = 0;
+	uint16_t idx;
+
+	for (idx = b->hash[buddy_hash(b, pfn)]; idx != BUDDY_NIL;
+	     idx = b->node[idx].hnext)
+		if (b->node[idx].pfn == pfn)
+			return idx;
+	return BUDDY_NIL;
 }
 
-void show_pages(void *allocator)
+/**
+ * Add a free block to its free list and the hash table. The caller must
+ * ensure that there is a spare node available.
+ */
+static void buddy_push(struct buddy *b, uint32_t pfn, uint32_t order)
 {
-	struct zonehdr *hdr = (struct zonehdr *)allocator;
-	int i;
-
-	printf("BEGIN MEMORY ZONES (%u)\n", hdr->count);
-	for (i = 0; i < hdr->count; i++)
-		printf(" 0x%x: %s\n", hdr->zones[i].addr << PAGE_BITS,
-		       hdr->zones[i].free ? "FREE" : "ALLOCATED");
-	printf("END MEMORY ZONES\n");
+	uint16_t idx = b->spare;
+	struct buddy_node *n = &b->node[idx];
+	uint32_t bucket = buddy_hash(b, pfn);
+
+	b->spare = n->next;
+	b->nspare--;
+
+	n->pfn = pfn;
+	n->order = order;
+	n->prev = BUDDY_NIL;
+	n->next = b->heads[order];
+	if (n->next != BUDDY_NIL)
+		b->node[n->next].prev = idx;
+	b->heads[order] = idx;
+	b->counts[order]++;
+
+	n->hnext = b->hash[bucket];
+	b->hash[bucket] = idx;
 }
 
 /**
- * Move zones to the right by `to_shift` descriptors, starting at `start`.
- * This can fail if there's not enough room. Theoretically, we have a spot in
- * the zonehdr to point to a new page to store more zones, but hell if I'm going
- * to implement that.
+ * Remove a free block from its free list and the hash table, and return its
+ * node to the spare list.
  */
-static bool shift_zones_up(struct zonehdr *hdr, int start, int to_shift)
+static void buddy_remove(struct buddy *b, uint16_t idx)
 {
-	int i;
+	struct buddy_node *n = &b->node[idx];
+	uint16_t *link = &b->hash[buddy_hash(b, n->pfn)];
+
+	while (*link != idx)
+		link = &b->node[*link].hnext;
+	*link = n->hnext;
+
+	if (n->prev != BUDDY_NIL)
+		b->node[n->prev].next = n->next;
+	else
+		b->heads[n->order] = n->next;
+	if (n->next != BUDDY_NIL)
+		b->node[n->next].prev = n->prev;
+	b->counts[n->order]--;
+
+	n->next = b->spare;
+	b->spare = idx;
+	b->nspare++;
+}
 
-	if (hdr->count + start >= MAX_DESCRIPTORS)
-		return false;
+/**
+ * Free a block, merging it with its buddy as many times as possible.
+ */
+static void buddy_release(struct buddy *b, uint32_t pfn, uint32_t order)
+{
+	uint16_t idx;
+
+	while (order + 1 < BUDDY_ORDERS) {
+		idx = buddy_lookup(b, pfn ^ (1 << order));
+		if (idx == BUDDY_NIL || b->node[idx].order != order)
+			break;
+		buddy_remove(b, idx);
+		pfn &= ~(1 << order);
+		order++;
+	}
+	buddy_push(b, pfn, order);
+}
+
+/**
+ * Return the index of the free block which contains the (aligned) 2^order
+ * pages starting at pfn, or BUDDY_NIL if they are not entirely free.
+ */
+static uint16_t buddy_containing(struct buddy *b, uint32_t pfn, uint32_t order)
+{
+	uint16_t idx;
 
-	for (i = hdr->count - 1; i >= start; i--)
-		hdr->zones[i + to_shift] = hdr->zones[i];
+	for (; order < BUDDY_ORDERS; order++) {
+		idx = buddy_lookup(b, pfn & ~((1 << order) - 1));
+		if (idx != BUDDY_NIL && b->node[idx].order >= order)
+			return idx;
+	}
+	return BUDDY_NIL;
+}
 
-	hdr->count += to_shift;
-	return true;
+/**
+ * Return true if any page in the (aligned) 2^order pages starting at pfn is
+ * free.
+ */
+static bool buddy_overlaps(struct buddy *b, uint32_t pfn, uint32_t order)
+{
+	uint32_t i, head;
+	uint16_t idx;
+
+	/* a free block starting within the range */
+	for (i = 0; i < (1 << order); i++)
+		if (buddy_lookup(b, pfn + i) != BUDDY_NIL)
+			return true;
+
+	/*
+	 * A larger free block starting before the range. We only need to look
+	 * at each distinct aligned head once, and once we find any free block,
+	 * there can't be a larger one around pfn (it would overlap).
+	 */
+	for (i = order; i < BUDDY_ORDERS; i++) {
+		if (!(pfn & (1 << i)))
+			continue;
+		head = pfn & ~((2 << i) - 1);
+		idx = buddy_lookup(b, head);
+		if (idx != BUDDY_NIL)
+			return head + (1 << b->node[idx].order) > pfn;
+	}
+	return false;
 }
 
-static void shift_zones_down(struct zonehdr *hdr, int dst, int to_shift)
+/**
+ * Return the order of the largest aligned block starting at pfn which does not
+ * extend past end. Any page range is a sequence of these "chunks".
+ */
+static uint32_t chunk_order(uint32_t pfn, uint32_t end)
 {
-	int i;
+	uint32_t order = 0;
 
-	for (i = dst; i < hdr->count - to_shift; i++)
-		hdr->zones[i] = hdr->zones[i + to_shift];
+	while (order + 1 < BUDDY_ORDERS && !(pfn & (1 << order)) &&
+	       pfn + (2 << order) <= end)
+		order++;
+	return order;
+}
+
+static uint32_t count_chunks(uint32_t pfn, uint32_t end)
+{
+	uint32_t count = 0;
 
-	hdr->count -= to_shift;
+	for (; pfn < end; pfn += 1 << chunk_order(pfn, end))
+		count++;
+	return count;
 }
 
 /**
- * Change the allocation status of region `exact` of length `count` within the
- * (potentially larger) region `region`.
+ * Convert a byte range into a page frame range, returning false if it is not
+ * entirely within the allocator's memory.
  */
-static bool change_status(struct zonehdr *hdr, uint32_t exact, uint32_t count,
-                          uint32_t region, uint32_t index, int status)
+static bool page_range(struct buddy *b, uint32_t start, uint32_t count,
+                       uint32_t *pfn, uint32_t *end)
 {
-	uint32_t next = 0;
+	*pfn = start >> PAGE_BITS;
+	*end = *pfn + ((count + PAGE_SIZE - 1) >> PAGE_BITS);
+	return *pfn >= b->start && *end <= b->end && *end > *pfn;
+}
 
-	bool have_left_zone = (index > 0);
-	bool have_right_zone = (index < hdr->count - 1);
-	bool exact_on_left = false, exact_on_right = false;
+void init_page_allocator_sized(void *allocator, uint32_t size, uint32_t start,
+                               uint32_t end)
+{
+	struct buddy *b = (struct buddy *)allocator;
+	uint32_t i, pfn, avail;
 
-	if (have_right_zone) {
-		next = hdr->zones[index + 1].addr << PAGE_BITS;
-		exact_on_right = (exact + count == next);
+	/*
+	 * Aim for about two nodes per hash bucket, and use whatever is left
+	 * over for more nodes.
+	 */
+	avail = size - sizeof(struct buddy);
+	for (i = 1; (52 << i) <= avail && i < 15; i++)
+		;
+	b->hash_bits = i;
+	b->nodes = (avail - (2 << i)) / sizeof(struct buddy_node);
+	if (b->nodes > BUDDY_NIL)
+		b->nodes = BUDDY_NIL;
+	b->hash = (uint16_t *)&b->node[b->nodes];
+
+	b->start = start >> PAGE_BITS;
+	b->end = end >> PAGE_BITS;
+	b->nspare = b->nodes;
+	b->spare = 0;
+	for (i = 0; i < b->nodes; i++)
+		b->node[i].next = i + 1 < b->nodes ? i + 1 : BUDDY_NIL;
+	for (i = 0; i < BUDDY_ORDERS; i++) {
+		b->heads[i] = BUDDY_NIL;
+		b->counts[i] = 0;
 	}
-	exact_on_left = (region == exact);
-
-	if (exact_on_left && exact_on_right) {
-		/* there must be a right zone */
-		if (have_left_zone) {
-			/*
-			 * aaa  BBB  aaa
-			 *
-			 * We delete the last two and shift everything after
-			 * down by two:
-			 *
-			 * aaaAAAaaa
-			 *
-			 * (test_free)
-			 */
-			shift_zones_down(hdr, index, 2);
-		} else {
-			/*
-			 * BBB aaa
-			 *
-			 * Shift everything down by one and modify the AAA zone
-			 * to have our exact left address:
-			 *
-			 * AAAAAA
-			 */
-			shift_zones_down(hdr, index, 1);
-			hdr->zones[index].addr = (exact >> PAGE_BITS);
-		}
-	} else if (exact_on_left) {
-		/*
-		 * ?a? BBBbb (aaa)
-		 *
-		 * We move the current zone up to (exact+count). If
-		 * there's a left zone, we're set. Otherwise, we insert
-		 * one and set it to the correct status. We don't care if
-		 * there's a right zone.
-		 *
-		 * ?a?AAA bb AAA
-		 */
-		if (have_left_zone) {
-			hdr->zones[index].addr = ((exact + count) >> PAGE_BITS);
-		} else {
-			if (!shift_zones_up(hdr, index, 1))
-				return false;
-			hdr->zones[index + 1].addr =
-			        ((exact + count) >> PAGE_BITS);
-			hdr->zones[index].free = status;
-		}
-	} else if (exact_on_right) {
-		/*
-		 * ?a? bbBBB aaa
-		 *
-		 * We know there's a right zone, we just slide that one down.
-		 *
-		 * ?a? bb AAAaaa
-		 */
-		hdr->zones[index + 1].addr = (exact >> PAGE_BITS);
-	} else {
-		/*
-		 * ?a? bbBBBbb ?a?
-		 *
-		 * We must shift up two, insert a descriptor for the new AAA
-		 * zone, and a descriptor for the right side bb zone.
-		 *
-		 * ?a? bb AAA bb ?a?
-		 */
-		if (!shift_zones_up(hdr, index, 2))
-			return false;
-		hdr->zones[index + 1].addr = (exact >> PAGE_BITS);
-		hdr->zones[index + 1].free = status;
-		hdr->zones[index + 2].addr = ((exact + count) >> PAGE_BITS);
-		hdr->zones[index + 2].free = hdr->zones[index].free;
+	for (i = 0; i < (1 << b->hash_bits); i++)
+		b->hash[i] = BUDDY_NIL;
+
+	/*
+	 * Carve the memory into the largest aligned blocks possible. None of
+	 * these can be merged, so there's no need to use buddy_release().
+	 */
+	for (pfn = b->start; pfn < b->end; pfn += 1 << i) {
+		i = chunk_order(pfn, b->end);
+		buddy_push(b, pfn, i);
 	}
-	return true;
+}
+
+void init_page_allocator(void *allocator, uint32_t start, uint32_t end)
+{
+	init_page_allocator_sized(allocator, PAGE_SIZE, start, end);
+}
+
+void show_pages(void *allocator)
+{
+	struct buddy *b = (struct buddy *)allocator;
+	uint32_t i;
+	uint16_t idx;
+
+	printf("BEGIN FREE BLOCKS (%u of %u descriptors used)\n",
+	       b->nodes - b->nspare, b->nodes);
+	for (i = 0; i < BUDDY_ORDERS; i++) {
+		if (!b->counts[i])
+			continue;
+		printf(" order %u (%u pages): %u free\n", i, 1 << i,
+		       b->counts[i]);
+		for (idx = b->heads[i]; idx != BUDDY_NIL;
+		     idx = b->node[idx].next)
+			printf("  0x%x\n", b->node[idx].pfn << PAGE_BITS);
+	}
+	printf("END FREE BLOCKS\n");
 }
 
 /**
@@ -175,102 +256,137 @@ static bool change_status(struct zonehdr *hdr, uint32_t exact, uint32_t count,
  */
 uint32_t alloc_pages(void *allocator, uint32_t count, uint32_t align)
 {
-	uint32_t i, align_mask, zone, alignzone, next;
-	struct zonehdr *hdr = (struct zonehdr *)allocator;
-	bool result = false;
+	struct buddy *b = (struct buddy *)allocator;
+	uint32_t pages, order, k, pfn, tail;
+	uint16_t idx;
 
 	/* threshold alignment between PAGE_BITS <= align <= 32 */
 	align = (align < PAGE_BITS ? PAGE_BITS : align);
 	align = (align > 32 ? 32 : align);
 
-	/* align mask has the N least significant bits set */
-	align_mask = 0xFFFFFFFF >> (32 - align);
+	pages = (count + PAGE_SIZE - 1) >> PAGE_BITS;
+	if (!pages)
+		return 0;
 
-	for (i = 0; i < hdr->count; i++) {
-		if (!hdr->zones[i].free)
-			continue;
-		alignzone = zone = hdr->zones[i].addr << PAGE_BITS;
+	/* blocks are naturally aligned, so alignment is just a minimum order */
+	for (order = align - PAGE_BITS; (1 << order) < pages; order++)
+		;
+	if (order >= BUDDY_ORDERS)
+		return 0;
 
-		/* align memory if necessary */
-		if (zone & align_mask) {
-			alignzone = ((zone >> align) + 1) << align;
-		}
+	for (k = order; k < BUDDY_ORDERS; k++)
+		if (b->heads[k] != BUDDY_NIL)
+			break;
+	if (k == BUDDY_ORDERS)
+		return 0;
 
-		next = hdr->zones[i + 1].addr << PAGE_BITS;
-		if (alignzone + count > next) {
-			/* can't satisfy alignment and/or size in zone */
-			continue;
-		}
+	idx = b->heads[k];
+	pfn = b->node[idx].pfn;
 
-		result = change_status(hdr, alignzone, count, zone, i, 0);
-		if (result) {
-			return alignzone;
-		}
+	/*
+	 * Splitting the block down to our order frees one block per order, and
+	 * then we free any pages past what we need. Make sure we have enough
+	 * descriptors for all that before touching anything.
+	 */
+	tail = pfn + (1 << order);
+	if (b->nspare + 1 < k - order + count_chunks(pfn + pages, tail))
+		return 0;
+
+	buddy_remove(b, idx);
+	while (k > order) {
+		k--;
+		buddy_push(b, pfn + (1 << k), k);
 	}
 
-	return 0;
+	/* The tail's buddies are all (partly) allocated, no need to merge. */
+	for (tail = pfn + pages; tail < pfn + (1 << order); tail += 1 << k) {
+		k = chunk_order(tail, pfn + (1 << order));
+		buddy_push(b, tail, k);
+	}
+	return pfn << PAGE_BITS;
 }
 
 bool free_pages(void *allocator, uint32_t start, uint32_t count)
 {
-	uint32_t i, addr, next;
-	bool has_next;
-	struct zonehdr *hdr = (struct zonehdr *)allocator;
+	struct buddy *b = (struct buddy *)allocator;
+	uint32_t pfn, end, order, need = 0;
+	uint16_t idx;
 
-	for (i = 0; i < hdr->count; i++) {
-		addr = hdr->zones[i].addr << PAGE_BITS;
-		has_next = i + 1 < hdr->count;
+	if (!page_range(b, start, count, &pfn, &end))
+		return false;
 
-		/* Trying to free a region from before the allocator's memory.
-		 */
-		if (addr > start)
+	/* already freed, or never even allocated */
+	for (start = pfn; start < end; start += 1 << order) {
+		order = chunk_order(start, end);
+		if (buddy_overlaps(b, start, order))
 			return false;
+	}
 
-		/* Compute next */
-		if (has_next)
-			next = hdr->zones[i + 1].addr << PAGE_BITS;
-
-		/* If the zone doesn't fit within this block, continue */
-		if (has_next && start + count > next)
-			continue;
-
-		/* already freed, or never even allocated */
-		if (hdr->zones[i].free)
+	/*
+	 * Each chunk needs at most one descriptor. When we're short, look
+	 * closer: a chunk which merges with its buddy reuses the buddy's.
+	 */
+	if (b->nspare < count_chunks(pfn, end)) {
+		for (start = pfn; start < end; start += 1 << order) {
+			order = chunk_order(start, end);
+			idx = buddy_lookup(b, start ^ (1 << order));
+			if (idx == BUDDY_NIL || b->node[idx].order != order ||
+			    order + 1 == BUDDY_ORDERS)
+				need++;
+		}
+		if (b->nspare < need)
 			return false;
+	}
 
-		return change_status(hdr, start, count, addr, i, 1);
+	for (start = pfn; start < end; start += 1 << order) {
+		order = chunk_order(start, end);
+		buddy_release(b, start, order);
 	}
-	return false;
+	return true;
 }
 
 bool mark_alloc(void *allocator, uint32_t start, uint32_t count)
 {
-	uint32_t i, addr, next;
-	bool has_next;
-	struct zonehdr *hdr = (struct zonehdr *)allocator;
-
-	for (i = 0; i < hdr->count; i++) {
-		addr = hdr->zones[i].addr << PAGE_BITS;
-		has_next = i + 1 < hdr->count;
-
-		/* Trying to free a region from before the allocator's memory.
-		 */
-		if (addr > start)
-			return false;
-
-		/* Compute next */
-		if (has_next)
-			next = hdr->zones[i + 1].addr << PAGE_BITS;
+	struct buddy *b = (struct buddy *)allocator;
+	uint32_t pfn, end, order, blk, k, need = 0;
+	uint16_t idx;
 
-		/* If the zone doesn't fit within this block, continue */
-		if (has_next && start + count > next)
-			continue;
+	if (!page_range(b, start, count, &pfn, &end))
+		return false;
 
-		/* already allocated! */
-		if (!hdr->zones[i].free)
-			return false;
+	/*
+	 * Check that everything is free, and count how many descriptors we
+	 * could need to split the containing blocks.
+	 */
+	for (start = pfn; start < end; start += 1 << order) {
+		order = chunk_order(start, end);
+		idx = buddy_containing(b, start, order);
+		if (idx == BUDDY_NIL)
+			return false; /* already allocated! */
+		need += b->node[idx].order - order;
+	}
+	if (b->nspare < need)
+		return false;
 
-		return change_status(hdr, start, count, addr, i, 0);
+	/*
+	 * Split each containing block down until the chunk is isolated, freeing
+	 * the other half at each level.
+	 */
+	for (start = pfn; start < end; start += 1 << order) {
+		order = chunk_order(start, end);
+		idx = buddy_containing(b, start, order);
+		blk = b->node[idx].pfn;
+		k = b->node[idx].order;
+		buddy_remove(b, idx);
+		while (k > order) {
+			k--;
+			if (start & (1 << k)) {
+				buddy_push(b, blk, k);
+				blk += 1 << k;
+			} else {
+				buddy_push(b, blk + (1 << k), k);
+			}
+		}
 	}
-	return false;
+	return true;
 }
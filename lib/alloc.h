@@ -21,7 +21,21 @@
 void init_page_allocator(void *allocator, uint32_t start, uint32_t end);
 
 /**
- * Print out all allocations, for debugging.
+ * Create a page allocator with more than one page of memory for its own use.
+ * The allocator needs a small descriptor for each free block of memory, so an
+ * allocator which will see heavy fragmentation (e.g. the kernel's) should be
+ * given more room. One page fits roughly 310 free blocks.
+ *
+ * allocator: pointer to `size` bytes of memory for use by allocator
+ * size: bytes available at allocator, at most 768KB
+ * start: address of first byte of memory managed by the allocator
+ * end: address of the first byte of memory no longer managed by us
+ */
+void init_page_allocator_sized(void *allocator, uint32_t size, uint32_t start,
+                               uint32_t end);
+
+/**
+ * Print out all free blocks, for debugging.
  */
 void show_pages(void *allocator);
 
@@ -41,10 +55,12 @@ uint32_t alloc_pages(void *allocator, uint32_t count, uint32_t align);
  * Free physical pages.
  * addr: address of range to free
  * count: number of bytes to free
+ * return: false if any of the range was not allocated (nothing is freed)
  */
 bool free_pages(void *allocator, uint32_t addr, uint32_t count);
 
 /**
  * Mark a memory region as allocated.
+ * return: false if any of the range was already allocated (nothing is marked)
  */
 bool mark_alloc(void *allocator, uint32_t start, uint32_t count);
@@ -8,23 +8,54 @@
 
 #include "alloc.h"
 
-#define MAX_DESCRIPTORS 1023
-
-/**
- * Zone descriptors manage zones of memory. The minimum zone that can be managed
- * by this mechanism is one 4096-byte page.
+/*
+ * The page allocator is a binary buddy allocator. A block of order k is 2^k
+ * pages long, and its first page frame number is a multiple of 2^k. The
+ * "buddy" of a block is the other half of the order k+1 block containing it,
+ * and when a block and its buddy are both free, they are merged.
  *
- * Zone descriptors are kept in a sorted array (the zonelist), which may
- * dynamically expand and contract as needed. Each entry in the array is 4
- * bytes, containing the start address of the zone.
+ * The allocator never writes into the memory it manages: it may be managing a
+ * virtual address space which isn't even mapped. Instead, each free block is
+ * described by a node stored in the allocator's own metadata memory. Nodes are
+ * linked into a free list for their order (so allocation looks at no more than
+ * BUDDY_ORDERS lists), and into a hash table keyed by page frame number (so
+ * finding the buddy of a freed block is a single lookup).
+ *
+ * Since a free block's buddy is never free (they would have been merged), an
+ * aligned range of free pages is always within a single free block.
  */
-struct zone {
-	unsigned int addr : 20;         /* last 12 bits do not matter */
-	unsigned int _unallocated : 11; /* reserved for other uses */
-	unsigned int free : 1;          /* boolean */
+#define BUDDY_ORDERS 20 /* largest block is 2^19 pages, or 2GiB */
+#define BUDDY_NIL    0xFFFF
+
+struct buddy_node {
+	unsigned int pfn : 20;     /* first page frame of the block */
+	unsigned int order : 5;    /* block is 2^order pages */
+	unsigned int _unused : 7;  /* reserved for other uses */
+	uint16_t next;             /* free list (or spare list) link */
+	uint16_t prev;             /* free list link */
+	uint16_t hnext;            /* hash bucket link */
+	uint16_t _pad;
 };
-struct zonehdr {
-	unsigned int next : 22;  /* last 10 bits do not matter */
-	unsigned int count : 10; /* number of zone structs */
-	struct zone zones[];     /* array of zones */
+
+/*
+ * The metadata memory contains this header, followed by the array of nodes,
+ * followed by the hash buckets. The number of each depends on how much memory
+ * the allocator was given.
+ */
+struct buddy {
+	uint32_t start;                 /* first page frame managed */
+	uint32_t end;                   /* first page frame not managed */
+	uint16_t nodes;                 /* number of node structs */
+	uint16_t spare;                 /* list of unused nodes */
+	uint16_t nspare;                /* length of spare list */
+	uint16_t hash_bits;             /* there are 2^hash_bits buckets */
+	uint16_t *hash;                 /* hash buckets, by pfn */
+	uint16_t heads[BUDDY_ORDERS];   /* free list of each order */
+	uint16_t counts[BUDDY_ORDERS];  /* length of each free list */
+	struct buddy_node node[];       /* array of nodes */
 };
+
+static inline uint32_t buddy_hash(struct buddy *b, uint32_t pfn)
+{
+	return (pfn * 2654435761U) >> (32 - b->hash_bits);
+}
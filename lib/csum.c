@@ -0,0 +1,116 @@
+/*
+ * Internet checksum
+ *
+ * The one's complement sum of 16-bit words can be computed 32 bits at a time,
+ * since the carries out of each half are added back in when the sum is
+ * folded. On ARM, the bulk of the data is summed 16 bytes per LDM with a chain
+ * of ADCS instructions. Everything else is portable C, which is what the host
+ * unit tests exercise.
+ */
+#include "csum.h"
+
+/*
+ * Words may alias any other type, since we use them to access packet buffers.
+ */
+typedef uint32_t __attribute__((__may_alias__)) word_t;
+typedef uint16_t __attribute__((__may_alias__)) half_t;
+
+void csum_init(uint32_t *csum)
+{
+	*csum = 0;
+}
+
+/*
+ * Sum blocks of 16 bytes from an aligned pointer, with end-around carry.
+ * Returns the number of bytes summed.
+ */
+static inline uint32_t sum_blocks(uint64_t *sum, const word_t *w, uint32_t n)
+{
+	uint32_t blocks = n & ~15;
+#ifdef __arm__
+	uint32_t left = blocks / 16;
+	uint32_t acc = 0;
+	if (left)
+		asm volatile("1:\n\t"
+		             "ldmia %1!, {r3, r4, r5, r6}\n\t"
+		             "adds %0, %0, r3\n\t"
+		             "adcs %0, %0, r4\n\t"
+		             "adcs %0, %0, r5\n\t"
+		             "adcs %0, %0, r6\n\t"
+		             "adc %0, %0, #0\n\t"
+		             "subs %2, %2, #1\n\t"
+		             "bne 1b\n\t"
+		             : "+r"(acc), "+r"(w), "+r"(left)
+		             :
+		             : "r3", "r4", "r5", "r6", "cc", "memory");
+	*sum += acc;
+#else
+	uint32_t i;
+	for (i = 0; i < blocks / 4; i += 4)
+		*sum += (uint64_t)w[i] + w[i + 1] + w[i + 2] + w[i + 3];
+#endif
+	return blocks;
+}
+
+void csum_add(uint32_t *csum, const void *data, uint32_t n)
+{
+	const uint8_t *p = data;
+	uint32_t bytes = n * 2;
+	uint64_t sum = *csum;
+	uint32_t done;
+
+	if (bytes && ((uintptr_t)p & 2)) {
+		sum += *(const half_t *)p;
+		p += 2;
+		bytes -= 2;
+	}
+
+	done = sum_blocks(&sum, (const word_t *)p, bytes);
+	p += done;
+	bytes -= done;
+
+	for (; bytes >= 4; p += 4, bytes -= 4)
+		sum += *(const word_t *)p;
+	if (bytes)
+		sum += *(const half_t *)p;
+
+	/* 2^32 is 1 in one's complement arithmetic */
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	*csum = (uint32_t)sum;
+}
+
+void csum_add_bytes(uint32_t *csum, const void *data, uint32_t len)
+{
+	union {
+		uint8_t b[2];
+		uint16_t w;
+	} last = { { 0, 0 } };
+
+	csum_add(csum, data, len / 2);
+	if (len & 1) {
+		last.b[0] = ((const uint8_t *)data)[len - 1];
+		csum_add(csum, &last.w, 1);
+	}
+}
+
+void csum_add_value(uint32_t *csum, uint16_t data)
+{
+	csum_add(csum, &data, 1);
+}
+
+uint16_t csum_fold(uint32_t *csum)
+{
+	uint32_t add;
+	while (*csum & 0xFFFF0000) {
+		add = (*csum & 0xFFFF0000) >> 16;
+		*csum &= 0x0000FFFF;
+		*csum += add;
+	}
+	return (uint16_t)*csum;
+}
+
+uint16_t csum_finalize(uint32_t *csum)
+{
+	return ~csum_fold(csum);
+}
@@ -0,0 +1,41 @@
+/*
+ * Internet checksum (RFC 1071)
+ *
+ * A checksum is accumulated into a uint32_t with csum_init() and the csum_add
+ * functions, in any order, and then folded into its final 16-bit form with
+ * csum_finalize(). Data is summed in memory order, so the result is already in
+ * network byte order.
+ */
+#ifndef SOS_CSUM_H
+#define SOS_CSUM_H
+
+#include <stdint.h>
+
+void csum_init(uint32_t *csum);
+
+/*
+ * Add n 16-bit words at data, which must be 2-byte aligned.
+ */
+void csum_add(uint32_t *csum, const void *data, uint32_t n);
+
+/*
+ * Add len bytes at data (2-byte aligned). An odd final byte is padded with
+ * zero, as the checksum requires.
+ */
+void csum_add_bytes(uint32_t *csum, const void *data, uint32_t len);
+
+void csum_add_value(uint32_t *csum, uint16_t data);
+
+/*
+ * Fold the accumulator into 16 bits, without complementing it. This is what
+ * goes in the checksum field for a device to finish the job.
+ */
+uint16_t csum_fold(uint32_t *csum);
+
+/*
+ * Return the complemented checksum. For data which includes its own checksum
+ * field, this is zero when the checksum is correct.
+ */
+uint16_t csum_finalize(uint32_t *csum);
+
+#endif
@@ -80,6 +80,11 @@ void list_insert_end(struct list_head *head, struct list_head *item);
 void list_remove(struct list_head *item);
 void hlist_remove(struct hlist_head *parent_or_head, struct hlist_head *item);
 
+/**
+ * Evaluates to true if the list referred to by `head` has no items.
+ */
+#define list_empty(head) ((head)->next == (head))
+
 /**
  * Iterate through list_head structures. This usually is not a very helpful
  * technique, but it's here for you.
@@ -141,6 +146,17 @@ void hlist_remove(struct hlist_head *parent_or_head, struct hlist_head *item);
 	     var_ptr = alt_container_of(var_ptr->field_name.next, var_ptr,     \
 	                                field_name))
 
+/**
+ * Iterate over every item within a list, from the last to the first. Arguments
+ * are the same as list_for_each_entry().
+ */
+#define list_for_each_entry_reverse(var_ptr, head, field_name)                 \
+	for (var_ptr = NULL,                                                   \
+	    var_ptr = alt_container_of((head)->prev, var_ptr, field_name);     \
+	     &var_ptr->field_name != (head);                                   \
+	     var_ptr = alt_container_of(var_ptr->field_name.prev, var_ptr,     \
+	                                field_name))
+
 /**
  * Iterate over every item within a list, but allow removing the node you are
  * iterating over while doing so.
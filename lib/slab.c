@@ -1,8 +1,8 @@
 /*
  * Slab allocator for frequently used structures. Built on top of a page
- * allocator. The first page allocated contains the struct slab, and the
- * remaining space is filled by structures. Subsequent pages contain only the
- * structures.
+ * allocator. Each page of a slab has a header (struct slab_page) which tracks
+ * its free structures, and the page is kept on one of three lists: full,
+ * partial, or empty. The struct slab itself is allocated from a slab too.
  */
 #include <stdint.h>
 
@@ -10,6 +10,18 @@
 
 #define PAGE_SIZE 4096
 
+/*
+ * Structures larger than this keep their page header outside of the page. For
+ * instance, 2048-byte packets would otherwise fit only once per page.
+ */
+#define SLAB_ONPAGE_MAX (PAGE_SIZE / 8)
+
+/* Buckets in a page-sized hash table */
+#define SLAB_HASH_MAX (PAGE_SIZE / sizeof(struct slab_page *))
+
+#define slab_page_hash(slab, page)                                             \
+	(((uintptr_t)(page) / PAGE_SIZE) & ((slab)->hash_size - 1))
+
 /**
  * Declare this so we don't depend on any particular library providing printf,
  * whether it's the standard library or my own printf implementation...
@@ -18,87 +30,285 @@ extern int printf(const char *fmt, ...);
 
 DECLARE_LIST_HEAD(slabs);
 
-static void slab_add_entries(struct slab *slab, void *page, unsigned int len)
+/*
+ * Slabs for the allocator's own structures. These are set up on the first
+ * call to slab_new(), and use the same page allocator as it.
+ */
+static struct slab slab_slab;
+static struct slab slab_page_slab;
+
+static void slab_init(struct slab *slab, char *name, unsigned int size,
+                      void *(*getter)(void), void (*putter)(void *))
 {
 	unsigned int i;
-	struct list_head *tmp;
 
-	for (i = 0; i + slab->size <= len; i += slab->size) {
-		tmp = (struct list_head *)(page + i);
-		list_insert_end(&slab->entries, tmp);
-		slab->total += 1;
-		slab->free += 1;
-	}
+	/* every structure must be able to hold the free list link */
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	slab->size = size;
+	slab->offpage = size > SLAB_ONPAGE_MAX;
+	slab->offset = slab->offpage ? 0
+	                             : (sizeof(struct slab_page) + 7) & ~7;
+	slab->per_page = (PAGE_SIZE - slab->offset) / size;
+	slab->total = 0;
+	slab->free = 0;
+	slab->pages = 0;
+	slab->empty_pages = 0;
+	slab->watermark = SLAB_DEFAULT_WATERMARK;
+	slab->reclaimed = 0;
+	slab->name = name;
+	slab->page_getter = getter;
+	slab->page_putter = putter;
+	INIT_LIST_HEAD(slab->full);
+	INIT_LIST_HEAD(slab->partial);
+	INIT_LIST_HEAD(slab->empty);
+	for (i = 0; i < SLAB_HASH; i++)
+		slab->hash_small[i] = NULL;
+	slab->hash = slab->hash_small;
+	slab->hash_size = SLAB_HASH;
+	list_insert_end(&slabs, &slab->slabs);
 }
 
-struct slab *slab_new(char *name, unsigned int size, void *(*getter)(void))
+struct slab *slab_new(char *name, unsigned int size, void *(*getter)(void),
+                      void (*putter)(void *))
 {
-	void *void_page = getter();
-	struct slab *slab = void_page;
+	struct slab *slab;
 
-	if (size < sizeof(struct list_head)) {
-		printf("slab: invalid slab size %u smaller than llnode %u\n",
-		       size, sizeof(struct list_head));
+	if (size < sizeof(void *) || size > PAGE_SIZE) {
+		printf("slab: invalid slab size %u, must be between %u and "
+		       "%u\n",
+		       size, sizeof(void *), PAGE_SIZE);
 		return NULL;
 	}
 
-	slab->size = size;
-	slab->total = 0;
-	slab->free = slab->total;
-	slab->page_getter = getter;
-	INIT_LIST_HEAD(slab->entries);
-	list_insert_end(&slabs, &slab->slabs);
-	slab->name = name;
+	if (!slab_slab.size) {
+		slab_init(&slab_slab, "slab", sizeof(struct slab), getter,
+		          putter);
+		slab_init(&slab_page_slab, "slab_page",
+		          sizeof(struct slab_page), getter, putter);
+	}
 
-	slab_add_entries(slab, void_page + sizeof(struct slab),
-	                 PAGE_SIZE - sizeof(struct slab));
+	slab = slab_alloc(&slab_slab);
+	if (!slab)
+		return NULL;
+	slab_init(slab, name, size, getter, putter);
 	return slab;
 }
 
-void *slab_alloc(struct slab *slab)
+/**
+ * Return the header of the page containing ptr.
+ */
+static struct slab_page *slab_page_of(struct slab *slab, void *ptr)
 {
-	struct list_head *entry;
+	void *page = (void *)((uintptr_t)ptr & ~(PAGE_SIZE - 1));
+	struct slab_page *sp;
+
+	if (!slab->offpage)
+		return page;
 
-	/* Expand if necessary */
-	if (slab->free == 0) {
-		void *page = slab->page_getter();
-		slab_add_entries(slab, page, PAGE_SIZE);
+	for (sp = slab->hash[slab_page_hash(slab, page)]; sp; sp = sp->hnext)
+		if (sp->page == page)
+			return sp;
+	return NULL;
+}
+
+/**
+ * Once there are more off-page headers than buckets, move them to a page of
+ * buckets, so that chains stay short. If we can't get a page, the small table
+ * still works.
+ */
+static void slab_hash_grow(struct slab *slab)
+{
+	struct slab_page **hash, **old = slab->hash, *sp, *next;
+	unsigned int i, old_size = slab->hash_size;
+
+	if (slab->hash_size == SLAB_HASH_MAX || slab->pages < slab->hash_size)
+		return;
+	hash = slab->page_getter();
+	if (!hash)
+		return;
+
+	for (i = 0; i < SLAB_HASH_MAX; i++)
+		hash[i] = NULL;
+	slab->hash = hash;
+	slab->hash_size = SLAB_HASH_MAX;
+	for (i = 0; i < old_size; i++) {
+		for (sp = old[i]; sp; sp = next) {
+			next = sp->hnext;
+			sp->hnext = hash[slab_page_hash(slab, sp->page)];
+			hash[slab_page_hash(slab, sp->page)] = sp;
+		}
 	}
+	if (old != slab->hash_small && slab->page_putter)
+		slab->page_putter(old);
+}
 
-	/* Return the first available entry from the first page */
-	list_for_each(entry, &slab->entries)
-	{
-		slab->free -= 1;
-		list_remove(entry);
-		return (void *)entry;
+/**
+ * Get a new page from the page allocator and add it to the empty list.
+ */
+static struct slab_page *slab_grow(struct slab *slab)
+{
+	void *page = slab->page_getter();
+	struct slab_page *sp;
+	unsigned int i;
+
+	if (!page)
+		return NULL;
+
+	if (slab->offpage) {
+		sp = slab_alloc(&slab_page_slab);
+		if (!sp) {
+			slab->page_putter(page);
+			return NULL;
+		}
+		slab_hash_grow(slab);
+		sp->hnext = slab->hash[slab_page_hash(slab, page)];
+		slab->hash[slab_page_hash(slab, page)] = sp;
+	} else {
+		sp = page;
+		sp->hnext = NULL;
 	}
 
-	return NULL;
+	/* build the free list backwards, so we hand out low addresses first */
+	sp->page = page;
+	sp->inuse = 0;
+	sp->freelist = NULL;
+	for (i = slab->per_page; i > 0; i--) {
+		void *obj = page + slab->offset + (i - 1) * slab->size;
+		*(void **)obj = sp->freelist;
+		sp->freelist = obj;
+	}
+
+	list_insert(&slab->empty, &sp->list);
+	slab->pages += 1;
+	slab->empty_pages += 1;
+	slab->total += slab->per_page;
+	slab->free += slab->per_page;
+	return sp;
+}
+
+/**
+ * Give an empty page back to the page allocator.
+ */
+static void slab_release(struct slab *slab, struct slab_page *sp)
+{
+	struct slab_page **link;
+	void *page = sp->page;
+
+	list_remove(&sp->list);
+	slab->pages -= 1;
+	slab->empty_pages -= 1;
+	slab->total -= slab->per_page;
+	slab->free -= slab->per_page;
+	slab->reclaimed += 1;
+
+	if (slab->offpage) {
+		link = &slab->hash[slab_page_hash(slab, page)];
+		while (*link != sp)
+			link = &(*link)->hnext;
+		*link = sp->hnext;
+		slab_free(&slab_page_slab, sp);
+	}
+	slab->page_putter(page);
+}
+
+/**
+ * Free empty pages until we are at the watermark. We free the least recently
+ * emptied pages, since they are the least likely to be in cache.
+ */
+static void slab_shrink(struct slab *slab)
+{
+	while (slab->empty_pages > slab->watermark && slab->page_putter)
+		slab_release(slab, container_of(slab->empty.prev,
+		                                struct slab_page, list));
+}
+
+void *slab_alloc(struct slab *slab)
+{
+	struct slab_page *sp;
+	void *obj;
+
+	if (!list_empty(&slab->partial)) {
+		sp = container_of(slab->partial.next, struct slab_page, list);
+	} else {
+		/* Expand if necessary */
+		if (list_empty(&slab->empty) && !slab_grow(slab))
+			return NULL;
+		sp = container_of(slab->empty.next, struct slab_page, list);
+		slab->empty_pages -= 1;
+		list_remove(&sp->list);
+		list_insert(&slab->partial, &sp->list);
+	}
+
+	obj = sp->freelist;
+	sp->freelist = *(void **)obj;
+	sp->inuse += 1;
+	slab->free -= 1;
+
+	if (sp->inuse == slab->per_page) {
+		list_remove(&sp->list);
+		list_insert(&slab->full, &sp->list);
+	}
+	return obj;
 }
 
 void slab_free(struct slab *slab, void *ptr)
 {
-	list_insert(&slab->entries, (struct list_head *)ptr);
-	slab->free++;
+	struct slab_page *sp = slab_page_of(slab, ptr);
+
+	if (!sp) {
+		printf("slab: \"%s\" does not contain 0x%x\n", slab->name, ptr);
+		return;
+	}
+
+	*(void **)ptr = sp->freelist;
+	sp->freelist = ptr;
+	slab->free += 1;
+
+	if (sp->inuse-- == slab->per_page) {
+		list_remove(&sp->list);
+		list_insert(&slab->partial, &sp->list);
+	}
+	if (sp->inuse == 0) {
+		list_remove(&sp->list);
+		list_insert(&slab->empty, &sp->list);
+		slab->empty_pages += 1;
+		slab_shrink(slab);
+	}
+}
+
+void slab_set_watermark(struct slab *slab, unsigned int pages)
+{
+	slab->watermark = pages;
+	slab_shrink(slab);
+}
+
+static unsigned int slab_count_pages(struct list_head *head)
+{
+	struct list_head *entry;
+	unsigned int count = 0;
+	list_for_each(entry, head)
+	{
+		count++;
+	}
+	return count;
 }
 
 void slab_report(struct slab *slab)
 {
-	int headerct, headerwaste, regct, regwaste, pages;
+	unsigned int waste;
 	printf(" slab \"%s\":\n", slab->name);
 	printf("  item_size %u\n  %u alloc / %u total (%u free)\n", slab->size,
 	       slab->total - slab->free, slab->total, slab->free);
-	headerct = (PAGE_SIZE - sizeof(struct slab)) / slab->size;
-	regct = PAGE_SIZE / slab->size;
-	headerwaste = PAGE_SIZE - sizeof(struct slab) - slab->size * headerct;
-	regwaste = PAGE_SIZE - slab->size * regct;
-	printf("  header fits %u structures, wasting %u bytes\n", headerct,
-	       headerwaste);
-	printf("  regular page fits %u structures, wasting %u bytes\n", regct,
-	       regwaste);
-	pages = (slab->total - headerct) / regct + 1;
-	printf("  %u pages (including header) allocated = %u bytes\n", pages,
-	       pages * PAGE_SIZE);
+	waste = PAGE_SIZE - slab->offset - slab->size * slab->per_page;
+	printf("  page fits %u structures, wasting %u bytes (%s header)\n",
+	       slab->per_page, waste, slab->offpage ? "off-page" : "on-page");
+	printf("  %u pages = %u bytes: %u full, %u partial, %u empty\n",
+	       slab->pages, slab->pages * PAGE_SIZE,
+	       slab_count_pages(&slab->full), slab_count_pages(&slab->partial),
+	       slab->empty_pages);
+	printf("  keeps %u empty pages, %u pages reclaimed\n", slab->watermark,
+	       slab->reclaimed);
 }
 
 void slab_report_all(void)
@@ -5,11 +5,13 @@
  * sockets, packets, etc. They help reduce memory fragmentation and can very
  * quickly allocate in most cases.
  *
- * This implementation can grow, but not shrink. Note that it depends on the
- * page size, and that wasted memory can occur if your objects don't fit nicely
- * into a page. Common examples of this are:
+ * Each page of a slab is either full, partially full, or empty. Allocations
+ * come from partially full pages first, which keeps objects packed together,
+ * and empty pages beyond a watermark are given back to the page allocator.
+ * Note that this depends on the page size, and that wasted memory can occur if
+ * your objects don't fit nicely into a page. Common examples of this are:
  *
- * - Objects larger than a page, of course
+ * - Objects larger than a page, of course (these are not supported)
  * - Objects which are large and not near a power of two. For example, a
  *   3072-byte structure will fit once within a page, wasting 1024 bytes in
  *   every page which is part of the slab. This allocator is not equipped to
@@ -24,14 +26,22 @@
  */
 struct slab;
 
+/*
+ * How many empty pages a slab keeps around by default before it starts giving
+ * them back.
+ */
+#define SLAB_DEFAULT_WATERMARK 1
+
 /**
  * Create a new named slab cache.
  *
  * name: name of the slab allocator (used in diagnostics)
  * size: size of the item
  * getter: function which returns freshly allocated pages
+ * putter: function which frees pages returned by getter
  */
-struct slab *slab_new(char *name, unsigned int size, void *(*getter)(void));
+struct slab *slab_new(char *name, unsigned int size, void *(*getter)(void),
+                      void (*putter)(void *));
 
 /**
  * Allocate an object from the slab.
@@ -48,6 +58,15 @@ void *slab_alloc(struct slab *slab);
  */
 void slab_free(struct slab *slab, void *ptr);
 
+/**
+ * Set the number of empty pages a slab may keep before freeing them, and free
+ * any empty pages beyond that right away.
+ *
+ * slab: the slab to configure
+ * pages: number of empty pages to keep
+ */
+void slab_set_watermark(struct slab *slab, unsigned int pages);
+
 /**
  * Report on the status of a slab. Requires a printf implementation linked in
  * with the library.
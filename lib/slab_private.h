@@ -1,15 +1,52 @@
 #pragma once
 
+#include <stdbool.h>
+
 #include "list.h"
 #include "slab.h"
 
+/*
+ * Buckets in the hash table of off-page headers. It starts out small, inside
+ * struct slab, and once the slab has more pages than that it moves to a whole
+ * page of buckets from the page allocator (see slab_hash_grow()).
+ */
+#define SLAB_HASH 16
+
+/*
+ * Every page belonging to a slab has one of these. For small objects, it lives
+ * at the beginning of the page itself, so finding the page of an object is
+ * just masking off the low bits. For large objects that would waste too much
+ * of the page, it is allocated separately and found through a hash table in
+ * the slab, which has about one header per bucket.
+ */
+struct slab_page {
+	struct list_head list;   /* entry in full, partial or empty list */
+	struct slab_page *hnext; /* off-page headers: hash bucket link */
+	void *page;              /* address of the page */
+	void *freelist;          /* free objects, linked through first word */
+	unsigned int inuse;      /* count of allocated objects */
+};
+
 struct slab {
 	unsigned int size;        /* size of structure */
+	unsigned int per_page;    /* count of structures in each page */
+	unsigned int offset;      /* offset of first structure in a page */
+	bool offpage;             /* are page headers kept outside the page? */
 	unsigned int total;       /* count of structures in total */
 	unsigned int free;        /* count which are free */
+	unsigned int pages;       /* count of pages */
+	unsigned int empty_pages; /* count of pages in empty list */
+	unsigned int watermark;   /* max empty pages before we free them */
+	unsigned int reclaimed;   /* count of pages we've freed */
 	char *name;               /* name of this slab allocator, diagnostic */
-	struct list_head entries; /* list of pages */
+	struct list_head full;    /* list of pages with no free structures */
+	struct list_head partial; /* list of pages with some free structures */
+	struct list_head empty;   /* list of pages with only free structures */
 	struct list_head slabs;   /* list of slab allocators */
+	struct slab_page **hash;  /* off-page headers, by address */
+	unsigned int hash_size;   /* buckets in hash, a power of two */
+	struct slab_page *hash_small[SLAB_HASH];
 
 	void *(*page_getter)(void);
+	void (*page_putter)(void *);
 };
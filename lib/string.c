@@ -1,18 +1,51 @@
 /*
- * String utilities - very inefficient ones at that
+ * String utilities
+ *
+ * The memory routines and strlen() work a word at a time once the pointers are
+ * aligned. On ARM, the bulk of memcpy() and memset() is done with LDM/STM, 16
+ * bytes per instruction pair. Everything else is portable C, which is what the
+ * host unit tests exercise.
  */
 #include "string.h"
 
+#ifdef TEST_PREFIX
+#define strlen  test_strlen
+#define strcmp  test_strcmp
+#define memcmp  test_memcmp
+#define memcpy  test_memcpy
+#define memset  test_memset
+#endif
+
 /*
- * TODO: please for the love of god write an optimized strcpy / memcpy :(
+ * Words may alias any other type, since we use them to access char buffers.
  */
+typedef uint32_t __attribute__((__may_alias__)) word_t;
+
+#define WORD     sizeof(word_t)
+#define WORDMASK (WORD - 1)
+
+/* true if any byte of w is zero */
+#define haszero(w) (((w) - 0x01010101U) & ~(w) & 0x80808080U)
 
 uint32_t strlen(const char *string)
 {
-	uint32_t len;
-	for (len = 0; string[len]; len++) {
+	const char *s = string;
+	const word_t *w;
+
+	for (; (uintptr_t)s & WORDMASK; s++)
+		if (!*s)
+			return s - string;
+
+	/*
+	 * Reading the whole aligned word containing the terminator is safe: it
+	 * can't cross into another page.
+	 */
+	for (w = (const word_t *)s; !haszero(*w); w++) {
+	};
+
+	for (s = (const char *)w; *s; s++) {
 	};
-	return len;
+	return s - string;
 }
 
 int strcmp(const char *lhs, const char *rhs)
@@ -26,10 +59,42 @@ int strcmp(const char *lhs, const char *rhs)
 
 int memcmp(const uint8_t *lhs, const uint8_t *rhs, size_t n)
 {
-	size_t i;
-	for (i = 0; i < n; i++)
-		if (lhs[i] != rhs[i])
-			return lhs[i] - rhs[i];
+	const word_t *lw, *rw;
+	word_t prev, next;
+	uint32_t shift;
+
+	/* compare bytes until lhs is aligned */
+	for (; n && ((uintptr_t)lhs & WORDMASK); n--, lhs++, rhs++)
+		if (*lhs != *rhs)
+			return *lhs - *rhs;
+
+	/* skip equal words, then find the differing byte below */
+	lw = (const word_t *)lhs;
+	if (((uintptr_t)rhs & WORDMASK) == 0) {
+		rw = (const word_t *)rhs;
+		for (; n >= WORD && *lw == *rw; n -= WORD) {
+			lw++;
+			rw++;
+		}
+		rhs = (const uint8_t *)rw;
+	} else if (n >= 2 * WORD) {
+		/* rhs is misaligned: shift its words together like memcpy() */
+		shift = 8 * ((uintptr_t)rhs & WORDMASK);
+		rw = (const word_t *)((uintptr_t)rhs & ~WORDMASK);
+		prev = *rw++;
+		for (; n >= 2 * WORD; n -= WORD, lw++, rw++) {
+			next = *rw;
+			if (*lw != ((prev >> shift) | (next << (32 - shift))))
+				break;
+			prev = next;
+		}
+		rhs = (const uint8_t *)rw - WORD + shift / 8;
+	}
+	lhs = (const uint8_t *)lw;
+
+	for (; n; n--, lhs++, rhs++)
+		if (*lhs != *rhs)
+			return *lhs - *rhs;
 	return 0;
 }
 
@@ -68,27 +133,121 @@ unsigned int strlcpy(char *dst, const char *src, unsigned int size)
 	return i;
 }
 
-/* wow this is bad */
-void *memcpy(void *dest, const void *src, size_t n)
+/*
+ * Copy n bytes from an aligned src to an aligned dest, where n is a multiple of
+ * 16. Returns the number of bytes copied.
+ */
+static inline size_t copy_blocks(word_t *dest, const word_t *src, size_t n)
 {
+	size_t blocks = n & ~15;
+#ifdef __arm__
+	size_t left = blocks;
+	if (left)
+		asm volatile("1:\n\t"
+		             "ldmia %1!, {r3, r4, r5, r6}\n\t"
+		             "stmia %0!, {r3, r4, r5, r6}\n\t"
+		             "subs %2, %2, #16\n\t"
+		             "bne 1b\n\t"
+		             : "+r"(dest), "+r"(src), "+r"(left)
+		             :
+		             : "r3", "r4", "r5", "r6", "cc", "memory");
+#else
 	size_t i;
-	char *destc;
-	const char *srcc;
-	destc = dest;
-	srcc = src;
+	for (i = 0; i < blocks / WORD; i += 4) {
+		dest[i] = src[i];
+		dest[i + 1] = src[i + 1];
+		dest[i + 2] = src[i + 2];
+		dest[i + 3] = src[i + 3];
+	}
+#endif
+	return blocks;
+}
 
-	for (i = 0; i < n; i++)
-		destc[i] = srcc[i];
+void *memcpy(void *dest, const void *src, size_t n)
+{
+	uint8_t *d = dest;
+	const uint8_t *s = src;
+	word_t *dw;
+	const word_t *sw;
+	word_t prev, next;
+	uint32_t shift;
+	size_t done;
+
+	/* copy bytes until dest is aligned */
+	for (; n && ((uintptr_t)d & WORDMASK); n--)
+		*d++ = *s++;
+
+	if (((uintptr_t)s & WORDMASK) == 0) {
+		done = copy_blocks((word_t *)d, (const word_t *)s, n);
+		d += done;
+		s += done;
+		n -= done;
+		for (; n >= WORD; n -= WORD, d += WORD, s += WORD)
+			*(word_t *)d = *(const word_t *)s;
+	} else if (n >= 2 * WORD) {
+		/*
+		 * The source is misaligned: read aligned words and shift them
+		 * together (this is little endian). We never read an aligned
+		 * word which doesn't contain a byte of the source.
+		 */
+		shift = 8 * ((uintptr_t)s & WORDMASK);
+		sw = (const word_t *)((uintptr_t)s & ~WORDMASK);
+		dw = (word_t *)d;
+		prev = *sw++;
+		for (; n >= 2 * WORD; n -= WORD) {
+			next = *sw++;
+			*dw++ = (prev >> shift) | (next << (32 - shift));
+			prev = next;
+		}
+		d = (uint8_t *)dw;
+		s = (const uint8_t *)sw - WORD + shift / 8;
+	}
 
+	while (n--)
+		*d++ = *s++;
 	return dest;
 }
 
 void *memset(void *dest, int c, size_t n)
 {
-	uint8_t *destc = (uint8_t *)dest;
-	size_t i;
-	for (i = 0; i < n; i++)
-		destc[i] = (uint8_t)c;
+	uint8_t *d = dest;
+	word_t pattern = (uint8_t)c * 0x01010101U;
+	size_t blocks;
+
+	for (; n && ((uintptr_t)d & WORDMASK); n--)
+		*d++ = (uint8_t)c;
+
+	blocks = n & ~15;
+#ifdef __arm__
+	if (blocks) {
+		register word_t r3 asm("r3") = pattern;
+		register word_t r4 asm("r4") = pattern;
+		register word_t r5 asm("r5") = pattern;
+		register word_t r6 asm("r6") = pattern;
+		size_t left = blocks;
+		asm volatile("1:\n\t"
+		             "stmia %0!, {%2, %3, %4, %5}\n\t"
+		             "subs %1, %1, #16\n\t"
+		             "bne 1b\n\t"
+		             : "+r"(d), "+r"(left)
+		             : "r"(r3), "r"(r4), "r"(r5), "r"(r6)
+		             : "cc", "memory");
+	}
+#else
+	for (size_t i = 0; i < blocks; i += 4 * WORD) {
+		((word_t *)d)[0] = pattern;
+		((word_t *)d)[1] = pattern;
+		((word_t *)d)[2] = pattern;
+		((word_t *)d)[3] = pattern;
+		d += 4 * WORD;
+	}
+#endif
+	n -= blocks;
+
+	for (; n >= WORD; n -= WORD, d += WORD)
+		*(word_t *)d = pattern;
+	while (n--)
+		*d++ = (uint8_t)c;
 	return dest;
 }
 
@@ -126,3 +285,11 @@ char *strchrnul(const char *s, int c)
 		s++;
 	return (char *)s;
 }
+
+#ifdef TEST_PREFIX
+#undef strlen
+#undef strcmp
+#undef memcmp
+#undef memcpy
+#undef memset
+#endif
@@ -8,6 +8,14 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#ifdef TEST_PREFIX
+#define strlen test_strlen
+#define strcmp test_strcmp
+#define memcmp test_memcmp
+#define memcpy test_memcpy
+#define memset test_memset
+#endif
+
 uint32_t strlen(const char *string);
 
 bool strprefix(const char *haystack, const char *prefix);
@@ -45,4 +53,12 @@ int buf_trim(struct buffer *buf, unsigned int newlen);
 
 char *strchrnul(const char *s, int c);
 
+#ifdef TEST_PREFIX
+#undef strlen
+#undef strcmp
+#undef memcmp
+#undef memcpy
+#undef memset
+#endif
+
 #endif
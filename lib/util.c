@@ -17,3 +17,39 @@ uint32_t align(uint32_t n, uint32_t b)
 
 	return n;
 }
+
+/**
+ * Divide *n by base, leaving the quotient in *n and returning the remainder.
+ * There is no 64-bit division instruction, and we don't link libgcc, so this
+ * uses one 32-bit division for the upper half and then long division.
+ */
+uint32_t div64_32(uint64_t *n, uint32_t base)
+{
+	uint64_t rem = *n;
+	uint64_t b = base;
+	uint64_t res = 0, d = 1;
+	uint32_t high = rem >> 32;
+
+	if (high >= base) {
+		high /= base;
+		res = (uint64_t)high << 32;
+		rem -= (uint64_t)(high * base) << 32;
+	}
+
+	while ((int64_t)b > 0 && b < rem) {
+		b += b;
+		d += d;
+	}
+
+	do {
+		if (rem >= b) {
+			rem -= b;
+			res += d;
+		}
+		b >>= 1;
+		d >>= 1;
+	} while (d);
+
+	*n = res;
+	return rem;
+}
@@ -7,5 +7,17 @@
 #include <stdint.h>
 
 uint32_t align(uint32_t n, uint32_t b);
+uint32_t div64_32(uint64_t *n, uint32_t base);
+
+/**
+ * Return the smallest b such that n <= 2^b, for n >= 1. This is computed from
+ * the highest set bit of (n - 1), rather than by searching.
+ */
+static inline uint32_t log2_ceil(uint32_t n)
+{
+	if (n <= 1)
+		return 0;
+	return 32 - __builtin_clz(n - 1);
+}
 
 #endif
@@ -0,0 +1,168 @@
+/*
+ * bench_alloc.c: measure page allocator latency on the host
+ *
+ * Each benchmark runs against the current buddy allocator (lib/alloc.c) and the
+ * zone-list allocator it replaced (bench_alloc_zone.c), so that one run prints
+ * a before and after comparison.
+ */
+#include <stdio.h>
+#include <time.h>
+
+#include "alloc.h"
+
+#define MEM_START 0x100000
+#define MEM_END   0x40100000 /* 1GB, like the qemu board */
+#define LIVE      256
+#define ITERS     200000
+#define META_SIZE (8 * PAGE_SIZE) /* same as the kernel's allocator */
+
+uint8_t allocator[META_SIZE];
+
+void zone_init_page_allocator(void *allocator, uint32_t start, uint32_t end);
+uint32_t zone_alloc_pages(void *allocator, uint32_t count, uint32_t align);
+bool zone_free_pages(void *allocator, uint32_t start, uint32_t count);
+
+static void buddy_init(void)
+{
+	init_page_allocator_sized(allocator, META_SIZE, MEM_START, MEM_END);
+}
+
+static void zone_init(void)
+{
+	/* the zone-list allocator only ever had one page of metadata */
+	zone_init_page_allocator(allocator, MEM_START, MEM_END);
+}
+
+struct impl {
+	char *name;
+	void (*init)(void);
+	uint32_t (*alloc)(void *allocator, uint32_t count, uint32_t align);
+	bool (*free)(void *allocator, uint32_t start, uint32_t count);
+} impls[] = {
+	{ "before (zones)", zone_init, zone_alloc_pages, zone_free_pages },
+	{ "after (buddy)", buddy_init, alloc_pages, free_pages },
+};
+#define NIMPLS (sizeof(impls) / sizeof(impls[0]))
+
+struct live {
+	uint32_t addr;
+	uint32_t size;
+} live[LIVE];
+
+static uint32_t seed = 12345;
+
+static uint32_t rand32(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(struct impl *impl, double start, uint32_t ops,
+                   uint32_t failed)
+{
+	printf("  %-16s %8.1f ns/op  (%u of %u ops failed)\n", impl->name,
+	       (now_ns() - start) / ops, failed, ops);
+}
+
+/*
+ * Hold LIVE single page allocations, and repeatedly replace a random one.
+ */
+static void bench_single_pages(struct impl *impl)
+{
+	uint32_t i, j, failed = 0;
+	double start;
+
+	seed = 12345;
+	impl->init();
+	for (i = 0; i < LIVE; i++)
+		live[i].addr = impl->alloc(allocator, PAGE_SIZE, 0);
+
+	start = now_ns();
+	for (i = 0; i < ITERS; i++) {
+		j = rand32() % LIVE;
+		if (live[j].addr)
+			impl->free(allocator, live[j].addr, PAGE_SIZE);
+		live[j].addr = impl->alloc(allocator, PAGE_SIZE, 0);
+		failed += !live[j].addr;
+	}
+	report(impl, start, 2 * ITERS, failed);
+}
+
+/*
+ * Same as above, but with random sizes from 1 to 16 pages, some aligned like
+ * first-level page tables.
+ */
+static void bench_mixed_sizes(struct impl *impl)
+{
+	uint32_t i, j, align, failed = 0;
+	double start;
+
+	seed = 12345;
+	impl->init();
+	for (i = 0; i < LIVE; i++)
+		live[i].addr = 0;
+
+	start = now_ns();
+	for (i = 0; i < ITERS; i++) {
+		j = rand32() % LIVE;
+		if (live[j].addr)
+			impl->free(allocator, live[j].addr, live[j].size);
+		live[j].size = (rand32() % 16 + 1) * PAGE_SIZE;
+		align = (rand32() % 8 == 0) ? 14 : 0;
+		live[j].addr = impl->alloc(allocator, live[j].size, align);
+		failed += !live[j].addr;
+	}
+	report(impl, start, 2 * ITERS, failed);
+}
+
+/*
+ * Punch holes into the first part of memory, then time allocations which
+ * must get past all of them.
+ */
+static void bench_fragmented(struct impl *impl)
+{
+	uint32_t i, addr, failed = 0;
+	double start;
+
+	seed = 12345;
+	impl->init();
+	for (i = 0; i < 2 * LIVE; i++)
+		impl->alloc(allocator, PAGE_SIZE, 0);
+	for (i = 0; i < 2 * LIVE; i += 2)
+		impl->free(allocator, MEM_START + i * PAGE_SIZE, PAGE_SIZE);
+
+	start = now_ns();
+	for (i = 0; i < ITERS; i++) {
+		addr = impl->alloc(allocator, 4 * PAGE_SIZE, 0);
+		if (addr)
+			impl->free(allocator, addr, 4 * PAGE_SIZE);
+		else
+			failed++;
+	}
+	report(impl, start, 2 * ITERS, failed);
+}
+
+static void run(char *name, void (*bench)(struct impl *impl))
+{
+	unsigned int i;
+
+	printf("%s\n", name);
+	for (i = 0; i < NIMPLS; i++)
+		bench(&impls[i]);
+}
+
+int main(int argc, char **argv)
+{
+	printf("page allocator benchmark\n");
+	run("single pages", bench_single_pages);
+	run("mixed sizes", bench_mixed_sizes);
+	run("fragmented, 4 pages", bench_fragmented);
+	return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * bench_string.c: measure the memory routines on the host
+ *
+ * Each routine is compared against the byte-at-a-time loop it replaced. On the
+ * host, this measures the portable word-at-a-time code, not the ARM LDM/STM
+ * paths.
+ */
+#include <stdio.h>
+#include <time.h>
+
+#include "string.h"
+
+#define BUFSIZE 8192
+
+uint8_t src[BUFSIZE] __attribute__((aligned(8)));
+uint8_t dst[BUFSIZE] __attribute__((aligned(8)));
+
+/*
+ * The original implementations. Keep the compiler from turning them back into
+ * calls to the C library.
+ */
+#define NAIVE                                                                  \
+	__attribute__((noinline,                                               \
+	               optimize("no-tree-loop-distribute-patterns",            \
+	                        "no-tree-vectorize")))
+
+NAIVE static void *naive_memcpy(void *dest, const void *src, size_t n)
+{
+	size_t i;
+	char *destc = dest;
+	const char *srcc = src;
+	for (i = 0; i < n; i++)
+		destc[i] = srcc[i];
+	return dest;
+}
+
+NAIVE static void *naive_memset(void *dest, int c, size_t n)
+{
+	uint8_t *destc = (uint8_t *)dest;
+	size_t i;
+	for (i = 0; i < n; i++)
+		destc[i] = (uint8_t)c;
+	return dest;
+}
+
+NAIVE static int naive_memcmp(const uint8_t *lhs, const uint8_t *rhs, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; i++)
+		if (lhs[i] != rhs[i])
+			return lhs[i] - rhs[i];
+	return 0;
+}
+
+NAIVE static uint32_t naive_strlen(const char *string)
+{
+	uint32_t len;
+	for (len = 0; string[len]; len++) {
+	};
+	return len;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* keep results alive so the calls aren't optimized out */
+volatile uintptr_t sink;
+
+#define TIME(expr, iters)                                                      \
+	({                                                                     \
+		double _start = now_ns();                                      \
+		for (uint32_t _i = 0; _i < (iters); _i++) {                    \
+			sink += (uintptr_t)(expr);                             \
+			asm volatile("" ::: "memory");                         \
+		}                                                              \
+		(now_ns() - _start) / (iters);                                 \
+	})
+
+static uint32_t iters_for(uint32_t len)
+{
+	return 20000000 / (len + 16);
+}
+
+static void bench_len(uint32_t len, uint32_t misalign)
+{
+	uint32_t iters = iters_for(len);
+	double old, new;
+
+	printf("  %5u bytes, offset %u:\n", len, misalign);
+
+	old = TIME(naive_memcpy(dst, src + misalign, len), iters);
+	new = TIME(test_memcpy(dst, src + misalign, len), iters);
+	printf("    memcpy %9.1f ns -> %9.1f ns\n", old, new);
+
+	old = TIME(naive_memset(dst + misalign, 0, len), iters);
+	new = TIME(test_memset(dst + misalign, 0, len), iters);
+	printf("    memset %9.1f ns -> %9.1f ns\n", old, new);
+
+	naive_memcpy(dst, src + misalign, len);
+	old = TIME(naive_memcmp(dst, src + misalign, len), iters);
+	new = TIME(test_memcmp(dst, src + misalign, len), iters);
+	printf("    memcmp %9.1f ns -> %9.1f ns\n", old, new);
+
+	src[misalign + len] = '\0';
+	old = TIME(naive_strlen((char *)src + misalign), iters);
+	new = TIME(test_strlen((char *)src + misalign), iters);
+	printf("    strlen %9.1f ns -> %9.1f ns\n", old, new);
+	src[misalign + len] = 'x';
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t lens[] = { 16, 64, 256, 2048, 4096 };
+	uint32_t i;
+
+	for (i = 0; i < BUFSIZE; i++)
+		src[i] = 'a' + i % 26;
+
+	printf("string routine benchmark (byte loop -> word at a time)\n");
+	for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		bench_len(lens[i], 0);
+		bench_len(lens[i], 1);
+	}
+	return 0;
+}
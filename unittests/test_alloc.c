@@ -6,12 +6,6 @@
 #include "alloc_private.h"
 #include "unittest.h"
 
-#define FREE  1
-#define ALLOC 0
-#define ZONE(addr_, free_)                                                     \
-	{                                                                      \
-		.addr = (addr_) >> PAGE_BITS, .free = free_                    \
-	}
 uint8_t allocator[PAGE_SIZE];
 
 void init(struct unittest *test)
@@ -19,117 +13,178 @@ void init(struct unittest *test)
 	init_page_allocator(allocator, 0x1000, 0x100000);
 }
 
-void expect_zones(struct unittest *test, struct zone zones[])
+/*
+ * Return true if a free block of exactly this address and order exists.
+ */
+bool is_free_block(uint32_t addr, uint32_t order)
 {
-	int i;
-	struct zonehdr *hdr = (struct zonehdr *)allocator;
-	for (i = 0; zones[i].addr != 0; i++) {
-		UNITTEST_EXPECT_EQ(test, hdr->zones[i].addr, zones[i].addr);
-		UNITTEST_EXPECT_EQ(test, hdr->zones[i].free, zones[i].free);
+	struct buddy *b = (struct buddy *)allocator;
+	uint16_t idx;
+
+	for (idx = b->heads[order]; idx != BUDDY_NIL; idx = b->node[idx].next)
+		if (b->node[idx].pfn << PAGE_BITS == addr)
+			return true;
+	return false;
+}
+
+/*
+ * Walk every free list and check the allocator's invariants: blocks are
+ * aligned, inside the managed range, reachable through the hash table, never
+ * overlapping, and never mergeable with a free buddy. Returns the number of
+ * free pages.
+ */
+uint32_t check_invariants(struct unittest *test)
+{
+	struct buddy *b = (struct buddy *)allocator;
+	uint32_t order, pfn, count, pages = 0, used = 0;
+	uint16_t idx, other;
+	static uint8_t seen[0x100000 >> PAGE_BITS];
+
+	for (pfn = 0; pfn < sizeof(seen); pfn++)
+		seen[pfn] = 0;
+
+	for (order = 0; order < BUDDY_ORDERS; order++) {
+		count = 0;
+		for (idx = b->heads[order]; idx != BUDDY_NIL;
+		     idx = b->node[idx].next) {
+			pfn = b->node[idx].pfn;
+			count++;
+			UNITTEST_EXPECT_EQ(test, b->node[idx].order, order);
+			UNITTEST_EXPECT_EQ(test, pfn & ((1 << order) - 1), 0);
+			UNITTEST_EXPECT_EQ(test, pfn >= b->start, true);
+			UNITTEST_EXPECT_EQ(test, pfn + (1 << order) <= b->end,
+			                   true);
+
+			/* reachable via hash */
+			for (other = b->hash[buddy_hash(b, pfn)];
+			     other != BUDDY_NIL && other != idx;
+			     other = b->node[other].hnext)
+				;
+			UNITTEST_EXPECT_EQ(test, other, idx);
+
+			/* buddy must not be free at the same order */
+			UNITTEST_EXPECT_EQ(test,
+			                   is_free_block((pfn ^ (1 << order))
+			                                         << PAGE_BITS,
+			                                 order),
+			                   false);
+
+			for (; pfn < b->node[idx].pfn + (1 << order); pfn++) {
+				if (pfn < sizeof(seen)) {
+					UNITTEST_EXPECT_EQ(test, seen[pfn], 0);
+					seen[pfn] = 1;
+				}
+			}
+			pages += 1 << order;
+		}
+		UNITTEST_EXPECT_EQ(test, count, b->counts[order]);
+		used += count;
 	}
-	UNITTEST_EXPECT_EQ(test, hdr->count, i);
+	UNITTEST_EXPECT_EQ(test, used + b->nspare, b->nodes);
+	return pages;
 }
 
-void test_first_fit(struct unittest *test)
+void test_initial_blocks(struct unittest *test)
 {
 	/*
-	 * Test that the allocator returns the first available memory region
-	 * when there are no extra requirements (e.g. alignment)
+	 * The range 0x1000 - 0x100000 should be carved into the largest
+	 * naturally aligned blocks: 1, 2, 4, ... 128 pages.
 	 */
-	uint32_t allocated;
+	uint32_t order;
 
 	init(test);
-	allocated = alloc_pages(allocator, PAGE_SIZE, 0);
-	UNITTEST_EXPECT_EQ(test, allocated, 0x1000);
+	for (order = 0; order < 8; order++)
+		UNITTEST_EXPECT_EQ(test,
+		                   is_free_block(0x1000 << order, order), true);
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), 255);
 }
 
-void test_combine_adjacent(struct unittest *test)
+void test_smallest_block_first(struct unittest *test)
 {
 	/*
-	 * Test that when we allocate two zones next to each other, they get
-	 * lumped into the same zone descriptor.
+	 * Test that the allocator uses the smallest block which can satisfy the
+	 * request, rather than splitting a large one.
 	 */
 	uint32_t allocated;
+
 	init(test);
-	alloc_pages(allocator, PAGE_SIZE, 0);
-	alloc_pages(allocator, PAGE_SIZE, 0);
-
-	struct zone zones[] = {
-		ZONE(0x1000, ALLOC),
-		ZONE(0x3000, FREE),
-		ZONE(0X100000, ALLOC),
-		{},
-	};
-	expect_zones(test, zones);
+	allocated = alloc_pages(allocator, PAGE_SIZE, 0);
+	UNITTEST_EXPECT_EQ(test, allocated, 0x1000);
+
+	allocated = alloc_pages(allocator, PAGE_SIZE * 2, 0);
+	UNITTEST_EXPECT_EQ(test, allocated, 0x2000);
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), 252);
 }
 
-void test_alignment(struct unittest *test)
+void test_split(struct unittest *test)
 {
 	/*
-	 * Test that we can get memory aligned to our specification.
+	 * When there is no block of the right order, a larger one is split and
+	 * the unused halves go onto the free lists.
 	 */
 	uint32_t allocated;
 
 	init(test);
-	allocated = alloc_pages(allocator, PAGE_SIZE, PAGE_BITS + 1);
+	alloc_pages(allocator, PAGE_SIZE, 0);                 /* 0x1000 */
+	allocated = alloc_pages(allocator, PAGE_SIZE, 0); /* split 0x2000 */
 	UNITTEST_EXPECT_EQ(test, allocated, 0x2000);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0x3000, 0), true);
+
+	allocated = alloc_pages(allocator, PAGE_SIZE, 0);
+	UNITTEST_EXPECT_EQ(test, allocated, 0x3000);
 
-	struct zone zones[] = {
-		ZONE(0x1000, FREE),
-		ZONE(0x2000, ALLOC),
-		ZONE(0x3000, FREE),
-		ZONE(0x100000, ALLOC),
-		{},
-	};
-	expect_zones(test, zones);
+	allocated = alloc_pages(allocator, PAGE_SIZE, 0); /* split 0x4000 */
+	UNITTEST_EXPECT_EQ(test, allocated, 0x4000);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0x5000, 0), true);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0x6000, 1), true);
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), 251);
 }
 
-void test_skip_hole(struct unittest *test)
+void test_alignment(struct unittest *test)
 {
 	/*
-	 * Test that, when the first free zone is a hole that is too small, we
-	 * skip it and return a zone that fits.
+	 * Test that we can get memory aligned to our specification, and that
+	 * the extra memory used to get the alignment is given back.
 	 */
 	uint32_t allocated;
 
 	init(test);
-	alloc_pages(allocator, PAGE_SIZE * 3, 0); /* 0x1000 - 0x4000 */
-	free_pages(allocator, 0x2000, PAGE_SIZE); /* 0x2000 - 0x3000 */
-
-	/* the first gap is not big enough, have to use 0x4000 */
-	allocated = alloc_pages(allocator, PAGE_SIZE * 2, 0);
-	UNITTEST_EXPECT_EQ(test, allocated, 0x4000);
-
-	struct zone zones[] = {
-		ZONE(0x1000, ALLOC), ZONE(0x2000, FREE),    ZONE(0x3000, ALLOC),
-		ZONE(0x6000, FREE),  ZONE(0x100000, ALLOC), {},
-	};
-	expect_zones(test, zones);
+	allocated = alloc_pages(allocator, PAGE_SIZE, PAGE_BITS + 1);
+	UNITTEST_EXPECT_EQ(test, allocated, 0x2000);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0x1000, 0), true);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0x3000, 0), true);
+
+	allocated = alloc_pages(allocator, PAGE_SIZE * 4, PAGE_BITS + 4);
+	UNITTEST_EXPECT_EQ(test, allocated, 0x10000);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0x14000, 2), true);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0x18000, 3), true);
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), 250);
 }
 
-void test_exact_hole(struct unittest *test)
+void test_exact_size(struct unittest *test)
 {
 	/*
-	 * Test that, when the first free zone is a hole that is perfectly
-	 * sized, we return that.
+	 * Sizes which aren't a power of two are rounded up to a block, and then
+	 * the pages past the end are freed.
 	 */
 	uint32_t allocated;
 
 	init(test);
-	alloc_pages(allocator, PAGE_SIZE * 3, 0); /* 0x1000 - 0x4000 */
-	free_pages(allocator, 0x2000, PAGE_SIZE); /* 0x2000 - 0x3000 */
-
-	/* we should be able to use 0x2000 */
-	allocated = alloc_pages(allocator, PAGE_SIZE, 0);
-	UNITTEST_EXPECT_EQ(test, allocated, 0x2000);
-
-	struct zone zones[] = {
-		ZONE(0x1000, ALLOC),
-		ZONE(0x4000, FREE),
-		ZONE(0x100000, ALLOC),
-		{},
-	};
-	expect_zones(test, zones);
+	allocated = alloc_pages(allocator, PAGE_SIZE * 3, 0);
+	UNITTEST_EXPECT_EQ(test, allocated, 0x4000);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0x7000, 0), true);
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), 252);
+
+	allocated = alloc_pages(allocator, PAGE_SIZE * 5, 0);
+	UNITTEST_EXPECT_EQ(test, allocated, 0x8000);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0xD000, 0), true);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0xE000, 1), true);
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), 247);
+
+	/* a partial page counts as a whole page, most recently freed first */
+	allocated = alloc_pages(allocator, 1, 0);
+	UNITTEST_EXPECT_EQ(test, allocated, 0xD000);
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), 246);
 }
 
 void test_free(struct unittest *test)
@@ -146,92 +201,83 @@ void test_free(struct unittest *test)
 
 	result = free_pages(allocator, allocated, PAGE_SIZE);
 	UNITTEST_EXPECT_EQ(test, result, true);
-
-	struct zone zones[] = { ZONE(0x1000, FREE), ZONE(0x100000, ALLOC), {} };
-	expect_zones(test, zones);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0x1000, 0), true);
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), 255);
 }
 
-void test_free_after_free_region(struct unittest *test)
+void test_free_merges(struct unittest *test)
 {
 	/*
-	 * Test freeing when it's not the first region in the list.
+	 * Test that freed blocks merge with their buddies, in any order, until
+	 * we're back where we started.
 	 */
-	uint32_t allocated;
+	uint32_t a, b, c, d;
 	bool result;
 
 	init(test);
-	/* should get 0x2000 - 0x6000 */
-	allocated = alloc_pages(allocator, PAGE_SIZE * 4, PAGE_BITS + 1);
-	UNITTEST_EXPECT_EQ(test, allocated, 0x2000);
+	a = alloc_pages(allocator, PAGE_SIZE, 0);     /* 0x1000 */
+	b = alloc_pages(allocator, PAGE_SIZE, 0);     /* 0x2000 */
+	c = alloc_pages(allocator, PAGE_SIZE, 0);     /* 0x3000 */
+	d = alloc_pages(allocator, PAGE_SIZE * 2, 0); /* 0x4000 */
+	UNITTEST_EXPECT_EQ(test, d, 0x4000);
 
-	result = free_pages(allocator, 0x3000, PAGE_SIZE);
+	result = free_pages(allocator, c, PAGE_SIZE);
 	UNITTEST_EXPECT_EQ(test, result, true);
-
-	result = free_pages(allocator, 0x5000, PAGE_SIZE);
+	result = free_pages(allocator, b, PAGE_SIZE);
 	UNITTEST_EXPECT_EQ(test, result, true);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0x2000, 1), true);
 
-	struct zone zones[] = {
-		ZONE(0x1000, FREE),
-		ZONE(0x2000, ALLOC),
-		ZONE(0x3000, FREE),
-		ZONE(0x4000, ALLOC),
-		ZONE(0x5000, FREE),
-		ZONE(0x100000, ALLOC),
-		{},
-	};
-	expect_zones(test, zones);
-
-	result = free_pages(allocator, 0x4000, PAGE_SIZE);
+	result = free_pages(allocator, d, PAGE_SIZE * 2);
 	UNITTEST_EXPECT_EQ(test, result, true);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0x4000, 2), true);
 
-	result = free_pages(allocator, 0x2000, PAGE_SIZE);
+	result = free_pages(allocator, a, PAGE_SIZE);
 	UNITTEST_EXPECT_EQ(test, result, true);
-
-	struct zone final_zones[] = {
-		ZONE(0x1000, FREE),
-		ZONE(0x100000, ALLOC),
-		{},
-	};
-	expect_zones(test, final_zones);
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), 255);
+	test_initial_blocks(test);
 }
 
-void test_alloc_whole_thing(struct unittest *test)
+void test_partial_free(struct unittest *test)
 {
 	/*
-	 * Weird scenario, make sure that allocating and freeing the whole
-	 * memory region works.
+	 * Freeing part of an allocation works, and the rest remains allocated.
 	 */
-	uint32_t allocated;
+	bool result;
 
 	init(test);
-	allocated = alloc_pages(allocator, 0x100000 - 0x1000, 0);
-	UNITTEST_EXPECT_EQ(test, allocated, 0x1000);
+	alloc_pages(allocator, 0x2000, 0);                  /* 0x2000-0x4000 */
+	result = free_pages(allocator, 0x3000, 0x1000); /* free 0x3000 */
+	UNITTEST_EXPECT_EQ(test, result, true);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0x3000, 0), true);
 
-	free_pages(allocator, allocated, 0x100000 - 0x1000);
+	result = free_pages(allocator, 0x2000, 0x2000); /* 0x3000 is free */
+	UNITTEST_EXPECT_EQ(test, result, false);
 
-	struct zone zones[] = { ZONE(0x1000, FREE), ZONE(0x100000, ALLOC), {} };
-	expect_zones(test, zones);
+	result = free_pages(allocator, 0x2000, 0x1000);
+	UNITTEST_EXPECT_EQ(test, result, true);
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), 255);
 }
 
-void test_free_exact_on_right_but_not_left(struct unittest *test)
+void test_alloc_whole_thing(struct unittest *test)
 {
 	/*
-	 * When you have an allocated region and you free the right half of it,
-	 * leaving the left half still allocated.
+	 * Make sure that allocating and freeing a whole (aligned) memory region
+	 * works. Note that an unaligned region can't be allocated in one piece,
+	 * since it is not a single buddy block.
 	 */
 	uint32_t allocated;
 
+	init_page_allocator(allocator, 0x100000, 0x200000);
+	allocated = alloc_pages(allocator, 0x100000, 0);
+	UNITTEST_EXPECT_EQ(test, allocated, 0x100000);
+	UNITTEST_EXPECT_EQ(test, alloc_pages(allocator, 0x1000, 0), 0);
+
+	free_pages(allocator, allocated, 0x100000);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0x100000, 8), true);
+
 	init(test);
-	alloc_pages(allocator, 0x2000, 0);     /* gives me 0x1000-0x3000 */
-	free_pages(allocator, 0x2000, 0x1000); /* free 0x2000-0x3000 */
-
-	struct zone zones[] = {
-		ZONE(0x1000, ALLOC),
-		ZONE(0x2000, FREE),
-		ZONE(0x100000, ALLOC),
-		{},
-	};
-	expect_zones(test, zones);
+	allocated = alloc_pages(allocator, 0x100000 - 0x1000, 0);
+	UNITTEST_EXPECT_EQ(test, allocated, 0);
 }
 
 void test_unsatisfiable_allocation(struct unittest *test)
@@ -244,15 +290,21 @@ void test_unsatisfiable_allocation(struct unittest *test)
 	init(test);
 	allocated = alloc_pages(allocator, 0x100000, 0);
 	UNITTEST_EXPECT_EQ(test, allocated, 0);
+
+	allocated = alloc_pages(allocator, 0x1000, 20);
+	UNITTEST_EXPECT_EQ(test, allocated, 0);
+
+	allocated = alloc_pages(allocator, 0, 0);
+	UNITTEST_EXPECT_EQ(test, allocated, 0);
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), 255);
 }
 
 void test_unsatisfiable_free(struct unittest *test)
 {
 	/*
 	 * Try freeing more memory than we actually received. free_pages()
-	 * should check to make sure that the freed memory fits within an
-	 * allocated region, otherwise it will corrupt the memory zone
-	 * descriptors.
+	 * should check to make sure that the freed memory is entirely
+	 * allocated, otherwise it will corrupt the free lists.
 	 *
 	 * Of course, if an application is freeing memory it was never
 	 * allocated, there's no saving it anyway, shrug.
@@ -264,13 +316,12 @@ void test_unsatisfiable_free(struct unittest *test)
 	result = free_pages(allocator, 0x1000, 0x10000);
 	UNITTEST_EXPECT_EQ(test, result, false);
 
-	struct zone zones[] = {
-		ZONE(0x1000, ALLOC),
-		ZONE(0x2000, FREE),
-		ZONE(0x100000, ALLOC),
-		{},
-	};
-	expect_zones(test, zones);
+	result = free_pages(allocator, 0x0, 0x1000);
+	UNITTEST_EXPECT_EQ(test, result, false);
+
+	result = free_pages(allocator, 0x100000, 0x1000);
+	UNITTEST_EXPECT_EQ(test, result, false);
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), 254);
 }
 
 void test_free_already_freed(struct unittest *test)
@@ -280,8 +331,10 @@ void test_free_already_freed(struct unittest *test)
 	result = free_pages(allocator, 0x1000, 0x1000);
 	UNITTEST_EXPECT_EQ(test, result, false);
 
-	struct zone zones[] = { ZONE(0x1000, FREE), ZONE(0x100000, ALLOC), {} };
-	expect_zones(test, zones);
+	/* a page inside a larger free block */
+	result = free_pages(allocator, 0x9000, 0x1000);
+	UNITTEST_EXPECT_EQ(test, result, false);
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), 255);
 }
 
 void test_mark_alloc(struct unittest *test)
@@ -305,15 +358,22 @@ void test_mark_alloc(struct unittest *test)
 	result = mark_alloc(allocator, 0x100000 - 0x1000, 0x1000);
 	UNITTEST_EXPECT_EQ(test, result, true);
 
-	struct zone zones[] = {
-		ZONE(0x1000, ALLOC),
-		ZONE(0x3000, FREE),
-		ZONE(0x4000, ALLOC),
-		ZONE(0x5000, FREE),
-		ZONE(0x100000 - 0x1000, ALLOC),
-		{},
-	};
-	expect_zones(test, zones);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0x3000, 0), true);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0x5000, 0), true);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0x6000, 1), true);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0xFE000, 0), true);
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), 251);
+
+	/* an unaligned range spanning several blocks */
+	result = mark_alloc(allocator, 0x6000, 0x5000);
+	UNITTEST_EXPECT_EQ(test, result, true);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0xB000, 0), true);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0xC000, 2), true);
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), 246);
+
+	result = free_pages(allocator, 0x6000, 0x5000);
+	UNITTEST_EXPECT_EQ(test, result, true);
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), 251);
 }
 
 void test_mark_alloc_already_alloced(struct unittest *test)
@@ -340,36 +400,93 @@ void test_mark_alloc_already_alloced(struct unittest *test)
 	result = mark_alloc(allocator, 0x2000, 0x1000);
 	UNITTEST_EXPECT_EQ(test, result, false);
 
-	struct zone zones[] = {
-		ZONE(0x1000, FREE),
-		ZONE(0x2000, ALLOC),
-		ZONE(0x4000, FREE),
-		ZONE(0X100000, ALLOC),
-		{},
-	};
-	expect_zones(test, zones);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0x1000, 0), true);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0x4000, 2), true);
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), 253);
+}
+
+void test_fragmentation(struct unittest *test)
+{
+	/*
+	 * Allocate every page one at a time, free every other page, then the
+	 * rest. Everything must merge back to the starting state.
+	 */
+	uint32_t addr;
+	bool result;
+
+	init(test);
+	for (addr = 0x1000; addr < 0x100000; addr += 0x1000)
+		UNITTEST_EXPECT_EQ(test, alloc_pages(allocator, 0x1000, 0) != 0,
+		                   true);
+	UNITTEST_EXPECT_EQ(test, alloc_pages(allocator, 0x1000, 0), 0);
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), 0);
+
+	for (addr = 0x1000; addr < 0x100000; addr += 0x2000) {
+		result = free_pages(allocator, addr, 0x1000);
+		UNITTEST_EXPECT_EQ(test, result, true);
+	}
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), 128);
+
+	for (addr = 0x2000; addr < 0x100000; addr += 0x2000) {
+		result = free_pages(allocator, addr, 0x1000);
+		UNITTEST_EXPECT_EQ(test, result, true);
+	}
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), 255);
+	test_initial_blocks(test);
+}
+
+void test_out_of_descriptors(struct unittest *test)
+{
+	/*
+	 * With only a few descriptors, fragmenting memory eventually fails, but
+	 * cleanly: nothing gets corrupted, and freeing neighbors still works.
+	 */
+	struct buddy *b = (struct buddy *)allocator;
+	uint32_t addr, freed = 0;
+	bool result;
+
+	init_page_allocator_sized(allocator, sizeof(struct buddy) + 256,
+	                          0x100000, 0x200000);
+	UNITTEST_EXPECT_EQ(test, b->nodes <= 20, true);
+	UNITTEST_EXPECT_EQ(test, alloc_pages(allocator, 0x100000, 0), 0x100000);
+
+	for (addr = 0x100000; addr < 0x200000; addr += 0x2000) {
+		if (!free_pages(allocator, addr, 0x1000))
+			break;
+		freed++;
+	}
+	UNITTEST_EXPECT_EQ(test, freed, b->nodes);
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), b->nodes);
+
+	/* the page next door merges, so no descriptor is needed */
+	result = free_pages(allocator, 0x101000, 0x1000);
+	UNITTEST_EXPECT_EQ(test, result, true);
+	UNITTEST_EXPECT_EQ(test, is_free_block(0x100000, 1), true);
+	UNITTEST_EXPECT_EQ(test, check_invariants(test), b->nodes + 1);
 }
 
 struct unittest_case cases[] = {
-	UNITTEST_CASE(test_first_fit),
-	UNITTEST_CASE(test_combine_adjacent),
+	UNITTEST_CASE(test_initial_blocks),
+	UNITTEST_CASE(test_smallest_block_first),
+	UNITTEST_CASE(test_split),
 	UNITTEST_CASE(test_alignment),
-	UNITTEST_CASE(test_skip_hole),
-	UNITTEST_CASE(test_exact_hole),
+	UNITTEST_CASE(test_exact_size),
 	UNITTEST_CASE(test_free),
-	UNITTEST_CASE(test_free_after_free_region),
+	UNITTEST_CASE(test_free_merges),
+	UNITTEST_CASE(test_partial_free),
 	UNITTEST_CASE(test_alloc_whole_thing),
-	UNITTEST_CASE(test_free_exact_on_right_but_not_left),
 	UNITTEST_CASE(test_unsatisfiable_allocation),
 	UNITTEST_CASE(test_unsatisfiable_free),
 	UNITTEST_CASE(test_free_already_freed),
 	UNITTEST_CASE(test_mark_alloc),
 	UNITTEST_CASE(test_mark_alloc_already_alloced),
+	UNITTEST_CASE(test_fragmentation),
+	UNITTEST_CASE(test_out_of_descriptors),
 	{ 0 },
 };
 
 struct unittest_module module = {
-	.name = "lists",
+	.name = "alloc",
 	.cases = cases,
 	.printf = printf,
 };
@@ -0,0 +1,145 @@
+/*
+ * test_csum.c: test the Internet checksum routines
+ *
+ * The word-at-a-time sum is compared against the 16-bit loop it replaced, for
+ * every alignment and a range of lengths, with data chosen to produce plenty of
+ * carries.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "csum.h"
+#include "unittest.h"
+
+#define MAXLEN 200
+#define BUFLEN (8 + MAXLEN + 8)
+
+uint8_t buf[BUFLEN] __attribute__((aligned(8)));
+
+/* The original implementation, which summed one 16-bit word at a time */
+static void ref_csum_add(uint32_t *csum, const uint16_t *data, uint32_t n)
+{
+	uint32_t i;
+	for (i = 0; i < n; i++)
+		*csum += data[i];
+}
+
+static uint16_t ref_csum_finalize(uint32_t *csum)
+{
+	uint32_t add;
+	while (*csum & 0xFFFF0000) {
+		add = (*csum & 0xFFFF0000) >> 16;
+		*csum &= 0x0000FFFF;
+		*csum += add;
+	}
+	return ~((uint16_t)*csum);
+}
+
+static void fill(uint8_t seed)
+{
+	for (int i = 0; i < BUFLEN; i++)
+		buf[i] = (uint8_t)(0xF0 + seed + i * 13);
+}
+
+void test_matches_reference(struct unittest *test)
+{
+	uint32_t a, n, csum, ref, failed = 0;
+
+	fill(1);
+	for (a = 0; a < 8; a += 2) {
+		for (n = 0; n <= MAXLEN / 2; n++) {
+			csum_init(&csum);
+			csum_add(&csum, &buf[a], n);
+			ref = 0;
+			ref_csum_add(&ref, (uint16_t *)&buf[a], n);
+			if (csum_finalize(&csum) != ref_csum_finalize(&ref))
+				failed++;
+		}
+	}
+	UNITTEST_EXPECT_EQ(test, failed, 0);
+}
+
+void test_all_ones(struct unittest *test)
+{
+	uint32_t csum, ref = 0;
+
+	/* the worst case for carries */
+	for (int i = 0; i < BUFLEN; i++)
+		buf[i] = 0xFF;
+	csum_init(&csum);
+	csum_add(&csum, buf, MAXLEN / 2);
+	ref_csum_add(&ref, (uint16_t *)buf, MAXLEN / 2);
+	UNITTEST_EXPECT_EQ(test, csum_finalize(&csum), ref_csum_finalize(&ref));
+}
+
+void test_accumulates(struct unittest *test)
+{
+	uint32_t csum, whole;
+
+	/* summing in pieces gives the same result as all at once */
+	fill(7);
+	csum_init(&whole);
+	csum_add(&whole, buf, 50);
+	csum_init(&csum);
+	csum_add(&csum, buf, 3);
+	csum_add(&csum, &buf[6], 20);
+	csum_add_value(&csum, *(uint16_t *)&buf[46]);
+	csum_add(&csum, &buf[48], 26);
+	UNITTEST_EXPECT_EQ(test, csum_finalize(&csum), csum_finalize(&whole));
+}
+
+void test_odd_bytes(struct unittest *test)
+{
+	uint32_t csum, ref;
+
+	/* an odd byte is summed as if followed by zero */
+	fill(3);
+	buf[31] = 0;
+	csum_init(&csum);
+	csum_add_bytes(&csum, buf, 31);
+	csum_init(&ref);
+	csum_add(&ref, buf, 16);
+	UNITTEST_EXPECT_EQ(test, csum_finalize(&csum), csum_finalize(&ref));
+}
+
+void test_verifies(struct unittest *test)
+{
+	/* An IPv4 header from RFC 1071 discussions, checksum 0xb861 */
+	uint8_t hdr[20] __attribute__((aligned(4))) = {
+		0x45, 0x00, 0x00, 0x73, 0x00, 0x00, 0x40, 0x00, 0x40, 0x11,
+		0x00, 0x00, 0xc0, 0xa8, 0x00, 0x01, 0xc0, 0xa8, 0x00, 0xc7,
+	};
+	uint32_t csum;
+	uint16_t result;
+
+	csum_init(&csum);
+	csum_add(&csum, hdr, 10);
+	result = csum_finalize(&csum);
+	UNITTEST_EXPECT_EQ(test, ((uint8_t *)&result)[0], 0xb8);
+	UNITTEST_EXPECT_EQ(test, ((uint8_t *)&result)[1], 0x61);
+
+	/* with the checksum filled in, the sum comes out to zero */
+	hdr[10] = 0xb8;
+	hdr[11] = 0x61;
+	csum_init(&csum);
+	csum_add(&csum, hdr, 10);
+	UNITTEST_EXPECT_EQ(test, csum_finalize(&csum), 0);
+}
+
+struct unittest_case cases[] = {
+	UNITTEST_CASE(test_matches_reference),
+	UNITTEST_CASE(test_all_ones),
+	UNITTEST_CASE(test_accumulates),
+	UNITTEST_CASE(test_odd_bytes),
+	UNITTEST_CASE(test_verifies),
+	{ 0 },
+};
+
+struct unittest_module module = {
+	.name = "csum",
+	.cases = cases,
+	.printf = printf,
+};
+
+UNITTEST(module);
@@ -55,9 +55,33 @@ static void test_insert_end(struct unittest *test)
 	}
 }
 
+static void test_reverse(struct unittest *test)
+{
+	struct item first;
+	struct item second;
+	struct item *iter;
+	int i = 2;
+
+	INIT_LIST_HEAD(list);
+	first.number = 1;
+	second.number = 2;
+
+	list_insert_end(&list, &first.list);
+	list_insert_end(&list, &second.list);
+
+	list_for_each_entry_reverse(iter, &list, list)
+	{
+		UNITTEST_EXPECT_EQ(test, iter->number, i);
+		i--;
+	}
+	UNITTEST_EXPECT_EQ(test, i, 0);
+	UNITTEST_EXPECT_EQ(test, list_empty(&list), 0);
+}
+
 struct unittest_case cases[] = {
 	UNITTEST_CASE(test_insert_and_remove),
 	UNITTEST_CASE(test_insert_end),
+	UNITTEST_CASE(test_reverse),
 	{ 0 },
 };
 
@@ -8,41 +8,53 @@
 #include "slab_private.h"
 #include "unittest.h"
 
-int pages_allocd;
+#define NPAGES 64
 
-/* our "pages" must be aligned like the ones we would allocated in SOS */
-uint8_t first_page[4096] __attribute__((aligned(4096)));
-uint8_t second_page[4096] __attribute__((aligned(4096)));
+/*
+ * Our "pages" must be aligned like the ones we would allocated in SOS. The
+ * slab allocator keeps its own structures in slabs which live across test
+ * cases, so pages are never handed out twice while in use.
+ */
+uint8_t pages[NPAGES][4096] __attribute__((aligned(4096)));
+bool page_used[NPAGES];
 
-bool first_page_freed, second_page_freed;
+int pages_allocd, pages_freed;
 
 struct slab *slab;
 
 void *page_getter(void)
 {
-	pages_allocd++;
-	if (pages_allocd == 1) {
-		return first_page;
-	} else {
-		return second_page;
+	int i;
+	for (i = 0; i < NPAGES; i++) {
+		if (!page_used[i]) {
+			page_used[i] = true;
+			pages_allocd++;
+			return pages[i];
+		}
 	}
+	return NULL;
+}
+
+void page_putter(void *page)
+{
+	page_used[((uint8_t(*)[4096])page) - pages] = false;
+	pages_freed++;
 }
 
 void init(struct unittest *test)
 {
 	pages_allocd = 0;
-	first_page_freed = false;
-	second_page_freed = false;
+	pages_freed = 0;
 }
 
 void test_allocates(struct unittest *test)
 {
 	void *alloc, *expected;
 	init(test);
-	slab = slab_new("tester", 64, page_getter);
+	slab = slab_new("tester", 64, page_getter, page_putter);
 	alloc = slab_alloc(slab);
 
-	expected = (void *)first_page + sizeof(struct slab);
+	expected = (void *)((uintptr_t)alloc & ~4095) + slab->offset;
 	UNITTEST_EXPECT_EQ(test, alloc, expected);
 
 	alloc = slab_alloc(slab);
@@ -54,17 +66,176 @@ void test_frees(struct unittest *test)
 {
 	void *alloc1, *alloc2, *alloc3;
 	init(test);
-	slab = slab_new("tester", 64, page_getter);
+	slab = slab_new("tester", 64, page_getter, page_putter);
 	alloc1 = slab_alloc(slab);
 	alloc2 = slab_alloc(slab);
 	slab_free(slab, alloc2);
 	alloc3 = slab_alloc(slab);
 	UNITTEST_EXPECT_EQ(test, alloc2, alloc3);
+	UNITTEST_EXPECT_EQ(test, slab->free, slab->per_page - 2);
+	(void)alloc1;
+}
+
+void test_fills_page(struct unittest *test)
+{
+	unsigned int i;
+	void *first, *alloc;
+	init(test);
+	slab = slab_new("tester", 64, page_getter, page_putter);
+
+	first = slab_alloc(slab);
+	for (i = 1; i < slab->per_page; i++)
+		alloc = slab_alloc(slab);
+	UNITTEST_EXPECT_EQ(test, slab->pages, 1);
+	UNITTEST_EXPECT_EQ(test, slab->free, 0);
+	UNITTEST_EXPECT_EQ(test, list_empty(&slab->full), false);
+	UNITTEST_EXPECT_EQ(test, list_empty(&slab->partial), true);
+
+	/* the next allocation needs another page */
+	alloc = slab_alloc(slab);
+	UNITTEST_EXPECT_EQ(test, slab->pages, 2);
+	UNITTEST_EXPECT_EQ(test, list_empty(&slab->partial), false);
+	UNITTEST_EXPECT_EQ(test, (uintptr_t)alloc & ~4095,
+	                   (uintptr_t)alloc - slab->offset);
+	UNITTEST_EXPECT_EQ(test, ((uintptr_t)alloc & ~4095) ==
+	                                 ((uintptr_t)first & ~4095),
+	                   false);
+}
+
+void test_prefers_partial(struct unittest *test)
+{
+	unsigned int i;
+	void *first, *second, *alloc;
+	init(test);
+	slab = slab_new("tester", 64, page_getter, page_putter);
+	slab_set_watermark(slab, 4);
+
+	/* fill two pages */
+	first = slab_alloc(slab);
+	for (i = 1; i < slab->per_page; i++)
+		slab_alloc(slab);
+	second = slab_alloc(slab);
+	for (i = 1; i < slab->per_page; i++)
+		slab_alloc(slab);
+
+	/* empty the second page, and free one object in the first */
+	for (i = 0; i < slab->per_page; i++)
+		slab_free(slab, second + i * 64);
+	slab_free(slab, first);
+	UNITTEST_EXPECT_EQ(test, slab->empty_pages, 1);
+
+	/* the partial page is used before the empty one */
+	alloc = slab_alloc(slab);
+	UNITTEST_EXPECT_EQ(test, alloc, first);
+	UNITTEST_EXPECT_EQ(test, slab->empty_pages, 1);
+	UNITTEST_EXPECT_EQ(test, pages_freed, 0);
+}
+
+void test_reclaims_empty(struct unittest *test)
+{
+	unsigned int i, j;
+	void *objs[3];
+	init(test);
+	slab = slab_new("tester", 64, page_getter, page_putter);
+
+	for (j = 0; j < 3; j++) {
+		objs[j] = slab_alloc(slab);
+		for (i = 1; i < slab->per_page; i++)
+			slab_alloc(slab);
+	}
+	UNITTEST_EXPECT_EQ(test, slab->pages, 3);
+
+	/* the first empty page is kept, the second goes back */
+	for (j = 0; j < 2; j++)
+		for (i = 0; i < slab->per_page; i++)
+			slab_free(slab, objs[j] + i * 64);
+	UNITTEST_EXPECT_EQ(test, slab->pages, 2);
+	UNITTEST_EXPECT_EQ(test, slab->empty_pages, 1);
+	UNITTEST_EXPECT_EQ(test, slab->reclaimed, 1);
+	UNITTEST_EXPECT_EQ(test, pages_freed, 1);
+	UNITTEST_EXPECT_EQ(test, slab->total, slab->per_page * 2);
+	UNITTEST_EXPECT_EQ(test, slab->free, slab->per_page);
+
+	/* setting the watermark to zero frees the last empty page */
+	slab_set_watermark(slab, 0);
+	UNITTEST_EXPECT_EQ(test, slab->pages, 1);
+	UNITTEST_EXPECT_EQ(test, slab->empty_pages, 0);
+	UNITTEST_EXPECT_EQ(test, pages_freed, 2);
+	UNITTEST_EXPECT_EQ(test, slab->free, 0);
+
+	for (i = 0; i < slab->per_page; i++)
+		slab_free(slab, objs[2] + i * 64);
+	UNITTEST_EXPECT_EQ(test, slab->pages, 0);
+	UNITTEST_EXPECT_EQ(test, pages_freed, 3);
+}
+
+void test_offpage(struct unittest *test)
+{
+	void *a, *b, *c;
+	init(test);
+	slab = slab_new("tester", 2048, page_getter, page_putter);
+	UNITTEST_EXPECT_EQ(test, slab->offpage, true);
+	UNITTEST_EXPECT_EQ(test, slab->per_page, 2);
+
+	a = slab_alloc(slab);
+	b = slab_alloc(slab);
+	UNITTEST_EXPECT_EQ(test, (uintptr_t)a & 4095, 0);
+	UNITTEST_EXPECT_EQ(test, b, a + 2048);
+
+	c = slab_alloc(slab);
+	UNITTEST_EXPECT_EQ(test, slab->pages, 2);
+
+	slab_free(slab, a);
+	UNITTEST_EXPECT_EQ(test, slab_alloc(slab), a);
+	slab_free(slab, a);
+	slab_free(slab, b);
+	slab_free(slab, c);
+	UNITTEST_EXPECT_EQ(test, slab->pages, 1);
+	UNITTEST_EXPECT_EQ(test, slab->free, 2);
+	UNITTEST_EXPECT_EQ(test, pages_freed, 1);
+}
+
+void test_offpage_hash_grows(struct unittest *test)
+{
+	void *objs[48];
+	unsigned int i, failed = 0;
+
+	init(test);
+	slab = slab_new("tester", 2048, page_getter, page_putter);
+	for (i = 0; i < 48; i++)
+		if (!(objs[i] = slab_alloc(slab)))
+			failed++;
+	UNITTEST_ASSERT_EQ(test, failed, 0);
+	UNITTEST_EXPECT_EQ(test, slab->pages, 24);
+	UNITTEST_EXPECT_EQ(test, slab->hash_size,
+	                   4096 / sizeof(struct slab_page *));
+
+	/* every object is found through the new table */
+	for (i = 0; i < 48; i++)
+		slab_free(slab, objs[i]);
+	UNITTEST_EXPECT_EQ(test, slab->free, slab->total);
+	UNITTEST_EXPECT_EQ(test, slab->pages, SLAB_DEFAULT_WATERMARK);
+}
+
+void test_rejects_size(struct unittest *test)
+{
+	init(test);
+	UNITTEST_EXPECT_EQ(test, slab_new("tester", 1, page_getter, page_putter),
+	                   NULL);
+	UNITTEST_EXPECT_EQ(test,
+	                   slab_new("tester", 8192, page_getter, page_putter),
+	                   NULL);
 }
 
 struct unittest_case cases[] = {
 	UNITTEST_CASE(test_allocates),
 	UNITTEST_CASE(test_frees),
+	UNITTEST_CASE(test_fills_page),
+	UNITTEST_CASE(test_prefers_partial),
+	UNITTEST_CASE(test_reclaims_empty),
+	UNITTEST_CASE(test_offpage),
+	UNITTEST_CASE(test_offpage_hash_grows),
+	UNITTEST_CASE(test_rejects_size),
 	{ 0 },
 };
 
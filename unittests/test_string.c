@@ -0,0 +1,152 @@
+/*
+ * test_string.c: test the string and memory routines
+ *
+ * The word-at-a-time routines have a lot of alignment cases, so each test tries
+ * every combination of alignment and a range of lengths, and compares against a
+ * simple byte loop.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "string.h"
+#include "unittest.h"
+
+#define MAXLEN 80
+#define GUARD  16
+#define BUFLEN (GUARD + 8 + MAXLEN + GUARD)
+
+uint8_t src[BUFLEN] __attribute__((aligned(8)));
+uint8_t dst[BUFLEN] __attribute__((aligned(8)));
+uint8_t expect[BUFLEN] __attribute__((aligned(8)));
+
+static void fill(uint8_t *buf, uint8_t seed)
+{
+	for (int i = 0; i < BUFLEN; i++)
+		buf[i] = (uint8_t)(seed + i * 7);
+}
+
+static bool same(uint8_t *a, uint8_t *b)
+{
+	for (int i = 0; i < BUFLEN; i++)
+		if (a[i] != b[i])
+			return false;
+	return true;
+}
+
+void test_memcpy_cases(struct unittest *test)
+{
+	int s, d, n, i, failed = 0;
+	void *rv;
+
+	for (s = 0; s < 8; s++) {
+		for (d = 0; d < 8; d++) {
+			for (n = 0; n <= MAXLEN; n++) {
+				fill(src, 1);
+				fill(dst, 100);
+				fill(expect, 100);
+				for (i = 0; i < n; i++)
+					expect[GUARD + d + i] = src[GUARD + s + i];
+				rv = test_memcpy(&dst[GUARD + d], &src[GUARD + s],
+				                 n);
+				if (!same(dst, expect) || rv != &dst[GUARD + d])
+					failed++;
+			}
+		}
+	}
+	UNITTEST_EXPECT_EQ(test, failed, 0);
+}
+
+void test_memset_cases(struct unittest *test)
+{
+	int d, n, i, failed = 0;
+	void *rv;
+
+	for (d = 0; d < 8; d++) {
+		for (n = 0; n <= MAXLEN; n++) {
+			fill(dst, 100);
+			fill(expect, 100);
+			for (i = 0; i < n; i++)
+				expect[GUARD + d + i] = 0xA5;
+			rv = test_memset(&dst[GUARD + d], 0x3A5, n);
+			if (!same(dst, expect) || rv != &dst[GUARD + d])
+				failed++;
+		}
+	}
+	UNITTEST_EXPECT_EQ(test, failed, 0);
+}
+
+static int sign(int v)
+{
+	return (v > 0) - (v < 0);
+}
+
+void test_memcmp_cases(struct unittest *test)
+{
+	int a, b, n, i, failed = 0;
+
+	for (a = 0; a < 8; a++) {
+		for (b = 0; b < 8; b++) {
+			for (n = 0; n <= MAXLEN; n++) {
+				fill(src, 1);
+				for (i = 0; i < n; i++)
+					dst[GUARD + b + i] = src[GUARD + a + i];
+				if (test_memcmp(&src[GUARD + a], &dst[GUARD + b],
+				                n) != 0)
+					failed++;
+
+				/* a difference at every position */
+				for (i = 0; i < n; i++) {
+					dst[GUARD + b + i] += 1;
+					if (sign(test_memcmp(&src[GUARD + a],
+					                     &dst[GUARD + b], n)) !=
+					    sign((int)src[GUARD + a + i] -
+					         dst[GUARD + b + i]))
+						failed++;
+					dst[GUARD + b + i] -= 1;
+				}
+			}
+		}
+	}
+	UNITTEST_EXPECT_EQ(test, failed, 0);
+}
+
+void test_strlen_cases(struct unittest *test)
+{
+	int a, n, i, failed = 0;
+
+	for (a = 0; a < 8; a++) {
+		for (n = 0; n < MAXLEN; n++) {
+			for (i = 0; i < BUFLEN; i++)
+				src[i] = 0x80 + i % 0x7F;
+			src[GUARD + a + n] = '\0';
+			if (test_strlen((char *)&src[GUARD + a]) != n)
+				failed++;
+		}
+	}
+	UNITTEST_EXPECT_EQ(test, failed, 0);
+}
+
+void test_strcmp_cases(struct unittest *test)
+{
+	UNITTEST_EXPECT_EQ(test, test_strcmp("abc", "abc"), 0);
+	UNITTEST_EXPECT_EQ(test, test_strcmp("abc", "abd") < 0, true);
+	UNITTEST_EXPECT_EQ(test, test_strcmp("abcd", "abc") > 0, true);
+}
+
+struct unittest_case cases[] = {
+	UNITTEST_CASE(test_memcpy_cases),
+	UNITTEST_CASE(test_memset_cases),
+	UNITTEST_CASE(test_memcmp_cases),
+	UNITTEST_CASE(test_strlen_cases),
+	UNITTEST_CASE(test_strcmp_cases),
+	{ 0 },
+};
+
+struct unittest_module module = {
+	.name = "string",
+	.cases = cases,
+	.printf = printf,
+};
+
+UNITTEST(module);
@@ -0,0 +1,95 @@
+/*
+ * test_util.c: test the utility functions
+ */
+#include <stdint.h>
+#include <stdio.h>
+
+#include "unittest.h"
+#include "util.h"
+
+void test_align(struct unittest *test)
+{
+	UNITTEST_EXPECT_EQ(test, align(0, 12), 0);
+	UNITTEST_EXPECT_EQ(test, align(1, 12), 0x1000);
+	UNITTEST_EXPECT_EQ(test, align(0x1000, 12), 0x1000);
+	UNITTEST_EXPECT_EQ(test, align(0x1001, 2), 0x1004);
+}
+
+static uint64_t nums[] = {
+	0,
+	1,
+	999999999,
+	62500000,
+	0xFFFFFFFFULL,
+	0x100000000ULL,
+	0x123456789ABCDEFULL,
+	0x7FFFFFFFFFFFFFFFULL,
+	0xFFFFFFFFFFFFFFFFULL,
+};
+
+static uint32_t bases[] = {
+	1, 3, 1000, 19200000, 54000000, 62500000, 0x80000000, 0xFFFFFFFF,
+};
+
+void test_div64_32(struct unittest *test)
+{
+	uint32_t i, j, rem, failed = 0;
+	uint64_t n;
+
+	for (i = 0; i < sizeof(nums) / sizeof(nums[0]); i++) {
+		for (j = 0; j < sizeof(bases) / sizeof(bases[0]); j++) {
+			n = nums[i];
+			rem = div64_32(&n, bases[j]);
+			if (n != nums[i] / bases[j] ||
+			    rem != nums[i] % bases[j])
+				failed++;
+		}
+	}
+	UNITTEST_EXPECT_EQ(test, failed, 0);
+}
+
+void test_log2_ceil(struct unittest *test)
+{
+	UNITTEST_EXPECT_EQ(test, log2_ceil(1), 0);
+	UNITTEST_EXPECT_EQ(test, log2_ceil(2), 1);
+	UNITTEST_EXPECT_EQ(test, log2_ceil(3), 2);
+	UNITTEST_EXPECT_EQ(test, log2_ceil(4), 2);
+	UNITTEST_EXPECT_EQ(test, log2_ceil(5), 3);
+	UNITTEST_EXPECT_EQ(test, log2_ceil(0x80000000), 31);
+	UNITTEST_EXPECT_EQ(test, log2_ceil(0x80000001), 32);
+}
+
+/*
+ * kmalloc() picks its size class from log2_ceil(), so check each class
+ * boundary from 8 to 2048 bytes: 2^b fits class b, and 2^b + 1 the next.
+ */
+void test_log2_ceil_classes(struct unittest *test)
+{
+	uint32_t b, failed = 0;
+
+	for (b = 3; b <= 11; b++) {
+		if (log2_ceil((1 << b) - 1) != b)
+			failed++;
+		if (log2_ceil(1 << b) != b)
+			failed++;
+		if (log2_ceil((1 << b) + 1) != b + 1)
+			failed++;
+	}
+	UNITTEST_EXPECT_EQ(test, failed, 0);
+}
+
+struct unittest_case cases[] = {
+	UNITTEST_CASE(test_align),
+	UNITTEST_CASE(test_div64_32),
+	UNITTEST_CASE(test_log2_ceil),
+	UNITTEST_CASE(test_log2_ceil_classes),
+	{ 0 },
+};
+
+struct unittest_module module = {
+	.name = "util",
+	.cases = cases,
+	.printf = printf,
+};
+
+UNITTEST(module);
@@ -1,9 +1,16 @@
 # Startup conditions for userspace programs:
 # * The stack is not configured, do it yourself
 # * Execution starts at PC=0x40000000, which normally is the _start handler
+# * Only the text page containing _start is guaranteed to be mapped. Everything
+#   else in the image is faulted in by the kernel on first access.
 .section text
 .global _start
 _start:
+	b 1f
+	# Image header, see struct image_header in kernel/process.c
+	.word code_end
+	.word image_end
+1:
 	ldr sp, =stack_end
 	bl main
 	swi #2
@@ -104,3 +104,140 @@ int recv(int sockfd, void *buffer, size_t length, int flags)
 	                     : /* clobbers */ "a1", "a2", "a3", "a4");
 	return retval;
 }
+
+int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	int retval;
+	__asm__ __volatile__("svc #12\n"
+	                     "mov %[rv], a1"
+	                     : /* output operands */[ rv ] "=r"(retval)
+	                     : /* input operands */
+	                     : /* clobbers */ "a1", "a2", "a3", "a4", "memory");
+	return retval;
+}
+
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	int retval;
+	__asm__ __volatile__("svc #13\n"
+	                     "mov %[rv], a1"
+	                     : /* output operands */[ rv ] "=r"(retval)
+	                     : /* input operands */
+	                     : /* clobbers */ "a1", "a2", "a3", "a4", "memory");
+	return retval;
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	int retval;
+	__asm__ __volatile__("svc #14\n"
+	                     "mov %[rv], a1"
+	                     : /* output operands */[ rv ] "=r"(retval)
+	                     : /* input operands */
+	                     : /* clobbers */ "a1", "a2", "a3", "a4", "memory");
+	return retval;
+}
+
+int setsockopt(int sockfd, int level, int optname, const void *optval,
+               socklen_t optlen)
+{
+	struct sockopt_args args = {
+		.level = level,
+		.optname = optname,
+		.optval = optval,
+		.optlen = optlen,
+	};
+	register int a1 __asm__("a1") = sockfd;
+	register struct sockopt_args *a2 __asm__("a2") = &args;
+
+	__asm__ __volatile__("svc #11"
+	                     : /* output operands */ "+r"(a1)
+	                     : /* input operands */ "r"(a2), "m"(args)
+	                     : /* clobbers */ "a3", "a4", "memory");
+	return a1;
+}
+
+int close(int fd)
+{
+	int retval;
+	__asm__ __volatile__("svc #15\n"
+	                     "mov %[rv], a1"
+	                     : /* output operands */[ rv ] "=r"(retval)
+	                     : /* input operands */
+	                     : /* clobbers */ "a1", "a2", "a3", "a4", "memory");
+	return retval;
+}
+
+int open(const char *path, int flags)
+{
+	int retval;
+	__asm__ __volatile__("svc #16\n"
+	                     "mov %[rv], a1"
+	                     : /* output operands */[ rv ] "=r"(retval)
+	                     : /* input operands */
+	                     : /* clobbers */ "a1", "a2", "a3", "a4", "memory");
+	return retval;
+}
+
+int read(int fd, void *buf, size_t count)
+{
+	int retval;
+	__asm__ __volatile__("svc #17\n"
+	                     "mov %[rv], a1"
+	                     : /* output operands */[ rv ] "=r"(retval)
+	                     : /* input operands */
+	                     : /* clobbers */ "a1", "a2", "a3", "a4", "memory");
+	return retval;
+}
+
+int write(int fd, const void *buf, size_t count)
+{
+	int retval;
+	__asm__ __volatile__("svc #18\n"
+	                     "mov %[rv], a1"
+	                     : /* output operands */[ rv ] "=r"(retval)
+	                     : /* input operands */
+	                     : /* clobbers */ "a1", "a2", "a3", "a4", "memory");
+	return retval;
+}
+
+int nice(int inc)
+{
+	int retval;
+	__asm__ __volatile__("svc #19\n"
+	                     "mov %[rv], a1"
+	                     : /* output operands */[ rv ] "=r"(retval)
+	                     : /* input operands */
+	                     : /* clobbers */ "a1", "a2", "a3", "a4", "memory");
+	return retval;
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem)
+{
+	int retval;
+	__asm__ __volatile__("svc #20\n"
+	                     "mov %[rv], a1"
+	                     : /* output operands */[ rv ] "=r"(retval)
+	                     : /* input operands */
+	                     : /* clobbers */ "a1", "a2", "a3", "a4", "memory");
+	return retval;
+}
+
+int clock_gettime_syscall(clockid_t clk, struct timespec *tp)
+{
+	int retval;
+	__asm__ __volatile__("svc #21\n"
+	                     "mov %[rv], a1"
+	                     : /* output operands */[ rv ] "=r"(retval)
+	                     : /* input operands */
+	                     : /* clobbers */ "a1", "a2", "a3", "a4", "memory");
+	return retval;
+}
+
+unsigned int sleep(unsigned int seconds)
+{
+	struct timespec ts = { .tv_sec = seconds, .tv_nsec = 0 };
+
+	nanosleep(&ts, NULL);
+	return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * timebench.c: compare reading the time with and without a system call
+ */
+#include <stdint.h>
+
+#include "format.h"
+#include "syscall.h"
+
+#define ITERATIONS 10000
+
+typedef int (*gettime_t)(clockid_t clk, struct timespec *tp);
+
+static int ts_before(struct timespec *a, struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+	       (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static uint32_t ts_diff_ns(struct timespec *start, struct timespec *end)
+{
+	return (uint32_t)(end->tv_sec - start->tv_sec) * 1000000000 +
+	       end->tv_nsec - start->tv_nsec;
+}
+
+/*
+ * Time ITERATIONS calls of fn, and count any which went backwards.
+ */
+static int bench(char *name, gettime_t fn)
+{
+	struct timespec start, end, prev, ts;
+	uint32_t i, ns, backwards = 0;
+
+	fn(CLOCK_MONOTONIC, &start);
+	prev = start;
+	for (i = 0; i < ITERATIONS; i++) {
+		fn(CLOCK_MONOTONIC, &ts);
+		if (ts_before(&ts, &prev))
+			backwards++;
+		prev = ts;
+	}
+	fn(CLOCK_MONOTONIC, &end);
+
+	ns = ts_diff_ns(&start, &end);
+	printf("%s: %u calls in %u us, %u ns per call\n", name, ITERATIONS,
+	       ns / 1000, ns / ITERATIONS);
+	if (backwards)
+		printf("%s: time went backwards %u times\n", name, backwards);
+	return backwards;
+}
+
+int main()
+{
+	struct timespec before, vdso, after;
+	int rv = 0;
+
+	rv |= bench("syscall", clock_gettime_syscall);
+	rv |= bench("vdso", clock_gettime);
+
+	/* Each clock should be consistent with the other */
+	clock_gettime_syscall(CLOCK_MONOTONIC, &before);
+	clock_gettime(CLOCK_MONOTONIC, &vdso);
+	clock_gettime_syscall(CLOCK_MONOTONIC, &after);
+	if (ts_before(&vdso, &before) || ts_before(&after, &vdso)) {
+		printf("clocks disagree: syscall %u.%u, vdso %u.%u\n",
+		       before.tv_sec, before.tv_nsec, vdso.tv_sec,
+		       vdso.tv_nsec);
+		rv = 1;
+	} else {
+		puts("clocks agree\n");
+	}
+	return rv;
+}
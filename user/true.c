@@ -0,0 +1,7 @@
+/*
+ * true.c: exit immediately, for measuring how long a process takes to spawn
+ */
+int main()
+{
+	return 0;
+}
@@ -10,7 +10,10 @@
 static char input[256];
 static char *tokens[16];
 static int argc;
-static char data[2048]; /* socket data, should get dynamically alloced */
+static char data[65536]; /* socket data, should get dynamically alloced */
+
+#define MMSG_BATCH 32
+static struct mmsghdr msgs[MMSG_BATCH];
 
 /*
  * Shell commands section. Each command is represented by a struct cmd, and
@@ -63,9 +66,16 @@ static int cmd_runp(int argc, char **argv)
 
 static int cmd_socket(int argc, char **argv)
 {
-	int rv;
+	int rv, type = SOCK_DGRAM;
+
+	if (argc == 2 && strcmp(argv[1], "nonblock") == 0) {
+		type |= SOCK_NONBLOCK;
+	} else if (argc != 1) {
+		puts("usage: socket [nonblock]\n");
+		return -1;
+	}
 
-	rv = socket(AF_INET, SOCK_DGRAM, 0);
+	rv = socket(AF_INET, type, 0);
 	printf("socket() = %d\n", rv);
 	return rv;
 }
@@ -141,11 +151,298 @@ static int cmd_recv(int argc, char **argv)
 	sockfd = atoi(argv[1]);
 	rv = recv(sockfd, data, sizeof(data), 0);
 	printf("recv() = %d\n", rv);
+	if (rv < 0)
+		return rv;
 	data[rv] = '\0'; /* just in case */
 	printf(" -> \"%s\"\n", data);
 	return rv;
 }
 
+static int cmd_close(int argc, char **argv)
+{
+	int rv;
+
+	if (argc != 2) {
+		puts("usage: close FD\n");
+		return -1;
+	}
+
+	rv = close(atoi(argv[1]));
+	printf("close() = %d\n", rv);
+	return rv;
+}
+
+static int cmd_cat(int argc, char **argv)
+{
+	int rv, fd;
+
+	if (argc != 2) {
+		puts("usage: cat PATH\n");
+		return -1;
+	}
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0) {
+		printf("open() = %d\n", fd);
+		return fd;
+	}
+	while ((rv = read(fd, data, sizeof(data))) > 0)
+		write(STDOUT_FILENO, data, rv);
+	close(fd);
+	return rv;
+}
+
+static int cmd_poll(int argc, char **argv)
+{
+	struct pollfd fds[8];
+	int rv, i, nfds = argc - 2;
+
+	if (argc < 3 || nfds > (int)nelem(fds)) {
+		puts("usage: poll TIMEOUT_MS FD [FD...]\n");
+		return -1;
+	}
+
+	for (i = 0; i < nfds; i++) {
+		fds[i].fd = atoi(argv[i + 2]);
+		fds[i].events = POLLIN;
+	}
+	rv = poll(fds, nfds, atoi(argv[1]));
+	printf("poll() = %d\n", rv);
+	for (i = 0; rv > 0 && i < nfds; i++)
+		if (fds[i].revents)
+			printf("fd %d: revents 0x%x\n", fds[i].fd,
+			       fds[i].revents);
+	return rv;
+}
+
+static int cmd_rcvbuf(int argc, char **argv)
+{
+	int rv, sockfd, size;
+
+	if (argc != 3) {
+		puts("usage: rcvbuf FD BYTES\n");
+		return -1;
+	}
+
+	sockfd = atoi(argv[1]);
+	size = atoi(argv[2]);
+	rv = setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	printf("setsockopt() = %d\n", rv);
+	return rv;
+}
+
+static int cmd_sendbig(int argc, char **argv)
+{
+	int rv, sockfd, i, size;
+
+	if (argc != 3) {
+		puts("usage: sendbig FD SIZE\n");
+		return -1;
+	}
+
+	sockfd = atoi(argv[1]);
+	size = atoi(argv[2]);
+	if (size > (int)sizeof(data))
+		size = sizeof(data);
+	for (i = 0; i < size; i++)
+		data[i] = 'a' + i % 26;
+	rv = send(sockfd, data, size, 0);
+	printf("send() = %d\n", rv);
+	return rv;
+}
+
+static int cmd_recvbig(int argc, char **argv)
+{
+	int rv, sockfd, i;
+	unsigned int sum = 0;
+
+	if (argc != 2) {
+		puts("usage: recvbig FD\n");
+		return -1;
+	}
+
+	sockfd = atoi(argv[1]);
+	rv = recv(sockfd, data, sizeof(data), 0);
+	for (i = 0; i < rv; i++)
+		sum += (unsigned char)data[i];
+	printf("recv() = %d, sum = %u\n", rv, sum);
+	return rv;
+}
+
+static int cmd_recvbench(int argc, char **argv)
+{
+	int rv, sockfd, i, count;
+	unsigned int bytes = 0;
+
+	if (argc != 3) {
+		puts("usage: recvbench FD COUNT\n");
+		return -1;
+	}
+
+	sockfd = atoi(argv[1]);
+	count = atoi(argv[2]);
+	for (i = 0; i < count; i++) {
+		rv = recv(sockfd, data, sizeof(data), 0);
+		if (rv < 0) {
+			printf("recv() = %d after %d packets\n", rv, i);
+			return rv;
+		}
+		bytes += rv;
+	}
+	printf("recvbench: %d packets, %u bytes\n", count, bytes);
+	return 0;
+}
+
+static int cmd_sendbench(int argc, char **argv)
+{
+	int rv, sockfd, i, count, size, flags;
+
+	if (argc != 4) {
+		puts("usage: sendbench FD COUNT SIZE\n");
+		return -1;
+	}
+
+	sockfd = atoi(argv[1]);
+	count = atoi(argv[2]);
+	size = atoi(argv[3]);
+	if (size > (int)sizeof(data))
+		size = sizeof(data);
+	memset(data, 'x', size);
+	for (i = 0; i < count; i++) {
+		/* let the kernel batch everything but the last packet */
+		flags = (i == count - 1) ? 0 : MSG_MORE;
+		rv = send(sockfd, data, size, flags);
+		if (rv < 0) {
+			printf("send() = %d after %d packets\n", rv, i);
+			return rv;
+		}
+	}
+	printf("sendbench: %d packets, %d bytes each\n", count, size);
+	return 0;
+}
+
+static int cmd_recvmbench(int argc, char **argv)
+{
+	int rv, sockfd, i, n, count, done = 0;
+	unsigned int bytes = 0, calls = 0;
+	const int slot = sizeof(data) / MMSG_BATCH;
+
+	if (argc != 3) {
+		puts("usage: recvmbench FD COUNT\n");
+		return -1;
+	}
+
+	sockfd = atoi(argv[1]);
+	count = atoi(argv[2]);
+	for (i = 0; i < MMSG_BATCH; i++) {
+		msgs[i].msg_hdr.msg_name = NULL;
+		msgs[i].msg_hdr.msg_buf = data + i * slot;
+		msgs[i].msg_hdr.msg_buflen = slot;
+	}
+	while (done < count) {
+		n = count - done < MMSG_BATCH ? count - done : MMSG_BATCH;
+		rv = recvmmsg(sockfd, msgs, n, 0);
+		if (rv < 0) {
+			printf("recvmmsg() = %d after %d packets\n", rv, done);
+			return rv;
+		}
+		for (i = 0; i < rv; i++)
+			bytes += msgs[i].msg_len;
+		done += rv;
+		calls++;
+	}
+	printf("recvmbench: %d packets, %u bytes, %u calls\n", count, bytes,
+	       calls);
+	return 0;
+}
+
+static int cmd_sendmbench(int argc, char **argv)
+{
+	int rv, sockfd, i, n, count, size, done = 0;
+	unsigned int calls = 0;
+
+	if (argc != 4) {
+		puts("usage: sendmbench FD COUNT SIZE\n");
+		return -1;
+	}
+
+	sockfd = atoi(argv[1]);
+	count = atoi(argv[2]);
+	size = atoi(argv[3]);
+	if (size > (int)sizeof(data))
+		size = sizeof(data);
+	memset(data, 'x', size);
+	for (i = 0; i < MMSG_BATCH; i++) {
+		msgs[i].msg_hdr.msg_name = NULL;
+		msgs[i].msg_hdr.msg_buf = data;
+		msgs[i].msg_hdr.msg_buflen = size;
+	}
+	while (done < count) {
+		n = count - done < MMSG_BATCH ? count - done : MMSG_BATCH;
+		rv = sendmmsg(sockfd, msgs, n, 0);
+		if (rv < 0) {
+			printf("sendmmsg() = %d after %d packets\n", rv, done);
+			return rv;
+		}
+		done += rv;
+		calls++;
+	}
+	printf("sendmbench: %d packets, %d bytes each, %u calls\n", count,
+	       size, calls);
+	return 0;
+}
+
+static int cmd_nice(int argc, char **argv)
+{
+	int rv;
+
+	if (argc != 2) {
+		puts("usage: nice INCREMENT\n");
+		return -1;
+	}
+
+	rv = nice(atoi(argv[1]));
+	printf("nice() = %d\n", rv);
+	return rv;
+}
+
+static int cmd_sleep(int argc, char **argv)
+{
+	struct timespec ts;
+	int rv, ms;
+
+	if (argc != 2) {
+		puts("usage: sleep MILLISECONDS\n");
+		return -1;
+	}
+
+	ms = atoi(argv[1]);
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	rv = nanosleep(&ts, NULL);
+	printf("nanosleep() = %d\n", rv);
+	return rv;
+}
+
+static int cmd_rcvtimeo(int argc, char **argv)
+{
+	struct timeval tv;
+	int rv, sockfd, ms;
+
+	if (argc != 3) {
+		puts("usage: rcvtimeo FD MILLISECONDS\n");
+		return -1;
+	}
+
+	sockfd = atoi(argv[1]);
+	ms = atoi(argv[2]);
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	rv = setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	printf("setsockopt() = %d\n", rv);
+	return rv;
+}
+
 static int cmd_demo(int argc, char **argv)
 {
 	int i, count = 10;
@@ -157,6 +454,44 @@ static int cmd_demo(int argc, char **argv)
 	return 0;
 }
 
+/*
+ * Time how long it takes to run a process and wait for it to exit, which is
+ * mostly the cost of creating and destroying it when the process is "true".
+ */
+static int cmd_spawnbench(int argc, char **argv)
+{
+	struct timespec start, end;
+	char *name = "true";
+	int i, count = 100;
+	uint32_t us;
+
+	if (argc > 3) {
+		puts("usage: spawnbench [COUNT [PROCNAME]]\n");
+		return -1;
+	}
+	if (argc >= 2)
+		count = atoi(argv[1]);
+	if (argc == 3)
+		name = argv[2];
+	if (count <= 0)
+		count = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		if (runproc(name, RUNPROC_F_WAIT) != 0) {
+			printf("failed to run %s\n", name);
+			return -1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	us = (uint32_t)(end.tv_sec - start.tv_sec) * 1000000 +
+	     (end.tv_nsec - start.tv_nsec) / 1000;
+	printf("spawned %s %d times in %u us, %u us each\n", name, count, us,
+	       us / count);
+	return 0;
+}
+
 static int help(int argc, char **argv);
 struct cmd cmds[] = {
 	{ .name = "echo",
@@ -168,11 +503,51 @@ struct cmd cmds[] = {
 	  .func = cmd_runp,
 	  .help = "run a process without waiting for it to finish" },
 	{ .name = "demo", .func = cmd_demo, .help = "run many processes" },
+	{ .name = "spawnbench",
+	  .func = cmd_spawnbench,
+	  .help = "time running a process many times" },
+	{ .name = "sleep",
+	  .func = cmd_sleep,
+	  .help = "sleep for some milliseconds" },
+	{ .name = "nice",
+	  .func = cmd_nice,
+	  .help = "change the scheduling priority of this shell" },
 	{ .name = "socket", .func = cmd_socket, .help = "create socket" },
 	{ .name = "bind", .func = cmd_bind, .help = "bind socket" },
 	{ .name = "connect", .func = cmd_connect, .help = "connect socket" },
 	{ .name = "send", .func = cmd_send, .help = "send data on socket" },
 	{ .name = "recv", .func = cmd_recv, .help = "recv data from socket" },
+	{ .name = "close",
+	  .func = cmd_close,
+	  .help = "close a file descriptor" },
+	{ .name = "cat", .func = cmd_cat, .help = "print a file's contents" },
+	{ .name = "poll",
+	  .func = cmd_poll,
+	  .help = "wait for fds to be readable (0 is the console)" },
+	{ .name = "rcvbuf",
+	  .func = cmd_rcvbuf,
+	  .help = "set socket receive buffer size" },
+	{ .name = "rcvtimeo",
+	  .func = cmd_rcvtimeo,
+	  .help = "set socket receive timeout" },
+	{ .name = "sendbig",
+	  .func = cmd_sendbig,
+	  .help = "send a large patterned datagram" },
+	{ .name = "recvbig",
+	  .func = cmd_recvbig,
+	  .help = "recv a datagram, print its size and byte sum" },
+	{ .name = "recvbench",
+	  .func = cmd_recvbench,
+	  .help = "recv many packets, for measuring throughput" },
+	{ .name = "sendbench",
+	  .func = cmd_sendbench,
+	  .help = "send many packets, for measuring throughput" },
+	{ .name = "recvmbench",
+	  .func = cmd_recvmbench,
+	  .help = "recvbench, but with recvmmsg()" },
+	{ .name = "sendmbench",
+	  .func = cmd_sendmbench,
+	  .help = "sendbench, but with sendmmsg()" },
 	{ .name = "exit", .func = cmd_exit, .help = "exit this process" },
 };
 /*